@@ -5,16 +5,39 @@
 #include <commctrl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <wchar.h>
+#include <wctype.h>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
 
 #define EDITOR
 #include "../rc/resource.h"
 
 #define MAX_ERROR_MSG 512
-#define MAX_ERRORS 50
 #define MAX_NESTING_DEPTH 255
 #define GUTTER_WIDTH 50
+#define PREVIEW_TIMER_ID 1
+#define PREVIEW_MAX_WIDTH 4096
+#define PREVIEW_MAX_HEIGHT 1024
+#define OUTLINE_WIDTH 260
+#define LOAD_CHUNK_SIZE (1024 * 1024)	/* Source bytes decoded per chunk */
+#define LOAD_CHUNKS_IN_FLIGHT 2
+#define WM_APP_LOADCHUNK (WM_APP + 1)
+#define WM_APP_LOADDONE (WM_APP + 2)
+#define WM_APP_SAVEDONE (WM_APP + 3)
+#define WM_APP_COMPACTDONE (WM_APP + 4)
+#define SAVE_CHUNK_CHARS (64 * 1024)	/* Characters encoded per UTF-8 write */
+#define SAVE_WRITE_SIZE (1024 * 1024)	/* Largest single WriteFile */
+#define JOURNAL_TIMER_ID 2
+#define JOURNAL_FLUSH_MS 1000
+#define JOURNAL_BUFFER_SIZE (64 * 1024)	/* Flush early past this much */
+#define JOURNAL_COMPACT_SIZE (4 * 1024 * 1024)	/* Edit bytes before a snapshot */
+#define JOURNAL_VERSION 1
+#define JOURNAL_EDIT 1
+#define JOURNAL_SNAPSHOT 2
 
 typedef struct {
 	int lineNumber;
@@ -22,6 +45,175 @@ typedef struct {
 	int severity;		/* 0=info, 1=warning, 2=error */
 } ValidationError;
 
+/* Background file load; owned by the UI thread, read by the worker */
+typedef struct LoadJob {
+	HANDLE file;
+	HANDLE mapping;
+	const unsigned char *view;
+	size_t size;
+	HANDLE thread;
+	HANDLE slots;		/* Semaphore limiting decoded chunks in flight */
+	HWND hwndMain;
+	int encoding;
+	volatile BOOL cancel;
+	BOOL failed;
+} LoadJob;
+
+/* Decoded text posted to the UI thread */
+typedef struct {
+	wchar_t *text;
+	int length;
+	int percent;
+	BOOL last;
+} LoadChunk;
+
+/* Background save of an encoded snapshot; freed on WM_APP_SAVEDONE */
+typedef struct SaveJob {
+	wchar_t target[MAX_PATH];
+	wchar_t temp[MAX_PATH];
+	unsigned char *data;
+	size_t size;
+	HANDLE thread;
+	HWND hwndMain;
+	unsigned generation;	/* Edit generation the snapshot was taken at */
+	BOOL ok;
+} SaveJob;
+
+/* Journal snapshot written on a worker thread; freed on WM_APP_COMPACTDONE */
+typedef struct CompactJob {
+	wchar_t path[MAX_PATH];
+	wchar_t temp[MAX_PATH];
+	unsigned char *data;	/* Header and snapshot record, as written */
+	size_t size;
+	HANDLE thread;
+	HWND hwndMain;
+	BOOL ok;
+} CompactJob;
+
+/*
+ * Autosave journal: a header naming the document and the saved file the
+ * edits apply to, then records, each followed by its inserted text. A
+ * snapshot record replaces the whole document, so a journal that starts
+ * with one does not depend on the file on disk.
+ */
+typedef struct {
+	char magic[4];		/* "MLYJ" */
+	DWORD version;
+	unsigned long long baseSize;	/* Saved file the first edit applies to */
+	FILETIME baseTime;
+	wchar_t path[MAX_PATH];	/* Document, empty when untitled */
+} JournalHeader;
+
+typedef struct {
+	DWORD type;		/* JOURNAL_EDIT or JOURNAL_SNAPSHOT */
+	DWORD offset;
+	DWORD deleted;
+	DWORD length;		/* Inserted characters that follow */
+	DWORD checksum;		/* FNV-1a of the fields and text; spots torn tails */
+} JournalRecord;
+
+typedef struct {
+	HANDLE file;		/* NULL until the first unsaved edit, and while compacting */
+	CompactJob *compactJob;	/* Snapshot being written, or NULL */
+	wchar_t path[MAX_PATH];
+	unsigned char *buffer;	/* Records not yet written */
+	size_t used;
+	size_t capacity;
+	unsigned long long written;	/* Edit bytes since the last snapshot */
+	BOOL needSnapshot;	/* The edits are no longer known; compact next flush */
+	BOOL matchesFile;	/* Text equals the saved file; a new journal can refer to it */
+	BOOL replaying;
+} Journal;
+
+/* One color run of a preview line; text is shared with the line */
+typedef struct {
+	int start;
+	int length;
+	COLORREF color;
+	int x;			/* Start x, px */
+} PreviewRun;
+
+typedef struct {
+	wchar_t *text;		/* Line text with the markup removed */
+	int length;
+	PreviewRun *runs;
+	int runCount;
+	int runCapacity;
+	int width;
+} PreviewLine;
+
+typedef struct {
+	int startLine;		/* Editor lines of START and END */
+	int endLine;
+	PreviewLine *lines;
+	int lineCount;
+	int width;		/* Widest line, px */
+	BOOL dirty;		/* Lines changed since the last parse */
+} PreviewSegment;
+
+/* Embedded preview, parsed from the edit buffer with the renderer's rules */
+typedef struct {
+	HWND hwnd;
+	BOOL visible;
+
+	int linesPerScreen;
+	int screenWidth;
+	int screenHeight;
+	int screenDelay;
+	int centerDelay;
+	int timePerFrame;
+	int pixelsPerFrame;
+
+	HFONT font;
+	HDC frameDC;
+	HBITMAP frameBitmap;
+	HBITMAP oldBitmap;
+	int frameWidth;
+	int frameHeight;
+
+	PreviewSegment *segments;
+	int segmentCount;
+	BOOL structureDirty;	/* Rescan START/END before the next frame */
+	BOOL configDirty;	/* Lines outside segments changed */
+
+	int currentSegment;
+	int followSegment;	/* Segment under the caret, -1 when none */
+	int scrollPosition;
+	BOOL centered;
+	int holdFrames;
+} PreviewPane;
+
+/* Outline entry; line numbers may have a shift pending, see OutlineStart */
+typedef struct {
+	int startLine;
+	int endLine;		/* Same as startLine for header commands */
+	int errors;
+	int warnings;
+} OutlineEntry;
+
+/*
+ * Entries in line order. An edit moves every later entry by the same
+ * number of lines; that shift is kept pending for the entries from
+ * shiftFrom on and only applied as later edits move the pivot, so
+ * repeated edits in one place cost the same however long the file is.
+ */
+typedef struct {
+	OutlineEntry *items;
+	int count;
+	int capacity;
+	int shiftFrom;
+	int shiftDelta;
+} OutlineList;
+
+/* Index of header commands and segments, shown as a list beside the editor */
+typedef struct {
+	HWND hwnd;
+	BOOL visible;
+	OutlineList headers;
+	OutlineList segments;
+	int followRow;		/* Row selected for the caret, -1 when none */
+} OutlinePane;
+
 typedef struct {
 	HWND hwndMain;
 	HWND hwndEdit;
@@ -29,13 +221,42 @@ typedef struct {
 	HWND hwndStatus;
 	wchar_t currentFile[MAX_PATH];
 	BOOL isModified;
-	ValidationError errors[MAX_ERRORS];
+	ValidationError *errors;
 	int errorCount;
+	int errorCapacity;
+
+	/* Rows of the virtual error list: indices into errors, filtered and sorted */
+	int *errorView;
+	int errorViewCount;
+	int errorSortColumn;	/* -1 for validation order */
+	BOOL errorSortDescending;
+	int errorFilter;	/* Bit (1 << severity) set for shown severities */
+	ValidationError selectedError;	/* Selection kept across revalidation */
+	BOOL hasSelectedError;
 	HFONT hFont;
 	int lineHeight;
 	int gutterWidth;
 	WNDPROC originalEditProc;
 	HINSTANCE hInstance;
+
+	int editDepth;		/* Text-changing messages in progress in the edit control */
+
+	/* Syntax highlighting: lexer state at the start of every line */
+	unsigned char *lineStates;
+	int lineStateCount;
+	int lineStateCapacity;
+
+	PreviewPane preview;
+	OutlinePane outline;
+
+	LoadJob *loadJob;	/* Background load in progress, or NULL */
+
+	SaveJob *saveJob;	/* Background save in progress, or NULL */
+	BOOL saveQueued;	/* Save again once saveJob is done */
+	BOOL saveUtf8;		/* Save as UTF-8 instead of UTF-16LE */
+	unsigned editGeneration;	/* Bumped on every change */
+
+	Journal journal;
 } EditorState;
 
 EditorState *g_editor = NULL;
@@ -49,61 +270,175 @@ void SetStatusText(const wchar_t *text)
 
 void AddValidationError(int lineNum, const wchar_t *message, int severity)
 {
-	if (g_editor->errorCount < MAX_ERRORS) {
-		g_editor->errors[g_editor->errorCount].lineNumber = lineNum;
-		wcscpy(g_editor->errors[g_editor->errorCount].message, message);
-		g_editor->errors[g_editor->errorCount].severity = severity;
-		g_editor->errorCount++;
+	if (g_editor->errorCount == g_editor->errorCapacity) {
+		int capacity = g_editor->errorCapacity ? g_editor->errorCapacity * 2 : 64;
+		ValidationError *errors = realloc(g_editor->errors, capacity * sizeof(ValidationError));
+		int *view = realloc(g_editor->errorView, capacity * sizeof(int));
+		if (errors)
+			g_editor->errors = errors;
+		if (view)
+			g_editor->errorView = view;
+		if (!errors || !view)
+			return;
+		g_editor->errorCapacity = capacity;
+	}
+
+	ValidationError *error = &g_editor->errors[g_editor->errorCount++];
+	error->lineNumber = lineNum;
+	wcsncpy(error->message, message, MAX_ERROR_MSG - 1);
+	error->message[MAX_ERROR_MSG - 1] = L'\0';
+	error->severity = severity;
+}
+
+/* Remember the selected row's diagnostic so it can be found again */
+void SaveErrorSelection()
+{
+	int row = ListView_GetNextItem(g_editor->hwndErrorList, -1, LVNI_SELECTED);
+	g_editor->hasSelectedError = row >= 0 && row < g_editor->errorViewCount;
+	if (g_editor->hasSelectedError)
+		g_editor->selectedError = g_editor->errors[g_editor->errorView[row]];
+}
+
+/* Select the same message again, at the nearest line since lines may have moved */
+void RestoreErrorSelection()
+{
+	HWND hwnd = g_editor->hwndErrorList;
+	ListView_SetItemState(hwnd, -1, 0, LVIS_SELECTED | LVIS_FOCUSED);
+	if (!g_editor->hasSelectedError)
+		return;
+
+	const ValidationError *selected = &g_editor->selectedError;
+	int best = -1, bestDistance = 0;
+	for (int row = 0; row < g_editor->errorViewCount; row++) {
+		const ValidationError *error = &g_editor->errors[g_editor->errorView[row]];
+		if (error->severity != selected->severity || wcscmp(error->message, selected->message) != 0)
+			continue;
+		int distance = abs(error->lineNumber - selected->lineNumber);
+		if (best < 0 || distance < bestDistance) {
+			best = row;
+			bestDistance = distance;
+		}
+	}
+	if (best >= 0) {
+		ListView_SetItemState(hwnd, best, LVIS_SELECTED | LVIS_FOCUSED, LVIS_SELECTED | LVIS_FOCUSED);
+		ListView_EnsureVisible(hwnd, best, FALSE);
 	}
 }
 
 void ClearErrors()
 {
+	SaveErrorSelection();
 	g_editor->errorCount = 0;
-	ListView_DeleteAllItems(g_editor->hwndErrorList);
+	g_editor->errorViewCount = 0;
+	ListView_SetItemCountEx(g_editor->hwndErrorList, 0, 0);
 }
 
-void UpdateErrorList()
+int CompareErrorRows(const void *a, const void *b)
 {
-	ListView_DeleteAllItems(g_editor->hwndErrorList);
+	int left = *(const int *)a, right = *(const int *)b;
+	const ValidationError *x = &g_editor->errors[left];
+	const ValidationError *y = &g_editor->errors[right];
+	int result = 0;
+
+	switch (g_editor->errorSortColumn) {
+	case 0:
+		result = (x->lineNumber > y->lineNumber) - (x->lineNumber < y->lineNumber);
+		break;
+	case 1:
+		result = y->severity - x->severity;	/* Errors first */
+		break;
+	case 2:
+		result = wcscmp(x->message, y->message);
+		break;
+	}
+	if (g_editor->errorSortDescending)
+		result = -result;
+	return result ? result : left - right;	/* Keep validation order for ties */
+}
 
+/* Rebuild the row permutation; the diagnostics themselves are not copied */
+void UpdateErrorList()
+{
+	int count = 0;
 	for (int i = 0; i < g_editor->errorCount; i++) {
-		LVITEMW item = { 0 };
-		wchar_t lineStr[32];
-		wchar_t severityStr[16];
+		if (g_editor->errorFilter & (1 << g_editor->errors[i].severity))
+			g_editor->errorView[count++] = i;
+	}
+	if (g_editor->errorSortColumn >= 0)
+		qsort(g_editor->errorView, count, sizeof(int), CompareErrorRows);
+	g_editor->errorViewCount = count;
 
-		/* Line number */
-		swprintf(lineStr, 32, L"%d", g_editor->errors[i].lineNumber);
+	ListView_SetItemCountEx(g_editor->hwndErrorList, count, LVSICF_NOSCROLL);
+	InvalidateRect(g_editor->hwndErrorList, NULL, FALSE);
+	RestoreErrorSelection();
+}
 
-		/* Severity */
-		switch (g_editor->errors[i].severity) {
-		case 0:
-			wcscpy(severityStr, L"Info");
-			break;
-		case 1:
-			wcscpy(severityStr, L"Warning");
-			break;
-		case 2:
-			wcscpy(severityStr, L"Error");
-			break;
-		default:
-			wcscpy(severityStr, L"Unknown");
-			break;
-		}
+/* Supplies the text of a visible row; the list itself holds no items */
+void GetErrorDispInfo(NMLVDISPINFOW *info)
+{
+	LVITEMW *item = &info->item;
+	if (!(item->mask & LVIF_TEXT) || item->cchTextMax <= 0)
+		return;
+	item->pszText[0] = L'\0';
+	if (item->iItem < 0 || item->iItem >= g_editor->errorViewCount)
+		return;
 
-		item.mask = LVIF_TEXT;
-		item.iItem = i;
-		item.iSubItem = 0;
-		item.pszText = lineStr;
-		ListView_InsertItem(g_editor->hwndErrorList, &item);
+	const ValidationError *error = &g_editor->errors[g_editor->errorView[item->iItem]];
+	switch (item->iSubItem) {
+	case 0:
+		swprintf(item->pszText, item->cchTextMax, L"%d", error->lineNumber);
+		break;
+	case 1:
+		wcsncpy(item->pszText,
+			error->severity == 0 ? L"Info" :
+			error->severity == 1 ? L"Warning" :
+			error->severity == 2 ? L"Error" : L"Unknown", item->cchTextMax - 1);
+		item->pszText[item->cchTextMax - 1] = L'\0';
+		break;
+	case 2:
+		wcsncpy(item->pszText, error->message, item->cchTextMax - 1);
+		item->pszText[item->cchTextMax - 1] = L'\0';
+		break;
+	}
+}
 
-		item.iSubItem = 1;
-		item.pszText = severityStr;
-		ListView_SetItem(g_editor->hwndErrorList, &item);
+/* Clicking a column sorts by it; clicking it again reverses the order */
+void SortErrorList(int column)
+{
+	SaveErrorSelection();
+	if (g_editor->errorSortColumn == column) {
+		g_editor->errorSortDescending = !g_editor->errorSortDescending;
+	} else {
+		g_editor->errorSortColumn = column;
+		g_editor->errorSortDescending = FALSE;
+	}
+	UpdateErrorList();
+}
 
-		item.iSubItem = 2;
-		item.pszText = g_editor->errors[i].message;
-		ListView_SetItem(g_editor->hwndErrorList, &item);
+/* Right-click menu choosing which severities are listed */
+void ShowErrorFilterMenu(HWND hwnd, int x, int y)
+{
+	static const wchar_t *names[3] = { L"Show &Info", L"Show &Warnings", L"Show &Errors" };
+	HMENU menu = CreatePopupMenu();
+	if (!menu)
+		return;
+	for (int severity = 2; severity >= 0; severity--)
+		AppendMenuW(menu, MF_STRING | ((g_editor->errorFilter & (1 << severity)) ? MF_CHECKED : MF_UNCHECKED),
+			    severity + 1, names[severity]);
+
+	if (x == -1 && y == -1) {
+		/* Opened from the keyboard */
+		RECT rect;
+		GetWindowRect(hwnd, &rect);
+		x = rect.left;
+		y = rect.top;
+	}
+	int command = TrackPopupMenu(menu, TPM_RETURNCMD | TPM_RIGHTBUTTON, x, y, 0, g_editor->hwndMain, NULL);
+	DestroyMenu(menu);
+	if (command > 0) {
+		SaveErrorSelection();
+		g_editor->errorFilter ^= 1 << (command - 1);
+		UpdateErrorList();
 	}
 }
 
@@ -131,388 +466,1702 @@ void UpdateGutterAndRect()
 
 TEXTMETRICW tm;
 
-LRESULT CALLBACK
-EditControlProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
-{
-	switch (uMsg) {
-	case WM_PAINT:
-		{
-			/* Call the original paint first */
-			LRESULT result =
-			    CallWindowProcW(g_editor->originalEditProc, hwnd,
-					    uMsg,
-					    wParam,
-					    lParam);
-
-			/* Now paint the line numbers in the gutter */
-			HDC hdc = GetDC(hwnd);
-			if (hdc) {
-				RECT clientRect;
-				GetClientRect(hwnd, &clientRect);
-
-				/* Set up drawing context for gutter */
-				SetBkColor(hdc, RGB(245, 245, 245));
-				SetTextColor(hdc, RGB(100, 100, 100));
-				SelectObject(hdc, g_editor->hFont);
-
-				/* Fill gutter background */
-				RECT gutterRect = { 0, 0, g_editor->gutterWidth,
-					clientRect.bottom
-				};
-				FillRect(hdc, &gutterRect,
-					 CreateSolidBrush(RGB(245, 245, 245)));
-
-				/* Get first visible line */
-				int firstVisibleLine = (int)SendMessageW(hwnd,
-									 EM_GETFIRSTVISIBLELINE,
-									 0,
-									 0);
-				int totalLines =
-				    (int)SendMessageW(hwnd, EM_GETLINECOUNT, 0,
-						      0);
-
-				/* Calculate visible lines */
-				int visibleLines =
-				    (clientRect.bottom -
-				     clientRect.top) / g_editor->lineHeight + 2;
+BOOL IsValidHexColor(const wchar_t *str, int len);
+void PreviewNoteEdit(int firstLine, int lastLine, int lineDelta, BOOL all);
+void OutlineNoteEdit(int firstLine, int lastLine, int scanEnd, int lineDelta);
+void RebuildOutline();
+void CancelLoad();
+void JournalEdit(int start, int deleted, int inserted);
+const wchar_t *LockEditText(HLOCAL *handle, int *length);
+void JournalNoteUnknownEdit();
+void JournalDiscard();
+BOOL RecoverJournal();
+
+/*
+ * Syntax highlighting. The EDIT control can only draw in one color, so
+ * visible lines are lexed and overpainted after it paints. The only
+ * state that crosses lines is whether we are inside a START/END
+ * segment; it is cached per line and, after an edit, recomputed from
+ * the edited line until it matches the cache again.
+ */
+#define MAX_SYNTAX_TOKENS 256
+#define MAX_HIGHLIGHT_LINE 1024
+
+enum { LEX_OUTSIDE, LEX_SEGMENT };
+
+typedef enum {
+	TOK_TEXT,
+	TOK_COMMENT,
+	TOK_COMMAND,
+	TOK_NUMBER,
+	TOK_DELIMITER,
+	TOK_ESCAPE,
+	TOK_BRACKET,
+	TOK_COLOR,
+	TOK_ERROR
+} TokenKind;
 
-				/* Draw line numbers */
-				/* Get the y position of the first visible line */
-				int baseYPos = tm.tmExternalLeading;
+typedef struct {
+	int start;
+	int length;
+	TokenKind kind;
+	COLORREF color;		/* For TOK_COLOR, the spec's own color */
+} SyntaxToken;
+
+/* State at the start of the next line */
+int NextLexState(const wchar_t *line, int len, int state)
+{
+	if (len == 5 && wcsncmp(line, L"START", 5) == 0)
+		return LEX_SEGMENT;
+	if (len == 3 && wcsncmp(line, L"END", 3) == 0)
+		return LEX_OUTSIDE;
+	return state;
+}
 
-				for (int i = 0;
-				     i < visibleLines
-				     && (firstVisibleLine + i) < totalLines;
-				     i++) {
-					int lineNum = firstVisibleLine + i + 1;
-					wchar_t lineText[16];
-					swprintf(lineText, 16, L"%d", lineNum);
+int AddToken(SyntaxToken *tokens, int count, int start, int length,
+	     TokenKind kind, COLORREF color)
+{
+	if (count >= MAX_SYNTAX_TOKENS || length <= 0)
+		return count;
+	tokens[count].start = start;
+	tokens[count].length = length;
+	tokens[count].kind = kind;
+	tokens[count].color = color;
+	return count + 1;
+}
 
-					/* Calculate y position: base position + (line offset * line height) */
-					int yPos =
-					    baseYPos +
-					    (i * g_editor->lineHeight);
+BOOL IsHeaderCommand(const wchar_t *line, int len, int *commandLen)
+{
+	static const wchar_t *commands[] =
+	    { L"LPS", L"TPF", L"SW", L"SH", L"SC", L"SD", L"CD", L"PM" };
+	for (int i = 0; i < 8; i++) {
+		int n = (int)wcslen(commands[i]);
+		if (len >= n && wcsncmp(line, commands[i], n) == 0) {
+			*commandLen = n;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
 
-					/* Only draw if the line is within the visible client area */
-					if (yPos >= 0
-					    && yPos + g_editor->lineHeight <=
-					    clientRect.bottom) {
-						RECT lineRect = {
-							2,
-							yPos,
-							g_editor->gutterWidth -
-							    4,
-							yPos +
-							    g_editor->lineHeight
-						};
+/* Lex segment text the way ValidateColorSyntax reads it */
+int LexSegmentText(const wchar_t *line, int len, SyntaxToken *tokens)
+{
+	int count = 0;
+	int open[MAX_NESTING_DEPTH];	/* Token index of each open backtick */
+	int depth = 0;
 
-						DrawTextW(hdc, lineText, -1,
-							  &lineRect,
-							  DT_RIGHT | DT_VCENTER
-							  | DT_SINGLELINE);
-					}
+	for (int i = 0; i < len; i++) {
+		if (line[i] == L'\\' && i + 1 < len) {
+			count = AddToken(tokens, count, i, 2, TOK_ESCAPE, 0);
+			i++;
+		} else if (line[i] == L'`') {
+			int colonPos = -1;
+			for (int j = i + 1; j < len; j++) {
+				if (line[j] == L'\\' && j + 1 < len) {
+					j++;
+					continue;
 				}
-
-				/* Draw separator line */
-				HPEN pen =
-				    CreatePen(PS_SOLID, 1, RGB(200, 200, 200));
-				HPEN oldPen = SelectObject(hdc, pen);
-				MoveToEx(hdc, g_editor->gutterWidth - 1, 0,
-					 NULL);
-				LineTo(hdc, g_editor->gutterWidth - 1,
-				       clientRect.bottom);
-				SelectObject(hdc, oldPen);
-				DeleteObject(pen);
-
-				ReleaseDC(hwnd, hdc);
+				if (line[j] == L':') {
+					colonPos = j;
+					break;
+				}
+				if (line[j] == L'\'' || line[j] == L'`')
+					break;
 			}
 
-			return result;
-		}
-
-	case WM_LBUTTONDOWN:
-		{
-			/* Check if click is in the gutter */
-			int xPos = GET_X_LPARAM(lParam);
-			if (xPos < g_editor->gutterWidth) {
-				/* Handle gutter click - could select entire line */
-				int yPos = GET_Y_LPARAM(lParam);
-				POINT pt = { g_editor->gutterWidth + 1, yPos };
-				int charIndex =
-				    (int)SendMessageW(hwnd, EM_CHARFROMPOS, 0,
-						      MAKELPARAM(pt.x, pt.y));
-				if (charIndex >= 0) {
-					int lineIndex = (int)SendMessageW(hwnd,
-									  EM_LINEFROMCHAR,
-									  charIndex,
-									  0);
-					int lineStart = (int)SendMessageW(hwnd,
-									  EM_LINEINDEX,
-									  lineIndex,
-									  0);
-					int lineLength = (int)SendMessageW(hwnd,
-									   EM_LINELENGTH,
-									   lineStart,
-									   0);
-
-					/* Select the entire line */
-					SendMessageW(hwnd, EM_SETSEL, lineStart,
-						     lineStart + lineLength);
+			if (depth < MAX_NESTING_DEPTH)
+				open[depth++] = count;
+			count = AddToken(tokens, count, i, 1, TOK_BRACKET, 0);
+
+			if (colonPos > i + 1) {
+				int specLen = colonPos - i - 1;
+				if (IsValidHexColor(&line[i + 1], specLen)) {
+					wchar_t hex[7] = { 0 };
+					wcsncpy(hex, &line[i + 1], 6);
+					unsigned long rgb = wcstoul(hex, NULL, 16);
+					count = AddToken(tokens, count, i + 1, specLen + 1, TOK_COLOR,
+							 RGB((rgb >> 16) & 0xFF, (rgb >> 8) & 0xFF, rgb & 0xFF));
+				} else {
+					count = AddToken(tokens, count, i + 1, specLen, TOK_ERROR, 0);
 				}
-				return 0;
+				i = colonPos;
+			}
+		} else if (line[i] == L'\'') {
+			if (depth > 0) {
+				depth--;
+				count = AddToken(tokens, count, i, 1, TOK_BRACKET, 0);
+			} else {
+				count = AddToken(tokens, count, i, 1, TOK_ERROR, 0);
 			}
-			break;
 		}
+	}
 
-	case WM_ERASEBKGND:
-		/* Let the original control handle background, we'll paint gutter in WM_PAINT */
-		break;
+	/* Unclosed backticks */
+	while (depth > 0) {
+		int index = open[--depth];
+		if (index < count)
+			tokens[index].kind = TOK_ERROR;
+	}
+	return count;
+}
 
-	case WM_VSCROLL:
-	case WM_HSCROLL:
-	case WM_MOUSEWHEEL:
-		/* Call original handler first, then update display */
-		CallWindowProcW(g_editor->originalEditProc, hwnd, uMsg, wParam,
-				lParam);
-		InvalidateRect(hwnd, NULL, FALSE);
-		return 0;
+int LexLine(const wchar_t *line, int len, int state, SyntaxToken *tokens)
+{
+	int commandLen;
 
-	case WM_SIZE:
-		/* Update formatting rect when control is resized */
-		CallWindowProcW(g_editor->originalEditProc, hwnd, uMsg, wParam,
-				lParam);
-		UpdateGutterAndRect();
+	if (len == 0)
 		return 0;
+	if (line[0] == L'/')
+		return AddToken(tokens, 0, 0, len, TOK_COMMENT, 0);
+	if (len == 5 && wcsncmp(line, L"START", 5) == 0)	/* Error: START inside another segment */
+		return AddToken(tokens, 0, 0, len, state == LEX_SEGMENT ? TOK_ERROR : TOK_DELIMITER, 0);
+	if (len == 3 && wcsncmp(line, L"END", 3) == 0)	/* Error: END without START */
+		return AddToken(tokens, 0, 0, len, state == LEX_SEGMENT ? TOK_DELIMITER : TOK_ERROR, 0);
+	if (state == LEX_SEGMENT)
+		return LexSegmentText(line, len, tokens);
+
+	if (IsHeaderCommand(line, len, &commandLen)) {
+		int count = AddToken(tokens, 0, 0, commandLen, TOK_COMMAND, 0);
+		int i = commandLen;
+		while (i < len && (line[i] == L' ' || line[i] == L'\t'))
+			i++;
+		int numberStart = i;
+		while (i < len && ((line[i] >= L'0' && line[i] <= L'9') || (i == numberStart && line[i] == L'-')))
+			i++;
+		return AddToken(tokens, count, numberStart, i - numberStart, TOK_NUMBER, 0);
 	}
+	return AddToken(tokens, 0, 0, len, TOK_ERROR, 0);	/* Text outside segment */
+}
 
-	return CallWindowProcW(g_editor->originalEditProc, hwnd, uMsg, wParam,
-			       lParam);
+int GetEditLine(HWND hwnd, int lineIndex, wchar_t *buffer, int size)
+{
+	int start = (int)SendMessageW(hwnd, EM_LINEINDEX, lineIndex, 0);
+	int len = (int)SendMessageW(hwnd, EM_LINELENGTH, start, 0);
+	if (len >= size)
+		len = size - 1;
+	*(WORD *) buffer = (WORD) len;	/* EM_GETLINE takes the size in the first word */
+	len = (int)SendMessageW(hwnd, EM_GETLINE, lineIndex, (LPARAM) buffer);
+	buffer[len] = L'\0';
+	return len;
 }
 
-BOOL IsValidHexColor(const wchar_t *str, int len)
+BOOL EnsureLineStates(int lineCount)
 {
-	if (len != 6)
-		return FALSE;
-	for (int i = 0; i < 6; i++) {
-		wchar_t c = str[i];
-		if (!((c >= L'0' && c <= L'9') ||
-		      (c >= L'A' && c <= L'F') || (c >= L'a' && c <= L'f'))) {
+	if (lineCount + 1 > g_editor->lineStateCapacity) {
+		int capacity = g_editor->lineStateCapacity ? g_editor->lineStateCapacity : 1024;
+		while (capacity < lineCount + 1)
+			capacity *= 2;
+		unsigned char *states = realloc(g_editor->lineStates, capacity);
+		if (!states)
 			return FALSE;
-		}
+		g_editor->lineStates = states;
+		g_editor->lineStateCapacity = capacity;
 	}
 	return TRUE;
 }
 
-typedef struct {
-	int position;		/* Position in the line where backtick opened */
-	BOOL hasColor;		/* Whether this backtick has a color specification */
-} BacktickState;
-
-typedef struct {
-	BacktickState stack[MAX_NESTING_DEPTH];
-	int depth;
-} BacktickStack;
+/* Recompute line start states from firstLine until they converge past
+ * lastLine. lineStates[lineCount] is the state after the last line.
+ * Returns the last line looked at. */
+int RelexLines(int firstLine, int lastLine)
+{
+	HWND hwnd = g_editor->hwndEdit;
+	int lineCount = g_editor->lineStateCount;
+	wchar_t line[8];
+	int i;
+
+	for (i = firstLine; i < lineCount; i++) {
+		int start = (int)SendMessageW(hwnd, EM_LINEINDEX, i, 0);
+		int len = (int)SendMessageW(hwnd, EM_LINELENGTH, start, 0);
+		int next = g_editor->lineStates[i];
+		if (len == 3 || len == 5) {
+			GetEditLine(hwnd, i, line, 8);
+			next = NextLexState(line, len, next);
+		}
+		if (i >= lastLine && g_editor->lineStates[i + 1] == next)
+			break;
+		g_editor->lineStates[i + 1] = (unsigned char)next;
+	}
+	return i;
+}
 
-void InitBacktickStack(BacktickStack *stack)
+void RebuildLineStates()
 {
-	stack->depth = 0;
+	int lineCount = (int)SendMessageW(g_editor->hwndEdit, EM_GETLINECOUNT, 0, 0);
+	if (!EnsureLineStates(lineCount))
+		return;
+	g_editor->lineStateCount = lineCount;
+	g_editor->lineStates[0] = LEX_OUTSIDE;
+	RelexLines(0, lineCount);
+	PreviewNoteEdit(0, lineCount, 0, TRUE);
+	RebuildOutline();
 }
 
-BOOL PushBacktick(BacktickStack *stack, int position, BOOL hasColor)
+/* Called after the control's text changed: [start, start + inserted) is new */
+void OnEditChanged(int start, int inserted)
 {
-	if (stack->depth >= MAX_NESTING_DEPTH) {
-		return FALSE;	/* Stack overflow */
+	HWND hwnd = g_editor->hwndEdit;
+	int oldCount = g_editor->lineStateCount;
+	int newCount = (int)SendMessageW(hwnd, EM_GETLINECOUNT, 0, 0);
+	int firstLine = (int)SendMessageW(hwnd, EM_LINEFROMCHAR, start, 0);
+	int lastLine = (int)SendMessageW(hwnd, EM_LINEFROMCHAR, start + inserted, 0);
+	int lineDelta = newCount - oldCount;
+
+	if (!g_editor->lineStates || !EnsureLineStates(newCount)) {
+		RebuildLineStates();
+		return;
 	}
-	stack->stack[stack->depth].position = position;
-	stack->stack[stack->depth].hasColor = hasColor;
-	stack->depth++;
-	return TRUE;
+
+	/* Lines after the edit keep their states, shifted */
+	int oldLast = lastLine - lineDelta;
+	if (oldLast < oldCount)
+		memmove(g_editor->lineStates + lastLine + 1, g_editor->lineStates + oldLast + 1,
+			oldCount - oldLast);
+	g_editor->lineStateCount = newCount;
+	int scanEnd = RelexLines(firstLine, lastLine);
+	PreviewNoteEdit(firstLine, lastLine, lineDelta, FALSE);
+	OutlineNoteEdit(firstLine, lastLine, scanEnd, lineDelta);
 }
 
-BOOL PopBacktick(BacktickStack *stack, BacktickState *state)
+COLORREF TokenTextColor(const SyntaxToken *token)
 {
-	if (stack->depth <= 0) {
-		return FALSE;	/* Stack underflow */
-	}
-	stack->depth--;
-	if (state) {
-		*state = stack->stack[stack->depth];
+	switch (token->kind) {
+	case TOK_COMMENT:
+		return RGB(0, 128, 0);
+	case TOK_COMMAND:
+	case TOK_DELIMITER:
+		return RGB(0, 0, 192);
+	case TOK_NUMBER:
+		return RGB(128, 0, 128);
+	case TOK_ESCAPE:
+		return RGB(160, 96, 0);
+	case TOK_BRACKET:
+		return RGB(128, 128, 128);
+	case TOK_COLOR:
+		return token->color;
+	case TOK_ERROR:
+		return RGB(192, 0, 0);
+	default:
+		return RGB(0, 0, 0);
 	}
-	return TRUE;
 }
 
-BOOL IsStackEmpty(BacktickStack *stack)
+COLORREF TokenBackColor(const SyntaxToken *token)
 {
-	return stack->depth == 0;
+	if (token->kind == TOK_ERROR)
+		return RGB(255, 220, 220);
+	if (token->kind == TOK_COLOR &&
+	    GetRValue(token->color) * 3 + GetGValue(token->color) * 6 + GetBValue(token->color) > 2000)
+		return RGB(64, 64, 64);	/* Keep light colors readable */
+	return GetSysColor(COLOR_WINDOW);
 }
 
-void ValidateColorSyntax(const wchar_t *line, int lineNum)
+void PaintHighlighting(HWND hwnd, HDC hdc, RECT *clientRect)
 {
-	int len = (int)wcslen(line);
-	BacktickStack stack;
-	InitBacktickStack(&stack);
+	if (!g_editor->lineStates)
+		return;
 
-	for (int i = 0; i < len; i++) {
-		if (line[i] == L'\\' && i + 1 < len) {
-			i++;	/* Skip escaped character */
-			continue;
+	DWORD selStart, selEnd;
+	SendMessageW(hwnd, EM_GETSEL, (WPARAM) & selStart, (LPARAM) & selEnd);
+
+	int saved = SaveDC(hdc);
+	IntersectClipRect(hdc, g_editor->gutterWidth, clientRect->top, clientRect->right, clientRect->bottom);
+	SelectObject(hdc, g_editor->hFont);
+
+	int firstVisibleLine = (int)SendMessageW(hwnd, EM_GETFIRSTVISIBLELINE, 0, 0);
+	int visibleLines = (clientRect->bottom - clientRect->top) / g_editor->lineHeight + 2;
+	wchar_t line[MAX_HIGHLIGHT_LINE];
+	SyntaxToken tokens[MAX_SYNTAX_TOKENS];
+
+	for (int i = firstVisibleLine;
+	     i < firstVisibleLine + visibleLines && i < g_editor->lineStateCount; i++) {
+		int lineStart = (int)SendMessageW(hwnd, EM_LINEINDEX, i, 0);
+		int len = GetEditLine(hwnd, i, line, MAX_HIGHLIGHT_LINE);
+		int count = LexLine(line, len, g_editor->lineStates[i], tokens);
+
+		for (int t = 0; t < count; t++) {
+			SyntaxToken *token = &tokens[t];
+			int from = lineStart + token->start;
+			int to = from + token->length;
+
+			/* Leave the selection to the control */
+			if (from < (int)selEnd && to > (int)selStart) {
+				if (from >= (int)selStart && to <= (int)selEnd)
+					continue;
+				if (from < (int)selStart)
+					to = selStart;
+				else
+					from = selEnd;
+			}
+			if (wmemchr(line + (from - lineStart), L'\t', to - from))
+				continue;	/* Tab stops are the control's business */
+
+			LRESULT pos = SendMessageW(hwnd, EM_POSFROMCHAR, from, 0);
+			if (pos == -1)
+				continue;
+			SetTextColor(hdc, TokenTextColor(token));
+			SetBkColor(hdc, TokenBackColor(token));
+			TextOutW(hdc, (short)LOWORD(pos), (short)HIWORD(pos),
+				 line + (from - lineStart), to - from);
 		}
+	}
 
-		if (line[i] == L'`') {
-			/* Look for colon to determine if this has color specification */
-			int colonPos = -1;
-			int nextQuotePos = -1;
+	RestoreDC(hdc, saved);
+}
 
-			/* Find the next colon and quote to understand the structure */
+void FreePreviewSegment(PreviewSegment *segment)
+{
+	for (int l = 0; l < segment->lineCount; l++) {
+		free(segment->lines[l].text);
+		free(segment->lines[l].runs);
+	}
+	free(segment->lines);
+	segment->lines = NULL;
+	segment->lineCount = 0;
+}
+
+/* Append one character, sharing the run with same-colored neighbours */
+void AppendPreviewChar(PreviewLine *line, wchar_t c, COLORREF color)
+{
+	PreviewRun *run = line->runCount ? &line->runs[line->runCount - 1] : NULL;
+	if (!run || run->color != color) {
+		if (line->runCount == line->runCapacity) {
+			int capacity = line->runCapacity ? line->runCapacity * 2 : 4;
+			PreviewRun *runs = realloc(line->runs, capacity * sizeof(PreviewRun));
+			if (!runs)
+				return;
+			line->runs = runs;
+			line->runCapacity = capacity;
+		}
+		run = &line->runs[line->runCount++];
+		run->start = line->length;
+		run->length = 0;
+		run->color = color;
+	}
+	line->text[line->length++] = c;
+	run->length++;
+}
+
+/* Same markup rules as the renderer's ParseColoredLine */
+void ParsePreviewLine(const wchar_t *text, int len, PreviewLine *line)
+{
+	line->text = malloc((len + 1) * sizeof(wchar_t));
+	line->length = 0;
+	line->runs = NULL;
+	line->runCount = 0;
+	line->runCapacity = 0;
+	line->width = 0;
+	if (!line->text)
+		return;
+
+	COLORREF colorStack[MAX_NESTING_DEPTH];
+	int colorDepth = 0;
+	COLORREF currentColor = RGB(255, 255, 255);	/* Default white */
+	colorStack[0] = currentColor;
+
+	for (int i = 0; i < len; i++) {
+		if (text[i] == L'\\' && i + 1 < len) {
+			AppendPreviewChar(line, text[++i], currentColor);
+		} else if (text[i] == L'`') {
+			int colonPos = -1;
 			for (int j = i + 1; j < len; j++) {
-				if (line[j] == L'\\' && j + 1 < len) {
-					j++;	/* Skip escaped character */
+				if (text[j] == L'\\' && j + 1 < len) {
+					j++;
 					continue;
 				}
-				if (line[j] == L':' && colonPos == -1) {
+				if (text[j] == L':') {
 					colonPos = j;
-				} else if (line[j] == L'\''
-					   && nextQuotePos == -1) {
-					nextQuotePos = j;
 					break;
-				} else if (line[j] == L'`') {
-					/* Found another backtick before finding a quote */
+				} else if (text[j] == L'\'' || text[j] == L'`') {
 					break;
 				}
 			}
 
-			BOOL hasColorSpec = FALSE;
-
-			if (colonPos != -1
-			    && (nextQuotePos == -1 || colonPos < nextQuotePos))
-			{
-				/* Validate color specification between backtick and colon */
-				int paramLen = colonPos - i - 1;
-				if (paramLen == 6) {
-					wchar_t colorSpec[7] = { 0 };
-					wcsncpy(colorSpec, &line[i + 1], 6);
-					if (IsValidHexColor(colorSpec, 6)) {
-						hasColorSpec = TRUE;
-					} else {
-						AddValidationError(lineNum,
-								   L"Invalid hex color specification",
-								   2);
-					}
-				} else if (paramLen > 0) {
-					AddValidationError(lineNum,
-							   L"Color specification must be exactly 6 hex characters",
-							   2);
+			if (colonPos != -1) {
+				if (colonPos - i - 1 == 6 && IsValidHexColor(&text[i + 1], 6)
+				    && colorDepth < MAX_NESTING_DEPTH - 1) {
+					wchar_t hex[7] = { 0 };
+					wcsncpy(hex, &text[i + 1], 6);
+					unsigned long rgb = wcstoul(hex, NULL, 16);
+					currentColor = RGB((rgb >> 16) & 0xFF, (rgb >> 8) & 0xFF, rgb & 0xFF);
+					colorStack[++colorDepth] = currentColor;
 				}
+				i = colonPos;
+			} else {
+				AppendPreviewChar(line, text[i], currentColor);
 			}
+		} else if (text[i] == L'\'') {
+			if (colorDepth > 0)
+				colorDepth--;
+			currentColor = colorStack[colorDepth];
+		} else {
+			AppendPreviewChar(line, text[i], currentColor);
+		}
+	}
+}
 
-			/* Push this backtick onto the stack */
-			if (!PushBacktick(&stack, i, hasColorSpec)) {
-				AddValidationError(lineNum,
-						   L"Too many nested color specifications (maximum 10)",
-						   2);
+void MeasurePreviewSegment(PreviewPane *preview, PreviewSegment *segment)
+{
+	SelectObject(preview->frameDC, preview->font);
+	segment->width = 0;
+	for (int l = 0; l < segment->lineCount; l++) {
+		PreviewLine *line = &segment->lines[l];
+		int x = 0;
+		for (int r = 0; r < line->runCount; r++) {
+			SIZE size = { 0, 0 };
+			GetTextExtentPoint32W(preview->frameDC, line->text + line->runs[r].start,
+					      line->runs[r].length, &size);
+			line->runs[r].x = x;
+			x += size.cx;
+		}
+		line->width = x;
+		if (x > segment->width)
+			segment->width = x;
+	}
+}
+
+void ParsePreviewSegment(PreviewPane *preview, PreviewSegment *segment)
+{
+	wchar_t text[MAX_HIGHLIGHT_LINE];
+
+	FreePreviewSegment(segment);
+	int count = segment->endLine - segment->startLine - 1;
+	segment->lines = calloc(count > 0 ? count : 1, sizeof(PreviewLine));
+	if (!segment->lines)
+		return;
+
+	for (int i = segment->startLine + 1; i < segment->endLine; i++) {
+		int len = GetEditLine(g_editor->hwndEdit, i, text, MAX_HIGHLIGHT_LINE);
+		if (len > 0 && text[0] == L'/')
+			continue;	/* Comments are skipped, empty lines are kept */
+		ParsePreviewLine(text, len, &segment->lines[segment->lineCount++]);
+	}
+	MeasurePreviewSegment(preview, segment);
+	segment->dirty = FALSE;
+}
+
+void DestroyPreviewFrame(PreviewPane *preview)
+{
+	if (preview->frameDC) {
+		SelectObject(preview->frameDC, preview->oldBitmap);
+		DeleteObject(preview->frameBitmap);
+		DeleteDC(preview->frameDC);
+		preview->frameDC = NULL;
+	}
+	if (preview->font) {
+		DeleteObject(preview->font);
+		preview->font = NULL;
+	}
+}
+
+/* Read the header commands from the lines outside segments */
+void ParsePreviewConfig(PreviewPane *preview)
+{
+	wchar_t line[MAX_HIGHLIGHT_LINE];
+	int oldWidth = preview->screenWidth, oldHeight = preview->screenHeight;
+	int oldLines = preview->linesPerScreen, oldTpf = preview->timePerFrame;
+
+	preview->timePerFrame = 50;
+	preview->pixelsPerFrame = 3;
+	for (int i = 0; i < g_editor->lineStateCount; i++) {
+		if (g_editor->lineStates[i] != LEX_OUTSIDE)
+			continue;
+		int len = GetEditLine(g_editor->hwndEdit, i, line, MAX_HIGHLIGHT_LINE);
+		if (len < 3 || line[0] == L'/')
+			continue;
+		if (wcsncmp(line, L"LPS", 3) == 0) {
+			preview->linesPerScreen = _wtoi(&line[3]);
+		} else if (wcsncmp(line, L"SW", 2) == 0) {
+			preview->screenWidth = _wtoi(&line[2]);
+		} else if (wcsncmp(line, L"SH", 2) == 0) {
+			preview->screenHeight = _wtoi(&line[2]);
+		} else if (wcsncmp(line, L"SD", 2) == 0) {
+			preview->screenDelay = _wtoi(&line[2]);
+		} else if (wcsncmp(line, L"CD", 2) == 0) {
+			preview->centerDelay = _wtoi(&line[2]);
+		} else if (wcsncmp(line, L"TPF", 3) == 0) {
+			if (_wtoi(&line[3]) > 0)
+				preview->timePerFrame = _wtoi(&line[3]);
+		} else if (wcsncmp(line, L"PM", 2) == 0) {
+			if (_wtoi(&line[2]) > 0)
+				preview->pixelsPerFrame = _wtoi(&line[2]);
+		}
+	}
+	preview->configDirty = FALSE;
+
+	if (preview->timePerFrame != oldTpf && preview->visible)
+		SetTimer(preview->hwnd, PREVIEW_TIMER_ID, preview->timePerFrame, NULL);
+
+	if (preview->frameDC && preview->screenWidth == oldWidth
+	    && preview->screenHeight == oldHeight && preview->linesPerScreen == oldLines)
+		return;
+
+	/* Geometry changed: new font and frame, and every segment is remeasured */
+	DestroyPreviewFrame(preview);
+	preview->frameWidth = min(max(preview->screenWidth, 1), PREVIEW_MAX_WIDTH);
+	preview->frameHeight = min(max(preview->screenHeight, 1), PREVIEW_MAX_HEIGHT);
+
+	int fontSize = -(preview->screenHeight / max(preview->linesPerScreen, 1));
+	if (fontSize > -8)
+		fontSize = -8;	/* Minimum readable size */
+	preview->font = CreateFontW(fontSize, 0, 0, 0, FW_NORMAL, FALSE, FALSE, FALSE,
+				    DEFAULT_CHARSET, OUT_DEFAULT_PRECIS, CLIP_DEFAULT_PRECIS,
+				    DEFAULT_QUALITY, FIXED_PITCH | FF_MODERN, L"MingLiU");
+	if (!preview->font)
+		preview->font = CreateFontW(fontSize, 0, 0, 0, FW_NORMAL, FALSE, FALSE, FALSE,
+					    DEFAULT_CHARSET, OUT_DEFAULT_PRECIS, CLIP_DEFAULT_PRECIS,
+					    DEFAULT_QUALITY, FIXED_PITCH | FF_MODERN, L"Courier New");
+
+	HDC hdc = GetDC(preview->hwnd);
+	preview->frameDC = CreateCompatibleDC(hdc);
+	preview->frameBitmap = CreateCompatibleBitmap(hdc, preview->frameWidth, preview->frameHeight);
+	preview->oldBitmap = SelectObject(preview->frameDC, preview->frameBitmap);
+	ReleaseDC(preview->hwnd, hdc);
+
+	for (int s = 0; s < preview->segmentCount; s++)
+		MeasurePreviewSegment(preview, &preview->segments[s]);
+}
+
+/*
+ * Called for every edit with the new line range [firstLine, lastLine] and
+ * the change in line count. Segments after the edit are shifted, the ones
+ * it touches are marked for reparsing.
+ */
+void PreviewNoteEdit(int firstLine, int lastLine, int lineDelta, BOOL all)
+{
+	PreviewPane *preview = &g_editor->preview;
+	int oldLast = lastLine - lineDelta;
+	BOOL insideSegment = FALSE;
+
+	for (int s = 0; s < preview->segmentCount; s++) {
+		PreviewSegment *segment = &preview->segments[s];
+		if (all) {
+			segment->dirty = TRUE;
+		} else if (segment->startLine > oldLast) {
+			segment->startLine += lineDelta;
+			segment->endLine += lineDelta;
+		} else if (segment->endLine >= firstLine) {
+			segment->dirty = TRUE;
+			if (firstLine > segment->startLine && oldLast < segment->endLine)
+				insideSegment = TRUE;
+		}
+	}
+
+	preview->structureDirty = TRUE;
+	if (!insideSegment)
+		preview->configDirty = TRUE;
+}
+
+/*
+ * Find START/END pairs from the cached lexer states (no text is read) and
+ * reuse every parsed segment whose lines did not change.
+ */
+void RescanPreview(PreviewPane *preview)
+{
+	const unsigned char *states = g_editor->lineStates;
+	int lineCount = g_editor->lineStateCount;
+	int count = 0, capacity = 16;
+	PreviewSegment *segments = calloc(capacity, sizeof(PreviewSegment));
+	if (!segments || !states) {
+		free(segments);
+		return;
+	}
+
+	int start = -1;
+	for (int i = 0; i < lineCount; i++) {
+		if (states[i] == LEX_OUTSIDE && states[i + 1] == LEX_SEGMENT) {
+			start = i;
+		} else if (states[i] == LEX_SEGMENT && states[i + 1] == LEX_OUTSIDE && start >= 0) {
+			if (count == capacity) {
+				PreviewSegment *grown = realloc(segments, capacity * 2 * sizeof(PreviewSegment));
+				if (!grown)
+					break;
+				segments = grown;
+				memset(segments + capacity, 0, capacity * sizeof(PreviewSegment));
+				capacity *= 2;
 			}
+			segments[count].startLine = start;
+			segments[count].endLine = i;
+			segments[count].dirty = TRUE;
+			count++;
+			start = -1;
+		}
+	}
 
-		} else if (line[i] == L'\'') {
-			/* Pop the most recent backtick from stack */
-			BacktickState state;
-			if (!PopBacktick(&stack, &state)) {
-				AddValidationError(lineNum,
-						   L"Closing quote without opening backtick",
-						   2);
-			} else {
-				/* Successfully matched a backtick-quote pair */
-				/* Could add additional validation here if needed */
+	/* Both lists are ordered by line, so matching is a merge */
+	int old = 0;
+	for (int s = 0; s < count; s++) {
+		while (old < preview->segmentCount
+		       && preview->segments[old].startLine < segments[s].startLine)
+			old++;
+		if (old < preview->segmentCount) {
+			PreviewSegment *previous = &preview->segments[old];
+			if (!previous->dirty && previous->startLine == segments[s].startLine
+			    && previous->endLine == segments[s].endLine) {
+				segments[s] = *previous;
+				previous->lines = NULL;
+				previous->lineCount = 0;
+				old++;
 			}
 		}
 	}
 
-	/* Check for unmatched backticks */
-	if (!IsStackEmpty(&stack)) {
-		wchar_t errorMsg[256];
-		swprintf(errorMsg, 256,
-			 L"Unclosed color specification (%d unmatched backticks)",
-			 stack.depth);
-		AddValidationError(lineNum, errorMsg, 2);
+	if (count != preview->segmentCount)
+		preview->configDirty = TRUE;	/* START/END moved, so did the header lines */
+	for (int s = 0; s < preview->segmentCount; s++)
+		FreePreviewSegment(&preview->segments[s]);
+	free(preview->segments);
+	preview->segments = segments;
+	preview->segmentCount = count;
+	preview->structureDirty = FALSE;
+
+	if (preview->configDirty || !preview->frameDC)
+		ParsePreviewConfig(preview);
+	for (int s = 0; s < count; s++) {
+		if (segments[s].dirty)
+			ParsePreviewSegment(preview, &segments[s]);
 	}
+
+	if (preview->currentSegment >= count)
+		preview->currentSegment = 0;
 }
 
-void ValidateFile()
+void RestartPreviewSegment(PreviewPane *preview, int segment)
 {
-	ClearErrors();
+	preview->currentSegment = segment;
+	preview->scrollPosition = preview->screenWidth;
+	preview->centered = FALSE;
+	preview->holdFrames = 0;
+}
 
-	int textLen = GetWindowTextLengthW(g_editor->hwndEdit);
-	wchar_t *buffer = malloc((textLen + 1) * sizeof(wchar_t));
-	if (!buffer)
+/* Show the segment under the caret; outside segments, cycle like the renderer */
+void FollowCaret(PreviewPane *preview)
+{
+	DWORD caret;
+	SendMessageW(g_editor->hwndEdit, EM_GETSEL, (WPARAM) & caret, 0);
+	int line = (int)SendMessageW(g_editor->hwndEdit, EM_LINEFROMCHAR, caret, 0);
+
+	int lo = 0, hi = preview->segmentCount;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (preview->segments[mid].endLine < line)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	int segment = -1;
+	if (lo < preview->segmentCount && preview->segments[lo].startLine <= line)
+		segment = lo;
+
+	if (segment != preview->followSegment) {
+		preview->followSegment = segment;
+		if (segment >= 0)
+			RestartPreviewSegment(preview, segment);
+	}
+}
+
+int PreviewFramesForDelay(PreviewPane *preview, int delay)
+{
+	int frames = (delay + preview->timePerFrame - 1) / preview->timePerFrame;
+	return frames > 0 ? frames : 1;
+}
+
+void NextPreviewSegment(PreviewPane *preview)
+{
+	int next = preview->followSegment;
+	if (next < 0)
+		next = (preview->currentSegment + 1) % preview->segmentCount;
+	RestartPreviewSegment(preview, next);
+}
+
+/* One TPF step, same timeline as the renderer's AdvanceMarquee */
+void AdvancePreview(PreviewPane *preview)
+{
+	if (preview->segmentCount == 0)
 		return;
 
-	GetWindowTextW(g_editor->hwndEdit, buffer, textLen + 1);
+	if (preview->holdFrames > 0) {
+		preview->holdFrames--;
+		return;
+	}
 
-	/* Parse line by line */
-	wchar_t line[1024];
-	int linePos = 0;
-	int lineNum = 1;
-	int segmentCount = 0;
-	BOOL hasLPS = FALSE, hasSW = FALSE, hasSH = FALSE, hasSC =
-	    FALSE, hasSD = FALSE;
-	BOOL inSegment = FALSE;
-	int expectedSegments = 0;
+	int width = preview->segments[preview->currentSegment].width;
+	if (!preview->centered && width <= preview->screenWidth) {
+		preview->centered = TRUE;
+		preview->holdFrames = PreviewFramesForDelay(preview, preview->centerDelay) - 1;
+		return;
+	}
 
-	/* Optional flags tracking */
-	BOOL hasTPF = FALSE, hasPM = FALSE;
+	if (preview->centered) {
+		NextPreviewSegment(preview);
+		return;
+	}
 
-	for (int i = 0; i <= textLen; i++) {
-		wchar_t c = (i < textLen) ? buffer[i] : L'\0';
+	preview->scrollPosition -= preview->pixelsPerFrame;
+	if (preview->scrollPosition < -width) {
+		NextPreviewSegment(preview);
+		preview->holdFrames = PreviewFramesForDelay(preview, preview->screenDelay);
+	}
+}
 
-		if (c == L'\r') {
-			continue;
-		} else if (c == L'\n' || c == L'\0') {
-			line[linePos] = L'\0';
+void RenderPreviewFrame(PreviewPane *preview)
+{
+	HDC hdc = preview->frameDC;
+	RECT rect = { 0, 0, preview->frameWidth, preview->frameHeight };
+	FillRect(hdc, &rect, (HBRUSH) GetStockObject(BLACK_BRUSH));
 
-			int len = (int)wcslen(line);
+	if (preview->segmentCount == 0 || preview->linesPerScreen <= 0)
+		return;
 
-			/* Skip empty lines and comments */
-			if (line[0] != L'/' && len > 0) {
-				/* Check metadata commands */
-				if (wcsncmp(line, L"LPS", 3) == 0) {
-					if (hasLPS)
-						AddValidationError(lineNum,
-								   L"Duplicate LPS command",
-								   2);
-					hasLPS = TRUE;
-					int value = _wtoi(&line[4]);
-					if (value <= 0)
-						AddValidationError(lineNum,
-								   L"LPS must be positive",
-								   2);
-				} else if (wcsncmp(line, L"SW", 2) == 0) {
-					if (hasSW)
-						AddValidationError(lineNum,
-								   L"Duplicate SW command",
-								   2);
-					hasSW = TRUE;
-					int value = _wtoi(&line[3]);
-					if (value <= 0)
-						AddValidationError(lineNum,
-								   L"SW must be positive",
-								   2);
-				} else if (wcsncmp(line, L"SH", 2) == 0) {
-					if (hasSH)
-						AddValidationError(lineNum,
-								   L"Duplicate SH command",
-								   2);
-					hasSH = TRUE;
-					int value = _wtoi(&line[3]);
-					if (value <= 0)
-						AddValidationError(lineNum,
-								   L"SH must be positive",
-								   2);
-				} else if (wcsncmp(line, L"SC", 2) == 0) {
-					if (hasSC)
-						AddValidationError(lineNum,
-								   L"Duplicate SC command",
-								   2);
-					hasSC = TRUE;
-					expectedSegments = _wtoi(&line[3]);
+	SelectObject(hdc, preview->font);
+	SetBkMode(hdc, TRANSPARENT);
+
+	PreviewSegment *segment = &preview->segments[preview->currentSegment];
+	int lineHeight = preview->screenHeight / preview->linesPerScreen;
+	int maxLines = min(segment->lineCount, preview->linesPerScreen);
+
+	for (int l = 0; l < maxLines; l++) {
+		PreviewLine *line = &segment->lines[l];
+		int x = preview->centered ? (preview->screenWidth - line->width) / 2
+		    : preview->scrollPosition;
+		for (int r = 0; r < line->runCount; r++) {
+			PreviewRun *run = &line->runs[r];
+			if (x + run->x >= preview->frameWidth)
+				break;
+			if (r + 1 < line->runCount && x + line->runs[r + 1].x + lineHeight < 0)
+				continue;	/* Entirely left of the screen */
+			SetTextColor(hdc, run->color);
+			TextOutW(hdc, x + run->x, l * lineHeight, line->text + run->start, run->length);
+		}
+	}
+}
+
+LRESULT CALLBACK PreviewProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+{
+	PreviewPane *preview = &g_editor->preview;
+
+	switch (uMsg) {
+	case WM_TIMER:
+		if (preview->structureDirty)
+			RescanPreview(preview);
+		FollowCaret(preview);
+		AdvancePreview(preview);
+		InvalidateRect(hwnd, NULL, FALSE);
+		return 0;
+
+	case WM_ERASEBKGND:
+		return 1;
+
+	case WM_PAINT:
+		{
+			PAINTSTRUCT ps;
+			HDC hdc = BeginPaint(hwnd, &ps);
+			RECT rect;
+			GetClientRect(hwnd, &rect);
+			FillRect(hdc, &rect, GetSysColorBrush(COLOR_BTNFACE));
+			if (preview->frameDC) {
+				RenderPreviewFrame(preview);
+				int x = max((rect.right - preview->frameWidth) / 2, 0);
+				BitBlt(hdc, x, 0, preview->frameWidth, preview->frameHeight,
+				       preview->frameDC, 0, 0, SRCCOPY);
+			}
+			EndPaint(hwnd, &ps);
+			return 0;
+		}
+	}
+
+	return DefWindowProcW(hwnd, uMsg, wParam, lParam);
+}
+
+void ShowPreviewPane(BOOL show)
+{
+	PreviewPane *preview = &g_editor->preview;
+	preview->visible = show;
+	CheckMenuItem(GetMenu(g_editor->hwndMain), IDM_TOOLS_PREVIEW,
+		      MF_BYCOMMAND | (show ? MF_CHECKED : MF_UNCHECKED));
+
+	if (show) {
+		if (preview->structureDirty || !preview->frameDC)
+			RescanPreview(preview);
+		preview->followSegment = -1;
+		RestartPreviewSegment(preview, 0);
+		SetTimer(preview->hwnd, PREVIEW_TIMER_ID, preview->timePerFrame, NULL);
+		ShowWindow(preview->hwnd, SW_SHOW);
+	} else {
+		KillTimer(preview->hwnd, PREVIEW_TIMER_ID);
+		ShowWindow(preview->hwnd, SW_HIDE);
+	}
+
+	/* Re-run the layout */
+	RECT rect;
+	GetClientRect(g_editor->hwndMain, &rect);
+	SendMessageW(g_editor->hwndMain, WM_SIZE, 0, MAKELPARAM(rect.right, rect.bottom));
+}
+
+int OutlineStart(const OutlineList *list, int i)
+{
+	return list->items[i].startLine + (i >= list->shiftFrom ? list->shiftDelta : 0);
+}
+
+int OutlineEnd(const OutlineList *list, int i)
+{
+	return list->items[i].endLine + (i >= list->shiftFrom ? list->shiftDelta : 0);
+}
+
+/* Make the entries before index absolute and the rest relative */
+void MoveOutlinePivot(OutlineList *list, int index)
+{
+	if (list->shiftDelta != 0) {
+		for (int i = list->shiftFrom; i < index; i++) {
+			list->items[i].startLine += list->shiftDelta;
+			list->items[i].endLine += list->shiftDelta;
+		}
+		for (int i = index; i < list->shiftFrom; i++) {
+			list->items[i].startLine -= list->shiftDelta;
+			list->items[i].endLine -= list->shiftDelta;
+		}
+	}
+	list->shiftFrom = index;
+	if (index >= list->count)
+		list->shiftDelta = 0;
+}
+
+/* First entry ending at or after line */
+int OutlineFirstEnding(const OutlineList *list, int line)
+{
+	int lo = 0, hi = list->count;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (OutlineEnd(list, mid) < line)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* First entry starting at or after line */
+int OutlineFirstStarting(const OutlineList *list, int line)
+{
+	int lo = 0, hi = list->count;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (OutlineStart(list, mid) < line)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Replace entries [lo, hi) with count absolute entries */
+BOOL SpliceOutline(OutlineList *list, int lo, int hi, const OutlineEntry *items, int count)
+{
+	int newCount = list->count - (hi - lo) + count;
+	if (newCount > list->capacity) {
+		int capacity = list->capacity ? list->capacity : 64;
+		while (capacity < newCount)
+			capacity *= 2;
+		OutlineEntry *grown = realloc(list->items, capacity * sizeof(OutlineEntry));
+		if (!grown)
+			return FALSE;
+		list->items = grown;
+		list->capacity = capacity;
+	}
+
+	MoveOutlinePivot(list, hi);
+	if (hi < list->count)
+		memmove(list->items + lo + count, list->items + hi, (list->count - hi) * sizeof(OutlineEntry));
+	if (count)
+		memcpy(list->items + lo, items, count * sizeof(OutlineEntry));
+	list->count = newCount;
+	/* The relative tail now starts after the new entries */
+	list->shiftFrom = lo + count;
+	if (list->shiftFrom >= list->count)
+		list->shiftDelta = 0;
+	return TRUE;
+}
+
+void AppendOutlineEntry(OutlineList *list, int startLine, int endLine)
+{
+	OutlineEntry entry = { startLine, endLine, 0, 0 };
+	SpliceOutline(list, list->count, list->count, &entry, 1);
+}
+
+/*
+ * Collect header commands and segments on lines [from, to] from the lexer
+ * states; a segment still open at to is followed to its END. Returns the
+ * last line scanned.
+ */
+int ScanOutline(int from, int to, OutlineList *headers, OutlineList *segments)
+{
+	const unsigned char *states = g_editor->lineStates;
+	int lineCount = g_editor->lineStateCount;
+	wchar_t line[8];
+	int start = -1, commandLen;
+	int i;
+
+	for (i = from; i < lineCount && (i <= to || states[i] == LEX_SEGMENT); i++) {
+		if (states[i] == LEX_OUTSIDE && states[i + 1] == LEX_SEGMENT) {
+			start = i;
+		} else if (states[i] == LEX_SEGMENT && states[i + 1] == LEX_OUTSIDE) {
+			if (start >= 0)
+				AppendOutlineEntry(segments, start, i);
+			start = -1;
+		} else if (states[i] == LEX_OUTSIDE) {
+			int len = GetEditLine(g_editor->hwndEdit, i, line, 8);
+			if (IsHeaderCommand(line, len, &commandLen))
+				AppendOutlineEntry(headers, i, i);
+		}
+	}
+	return i - 1;
+}
+
+void ReplaceOutlineLines(OutlineList *list, int from, int to, const OutlineList *scanned)
+{
+	int lo = OutlineFirstEnding(list, from);
+	int hi = OutlineFirstStarting(list, to + 1);
+	SpliceOutline(list, lo, max(lo, hi), scanned->items, scanned->count);
+}
+
+/* Rescan lines [from, to], widened to the segments they touch */
+void UpdateOutlineLines(int from, int to)
+{
+	OutlinePane *outline = &g_editor->outline;
+	OutlineList *segments = &outline->segments;
+
+	int lo = OutlineFirstEnding(segments, from);
+	if (lo < segments->count && OutlineStart(segments, lo) < from)
+		from = OutlineStart(segments, lo);
+	int hi = OutlineFirstStarting(segments, to + 1);
+	if (hi > lo && OutlineEnd(segments, hi - 1) > to)
+		to = OutlineEnd(segments, hi - 1);
+	/* A segment that had no END yet has no entry; find its START */
+	while (from > 0 && g_editor->lineStates[from] == LEX_SEGMENT)
+		from--;
+
+	OutlineList scannedHeaders = { 0 }, scannedSegments = { 0 };
+	int last = ScanOutline(from, to, &scannedHeaders, &scannedSegments);
+	if (last > to)
+		to = last;
+	ReplaceOutlineLines(&outline->headers, from, to, &scannedHeaders);
+	ReplaceOutlineLines(segments, from, to, &scannedSegments);
+	free(scannedHeaders.items);
+	free(scannedSegments.items);
+}
+
+void RefreshOutline()
+{
+	OutlinePane *outline = &g_editor->outline;
+	if (!outline->visible)
+		return;
+	ListView_SetItemCountEx(outline->hwnd, outline->headers.count + outline->segments.count,
+				LVSICF_NOINVALIDATEALL | LVSICF_NOSCROLL);
+	InvalidateRect(outline->hwnd, NULL, FALSE);
+	outline->followRow = -1;
+}
+
+/*
+ * Called for every edit like PreviewNoteEdit, with scanEnd the last line
+ * whose lexer state was recomputed. Entries starting on the edited lines
+ * are dropped, later ones shifted, and only the affected lines rescanned.
+ */
+void OutlineNoteEdit(int firstLine, int lastLine, int scanEnd, int lineDelta)
+{
+	OutlinePane *outline = &g_editor->outline;
+	OutlineList *lists[2] = { &outline->headers, &outline->segments };
+	int oldLast = lastLine - lineDelta;
+
+	for (int l = 0; l < 2; l++) {
+		OutlineList *list = lists[l];
+		int lo = OutlineFirstStarting(list, firstLine);
+		int hi = OutlineFirstStarting(list, oldLast + 1);
+		MoveOutlinePivot(list, hi);
+		/* A segment running through the edit keeps its START */
+		if (lo > 0 && list->items[lo - 1].endLine > oldLast)
+			list->items[lo - 1].endLine += lineDelta;
+		SpliceOutline(list, lo, hi, NULL, 0);
+		if (lo < list->count)
+			list->shiftDelta += lineDelta;
+	}
+
+	UpdateOutlineLines(firstLine, max(lastLine, scanEnd));
+	RefreshOutline();
+}
+
+void RebuildOutline()
+{
+	OutlinePane *outline = &g_editor->outline;
+	outline->headers.count = outline->headers.shiftFrom = outline->headers.shiftDelta = 0;
+	outline->segments.count = outline->segments.shiftFrom = outline->segments.shiftDelta = 0;
+	if (g_editor->lineStates)
+		ScanOutline(0, g_editor->lineStateCount - 1, &outline->headers, &outline->segments);
+	RefreshOutline();
+}
+
+/* Attribute the validation results to the entries they fall in */
+void CountOutlineErrors()
+{
+	OutlinePane *outline = &g_editor->outline;
+	OutlineList *lists[2] = { &outline->headers, &outline->segments };
+
+	for (int l = 0; l < 2; l++) {
+		for (int i = 0; i < lists[l]->count; i++)
+			lists[l]->items[i].errors = lists[l]->items[i].warnings = 0;
+	}
+	for (int e = 0; e < g_editor->errorCount; e++) {
+		int line = g_editor->errors[e].lineNumber - 1;
+		for (int l = 0; l < 2; l++) {
+			int i = OutlineFirstEnding(lists[l], line);
+			if (i < lists[l]->count && OutlineStart(lists[l], i) <= line) {
+				if (g_editor->errors[e].severity == 2)
+					lists[l]->items[i].errors++;
+				else if (g_editor->errors[e].severity == 1)
+					lists[l]->items[i].warnings++;
+			}
+		}
+	}
+	RefreshOutline();
+}
+
+/* Rows list the header commands, then the segments */
+int OutlineRowLine(int row)
+{
+	OutlinePane *outline = &g_editor->outline;
+	if (row < 0)
+		return -1;
+	if (row < outline->headers.count)
+		return OutlineStart(&outline->headers, row);
+	row -= outline->headers.count;
+	if (row < outline->segments.count)
+		return OutlineStart(&outline->segments, row);
+	return -1;
+}
+
+void GetOutlineDispInfo(NMLVDISPINFOW *info)
+{
+	OutlinePane *outline = &g_editor->outline;
+	LVITEMW *item = &info->item;
+	if (!(item->mask & LVIF_TEXT) || item->cchTextMax <= 0)
+		return;
+
+	int row = item->iItem;
+	BOOL isHeader = row < outline->headers.count;
+	OutlineList *list = isHeader ? &outline->headers : &outline->segments;
+	int index = isHeader ? row : row - outline->headers.count;
+	item->pszText[0] = 0;
+	if (index < 0 || index >= list->count)
+		return;
+
+	int startLine = OutlineStart(list, index);
+	OutlineEntry *entry = &list->items[index];
+	wchar_t text[MAX_HIGHLIGHT_LINE];
+
+	if (item->iSubItem == 0) {
+		swprintf(item->pszText, item->cchTextMax, L"%d", startLine + 1);
+	} else if (item->iSubItem == 1 && isHeader) {
+		GetEditLine(g_editor->hwndEdit, startLine, text, MAX_HIGHLIGHT_LINE);
+		wcsncpy(item->pszText, text, item->cchTextMax - 1);
+		item->pszText[item->cchTextMax - 1] = 0;
+	} else if (item->iSubItem == 1) {
+		/* Segment number and its first line without the color markup */
+		int endLine = OutlineEnd(list, index);
+		int len = 0;
+		for (int i = startLine + 1; i < endLine; i++) {
+			len = GetEditLine(g_editor->hwndEdit, i, text, MAX_HIGHLIGHT_LINE);
+			if (len > 0 && text[0] != L'/')
+				break;
+			len = 0;
+		}
+		PreviewLine line;
+		ParsePreviewLine(text, len, &line);
+		swprintf(item->pszText, item->cchTextMax, L"%d: %.*ls", index + 1,
+			 line.text ? line.length : 0, line.text ? line.text : L"");
+		free(line.text);
+		free(line.runs);
+	} else if (item->iSubItem == 2 && (entry->errors || entry->warnings)) {
+		swprintf(item->pszText, item->cchTextMax, L"%d / %d", entry->errors, entry->warnings);
+	}
+}
+
+/* Put line at the top of the editor with the caret on it */
+void JumpToLine(int line)
+{
+	HWND hwnd = g_editor->hwndEdit;
+	if (line < 0)
+		return;
+	int start = (int)SendMessageW(hwnd, EM_LINEINDEX, line, 0);
+	if (start < 0)
+		return;
+	SendMessageW(hwnd, EM_SETSEL, start, start);
+	int firstVisible = (int)SendMessageW(hwnd, EM_GETFIRSTVISIBLELINE, 0, 0);
+	SendMessageW(hwnd, EM_LINESCROLL, 0, line - firstVisible);
+	SetFocus(hwnd);
+	InvalidateRect(hwnd, NULL, FALSE);
+}
+
+/* Select the outline row for the line under the caret */
+void OutlineFollowCaret()
+{
+	OutlinePane *outline = &g_editor->outline;
+	if (!outline->visible)
+		return;
+
+	DWORD caret;
+	SendMessageW(g_editor->hwndEdit, EM_GETSEL, (WPARAM) & caret, 0);
+	int line = (int)SendMessageW(g_editor->hwndEdit, EM_LINEFROMCHAR, caret, 0);
+
+	int row = -1;
+	int i = OutlineFirstEnding(&outline->segments, line);
+	if (i < outline->segments.count && OutlineStart(&outline->segments, i) <= line) {
+		row = outline->headers.count + i;
+	} else {
+		i = OutlineFirstStarting(&outline->headers, line);
+		if (i < outline->headers.count && OutlineStart(&outline->headers, i) == line)
+			row = i;
+	}
+
+	if (row != outline->followRow) {
+		outline->followRow = row;
+		ListView_SetItemState(outline->hwnd, -1, 0, LVIS_SELECTED | LVIS_FOCUSED);
+		if (row >= 0) {
+			ListView_SetItemState(outline->hwnd, row, LVIS_SELECTED | LVIS_FOCUSED,
+					      LVIS_SELECTED | LVIS_FOCUSED);
+			ListView_EnsureVisible(outline->hwnd, row, FALSE);
+		}
+	}
+}
+
+void ShowOutlinePane(BOOL show)
+{
+	OutlinePane *outline = &g_editor->outline;
+	outline->visible = show;
+	CheckMenuItem(GetMenu(g_editor->hwndMain), IDM_TOOLS_OUTLINE,
+		      MF_BYCOMMAND | (show ? MF_CHECKED : MF_UNCHECKED));
+	ShowWindow(outline->hwnd, show ? SW_SHOW : SW_HIDE);
+	RefreshOutline();
+	OutlineFollowCaret();
+
+	RECT rect;
+	GetClientRect(g_editor->hwndMain, &rect);
+	SendMessageW(g_editor->hwndMain, WM_SIZE, 0, MAKELPARAM(rect.right, rect.bottom));
+}
+
+BOOL IsTextEditMessage(UINT uMsg, WPARAM wParam)
+{
+	switch (uMsg) {
+	case WM_CHAR:
+	case WM_PASTE:
+	case WM_CUT:
+	case WM_CLEAR:
+	case WM_UNDO:
+	case EM_UNDO:
+	case EM_REPLACESEL:
+	case WM_SETTEXT:
+	case WM_IME_CHAR:
+		return TRUE;
+	case WM_KEYDOWN:
+		/* Delete and Shift+Delete; Shift+Insert pastes without WM_PASTE */
+		return wParam == VK_DELETE || wParam == VK_INSERT;
+	}
+	return FALSE;
+}
+
+BOOL IsUndoMessage(UINT uMsg, WPARAM wParam)
+{
+	return uMsg == WM_UNDO || uMsg == EM_UNDO || (uMsg == WM_CHAR && wParam == 0x1A);
+}
+
+/* Copy of the text, for finding what an undo changed */
+wchar_t *CopyEditText(void)
+{
+	HLOCAL handle;
+	int length;
+	const wchar_t *text = LockEditText(&handle, &length);
+	if (!text)
+		return NULL;
+	wchar_t *copy = malloc(((size_t)length + 1) * sizeof(wchar_t));
+	if (copy)
+		wmemcpy(copy, text, length);
+	LocalUnlock(handle);
+	return copy;
+}
+
+/* Undo restores a range the selection does not tell; compare the text before
+ * and after it instead, from both ends */
+void TrackUndo(const wchar_t *before, int oldLength)
+{
+	HLOCAL handle;
+	int newLength;
+	const wchar_t *after = before ? LockEditText(&handle, &newLength) : NULL;
+	if (!after) {
+		RebuildLineStates();
+		JournalNoteUnknownEdit();
+		return;
+	}
+
+	int shorter = min(oldLength, newLength);
+	int prefix = 0, suffix = 0;
+	while (prefix < shorter && before[prefix] == after[prefix])
+		prefix++;
+	while (suffix < shorter - prefix
+	       && before[oldLength - 1 - suffix] == after[newLength - 1 - suffix])
+		suffix++;
+	LocalUnlock(handle);
+	if (oldLength == newLength && prefix == shorter)
+		return;		/* Nothing to undo */
+
+	int inserted = newLength - prefix - suffix;
+	OnEditChanged(prefix, inserted);
+	JournalEdit(prefix, oldLength - prefix - suffix, inserted);
+}
+
+/* Work out what an edit message changed from the selection before and after */
+void TrackEdit(HWND hwnd, UINT uMsg, DWORD selStart, DWORD selEnd, int oldLength)
+{
+	if (uMsg == WM_SETTEXT) {
+		RebuildLineStates();
+		return;
+	}
+
+	DWORD caret, caretEnd;
+	SendMessageW(hwnd, EM_GETSEL, (WPARAM) & caret, (LPARAM) & caretEnd);
+	int newLength = GetWindowTextLengthW(hwnd);
+	if (newLength == oldLength && caret == selStart && selStart == selEnd)
+		return;		/* Nothing was replaced */
+
+	int start = (int)min(selStart, caret);
+	OnEditChanged(start, (int)caret - start);
+	JournalEdit(start, oldLength - newLength + ((int)caret - start), (int)caret - start);
+}
+
+LRESULT CALLBACK
+EditControlProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+{
+	if (IsTextEditMessage(uMsg, wParam)) {
+		/* Ctrl+V, Ctrl+X and Ctrl+Z arrive as WM_CHAR, which sends the control
+		 * WM_PASTE, WM_CUT or WM_UNDO; only the outermost message is tracked */
+		if (g_editor->editDepth > 0)
+			return CallWindowProcW(g_editor->originalEditProc, hwnd, uMsg, wParam, lParam);
+
+		DWORD selStart, selEnd;
+		SendMessageW(hwnd, EM_GETSEL, (WPARAM) & selStart, (LPARAM) & selEnd);
+		int oldLength = GetWindowTextLengthW(hwnd);
+		BOOL undo = IsUndoMessage(uMsg, wParam);
+		wchar_t *before = undo ? CopyEditText() : NULL;
+
+		g_editor->editDepth++;
+		LRESULT result = CallWindowProcW(g_editor->originalEditProc, hwnd, uMsg, wParam, lParam);
+		g_editor->editDepth--;
+
+		if (undo) {
+			TrackUndo(before, oldLength);
+			free(before);
+		} else {
+			TrackEdit(hwnd, uMsg, selStart, selEnd, oldLength);
+		}
+		/* The control draws typed text itself, so repaint the highlighting */
+		InvalidateRect(hwnd, NULL, FALSE);
+		return result;
+	}
+
+	switch (uMsg) {
+	case WM_PAINT:
+		{
+			/* Call the original paint first */
+			LRESULT result =
+			    CallWindowProcW(g_editor->originalEditProc, hwnd,
+					    uMsg,
+					    wParam,
+					    lParam);
+
+			/* Now paint the line numbers in the gutter */
+			HDC hdc = GetDC(hwnd);
+			if (hdc) {
+				RECT clientRect;
+				GetClientRect(hwnd, &clientRect);
+
+				PaintHighlighting(hwnd, hdc, &clientRect);
+
+				/* Set up drawing context for gutter */
+				SetBkColor(hdc, RGB(245, 245, 245));
+				SetTextColor(hdc, RGB(100, 100, 100));
+				SelectObject(hdc, g_editor->hFont);
+
+				/* Fill gutter background */
+				RECT gutterRect = { 0, 0, g_editor->gutterWidth,
+					clientRect.bottom
+				};
+				FillRect(hdc, &gutterRect,
+					 CreateSolidBrush(RGB(245, 245, 245)));
+
+				/* Get first visible line */
+				int firstVisibleLine = (int)SendMessageW(hwnd,
+									 EM_GETFIRSTVISIBLELINE,
+									 0,
+									 0);
+				int totalLines =
+				    (int)SendMessageW(hwnd, EM_GETLINECOUNT, 0,
+						      0);
+
+				/* Calculate visible lines */
+				int visibleLines =
+				    (clientRect.bottom -
+				     clientRect.top) / g_editor->lineHeight + 2;
+
+				/* Draw line numbers */
+				/* Get the y position of the first visible line */
+				int baseYPos = tm.tmExternalLeading;
+
+				for (int i = 0;
+				     i < visibleLines
+				     && (firstVisibleLine + i) < totalLines;
+				     i++) {
+					int lineNum = firstVisibleLine + i + 1;
+					wchar_t lineText[16];
+					swprintf(lineText, 16, L"%d", lineNum);
+
+					/* Calculate y position: base position + (line offset * line height) */
+					int yPos =
+					    baseYPos +
+					    (i * g_editor->lineHeight);
+
+					/* Only draw if the line is within the visible client area */
+					if (yPos >= 0
+					    && yPos + g_editor->lineHeight <=
+					    clientRect.bottom) {
+						RECT lineRect = {
+							2,
+							yPos,
+							g_editor->gutterWidth -
+							    4,
+							yPos +
+							    g_editor->lineHeight
+						};
+
+						DrawTextW(hdc, lineText, -1,
+							  &lineRect,
+							  DT_RIGHT | DT_VCENTER
+							  | DT_SINGLELINE);
+					}
+				}
+
+				/* Draw separator line */
+				HPEN pen =
+				    CreatePen(PS_SOLID, 1, RGB(200, 200, 200));
+				HPEN oldPen = SelectObject(hdc, pen);
+				MoveToEx(hdc, g_editor->gutterWidth - 1, 0,
+					 NULL);
+				LineTo(hdc, g_editor->gutterWidth - 1,
+				       clientRect.bottom);
+				SelectObject(hdc, oldPen);
+				DeleteObject(pen);
+
+				ReleaseDC(hwnd, hdc);
+			}
+
+			return result;
+		}
+
+	case WM_LBUTTONDOWN:
+		{
+			/* Check if click is in the gutter */
+			int xPos = GET_X_LPARAM(lParam);
+			if (xPos < g_editor->gutterWidth) {
+				/* Handle gutter click - could select entire line */
+				int yPos = GET_Y_LPARAM(lParam);
+				POINT pt = { g_editor->gutterWidth + 1, yPos };
+				int charIndex =
+				    (int)SendMessageW(hwnd, EM_CHARFROMPOS, 0,
+						      MAKELPARAM(pt.x, pt.y));
+				if (charIndex >= 0) {
+					int lineIndex = (int)SendMessageW(hwnd,
+									  EM_LINEFROMCHAR,
+									  charIndex,
+									  0);
+					int lineStart = (int)SendMessageW(hwnd,
+									  EM_LINEINDEX,
+									  lineIndex,
+									  0);
+					int lineLength = (int)SendMessageW(hwnd,
+									   EM_LINELENGTH,
+									   lineStart,
+									   0);
+
+					/* Select the entire line */
+					SendMessageW(hwnd, EM_SETSEL, lineStart,
+						     lineStart + lineLength);
+				}
+				return 0;
+			}
+			break;
+		}
+
+	case WM_ERASEBKGND:
+		/* Let the original control handle background, we'll paint gutter in WM_PAINT */
+		break;
+
+	case WM_KEYDOWN:
+	case WM_LBUTTONUP:
+	case WM_MOUSEMOVE:
+		{
+			/* Selection changes are drawn by the control in plain colors */
+			LRESULT result =
+			    CallWindowProcW(g_editor->originalEditProc, hwnd,
+					    uMsg, wParam, lParam);
+			if (uMsg != WM_MOUSEMOVE || (wParam & MK_LBUTTON))
+				InvalidateRect(hwnd, NULL, FALSE);
+			if (uMsg != WM_MOUSEMOVE)
+				OutlineFollowCaret();
+			return result;
+		}
+
+	case WM_VSCROLL:
+	case WM_HSCROLL:
+	case WM_MOUSEWHEEL:
+		/* Call original handler first, then update display */
+		CallWindowProcW(g_editor->originalEditProc, hwnd, uMsg, wParam,
+				lParam);
+		InvalidateRect(hwnd, NULL, FALSE);
+		return 0;
+
+	case WM_SIZE:
+		/* Update formatting rect when control is resized */
+		CallWindowProcW(g_editor->originalEditProc, hwnd, uMsg, wParam,
+				lParam);
+		UpdateGutterAndRect();
+		return 0;
+	}
+
+	return CallWindowProcW(g_editor->originalEditProc, hwnd, uMsg, wParam,
+			       lParam);
+}
+
+BOOL IsValidHexColor(const wchar_t *str, int len)
+{
+	if (len != 6)
+		return FALSE;
+	for (int i = 0; i < 6; i++) {
+		wchar_t c = str[i];
+		if (!((c >= L'0' && c <= L'9') ||
+		      (c >= L'A' && c <= L'F') || (c >= L'a' && c <= L'f'))) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+typedef struct {
+	int position;		/* Position in the line where backtick opened */
+	BOOL hasColor;		/* Whether this backtick has a color specification */
+} BacktickState;
+
+typedef struct {
+	BacktickState stack[MAX_NESTING_DEPTH];
+	int depth;
+} BacktickStack;
+
+void InitBacktickStack(BacktickStack *stack)
+{
+	stack->depth = 0;
+}
+
+BOOL PushBacktick(BacktickStack *stack, int position, BOOL hasColor)
+{
+	if (stack->depth >= MAX_NESTING_DEPTH) {
+		return FALSE;	/* Stack overflow */
+	}
+	stack->stack[stack->depth].position = position;
+	stack->stack[stack->depth].hasColor = hasColor;
+	stack->depth++;
+	return TRUE;
+}
+
+BOOL PopBacktick(BacktickStack *stack, BacktickState *state)
+{
+	if (stack->depth <= 0) {
+		return FALSE;	/* Stack underflow */
+	}
+	stack->depth--;
+	if (state) {
+		*state = stack->stack[stack->depth];
+	}
+	return TRUE;
+}
+
+BOOL IsStackEmpty(BacktickStack *stack)
+{
+	return stack->depth == 0;
+}
+
+void ValidateColorSyntax(const wchar_t *line, int lineNum)
+{
+	int len = (int)wcslen(line);
+	BacktickStack stack;
+	InitBacktickStack(&stack);
+
+	for (int i = 0; i < len; i++) {
+		if (line[i] == L'\\' && i + 1 < len) {
+			i++;	/* Skip escaped character */
+			continue;
+		}
+
+		if (line[i] == L'`') {
+			/* Look for colon to determine if this has color specification */
+			int colonPos = -1;
+			int nextQuotePos = -1;
+
+			/* Find the next colon and quote to understand the structure */
+			for (int j = i + 1; j < len; j++) {
+				if (line[j] == L'\\' && j + 1 < len) {
+					j++;	/* Skip escaped character */
+					continue;
+				}
+				if (line[j] == L':' && colonPos == -1) {
+					colonPos = j;
+				} else if (line[j] == L'\''
+					   && nextQuotePos == -1) {
+					nextQuotePos = j;
+					break;
+				} else if (line[j] == L'`') {
+					/* Found another backtick before finding a quote */
+					break;
+				}
+			}
+
+			BOOL hasColorSpec = FALSE;
+
+			if (colonPos != -1
+			    && (nextQuotePos == -1 || colonPos < nextQuotePos))
+			{
+				/* Validate color specification between backtick and colon */
+				int paramLen = colonPos - i - 1;
+				if (paramLen == 6) {
+					wchar_t colorSpec[7] = { 0 };
+					wcsncpy(colorSpec, &line[i + 1], 6);
+					if (IsValidHexColor(colorSpec, 6)) {
+						hasColorSpec = TRUE;
+					} else {
+						AddValidationError(lineNum,
+								   L"Invalid hex color specification",
+								   2);
+					}
+				} else if (paramLen > 0) {
+					AddValidationError(lineNum,
+							   L"Color specification must be exactly 6 hex characters",
+							   2);
+				}
+			}
+
+			/* Push this backtick onto the stack */
+			if (!PushBacktick(&stack, i, hasColorSpec)) {
+				AddValidationError(lineNum,
+						   L"Too many nested color specifications (maximum 10)",
+						   2);
+			}
+
+		} else if (line[i] == L'\'') {
+			/* Pop the most recent backtick from stack */
+			BacktickState state;
+			if (!PopBacktick(&stack, &state)) {
+				AddValidationError(lineNum,
+						   L"Closing quote without opening backtick",
+						   2);
+			} else {
+				/* Successfully matched a backtick-quote pair */
+				/* Could add additional validation here if needed */
+			}
+		}
+	}
+
+	/* Check for unmatched backticks */
+	if (!IsStackEmpty(&stack)) {
+		wchar_t errorMsg[256];
+		swprintf(errorMsg, 256,
+			 L"Unclosed color specification (%d unmatched backticks)",
+			 stack.depth);
+		AddValidationError(lineNum, errorMsg, 2);
+	}
+}
+
+void ValidateFile()
+{
+	ClearErrors();
+
+	int textLen = GetWindowTextLengthW(g_editor->hwndEdit);
+	wchar_t *buffer = malloc((textLen + 1) * sizeof(wchar_t));
+	if (!buffer)
+		return;
+
+	GetWindowTextW(g_editor->hwndEdit, buffer, textLen + 1);
+
+	/* Parse line by line */
+	wchar_t line[1024];
+	int linePos = 0;
+	int lineNum = 1;
+	int segmentCount = 0;
+	BOOL hasLPS = FALSE, hasSW = FALSE, hasSH = FALSE, hasSC =
+	    FALSE, hasSD = FALSE;
+	BOOL inSegment = FALSE;
+	int expectedSegments = 0;
+
+	/* Optional flags tracking */
+	BOOL hasTPF = FALSE, hasPM = FALSE;
+
+	for (int i = 0; i <= textLen; i++) {
+		wchar_t c = (i < textLen) ? buffer[i] : L'\0';
+
+		if (c == L'\r') {
+			continue;
+		} else if (c == L'\n' || c == L'\0') {
+			line[linePos] = L'\0';
+
+			int len = (int)wcslen(line);
+
+			/* Skip empty lines and comments */
+			if (line[0] != L'/' && len > 0) {
+				/* Check metadata commands */
+				if (wcsncmp(line, L"LPS", 3) == 0) {
+					if (hasLPS)
+						AddValidationError(lineNum,
+								   L"Duplicate LPS command",
+								   2);
+					hasLPS = TRUE;
+					int value = _wtoi(&line[4]);
+					if (value <= 0)
+						AddValidationError(lineNum,
+								   L"LPS must be positive",
+								   2);
+				} else if (wcsncmp(line, L"SW", 2) == 0) {
+					if (hasSW)
+						AddValidationError(lineNum,
+								   L"Duplicate SW command",
+								   2);
+					hasSW = TRUE;
+					int value = _wtoi(&line[3]);
+					if (value <= 0)
+						AddValidationError(lineNum,
+								   L"SW must be positive",
+								   2);
+				} else if (wcsncmp(line, L"SH", 2) == 0) {
+					if (hasSH)
+						AddValidationError(lineNum,
+								   L"Duplicate SH command",
+								   2);
+					hasSH = TRUE;
+					int value = _wtoi(&line[3]);
+					if (value <= 0)
+						AddValidationError(lineNum,
+								   L"SH must be positive",
+								   2);
+				} else if (wcsncmp(line, L"SC", 2) == 0) {
+					if (hasSC)
+						AddValidationError(lineNum,
+								   L"Duplicate SC command",
+								   2);
+					hasSC = TRUE;
+					expectedSegments = _wtoi(&line[3]);
 					if (expectedSegments <= 0)
 						AddValidationError(lineNum,
 								   L"SC must be positive",
@@ -535,256 +2184,1185 @@ void ValidateFile()
 								   L"CD cannot be negative",
 								   2);
 
-					/* OPTIONAL FLAGS */
-				} else if (wcsncmp(line, L"TPF", 3) == 0) {
-					if (hasTPF)
-						AddValidationError(lineNum, L"Duplicate TPF command", 1);	/* Warning for optional */
-					hasTPF = TRUE;
-					int value = _wtoi(&line[4]);
-					if (value <= 0)
-						AddValidationError(lineNum,
-								   L"TPF (millis per frame) must be positive",
-								   2);
-					if (value < 16)
-						AddValidationError(lineNum, L"TPF below 16ms may cause performance issues", 1);	/* Warning */
-				} else if (wcsncmp(line, L"PM", 2) == 0) {
-					if (hasPM)
-						AddValidationError(lineNum, L"Duplicate PM command", 1);	/* Warning for optional */
-					hasPM = TRUE;
-					int value = _wtoi(&line[3]);
-					if (value <= 0)
-						AddValidationError(lineNum,
-								   L"PM (pixel movement per frame) must be positive",
-								   2);
-					if (value > 20)
-						AddValidationError(lineNum, L"PM above 20 pixels may scroll too fast", 1);	/* Warning */
+					/* OPTIONAL FLAGS */
+				} else if (wcsncmp(line, L"TPF", 3) == 0) {
+					if (hasTPF)
+						AddValidationError(lineNum, L"Duplicate TPF command", 1);	/* Warning for optional */
+					hasTPF = TRUE;
+					int value = _wtoi(&line[4]);
+					if (value <= 0)
+						AddValidationError(lineNum,
+								   L"TPF (millis per frame) must be positive",
+								   2);
+					if (value < 16)
+						AddValidationError(lineNum, L"TPF below 16ms may cause performance issues", 1);	/* Warning */
+				} else if (wcsncmp(line, L"PM", 2) == 0) {
+					if (hasPM)
+						AddValidationError(lineNum, L"Duplicate PM command", 1);	/* Warning for optional */
+					hasPM = TRUE;
+					int value = _wtoi(&line[3]);
+					if (value <= 0)
+						AddValidationError(lineNum,
+								   L"PM (pixel movement per frame) must be positive",
+								   2);
+					if (value > 20)
+						AddValidationError(lineNum, L"PM above 20 pixels may scroll too fast", 1);	/* Warning */
+
+				} else if (wcscmp(line, L"START") == 0) {
+					if (inSegment)
+						AddValidationError(lineNum,
+								   L"START inside another segment",
+								   2);
+					inSegment = TRUE;
+				} else if (wcscmp(line, L"END") == 0) {
+					if (!inSegment)
+						AddValidationError(lineNum,
+								   L"END without START",
+								   2);
+					inSegment = FALSE;
+					segmentCount++;
+				} else if (inSegment) {
+					ValidateColorSyntax(line, lineNum);
+				} else {
+					AddValidationError(lineNum,
+							   L"Text outside segment",
+							   2);
+				}
+			}
+
+			linePos = 0;
+			lineNum++;
+
+			if (c == L'\0')
+				break;
+		} else {
+			if (linePos < 1023) {
+				line[linePos++] = c;
+			}
+		}
+	}
+
+	/* Check required metadata */
+	if (!hasLPS)
+		AddValidationError(0, L"Missing LPS command", 2);
+	if (!hasSW)
+		AddValidationError(0, L"Missing SW command", 2);
+	if (!hasSH)
+		AddValidationError(0, L"Missing SH command", 2);
+	if (!hasSC)
+		AddValidationError(0, L"Missing SC command", 2);
+	if (!hasSD)
+		AddValidationError(0, L"Missing SD command", 2);
+
+	/* Check segment count */
+	if (expectedSegments != segmentCount) {
+		wchar_t msg[256];
+		swprintf(msg, 256, L"Expected %d segments, found %d",
+			 expectedSegments, segmentCount);
+		AddValidationError(0, msg, 2);
+	}
+
+	if (inSegment) {
+		AddValidationError(lineNum - 1,
+				   L"File ends with unclosed segment", 2);
+	}
+
+	free(buffer);
+	UpdateErrorList();
+	CountOutlineErrors();
+
+	/* Update status */
+	if (g_editor->errorCount == 0) {
+		SetStatusText(L"Validation passed - No errors found");
+	} else {
+		wchar_t statusMsg[64];
+		swprintf(statusMsg, 64, L"Validation failed - %d errors found",
+			 g_editor->errorCount);
+		SetStatusText(statusMsg);
+	}
+}
+
+void NewFile()
+{
+	CancelLoad();
+
+	const wchar_t *template =
+	    L"// Created with Marquee Layout Editor\r\n"
+	    L"\r\n"
+	    L"LPS 2\r\n"
+	    L"//         Number of lines per screenfull\r\n"
+	    L"\r\n"
+	    L"SW  600\r\n"
+	    L"//         Screen width, px\r\n"
+	    L"SH  40\r\n"
+	    L"//         Screen height, px\r\n"
+	    L"\r\n"
+	    L"SC  1\r\n"
+	    L"//         Count of screens\r\n"
+	    L"SD  500\r\n"
+	    L"//         Delay after marquee stop scrolling to move to next screen (ms)\r\n"
+	    L"CD  1500\r\n"
+	    L"//         Delay after non-scrolling screen is displayed before moving to the next scene. (ms)\r\n"
+	    L"TPF 50\r\n"
+	    L"//         OPTIONAL, millis per frame\r\n"
+	    L"PM  3\r\n"
+	    L"//         OPTIONAL, pixel movement per frame\r\n"
+	    L"\r\n"
+	    L"//         Screen template\r\n"
+	    L"START\r\n" L"`00FF00:Hello, `FF0000:world'!'\r\n" L"END\r\n";
 
-				} else if (wcscmp(line, L"START") == 0) {
-					if (inSegment)
-						AddValidationError(lineNum,
-								   L"START inside another segment",
-								   2);
-					inSegment = TRUE;
-				} else if (wcscmp(line, L"END") == 0) {
-					if (!inSegment)
-						AddValidationError(lineNum,
-								   L"END without START",
-								   2);
-					inSegment = FALSE;
-					segmentCount++;
-				} else if (inSegment) {
-					ValidateColorSyntax(line, lineNum);
-				} else {
-					AddValidationError(lineNum,
-							   L"Text outside segment",
-							   2);
-				}
+	SetWindowTextW(g_editor->hwndEdit, template);
+	wcscpy(g_editor->currentFile, L"");
+	g_editor->isModified = FALSE;
+	JournalDiscard();
+	SetStatusText(L"New file created");
+	UpdateGutterAndRect();
+}
+
+/* Advance past the bytes of p that are plain ASCII */
+size_t SkipAscii(const unsigned char *p, size_t size)
+{
+	size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+	for (; i + 16 <= size; i += 16) {
+		__m128i block = _mm_loadu_si128((const __m128i *)(p + i));
+		if (_mm_movemask_epi8(block))
+			break;
+	}
+#else
+	for (; i + 8 <= size; i += 8) {
+		unsigned long long word;
+		memcpy(&word, p + i, 8);
+		if (word & 0x8080808080808080ULL)
+			break;
+	}
+#endif
+	while (i < size && p[i] < 0x80)
+		i++;
+	return i;
+}
+
+/* Strict UTF-8 check; ASCII stretches are skipped a block at a time */
+BOOL IsValidUtf8(const unsigned char *p, size_t size)
+{
+	size_t i = 0;
+	while (i < size) {
+		i += SkipAscii(p + i, size - i);
+		if (i >= size)
+			break;
+
+		unsigned char c = p[i];
+		int extra;
+		unsigned int min;
+		if (c >= 0xC2 && c <= 0xDF) {
+			extra = 1;
+			min = 0x80;
+		} else if (c >= 0xE0 && c <= 0xEF) {
+			extra = 2;
+			min = 0x800;
+		} else if (c >= 0xF0 && c <= 0xF4) {
+			extra = 3;
+			min = 0x10000;
+		} else {
+			return FALSE;
+		}
+		unsigned int cp = c & (0x3F >> extra);
+		for (int k = 1; k <= extra; k++) {
+			if (i + k >= size)
+				return TRUE;	/* Cut off by the end of the sample */
+			if ((p[i + k] & 0xC0) != 0x80)
+				return FALSE;
+			cp = (cp << 6) | (p[i + k] & 0x3F);
+		}
+		if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+			return FALSE;
+		i += extra + 1;
+	}
+	return TRUE;
+}
+
+enum { ENCODING_UTF16LE, ENCODING_UTF16BE, ENCODING_UTF8, ENCODING_ANSI };
+
+/* UTF-16LE without a BOM: mostly-ASCII text has zero high bytes */
+BOOL LooksLikeUtf16(const unsigned char *p, size_t size)
+{
+	size_t oddZeros = 0, evenZeros = 0;
+	for (size_t i = 0; i + 1 < size; i += 2) {
+		evenZeros += p[i] == 0;
+		oddZeros += p[i + 1] == 0;
+	}
+	return oddZeros >= size / 4 && evenZeros * 8 < oddZeros;
+}
+
+/* Decode one chunk of source bytes; returns bytes consumed */
+size_t DecodeLoadChunk(LoadJob *job, const unsigned char *p, size_t size, BOOL last, LoadChunk *chunk)
+{
+	size_t take = size;
+
+	if (job->encoding == ENCODING_UTF16LE || job->encoding == ENCODING_UTF16BE) {
+		take &= ~(size_t)1;
+		/* Keep a surrogate pair together */
+		if (!last && take >= 2) {
+			unsigned unit = job->encoding == ENCODING_UTF16LE ? p[take - 2] | (p[take - 1] << 8)
+			    : (p[take - 2] << 8) | p[take - 1];
+			if (unit >= 0xD800 && unit < 0xDC00)
+				take -= 2;
+		}
+		int units = (int)(take / 2);
+		chunk->text = malloc((units + 1) * sizeof(wchar_t));
+		if (!chunk->text)
+			return 0;
+		for (int i = 0; i < units; i++) {
+			chunk->text[i] = job->encoding == ENCODING_UTF16LE
+			    ? (wchar_t)(p[2 * i] | (p[2 * i + 1] << 8))
+			    : (wchar_t)((p[2 * i] << 8) | p[2 * i + 1]);
+		}
+		chunk->length = units;
+	} else {
+		if (!last) {
+			if (job->encoding == ENCODING_UTF8) {
+				/* Back up to the start of a sequence */
+				while (take > 0 && (p[take] & 0xC0) == 0x80)
+					take--;
+			} else {
+				/* A newline is never a DBCS trail byte */
+				size_t newline = take;
+				while (newline > 0 && p[newline - 1] != '\n')
+					newline--;
+				if (newline > 0)
+					take = newline;
 			}
+		}
+		UINT codePage = job->encoding == ENCODING_UTF8 ? CP_UTF8 : CP_ACP;
+		int units = take ? MultiByteToWideChar(codePage, 0, (const char *)p, (int)take, NULL, 0) : 0;
+		chunk->text = malloc((units + 1) * sizeof(wchar_t));
+		if (!chunk->text)
+			return 0;
+		if (units)
+			MultiByteToWideChar(codePage, 0, (const char *)p, (int)take, chunk->text, units);
+		chunk->length = units;
+	}
+
+	chunk->text[chunk->length] = L'\0';
+	return take;
+}
+
+DWORD WINAPI LoadThreadProc(LPVOID param)
+{
+	LoadJob *job = param;
+	const unsigned char *p = job->view;
+	size_t size = job->size;
+
+	/* BOM first, then a UTF-8 check of the first chunk */
+	if (size >= 2 && p[0] == 0xFF && p[1] == 0xFE) {
+		job->encoding = ENCODING_UTF16LE;
+		p += 2;
+		size -= 2;
+	} else if (size >= 2 && p[0] == 0xFE && p[1] == 0xFF) {
+		job->encoding = ENCODING_UTF16BE;
+		p += 2;
+		size -= 2;
+	} else if (size >= 3 && p[0] == 0xEF && p[1] == 0xBB && p[2] == 0xBF) {
+		job->encoding = ENCODING_UTF8;
+		p += 3;
+		size -= 3;
+	} else if (LooksLikeUtf16(p, min(size, (size_t)4096))) {
+		job->encoding = ENCODING_UTF16LE;
+	} else if (IsValidUtf8(p, min(size, (size_t)LOAD_CHUNK_SIZE))) {
+		job->encoding = ENCODING_UTF8;
+	} else {
+		job->encoding = ENCODING_ANSI;
+	}
+
+	size_t offset = 0;
+	BOOL ok = TRUE;
+	while (!job->cancel) {
+		size_t remaining = size - offset;
+		BOOL last = remaining <= LOAD_CHUNK_SIZE;
+		LoadChunk *chunk = calloc(1, sizeof(LoadChunk));
+		if (!chunk) {
+			ok = FALSE;
+			break;
+		}
+
+		size_t used = DecodeLoadChunk(job, p + offset, last ? remaining : LOAD_CHUNK_SIZE, last, chunk);
+		if (!chunk->text || (!used && !last)) {
+			free(chunk->text);
+			free(chunk);
+			ok = FALSE;
+			break;
+		}
+		offset += used;
+		chunk->last = last;
+		chunk->percent = size ? (int)(offset * 100 / size) : 100;
+
+		/* At most LOAD_CHUNKS_IN_FLIGHT decoded chunks exist at any time */
+		while (WaitForSingleObject(job->slots, 100) == WAIT_TIMEOUT && !job->cancel) ;
+		if (job->cancel) {
+			free(chunk->text);
+			free(chunk);
+			break;
+		}
+		PostMessageW(job->hwndMain, WM_APP_LOADCHUNK, (WPARAM) job, (LPARAM) chunk);
+		if (last)
+			break;
+	}
+
+	job->failed = !ok;
+	PostMessageW(job->hwndMain, WM_APP_LOADDONE, (WPARAM) job, 0);
+	return 0;
+}
+
+void CloseLoadJob(LoadJob *job)
+{
+	WaitForSingleObject(job->thread, INFINITE);
+	CloseHandle(job->thread);
+	CloseHandle(job->slots);
+	UnmapViewOfFile(job->view);
+	CloseHandle(job->mapping);
+	CloseHandle(job->file);
+	free(job);
+}
+
+/* Stop a load in progress; its queued chunks are dropped when they arrive */
+void CancelLoad()
+{
+	LoadJob *job = g_editor->loadJob;
+	if (!job)
+		return;
+	job->cancel = TRUE;
+	g_editor->loadJob = NULL;
+	SendMessageW(g_editor->hwndEdit, EM_SETREADONLY, FALSE, 0);
+}
+
+void OnLoadChunk(LoadJob *job, LoadChunk *chunk)
+{
+	if (job == g_editor->loadJob) {
+		int end = GetWindowTextLengthW(g_editor->hwndEdit);
+		SendMessageW(g_editor->hwndEdit, EM_SETSEL, end, end);
+		SendMessageW(g_editor->hwndEdit, EM_REPLACESEL, FALSE, (LPARAM) chunk->text);
+
+		wchar_t status[64];
+		swprintf(status, 64, L"Loading... %d%%", chunk->percent);
+		SetStatusText(status);
+	}
+	ReleaseSemaphore(job->slots, 1, NULL);
+	free(chunk->text);
+	free(chunk);
+}
+
+void SetSaveUtf8(BOOL utf8)
+{
+	g_editor->saveUtf8 = utf8;
+	CheckMenuItem(GetMenu(g_editor->hwndMain), IDM_FILE_UTF8,
+		      MF_BYCOMMAND | (utf8 ? MF_CHECKED : MF_UNCHECKED));
+}
+
+void OnLoadDone(LoadJob *job)
+{
+	BOOL current = job == g_editor->loadJob;
+	BOOL failed = job->failed;
+	BOOL utf8 = job->encoding == ENCODING_UTF8;
+	CloseLoadJob(job);
+	if (!current)
+		return;		/* Cancelled */
+
+	g_editor->loadJob = NULL;
+	SendMessageW(g_editor->hwndEdit, EM_SETREADONLY, FALSE, 0);
+	SendMessageW(g_editor->hwndEdit, EM_SETSEL, 0, 0);
+	/* Save back in the encoding the file came in; ANSI files become UTF-16 */
+	SetSaveUtf8(utf8);
+	SendMessageW(g_editor->hwndEdit, EM_SCROLLCARET, 0, 0);
+	g_editor->isModified = FALSE;
+	SetStatusText(failed ? L"File partially loaded (out of memory)" : L"File opened successfully");
+	if (!failed)
+		RecoverJournal();
+	UpdateGutterAndRect();
+}
+
+/*
+ * Open filename and stream it into the editor from a worker thread. The
+ * file is mapped rather than read, decoded a chunk at a time and appended
+ * as chunks arrive, so only the control's copy of the text is ever whole.
+ */
+void LoadFile_impl(wchar_t *filename)
+{
+	CancelLoad();
+
+	HANDLE file = CreateFileW(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+				  FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		MessageBoxW(g_editor->hwndMain, L"Could not open file",
+			    L"Error", MB_OK | MB_ICONERROR);
+		return;
+	}
+
+	LARGE_INTEGER size;
+	GetFileSizeEx(file, &size);
+
+	JournalDiscard();
+	wcscpy(g_editor->currentFile, filename);
+	SetWindowTextW(g_editor->hwndEdit, L"");
+	g_editor->isModified = FALSE;
+	g_editor->journal.matchesFile = TRUE;
+
+	if (size.QuadPart == 0) {
+		/* Empty files cannot be mapped */
+		CloseHandle(file);
+		SetStatusText(L"File opened successfully");
+		RecoverJournal();
+		UpdateGutterAndRect();
+		return;
+	}
+
+	LoadJob *job = calloc(1, sizeof(LoadJob));
+	if (job) {
+		job->file = file;
+		job->size = (size_t)size.QuadPart;
+		job->hwndMain = g_editor->hwndMain;
+		job->mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (job->mapping)
+			job->view = MapViewOfFile(job->mapping, FILE_MAP_READ, 0, 0, 0);
+		if (job->view)
+			job->slots = CreateSemaphoreW(NULL, LOAD_CHUNKS_IN_FLIGHT, LOAD_CHUNKS_IN_FLIGHT, NULL);
+		if (job->slots)
+			job->thread = CreateThread(NULL, 0, LoadThreadProc, job, 0, NULL);
+	}
+
+	if (!job || !job->thread) {
+		if (job) {
+			if (job->slots)
+				CloseHandle(job->slots);
+			if (job->view)
+				UnmapViewOfFile(job->view);
+			if (job->mapping)
+				CloseHandle(job->mapping);
+			free(job);
+		}
+		CloseHandle(file);
+		MessageBoxW(g_editor->hwndMain, L"Could not read file",
+			    L"Error", MB_OK | MB_ICONERROR);
+		return;
+	}
+
+	/* No edits until the whole file is in */
+	g_editor->loadJob = job;
+	SendMessageW(g_editor->hwndEdit, EM_SETREADONLY, TRUE, 0);
+	SetStatusText(L"Loading...");
+}
+
+void LoadFile()
+{
+	OPENFILENAMEW ofn;
+	wchar_t filename[MAX_PATH] = { 0 };
+
+	memset(&ofn, 0, sizeof(ofn));
+	ofn.lStructSize = sizeof(ofn);
+	ofn.hwndOwner = g_editor->hwndMain;
+	ofn.lpstrFile = filename;
+	ofn.nMaxFile = MAX_PATH;
+	ofn.lpstrFilter =
+	    L"Marquee Layout Files\0*.mly\0Text Files\0*.txt\0All Files\0*.*\0";
+	ofn.Flags = OFN_FILEMUSTEXIST | OFN_PATHMUSTEXIST;
+
+	if (GetOpenFileNameW(&ofn)) {
+		LoadFile_impl(filename);
+	}
+}
+
+/* Write size bytes in slices WriteFile can take */
+BOOL WriteAll(HANDLE file, const void *data, size_t size)
+{
+	const unsigned char *p = data;
+	while (size > 0) {
+		DWORD chunk = size > SAVE_WRITE_SIZE ? SAVE_WRITE_SIZE : (DWORD)size;
+		DWORD written;
+		if (!WriteFile(file, p, chunk, &written, NULL) || written != chunk)
+			return FALSE;
+		p += chunk;
+		size -= chunk;
+	}
+	return TRUE;
+}
+
+/* The temp file sits next to the target so the final rename stays on one volume */
+BOOL MakeSaveTempPath(const wchar_t *target, wchar_t *temp)
+{
+	int n = swprintf(temp, MAX_PATH, L"%ls.%lu.tmp", target,
+			 (unsigned long)GetCurrentProcessId());
+	return n > 0 && n < MAX_PATH;
+}
+
+HANDLE CreateSaveTemp(const wchar_t *temp)
+{
+	return CreateFileW(temp, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+			   FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+}
+
+/*
+ * Flush and close the temp file, then move it over the target. The target
+ * is either the old file or the complete new one, never a partial write.
+ */
+BOOL CommitSave(HANDLE file, const wchar_t *temp, const wchar_t *target, BOOL ok)
+{
+	if (file == INVALID_HANDLE_VALUE)
+		return FALSE;
+	if (ok)
+		ok = FlushFileBuffers(file);
+	CloseHandle(file);
+	if (ok) {
+		/* ReplaceFileW keeps the target's ACLs, streams and hard links */
+		if (GetFileAttributesW(target) != INVALID_FILE_ATTRIBUTES)
+			ok = ReplaceFileW(target, temp, NULL, REPLACEFILE_IGNORE_MERGE_ERRORS,
+					  NULL, NULL);
+		else
+			ok = MoveFileExW(temp, target, MOVEFILE_WRITE_THROUGH);
+	}
+	if (!ok)
+		DeleteFileW(temp);
+	return ok;
+}
+
+/* Stream text to file, UTF-8 without a BOM or UTF-16LE with one */
+BOOL WriteDocument(HANDLE file, const wchar_t *text, int length, BOOL utf8)
+{
+	if (!utf8) {
+		unsigned char bom[2] = { 0xFF, 0xFE };
+		return WriteAll(file, bom, 2)
+		    && WriteAll(file, text, (size_t)length * sizeof(wchar_t));
+	}
+
+	unsigned char *buffer = malloc(SAVE_CHUNK_CHARS * 3);
+	if (!buffer)
+		return FALSE;
+	BOOL ok = TRUE;
+	int pos = 0;
+	while (ok && pos < length) {
+		int n = length - pos > SAVE_CHUNK_CHARS ? SAVE_CHUNK_CHARS : length - pos;
+		/* Keep surrogate pairs in one chunk */
+		if (pos + n < length && text[pos + n - 1] >= 0xD800 && text[pos + n - 1] <= 0xDBFF)
+			n--;
+		int bytes = WideCharToMultiByte(CP_UTF8, 0, text + pos, n, (char *)buffer,
+						SAVE_CHUNK_CHARS * 3, NULL, NULL);
+		ok = bytes > 0 && WriteAll(file, buffer, bytes);
+		pos += n;
+	}
+	free(buffer);
+	return ok;
+}
+
+/* Encode the whole document once, for a save that outlives further edits */
+unsigned char *EncodeDocument(const wchar_t *text, int length, BOOL utf8, size_t *size)
+{
+	unsigned char *data;
+	if (!utf8) {
+		*size = 2 + (size_t)length * sizeof(wchar_t);
+		data = malloc(*size);
+		if (data) {
+			data[0] = 0xFF;
+			data[1] = 0xFE;
+			memcpy(data + 2, text, (size_t)length * sizeof(wchar_t));
+		}
+		return data;
+	}
+
+	int bytes = length ? WideCharToMultiByte(CP_UTF8, 0, text, length, NULL, 0, NULL, NULL) : 0;
+	*size = bytes;
+	data = malloc(bytes + 1);
+	if (data && bytes)
+		WideCharToMultiByte(CP_UTF8, 0, text, length, (char *)data, bytes, NULL, NULL);
+	return data;
+}
+
+/* The edit control's own buffer; no copy of the text is made */
+const wchar_t *LockEditText(HLOCAL *handle, int *length)
+{
+	*handle = (HLOCAL) SendMessageW(g_editor->hwndEdit, EM_GETHANDLE, 0, 0);
+	*length = GetWindowTextLengthW(g_editor->hwndEdit);
+	return *handle ? LocalLock(*handle) : NULL;
+}
+
+/* Journals live in the local profile, named by a hash of the document path */
+BOOL MakeJournalDir(wchar_t *dir)
+{
+	DWORD n = GetEnvironmentVariableW(L"LOCALAPPDATA", dir, MAX_PATH);
+	if (n == 0 || n >= MAX_PATH - 32) {
+		n = GetTempPathW(MAX_PATH, dir);
+		if (n == 0 || n >= MAX_PATH - 32)
+			return FALSE;
+	}
+	if (dir[n - 1] == L'\\')
+		dir[--n] = 0;
+	wcscat(dir, L"\\Marquee");
+	CreateDirectoryW(dir, NULL);
+	wcscat(dir, L"\\Journal");
+	CreateDirectoryW(dir, NULL);
+	return TRUE;
+}
+
+/* Untitled documents get one journal per process, so instances do not share one */
+BOOL MakeJournalPath(const wchar_t *document, wchar_t *path)
+{
+	wchar_t dir[MAX_PATH];
+	if (!MakeJournalDir(dir))
+		return FALSE;
+
+	if (document[0] == 0)
+		return swprintf(path, MAX_PATH, L"%ls\\untitled-%lu.journal", dir,
+				(unsigned long)GetCurrentProcessId()) > 0;
+
+	unsigned long long hash = 14695981039346656037ULL;
+	for (const wchar_t *c = document; *c; c++) {
+		hash ^= towlower(*c);
+		hash *= 1099511628211ULL;
+	}
+	return swprintf(path, MAX_PATH, L"%ls\\%016llx.journal", dir, hash) > 0;
+}
+
+DWORD JournalChecksum(const JournalRecord *record, const wchar_t *text)
+{
+	const unsigned char *fields = (const unsigned char *)record;
+	const unsigned char *bytes = (const unsigned char *)text;
+	DWORD hash = 2166136261u;
+	for (size_t i = 0; i < offsetof(JournalRecord, checksum); i++)
+		hash = (hash ^ fields[i]) * 16777619u;
+	for (size_t i = 0; i < record->length * sizeof(wchar_t); i++)
+		hash = (hash ^ bytes[i]) * 16777619u;
+	return hash;
+}
+
+BOOL AppendJournalRecord(DWORD type, int offset, int deleted, const wchar_t *text, int length)
+{
+	Journal *journal = &g_editor->journal;
+	size_t need = sizeof(JournalRecord) + (size_t)length * sizeof(wchar_t);
+	if (journal->used + need > journal->capacity) {
+		size_t capacity = journal->capacity ? journal->capacity : JOURNAL_BUFFER_SIZE;
+		while (capacity < journal->used + need)
+			capacity *= 2;
+		unsigned char *buffer = realloc(journal->buffer, capacity);
+		if (!buffer)
+			return FALSE;
+		journal->buffer = buffer;
+		journal->capacity = capacity;
+	}
+
+	JournalRecord record = { type, offset, deleted, length, 0 };
+	record.checksum = JournalChecksum(&record, text);
+	memcpy(journal->buffer + journal->used, &record, sizeof(record));
+	memcpy(journal->buffer + journal->used + sizeof(record), text, (size_t)length * sizeof(wchar_t));
+	journal->used += need;
+	return TRUE;
+}
+
+void FinishCompaction();
+
+void CloseJournal()
+{
+	Journal *journal = &g_editor->journal;
+	FinishCompaction();
+	if (journal->file)
+		CloseHandle(journal->file);
+	journal->file = NULL;
+	journal->used = 0;
+	journal->written = 0;
+	journal->needSnapshot = FALSE;
+	KillTimer(g_editor->hwndMain, JOURNAL_TIMER_ID);
+}
+
+/* The document matches its file again; nothing to recover */
+void JournalDiscard()
+{
+	BOOL open = g_editor->journal.file || g_editor->journal.compactJob;
+	CloseJournal();
+	if (open)
+		DeleteFileW(g_editor->journal.path);
+	g_editor->journal.matchesFile = g_editor->currentFile[0] != 0;
+}
+
+HANDLE OpenJournalFile(const wchar_t *path, DWORD disposition)
+{
+	HANDLE file = CreateFileW(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, disposition,
+				  FILE_ATTRIBUTE_NORMAL, NULL);
+	return file == INVALID_HANDLE_VALUE ? NULL : file;
+}
 
-			linePos = 0;
-			lineNum++;
+void InitJournalHeader(JournalHeader *header)
+{
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, "MLYJ", 4);
+	header->version = JOURNAL_VERSION;
+	wcscpy(header->path, g_editor->currentFile);
+}
 
-			if (c == L'\0')
-				break;
-		} else {
-			if (linePos < 1023) {
-				line[linePos++] = c;
-			}
+DWORD WINAPI CompactThreadProc(LPVOID param)
+{
+	CompactJob *job = param;
+	HANDLE file = CreateSaveTemp(job->temp);
+	BOOL ok = file != INVALID_HANDLE_VALUE && WriteAll(file, job->data, job->size);
+	job->ok = CommitSave(file, job->temp, job->path, ok);
+	PostMessageW(job->hwndMain, WM_APP_COMPACTDONE, (WPARAM) job, 0);
+	return 0;
+}
+
+/*
+ * Replace the journal with a snapshot of the current text. The snapshot is
+ * copied here and written by a worker to a temp file that is then renamed,
+ * so a crash meanwhile leaves the previous journal. Edits made until it is
+ * done stay in the buffer and are appended to the new journal.
+ */
+BOOL CompactJournal()
+{
+	Journal *journal = &g_editor->journal;
+	if (journal->compactJob)
+		return TRUE;
+	CompactJob *job = calloc(1, sizeof(CompactJob));
+	if (!job)
+		return FALSE;
+	wcscpy(job->path, journal->path);
+	job->hwndMain = g_editor->hwndMain;
+
+	HLOCAL handle;
+	int length;
+	const wchar_t *text = LockEditText(&handle, &length);
+	if (text) {
+		size_t bytes = (size_t)length * sizeof(wchar_t);
+		job->size = sizeof(JournalHeader) + sizeof(JournalRecord) + bytes;
+		job->data = malloc(job->size);
+		if (job->data) {
+			JournalHeader header;
+			InitJournalHeader(&header);
+			JournalRecord record = { JOURNAL_SNAPSHOT, 0, 0, length, 0 };
+			record.checksum = JournalChecksum(&record, text);
+			memcpy(job->data, &header, sizeof(header));
+			memcpy(job->data + sizeof(header), &record, sizeof(record));
+			memcpy(job->data + sizeof(header) + sizeof(record), text, bytes);
 		}
+		LocalUnlock(handle);
+	}
+	if (job->data && journal->path[0] && MakeSaveTempPath(journal->path, job->temp)) {
+		/* The temp file replaces the journal, which must not be open then */
+		if (journal->file)
+			CloseHandle(journal->file);
+		journal->file = NULL;
+		job->thread = CreateThread(NULL, 0, CompactThreadProc, job, 0, NULL);
+	}
+	if (!job->thread) {
+		free(job->data);
+		free(job);
+		return FALSE;
 	}
 
-	/* Check required metadata */
-	if (!hasLPS)
-		AddValidationError(0, L"Missing LPS command", 2);
-	if (!hasSW)
-		AddValidationError(0, L"Missing SW command", 2);
-	if (!hasSH)
-		AddValidationError(0, L"Missing SH command", 2);
-	if (!hasSC)
-		AddValidationError(0, L"Missing SC command", 2);
-	if (!hasSD)
-		AddValidationError(0, L"Missing SD command", 2);
+	/* The snapshot holds every edit so far */
+	journal->compactJob = job;
+	journal->used = 0;
+	journal->written = 0;
+	journal->needSnapshot = FALSE;
+	return TRUE;
+}
 
-	/* Check segment count */
-	if (expectedSegments != segmentCount) {
-		wchar_t msg[256];
-		swprintf(msg, 256, L"Expected %d segments, found %d",
-			 expectedSegments, segmentCount);
-		AddValidationError(0, msg, 2);
+/* Carry on appending to the journal the worker wrote */
+void CompleteCompaction(CompactJob *job)
+{
+	Journal *journal = &g_editor->journal;
+	journal->compactJob = NULL;
+	if (job->ok)
+		journal->file = OpenJournalFile(journal->path, OPEN_EXISTING);
+	if (!journal->file) {
+		CloseJournal();
+		return;
 	}
+	SetFilePointer(journal->file, 0, NULL, FILE_END);
+}
 
-	if (inSegment) {
-		AddValidationError(lineNum - 1,
-				   L"File ends with unclosed segment", 2);
+/* Wait for a compaction in progress; its WM_APP_COMPACTDONE then only frees it */
+void FinishCompaction()
+{
+	CompactJob *job = g_editor->journal.compactJob;
+	if (!job)
+		return;
+	WaitForSingleObject(job->thread, INFINITE);
+	CompleteCompaction(job);
+}
+
+void OnCompactDone(CompactJob *job)
+{
+	if (job == g_editor->journal.compactJob)
+		CompleteCompaction(job);
+	CloseHandle(job->thread);
+	free(job->data);
+	free(job);
+}
+
+/* Write batched records; runs on a timer so typing never waits for it */
+void FlushJournal()
+{
+	Journal *journal = &g_editor->journal;
+	if (!journal->file)
+		return;		/* Closed, or compacting: records wait in the buffer */
+
+	if (journal->needSnapshot || journal->written + journal->used > JOURNAL_COMPACT_SIZE) {
+		if (!CompactJournal())
+			CloseJournal();
+		return;
+	}
+	if (journal->used == 0)
+		return;
+	if (WriteAll(journal->file, journal->buffer, journal->used)) {
+		FlushFileBuffers(journal->file);
+		journal->written += journal->used;
+		journal->used = 0;
+	} else {
+		journal->needSnapshot = TRUE;
 	}
+}
 
-	free(buffer);
-	UpdateErrorList();
+/*
+ * Start a journal for the first unsaved edit. When the document has a
+ * saved file, the journal records that file's size and time and the edit
+ * itself; otherwise it starts with a snapshot, which already holds it.
+ */
+BOOL CreateJournal(int start, int deleted, int inserted, const wchar_t *text)
+{
+	Journal *journal = &g_editor->journal;
+	if (!MakeJournalPath(g_editor->currentFile, journal->path))
+		return FALSE;
 
-	/* Update status */
-	if (g_editor->errorCount == 0) {
-		SetStatusText(L"Validation passed - No errors found");
+	WIN32_FILE_ATTRIBUTE_DATA info;
+	BOOL matchesFile = journal->matchesFile;
+	journal->matchesFile = FALSE;
+	if (!matchesFile ||
+	    !GetFileAttributesExW(g_editor->currentFile, GetFileExInfoStandard, &info)) {
+		if (!CompactJournal())
+			return FALSE;
 	} else {
-		wchar_t statusMsg[64];
-		swprintf(statusMsg, 64, L"Validation failed - %d errors found",
-			 g_editor->errorCount);
-		SetStatusText(statusMsg);
+		journal->file = OpenJournalFile(journal->path, CREATE_ALWAYS);
+		if (!journal->file)
+			return FALSE;
+		JournalHeader header;
+		InitJournalHeader(&header);
+		header.baseSize = ((unsigned long long)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+		header.baseTime = info.ftLastWriteTime;
+		if (!WriteAll(journal->file, &header, sizeof(header))) {
+			JournalDiscard();
+			return FALSE;
+		}
+		AppendJournalRecord(JOURNAL_EDIT, start, deleted, text + start, inserted);
 	}
+	SetTimer(g_editor->hwndMain, JOURNAL_TIMER_ID, JOURNAL_FLUSH_MS, NULL);
+	return TRUE;
 }
 
-void NewFile()
+BOOL JournalActive()
 {
-	const wchar_t *template =
-	    L"// Created with Marquee Layout Editor\r\n"
-	    L"\r\n"
-	    L"LPS 2\r\n"
-	    L"//         Number of lines per screenfull\r\n"
-	    L"\r\n"
-	    L"SW  600\r\n"
-	    L"//         Screen width, px\r\n"
-	    L"SH  40\r\n"
-	    L"//         Screen height, px\r\n"
-	    L"\r\n"
-	    L"SC  1\r\n"
-	    L"//         Count of screens\r\n"
-	    L"SD  500\r\n"
-	    L"//         Delay after marquee stop scrolling to move to next screen (ms)\r\n"
-	    L"CD  1500\r\n"
-	    L"//         Delay after non-scrolling screen is displayed before moving to the next scene. (ms)\r\n"
-	    L"TPF 50\r\n"
-	    L"//         OPTIONAL, millis per frame\r\n"
-	    L"PM  3\r\n"
-	    L"//         OPTIONAL, pixel movement per frame\r\n"
-	    L"\r\n"
-	    L"//         Screen template\r\n"
-	    L"START\r\n" L"`00FF00:Hello, `FF0000:world'!'\r\n" L"END\r\n";
+	return !g_editor->journal.replaying && !g_editor->loadJob;
+}
 
-	SetWindowTextW(g_editor->hwndEdit, template);
-	wcscpy(g_editor->currentFile, L"");
-	g_editor->isModified = FALSE;
-	SetStatusText(L"New file created");
-	UpdateGutterAndRect();
+/* Record that start..start+deleted was replaced by inserted characters */
+void JournalEdit(int start, int deleted, int inserted)
+{
+	if (!JournalActive())
+		return;
+
+	HLOCAL handle;
+	int length;
+	const wchar_t *text = LockEditText(&handle, &length);
+	if (!text)
+		return;
+	if (!g_editor->journal.file && !g_editor->journal.compactJob)
+		CreateJournal(start, deleted, inserted, text);
+	else if (!g_editor->journal.needSnapshot &&
+		 !AppendJournalRecord(JOURNAL_EDIT, start, deleted, text + start, inserted))
+		g_editor->journal.needSnapshot = TRUE;
+	LocalUnlock(handle);
+
+	if (g_editor->journal.used > JOURNAL_BUFFER_SIZE)
+		FlushJournal();
 }
 
-void LoadFile_impl(wchar_t *filename)
+/* The text changed in a way that was not tracked; the next flush writes a snapshot */
+void JournalNoteUnknownEdit()
 {
-	FILE *file = _wfopen(filename, L"rb");
-	if (file) {
-		fseek(file, 0, SEEK_END);
-		long size = ftell(file);
-		fseek(file, 0, SEEK_SET);
-
-		if (size >= 2) {
-			/* Check for UTF-16LE BOM */
-			unsigned char bom[2];
-			fread(bom, 1, 2, file);
-
-			if (bom[0] == 0xFF && bom[1] == 0xFE) {
-				/* UTF-16LE file with BOM */
-				long remainingSize = size - 2;
-				if (remainingSize > 0) {
-					wchar_t *wideBuffer =
-					    malloc(remainingSize +
-						   sizeof(wchar_t));
-					if (wideBuffer) {
-						size_t bytesRead =
-						    fread(wideBuffer, 1,
-							  remainingSize, file);
-						/* Null terminate */
-						wideBuffer[bytesRead /
-							   sizeof(wchar_t)] =
-						    L'\0';
-						SetWindowTextW
-						    (g_editor->hwndEdit,
-						     wideBuffer);
-						free(wideBuffer);
-					}
-				} else {
-					/* Empty file with just BOM */
-					SetWindowTextW(g_editor->hwndEdit, L"");
-				}
-			} else {
-				/* Not UTF-16LE, rewind and read as multibyte */
-				fseek(file, 0, SEEK_SET);
-
-				char *buffer = malloc(size + 1);
-				if (buffer) {
-					fread(buffer, 1, size, file);
-					buffer[size] = 0;
-
-					/* Use IsTextUnicode to determine encoding */
-					INT flags =
-					    IS_TEXT_UNICODE_STATISTICS |
-					    IS_TEXT_UNICODE_CONTROLS;
-					if (IsTextUnicode(buffer, size, &flags)) {
-						/* Treat as UTF-16 */
-						SetWindowTextW
-						    (g_editor->hwndEdit,
-						     (wchar_t *)
-						     buffer);
-					} else {
-						/* Convert from multibyte to wide chars */
-						int wideSize =
-						    MultiByteToWideChar(CP_UTF8,
-									0,
-									buffer,
-									-1,
-									NULL,
-									0);
-						wchar_t *wideBuffer =
-						    malloc(wideSize *
-							   sizeof(wchar_t));
-						if (wideBuffer) {
-							MultiByteToWideChar
-							    (CP_UTF8, 0, buffer,
-							     -1, wideBuffer,
-							     wideSize);
-							SetWindowTextW
-							    (g_editor->hwndEdit,
-							     wideBuffer);
-							free(wideBuffer);
-						}
-					}
-					free(buffer);
-				}
+	if (!JournalActive())
+		return;
+	if (!g_editor->journal.file && !g_editor->journal.compactJob)
+		CreateJournal(0, 0, 0, L"");
+	g_editor->journal.needSnapshot = TRUE;
+}
+
+/*
+ * The file on disk changed under the journal. Edits made while a
+ * background save ran are journaled again, from a snapshot.
+ */
+void JournalSaved()
+{
+	JournalDiscard();
+	if (g_editor->isModified)
+		JournalNoteUnknownEdit();
+}
+
+/* Apply journal records to the edit control; FALSE when one does not fit */
+BOOL ReplayJournal(const unsigned char *data, size_t size)
+{
+	HWND hwnd = g_editor->hwndEdit;
+	size_t pos = 0;
+	while (pos < size) {
+		JournalRecord record;
+		memcpy(&record, data + pos, sizeof(record));
+		size_t bytes = (size_t)record.length * sizeof(wchar_t);
+		wchar_t *text = malloc(bytes + sizeof(wchar_t));
+		if (!text)
+			return FALSE;
+		memcpy(text, data + pos + sizeof(record), bytes);
+		text[record.length] = 0;
+		pos += sizeof(record) + bytes;
+
+		if (record.type == JOURNAL_SNAPSHOT) {
+			SetWindowTextW(hwnd, text);
+		} else {
+			DWORD length = GetWindowTextLengthW(hwnd);
+			if (record.offset > length || record.deleted > length - record.offset) {
+				free(text);
+				return FALSE;
 			}
+			SendMessageW(hwnd, EM_SETSEL, record.offset, record.offset + record.deleted);
+			SendMessageW(hwnd, EM_REPLACESEL, FALSE, (LPARAM) text);
+		}
+		free(text);
+	}
+	return TRUE;
+}
+
+/* The journal of an untitled document from a session that ended. Journals
+ * of running instances are open without sharing, so they are skipped. */
+HANDLE OpenUntitledJournal(wchar_t *path)
+{
+	wchar_t dir[MAX_PATH], pattern[MAX_PATH];
+	if (!MakeJournalDir(dir) || swprintf(pattern, MAX_PATH, L"%ls\\untitled*.journal", dir) < 0)
+		return NULL;
+
+	WIN32_FIND_DATAW found;
+	HANDLE search = FindFirstFileW(pattern, &found);
+	if (search == INVALID_HANDLE_VALUE)
+		return NULL;
+	HANDLE file = NULL;
+	do {
+		if (swprintf(path, MAX_PATH, L"%ls\\%ls", dir, found.cFileName) > 0)
+			file = OpenJournalFile(path, OPEN_EXISTING);
+	} while (!file && FindNextFileW(search, &found));
+	FindClose(search);
+	return file;
+}
+
+/*
+ * Offer to restore edits journaled for the current document by a session
+ * that did not exit cleanly. Called once the document has been loaded;
+ * on success the journal stays open and new edits append to it.
+ */
+BOOL RecoverJournal()
+{
+	Journal *journal = &g_editor->journal;
+	CloseJournal();
+	HANDLE file;
+	if (g_editor->currentFile[0] == 0) {
+		file = OpenUntitledJournal(journal->path);
+	} else {
+		if (!MakeJournalPath(g_editor->currentFile, journal->path))
+			return FALSE;
+		file = OpenJournalFile(journal->path, OPEN_EXISTING);
+	}
+	if (!file)
+		return FALSE;
+
+	LARGE_INTEGER fileSize;
+	JournalHeader header;
+	DWORD read;
+	unsigned char *data = NULL;
+	size_t size = 0, valid = 0;
+	if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > (LONGLONG) sizeof(header) &&
+	    ReadFile(file, &header, sizeof(header), &read, NULL) && read == sizeof(header) &&
+	    memcmp(header.magic, "MLYJ", 4) == 0 && header.version == JOURNAL_VERSION &&
+	    _wcsnicmp(header.path, g_editor->currentFile, MAX_PATH) == 0) {
+		size = (size_t)(fileSize.QuadPart - sizeof(header));
+		data = malloc(size);
+		if (data && (!ReadFile(file, data, (DWORD)size, &read, NULL) || read != size)) {
+			free(data);
+			data = NULL;
+		}
+	}
+
+	/* Keep the records that arrived whole; a crash may have torn the last */
+	while (data && valid + sizeof(JournalRecord) <= size) {
+		JournalRecord record;
+		memcpy(&record, data + valid, sizeof(record));
+		size_t bytes = (size_t)record.length * sizeof(wchar_t);
+		if (bytes > size - valid - sizeof(record) ||
+		    (record.type != JOURNAL_EDIT && record.type != JOURNAL_SNAPSHOT) ||
+		    JournalChecksum(&record, (const wchar_t *)(data + valid + sizeof(record))) != record.checksum)
+			break;
+		valid += sizeof(record) + bytes;
+	}
+
+	BOOL restored = FALSE;
+	if (valid > 0 &&
+	    MessageBoxW(g_editor->hwndMain,
+			L"This document has unsaved changes from a session that did not close normally. Restore them?",
+			L"Marquee Editor", MB_YESNO | MB_ICONQUESTION) == IDYES) {
+		JournalRecord first;
+		memcpy(&first, data, sizeof(first));
+		WIN32_FILE_ATTRIBUTE_DATA info;
+		BOOL baseMatches = first.type == JOURNAL_SNAPSHOT ||
+		    (GetFileAttributesExW(g_editor->currentFile, GetFileExInfoStandard, &info) &&
+		     (((unsigned long long)info.nFileSizeHigh << 32) | info.nFileSizeLow) == header.baseSize &&
+		     CompareFileTime(&info.ftLastWriteTime, &header.baseTime) == 0);
+
+		if (!baseMatches) {
+			MessageBoxW(g_editor->hwndMain,
+				    L"The file has changed on disk since the changes were made, so they cannot be restored.",
+				    L"Marquee Editor", MB_OK | MB_ICONWARNING);
 		} else {
-			/* File too small or empty */
-			SetWindowTextW(g_editor->hwndEdit, L"");
+			journal->replaying = TRUE;
+			restored = ReplayJournal(data, valid);
+			journal->replaying = FALSE;
+			SendMessageW(g_editor->hwndEdit, EM_EMPTYUNDOBUFFER, 0, 0);
+			SendMessageW(g_editor->hwndEdit, EM_SETSEL, 0, 0);
 		}
+	}
+	free(data);
 
-		fclose(file);
-		wcscpy(g_editor->currentFile, filename);
-		g_editor->isModified = FALSE;
-		SetStatusText(L"File opened successfully");
-		UpdateGutterAndRect();
+	if (!restored) {
+		CloseHandle(file);
+		DeleteFileW(journal->path);
+		journal->matchesFile = g_editor->currentFile[0] != 0;
+		return FALSE;
+	}
+
+	/* Drop the torn tail and carry on appending */
+	LARGE_INTEGER end;
+	end.QuadPart = sizeof(header) + valid;
+	SetFilePointerEx(file, end, NULL, FILE_BEGIN);
+	SetEndOfFile(file);
+	journal->file = file;
+	g_editor->isModified = TRUE;
+	SetTimer(g_editor->hwndMain, JOURNAL_TIMER_ID, JOURNAL_FLUSH_MS, NULL);
+	SetStatusText(L"Unsaved changes restored");
+	return TRUE;
+}
+
+DWORD WINAPI SaveThreadProc(LPVOID param)
+{
+	SaveJob *job = param;
+	HANDLE file = CreateSaveTemp(job->temp);
+	BOOL ok = file != INVALID_HANDLE_VALUE && WriteAll(file, job->data, job->size);
+	job->ok = CommitSave(file, job->temp, job->target, ok);
+	PostMessageW(job->hwndMain, WM_APP_SAVEDONE, (WPARAM) job, 0);
+	return 0;
+}
+
+void ReportSave(const SaveJob *job)
+{
+	if (job->ok) {
+		/* Edits made while the snapshot was written are still unsaved */
+		if (job->generation == g_editor->editGeneration)
+			g_editor->isModified = FALSE;
+		JournalSaved();
+		SetStatusText(L"File saved successfully");
 	} else {
-		MessageBoxW(g_editor->hwndMain, L"Could not open file",
+		MessageBoxW(g_editor->hwndMain, L"Could not save file",
 			    L"Error", MB_OK | MB_ICONERROR);
 	}
 }
 
-void LoadFile()
+/* Wait for a background save in progress; its WM_APP_SAVEDONE then only frees it */
+void FinishSave()
 {
-	OPENFILENAMEW ofn;
-	wchar_t filename[MAX_PATH] = { 0 };
+	SaveJob *job = g_editor->saveJob;
+	if (!job)
+		return;
+	WaitForSingleObject(job->thread, INFINITE);
+	g_editor->saveJob = NULL;
+	g_editor->saveQueued = FALSE;
+	ReportSave(job);
+}
 
-	memset(&ofn, 0, sizeof(ofn));
-	ofn.lStructSize = sizeof(ofn);
-	ofn.hwndOwner = g_editor->hwndMain;
-	ofn.lpstrFile = filename;
-	ofn.nMaxFile = MAX_PATH;
-	ofn.lpstrFilter =
-	    L"Marquee Layout Files\0*.mly\0Text Files\0*.txt\0All Files\0*.*\0";
-	ofn.Flags = OFN_FILEMUSTEXIST | OFN_PATHMUSTEXIST;
+void SaveFile(BOOL saveAs, BOOL background);
 
-	if (GetOpenFileNameW(&ofn)) {
-		LoadFile_impl(filename);
+void OnSaveDone(SaveJob *job)
+{
+	BOOL current = job == g_editor->saveJob;
+	CloseHandle(job->thread);
+	free(job->data);
+	if (current) {
+		g_editor->saveJob = NULL;
+		ReportSave(job);
+	}
+	free(job);
+
+	if (current && g_editor->saveQueued) {
+		g_editor->saveQueued = FALSE;
+		SaveFile(FALSE, TRUE);
+	}
+}
+
+/* Start writing the current text on a worker thread */
+BOOL StartBackgroundSave(const wchar_t *filename)
+{
+	SaveJob *job = calloc(1, sizeof(SaveJob));
+	if (!job)
+		return FALSE;
+	wcscpy(job->target, filename);
+	job->hwndMain = g_editor->hwndMain;
+	job->generation = g_editor->editGeneration;
+
+	HLOCAL handle;
+	int length;
+	const wchar_t *text = LockEditText(&handle, &length);
+	if (text) {
+		job->data = EncodeDocument(text, length, g_editor->saveUtf8, &job->size);
+		LocalUnlock(handle);
+	}
+	if (job->data && MakeSaveTempPath(filename, job->temp))
+		job->thread = CreateThread(NULL, 0, SaveThreadProc, job, 0, NULL);
+	if (!job->thread) {
+		free(job->data);
+		free(job);
+		return FALSE;
 	}
+	g_editor->saveJob = job;
+	SetStatusText(L"Saving...");
+	return TRUE;
+}
+
+/* Write the current text straight from the control's buffer */
+BOOL SaveDocument(const wchar_t *filename)
+{
+	wchar_t temp[MAX_PATH];
+	if (!MakeSaveTempPath(filename, temp))
+		return FALSE;
+	HANDLE file = CreateSaveTemp(temp);
+	if (file == INVALID_HANDLE_VALUE)
+		return FALSE;
+
+	HLOCAL handle;
+	int length;
+	const wchar_t *text = LockEditText(&handle, &length);
+	BOOL ok = text && WriteDocument(file, text, length, g_editor->saveUtf8);
+	if (text)
+		LocalUnlock(handle);
+	return CommitSave(file, temp, filename, ok);
 }
 
-void SaveFile(BOOL saveAs)
+/*
+ * Save to the current file, asking for a name when there is none. A
+ * background save encodes a snapshot and leaves the disk I/O to a worker,
+ * so typing carries on; otherwise the save is complete on return.
+ */
+void SaveFile(BOOL saveAs, BOOL background)
 {
+	if (g_editor->loadJob) {
+		SetStatusText(L"Cannot save while the file is still loading");
+		return;
+	}
+
 	wchar_t filename[MAX_PATH];
 	wcscpy(filename, g_editor->currentFile);
 
@@ -804,41 +3382,39 @@ void SaveFile(BOOL saveAs)
 			return;
 	}
 
-	int textLen = GetWindowTextLengthW(g_editor->hwndEdit);
-	wchar_t *wideBuffer = malloc((textLen + 1) * sizeof(wchar_t));
-	if (wideBuffer) {
-		GetWindowTextW(g_editor->hwndEdit, wideBuffer, textLen + 1);
-
-		/* Use _wfopen with wide character filename */
-		FILE *file = _wfopen(filename, L"wb");
-		if (file) {
-			unsigned char bom[2] = { 0xFF, 0xFE };	// WE ARE THE UTF-16 LE!!
-			fwrite(bom, 1, 2, file);
-			/* Write the wide character content directly as UTF-16LE */
-			size_t textBytes = wcslen(wideBuffer) * sizeof(wchar_t);
-			fwrite(wideBuffer, 1, textBytes, file);
-
-			fclose(file);
-			wcscpy(g_editor->currentFile, filename);
-			g_editor->isModified = FALSE;
-			SetStatusText(L"File saved successfully");
-		} else {
-			MessageBoxW(g_editor->hwndMain, L"Could not save file",
-				    L"Error", MB_OK | MB_ICONERROR);
+	if (g_editor->saveJob) {
+		if (background && !saveAs) {
+			/* Picked up with the latest text when the current save ends */
+			g_editor->saveQueued = TRUE;
+			return;
 		}
-		free(wideBuffer);
+		FinishSave();
+	}
+
+	wcscpy(g_editor->currentFile, filename);
+	if (background && StartBackgroundSave(filename))
+		return;
+
+	if (SaveDocument(filename)) {
+		g_editor->isModified = FALSE;
+		JournalSaved();
+		SetStatusText(L"File saved successfully");
+	} else {
+		MessageBoxW(g_editor->hwndMain, L"Could not save file",
+			    L"Error", MB_OK | MB_ICONERROR);
 	}
 }
 
 void LaunchPreview()
 {
+	FinishSave();
 	if (g_editor->isModified || wcslen(g_editor->currentFile) == 0) {
 		int result = MessageBoxW(g_editor->hwndMain,
 					 L"File must be saved before preview. Save now?",
 					 L"Preview",
 					 MB_YESNO | MB_ICONQUESTION);
 		if (result == IDYES) {
-			SaveFile(FALSE);
+			SaveFile(FALSE, FALSE);
 		} else {
 			return;
 		}
@@ -931,20 +3507,49 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 							     g_editor->hInstance,
 							     NULL);
 
+			/* Lift the default 32K limit; loading appends with EM_REPLACESEL */
+			SendMessageW(g_editor->hwndEdit, EM_SETLIMITTEXT, 0, 0);
+
 			/* Subclass the edit control to handle custom painting */
 			g_editor->originalEditProc =
 			    (WNDPROC) SetWindowLongPtrW(g_editor->hwndEdit,
 							GWLP_WNDPROC, (LONG_PTR)
 							EditControlProc);
 
-			/* Create error list */
+			/* Create error list; rows come from errorView on demand */
 			g_editor->hwndErrorList =
 			    CreateWindowExW(WS_EX_CLIENTEDGE, WC_LISTVIEWW, L"",
 					    WS_CHILD | WS_VISIBLE | LVS_REPORT |
-					    LVS_SINGLESEL, 10, 450, 800, 150,
+					    LVS_SINGLESEL | LVS_OWNERDATA |
+					    LVS_SHOWSELALWAYS, 10, 450, 800, 150,
 					    hwnd, (HMENU)
 					    IDC_LIST_ERRORS,
 					    g_editor->hInstance, NULL);
+			ListView_SetExtendedListViewStyle(g_editor->hwndErrorList,
+							  LVS_EX_FULLROWSELECT);
+			g_editor->errorSortColumn = -1;
+			g_editor->errorFilter = 7;
+
+			/* Live preview pane, hidden until Tools > Preview */
+			g_editor->preview.hwnd =
+			    CreateWindowExW(WS_EX_CLIENTEDGE, L"MarqueePreview", L"",
+					    WS_CHILD, 10, 410, 800, 40, hwnd,
+					    (HMENU) IDC_PREVIEW,
+					    g_editor->hInstance, NULL);
+			g_editor->preview.timePerFrame = 50;
+			g_editor->preview.followSegment = -1;
+
+			/* Outline of headers and segments, hidden until Tools > Outline */
+			g_editor->outline.hwnd =
+			    CreateWindowExW(WS_EX_CLIENTEDGE, WC_LISTVIEWW, L"",
+					    WS_CHILD | LVS_REPORT | LVS_SINGLESEL |
+					    LVS_OWNERDATA | LVS_SHOWSELALWAYS,
+					    10, 10, OUTLINE_WIDTH, 400, hwnd,
+					    (HMENU) IDC_OUTLINE,
+					    g_editor->hInstance, NULL);
+			ListView_SetExtendedListViewStyle(g_editor->outline.hwnd,
+							  LVS_EX_FULLROWSELECT);
+			g_editor->outline.followRow = -1;
 
 			/* Setup error list columns */
 			LVCOLUMNW col = { 0 };
@@ -961,6 +3566,18 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 			col.pszText = L"Message";
 			ListView_InsertColumn(g_editor->hwndErrorList, 2, &col);
 
+			col.cx = 50;
+			col.pszText = L"Line";
+			ListView_InsertColumn(g_editor->outline.hwnd, 0, &col);
+
+			col.cx = 140;
+			col.pszText = L"Outline";
+			ListView_InsertColumn(g_editor->outline.hwnd, 1, &col);
+
+			col.cx = 50;
+			col.pszText = L"E / W";
+			ListView_InsertColumn(g_editor->outline.hwnd, 2, &col);
+
 			SendMessageW(g_editor->hwndEdit, WM_SETFONT,
 				     (WPARAM) g_editor->hFont, TRUE);
 			SendMessageW(g_editor->hwndErrorList, WM_SETFONT,
@@ -986,10 +3603,13 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 			LoadFile();
 			break;
 		case IDM_FILE_SAVE:
-			SaveFile(FALSE);
+			SaveFile(FALSE, TRUE);
 			break;
 		case IDM_FILE_SAVEAS:
-			SaveFile(TRUE);
+			SaveFile(TRUE, TRUE);
+			break;
+		case IDM_FILE_UTF8:
+			SetSaveUtf8(!g_editor->saveUtf8);
 			break;
 		case IDM_FILE_EXIT:
 			PostMessage(hwnd, WM_CLOSE, 0, 0);
@@ -998,14 +3618,27 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 			ValidateFile();
 			break;
 		case IDM_TOOLS_PREVIEW:
+			ShowPreviewPane(!g_editor->preview.visible);
+			break;
+		case IDM_TOOLS_RENDERER:
 			LaunchPreview();
 			break;
+		case IDM_TOOLS_OUTLINE:
+			ShowOutlinePane(!g_editor->outline.visible);
+			break;
 		case IDM_HELP_ABOUT:
 			ShowAbout();
 			break;
 		case IDC_EDIT_MAIN:
 			if (HIWORD(wParam) == EN_CHANGE) {
 				g_editor->isModified = TRUE;
+				g_editor->editGeneration++;
+				/* A change from a message EditControlProc does not track:
+				 * the range is unknown, so start over */
+				if (g_editor->editDepth == 0) {
+					RebuildLineStates();
+					JournalNoteUnknownEdit();
+				}
 			}
 			break;
 		}
@@ -1024,17 +3657,38 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 			GetWindowRect(g_editor->hwndStatus, &statusRect);
 			int statusHeight = statusRect.bottom - statusRect.top;
 
+			/* Preview band between editor and error list, at most a third */
+			int previewHeight = 0;
+			if (g_editor->preview.visible) {
+				previewHeight = min(g_editor->preview.frameHeight + 4,
+						    (rect.bottom - statusHeight) / 3);
+				SetWindowPos(g_editor->preview.hwnd, NULL, 10,
+					     (rect.bottom - statusHeight - previewHeight) / 2,
+					     rect.right - 20, previewHeight,
+					     SWP_NOZORDER);
+				previewHeight += 10;
+			}
+			int half = (rect.bottom - statusHeight - previewHeight) / 2;
+
+			/* Outline to the left of the edit control */
+			int outlineWidth = 0;
+			if (g_editor->outline.visible) {
+				outlineWidth = OUTLINE_WIDTH + 10;
+				SetWindowPos(g_editor->outline.hwnd, NULL, 10, 10,
+					     OUTLINE_WIDTH, half - 20, SWP_NOZORDER);
+			}
+
 			/* Resize edit control - takes up top half */
-			SetWindowPos(g_editor->hwndEdit, NULL, 10, 10,
-				     rect.right - 20,
-				     (rect.bottom - statusHeight) / 2 - 20,
+			SetWindowPos(g_editor->hwndEdit, NULL, 10 + outlineWidth, 10,
+				     rect.right - 20 - outlineWidth,
+				     half - 20,
 				     SWP_NOZORDER);
 
 			/* Resize error list - takes up bottom half */
 			SetWindowPos(g_editor->hwndErrorList, NULL, 10,
-				     (rect.bottom - statusHeight) / 2 + 10,
+				     half + previewHeight + 10,
 				     rect.right - 20,
-				     (rect.bottom - statusHeight) / 2 - 20,
+				     half - 20,
 				     SWP_NOZORDER);
 
 			/* Update gutter and formatting rect */
@@ -1043,14 +3697,76 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 			break;
 		}
 
+	case WM_NOTIFY:
+		{
+			NMHDR *hdr = (NMHDR *) lParam;
+			if (hdr->idFrom == IDC_OUTLINE && hdr->code == LVN_GETDISPINFOW) {
+				GetOutlineDispInfo((NMLVDISPINFOW *) lParam);
+				return 0;
+			}
+			if (hdr->code == LVN_ITEMACTIVATE) {
+				/* Double-click or Enter jumps to the item's line */
+				int item = ((NMITEMACTIVATE *) lParam)->iItem;
+				if (hdr->idFrom == IDC_OUTLINE)
+					JumpToLine(OutlineRowLine(item));
+				else if (hdr->idFrom == IDC_LIST_ERRORS && item >= 0
+					 && item < g_editor->errorViewCount)
+					JumpToLine(g_editor->errors[g_editor->errorView[item]].lineNumber - 1);
+				return 0;
+			}
+			if (hdr->idFrom == IDC_LIST_ERRORS && hdr->code == LVN_GETDISPINFOW) {
+				GetErrorDispInfo((NMLVDISPINFOW *) lParam);
+				return 0;
+			}
+			if (hdr->idFrom == IDC_LIST_ERRORS && hdr->code == LVN_COLUMNCLICK) {
+				SortErrorList(((NMLISTVIEW *) lParam)->iSubItem);
+				return 0;
+			}
+			break;
+		}
+
+	case WM_CONTEXTMENU:
+		if ((HWND) wParam == g_editor->hwndErrorList) {
+			ShowErrorFilterMenu(g_editor->hwndErrorList, GET_X_LPARAM(lParam),
+					    GET_Y_LPARAM(lParam));
+			return 0;
+		}
+		break;
+
+	case WM_APP_LOADCHUNK:
+		OnLoadChunk((LoadJob *) wParam, (LoadChunk *) lParam);
+		return 0;
+
+	case WM_APP_LOADDONE:
+		OnLoadDone((LoadJob *) wParam);
+		return 0;
+
+	case WM_APP_SAVEDONE:
+		OnSaveDone((SaveJob *) wParam);
+		return 0;
+
+	case WM_APP_COMPACTDONE:
+		OnCompactDone((CompactJob *) wParam);
+		return 0;
+
+	case WM_TIMER:
+		if (wParam == JOURNAL_TIMER_ID) {
+			FlushJournal();
+			return 0;
+		}
+		break;
+
 	case WM_CLOSE:
+		FinishSave();
 		if (g_editor->isModified) {
 			int result =
 			    MessageBoxW(hwnd, L"Save changes before closing?",
 					L"Marquee Editor",
 					MB_YESNOCANCEL | MB_ICONQUESTION);
 			if (result == IDYES) {
-				SaveFile(FALSE);
+				SaveFile(FALSE, FALSE);
+			} else if (result == IDNO) {
+				JournalDiscard();
 			} else if (result == IDCANCEL) {
 				return 0;
 			}
@@ -1059,9 +3775,33 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 		break;
 
 	case WM_DESTROY:
+		CancelLoad();
+		FinishSave();
+		/* A journal left behind is recovered on the next start */
+		if (g_editor->isModified) {
+			/* Flushing may start a compaction, after which records can remain */
+			FinishCompaction();
+			FlushJournal();
+			FinishCompaction();
+			FlushJournal();
+			CloseJournal();
+		} else {
+			JournalDiscard();
+		}
+		free(g_editor->journal.buffer);
 		if (g_editor->hFont) {
 			DeleteObject(g_editor->hFont);
 		}
+		KillTimer(g_editor->preview.hwnd, PREVIEW_TIMER_ID);
+		DestroyPreviewFrame(&g_editor->preview);
+		for (int s = 0; s < g_editor->preview.segmentCount; s++)
+			FreePreviewSegment(&g_editor->preview.segments[s]);
+		free(g_editor->preview.segments);
+		free(g_editor->lineStates);
+		free(g_editor->outline.headers.items);
+		free(g_editor->outline.segments.items);
+		free(g_editor->errors);
+		free(g_editor->errorView);
 		PostQuitMessage(0);
 		break;
 	}
@@ -1101,6 +3841,15 @@ wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLine,
 
 	RegisterClassW(&wc);
 
+	/* Preview pane class */
+	WNDCLASSW previewClass;
+	memset(&previewClass, 0, sizeof(previewClass));
+	previewClass.lpfnWndProc = PreviewProc;
+	previewClass.hInstance = hInstance;
+	previewClass.lpszClassName = L"MarqueePreview";
+	previewClass.hCursor = LoadCursor(NULL, IDC_ARROW);
+	RegisterClassW(&previewClass);
+
 	/* Create window */
 	g_editor->hwndMain = CreateWindowExW(0,
 					     L"MarqueeEditor",
@@ -1144,6 +3893,10 @@ wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLine,
 	ShowWindow(g_editor->hwndMain, nCmdShow);
 	UpdateWindow(g_editor->hwndMain);
 
+	/* Untitled work from a session that crashed */
+	if (lpCmdLineLen == 0)
+		RecoverJournal();
+
 	/* Message loop with accelerator support */
 	MSG msg;
 	while (GetMessage(&msg, NULL, 0, 0)) {
@@ -1,6 +1,8 @@
 #ifndef RESOURCE_H
 #define RESOURCE_H
+#if defined(_WIN32) || defined(RC_INVOKED)
 #include <windows.h>
+#endif
 
 #define IDI_APPICON 1000
 
@@ -9,6 +11,8 @@
 // Control IDs
 #define IDC_EDIT_MAIN 1001
 #define IDC_LIST_ERRORS 1002
+#define IDC_PREVIEW 1003
+#define IDC_OUTLINE 1004
 #define IDC_STATUS 1009
 
 // Menu IDs
@@ -20,6 +24,9 @@
 #define IDM_TOOLS_VALIDATE 2006
 #define IDM_TOOLS_PREVIEW 2007
 #define IDM_HELP_ABOUT 2008
+#define IDM_TOOLS_RENDERER 2009
+#define IDM_FILE_UTF8 2010
+#define IDM_TOOLS_OUTLINE 2011
 
 // Accelerator IDs (same as menu IDs for simplicity)
 #define IDA_FILE_NEW IDM_FILE_NEW
@@ -27,6 +34,8 @@
 #define IDA_FILE_SAVE IDM_FILE_SAVE
 #define IDA_TOOLS_VALIDATE IDM_TOOLS_VALIDATE
 #define IDA_TOOLS_PREVIEW IDM_TOOLS_PREVIEW
+#define IDA_TOOLS_RENDERER IDM_TOOLS_RENDERER
+#define IDA_TOOLS_OUTLINE IDM_TOOLS_OUTLINE
 
 // Resource IDs
 #define IDR_MAINMENU 3001
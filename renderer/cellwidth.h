@@ -0,0 +1,87 @@
+/* cellwidth.h - Terminal-style cell widths of Unicode text
+ *
+ * The renderer measures text in a monospace face as cells times the width of
+ * one narrow cell. Plain portable C, so tools without GDI (headless outputs,
+ * validate) can include it instead of keeping their own copy of the table.
+ */
+#ifndef CELLWIDTH_H
+#define CELLWIDTH_H
+
+#include <wchar.h>
+
+/* Code points two cells wide: East Asian Wide and Fullwidth (UAX #11).
+ * Ambiguous-width characters count as one cell. */
+typedef struct {
+	unsigned first;
+	unsigned last;
+} CodeRange;
+
+static const CodeRange wideRanges[] = {
+	{ 0x1100, 0x115F },	/* Hangul Jamo initials */
+	{ 0x231A, 0x231B }, { 0x2329, 0x232A }, { 0x23E9, 0x23EC }, { 0x23F0, 0x23F0 },
+	{ 0x23F3, 0x23F3 }, { 0x25FD, 0x25FE }, { 0x2614, 0x2615 }, { 0x2648, 0x2653 },
+	{ 0x267F, 0x267F }, { 0x2693, 0x2693 }, { 0x26A1, 0x26A1 }, { 0x26AA, 0x26AB },
+	{ 0x26BD, 0x26BE }, { 0x26C4, 0x26C5 }, { 0x26CE, 0x26CE }, { 0x26D4, 0x26D4 },
+	{ 0x26EA, 0x26EA }, { 0x26F2, 0x26F3 }, { 0x26F5, 0x26F5 }, { 0x26FA, 0x26FA },
+	{ 0x26FD, 0x26FD }, { 0x2705, 0x2705 }, { 0x270A, 0x270B }, { 0x2728, 0x2728 },
+	{ 0x274C, 0x274C }, { 0x274E, 0x274E }, { 0x2753, 0x2755 }, { 0x2757, 0x2757 },
+	{ 0x2795, 0x2797 }, { 0x27B0, 0x27B0 }, { 0x27BF, 0x27BF }, { 0x2B1B, 0x2B1C },
+	{ 0x2B50, 0x2B50 }, { 0x2B55, 0x2B55 },
+	{ 0x2E80, 0x303E },	/* CJK radicals, symbols and punctuation */
+	{ 0x3041, 0x33FF },	/* Kana, Bopomofo, compatibility Jamo, enclosed CJK */
+	{ 0x3400, 0x4DBF },	/* CJK extension A */
+	{ 0x4E00, 0x9FFF },	/* CJK unified ideographs */
+	{ 0xA000, 0xA4CF },	/* Yi */
+	{ 0xA960, 0xA97F },	/* Hangul Jamo extended A */
+	{ 0xAC00, 0xD7A3 },	/* Hangul syllables */
+	{ 0xF900, 0xFAFF },	/* CJK compatibility ideographs */
+	{ 0xFE10, 0xFE19 }, { 0xFE30, 0xFE6F },	/* Vertical and small forms */
+	{ 0xFF00, 0xFF60 }, { 0xFFE0, 0xFFE6 },	/* Fullwidth forms */
+	{ 0x16FE0, 0x16FE4 }, { 0x17000, 0x18CFF }, { 0x1B000, 0x1B2FF },
+	{ 0x1F004, 0x1F004 }, { 0x1F0CF, 0x1F0CF }, { 0x1F18E, 0x1F18E }, { 0x1F191, 0x1F19A },
+	{ 0x1F200, 0x1F251 }, { 0x1F260, 0x1F265 },
+	{ 0x1F300, 0x1F64F },	/* Pictographs and emoticons */
+	{ 0x1F680, 0x1F6FF }, { 0x1F7E0, 0x1F7EB }, { 0x1F90C, 0x1F9FF }, { 0x1FA70, 0x1FAFF },
+	{ 0x20000, 0x2FFFD }, { 0x30000, 0x3FFFD },	/* CJK extensions B onwards */
+};
+
+/* Cells taken by code point c: 0 for combining and zero-width marks */
+static int CharCells(unsigned c)
+{
+	if (c < 0x300)
+		return c >= 0x20 ? 1 : 0;
+	if (c <= 0x36F || (c >= 0x200B && c <= 0x200F) || c == 0xFEFF)
+		return 0;
+	if (c < wideRanges[0].first)
+		return 1;
+
+	int lo = 0, hi = sizeof(wideRanges) / sizeof(wideRanges[0]) - 1;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (c < wideRanges[mid].first)
+			hi = mid - 1;
+		else if (c > wideRanges[mid].last)
+			lo = mid + 1;
+		else
+			return 2;
+	}
+	return 1;
+}
+
+/* Cells taken by UTF-16 text, counting a surrogate pair as one character */
+static int TextCells(const wchar_t *text, int length)
+{
+	int cells = 0;
+	for (int i = 0; i < length; i++) {
+		unsigned c = text[i];
+		if (c >= 0xD800 && c <= 0xDBFF && i + 1 < length
+		    && text[i + 1] >= 0xDC00 && text[i + 1] <= 0xDFFF) {
+			c = 0x10000 + ((c - 0xD800) << 10) + (text[i + 1] - 0xDC00);
+			i++;
+		}
+		cells += CharCells(c);
+	}
+	return cells;
+}
+
+#endif
@@ -0,0 +1,474 @@
+/* framedelta.h - Delta-encoded frame stream for bandwidth-limited displays
+ *
+ * Consecutive marquee frames are mostly the previous frame moved left by PM
+ * pixels. A stream sends an occasional keyframe and otherwise only a shift and
+ * the rectangles that still differ afterwards, which on a scrolling marquee is
+ * the newly exposed columns.
+ *
+ * Stream: "MQDS", uint32 version, then records. All integers little-endian.
+ *
+ * Record: a 16-byte header followed by size bytes of payload.
+ *   uint8  type      FRAMEDELTA_KEY or FRAMEDELTA_DELTA
+ *   uint8  reserved
+ *   uint16 shift     Delta: the previous frame moved left by this many pixels,
+ *                    with the exposed columns black, is the prediction
+ *   uint16 width
+ *   uint16 height
+ *   uint32 size      Payload bytes
+ *   uint32 checksum  FNV-1a of the whole decoded frame, so decoders can verify
+ *
+ * Key payload: the frame as RLE pixels (BGRX8888, rows top-down, no padding).
+ * Delta payload: uint16 rectangle count, then per rectangle uint16 x, y, w, h
+ * and w * h RLE pixels replacing that part of the prediction.
+ *
+ * RLE pixels: packets of a count byte n. If n & 0x80, one pixel follows that
+ * repeats (n & 0x7F) + 1 times; otherwise n + 1 literal pixels follow. Packets
+ * continue across rows.
+ */
+#ifndef FRAMEDELTA_H
+#define FRAMEDELTA_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FRAMEDELTA_MAGIC "MQDS"
+#define FRAMEDELTA_VERSION 1
+#define FRAMEDELTA_HEADER_SIZE 16
+#define FRAMEDELTA_KEY 1
+#define FRAMEDELTA_DELTA 2
+#define FRAMEDELTA_DEFAULT_KEY_INTERVAL 100
+
+typedef struct {
+	uint8_t type;
+	uint16_t shift;
+	uint16_t width;
+	uint16_t height;
+	uint32_t size;
+	uint32_t checksum;
+} FrameDeltaRecord;
+
+typedef struct {
+	uint32_t width;
+	uint32_t height;
+	uint32_t keyInterval;	/* Frames between keyframes */
+	uint32_t sinceKey;
+	uint32_t lastShift;	/* Shift of the last delta, tried again on the next */
+	uint8_t *previous;	/* Last frame sent, packed; NULL before the first key */
+	uint8_t *predicted;
+	uint8_t *record;	/* Header and payload of the last encoded frame */
+	size_t recordSize;
+	size_t recordCapacity;
+} FrameDeltaEncoder;
+
+typedef struct {
+	uint32_t width;
+	uint32_t height;
+	uint8_t *frame;		/* Last decoded frame, packed; NULL before the first key */
+} FrameDeltaDecoder;
+
+static uint32_t FrameDeltaChecksum(const uint8_t *pixels, size_t size)
+{
+	uint32_t hash = 2166136261U;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= pixels[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static void FrameDeltaPut16(uint8_t *p, uint32_t value)
+{
+	p[0] = (uint8_t)value;
+	p[1] = (uint8_t)(value >> 8);
+}
+
+static void FrameDeltaPut32(uint8_t *p, uint32_t value)
+{
+	FrameDeltaPut16(p, value);
+	FrameDeltaPut16(p + 2, value >> 16);
+}
+
+static uint32_t FrameDeltaGet16(const uint8_t *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8;
+}
+
+static uint32_t FrameDeltaGet32(const uint8_t *p)
+{
+	return FrameDeltaGet16(p) | FrameDeltaGet16(p + 2) << 16;
+}
+
+static void FrameDeltaWriteHeader(uint8_t *p, const FrameDeltaRecord *record)
+{
+	p[0] = record->type;
+	p[1] = 0;
+	FrameDeltaPut16(p + 2, record->shift);
+	FrameDeltaPut16(p + 4, record->width);
+	FrameDeltaPut16(p + 6, record->height);
+	FrameDeltaPut32(p + 8, record->size);
+	FrameDeltaPut32(p + 12, record->checksum);
+}
+
+static void FrameDeltaReadHeader(const uint8_t *p, FrameDeltaRecord *record)
+{
+	record->type = p[0];
+	record->shift = (uint16_t)FrameDeltaGet16(p + 2);
+	record->width = (uint16_t)FrameDeltaGet16(p + 4);
+	record->height = (uint16_t)FrameDeltaGet16(p + 6);
+	record->size = FrameDeltaGet32(p + 8);
+	record->checksum = FrameDeltaGet32(p + 12);
+}
+
+/* Room for extra more bytes in the record being built */
+static int FrameDeltaReserve(FrameDeltaEncoder *encoder, size_t extra)
+{
+	if (encoder->recordSize + extra <= encoder->recordCapacity)
+		return 1;
+
+	size_t capacity = encoder->recordCapacity ? encoder->recordCapacity : 4096;
+	while (capacity < encoder->recordSize + extra)
+		capacity *= 2;
+	uint8_t *grown = realloc(encoder->record, capacity);
+	if (!grown)
+		return 0;
+	encoder->record = grown;
+	encoder->recordCapacity = capacity;
+	return 1;
+}
+
+/* Append w x h pixels at pixels (rows stride bytes apart) as RLE */
+static int FrameDeltaPutRle(FrameDeltaEncoder *encoder, const uint8_t *pixels,
+			    size_t stride, uint32_t w, uint32_t h)
+{
+	/* Worst case is all literals: one count byte per 128 pixels */
+	size_t count = (size_t)w * h;
+	if (!FrameDeltaReserve(encoder, count * 4 + count / 128 + 1))
+		return 0;
+
+	uint8_t *out = encoder->record + encoder->recordSize;
+	uint8_t *literal = NULL;	/* Count byte of the open literal packet */
+	size_t i = 0;
+
+#define FRAMEDELTA_PIXEL(n) (pixels + ((n) / w) * stride + ((n) % w) * 4)
+	while (i < count) {
+		const uint8_t *pixel = FRAMEDELTA_PIXEL(i);
+		size_t run = 1;
+		while (i + run < count && run < 128
+		       && memcmp(FRAMEDELTA_PIXEL(i + run), pixel, 4) == 0)
+			run++;
+
+		if (run >= 2) {
+			*out++ = (uint8_t)(0x80 | (run - 1));
+			memcpy(out, pixel, 4);
+			out += 4;
+			literal = NULL;
+			i += run;
+			continue;
+		}
+
+		if (!literal || *literal == 127) {
+			literal = out++;
+			*literal = 0;
+		} else {
+			(*literal)++;
+		}
+		memcpy(out, pixel, 4);
+		out += 4;
+		i++;
+	}
+#undef FRAMEDELTA_PIXEL
+
+	encoder->recordSize = (size_t)(out - encoder->record);
+	return 1;
+}
+
+/* Decode w x h RLE pixels into pixels (rows stride bytes apart). Returns the
+ * bytes consumed, or 0 if the data is short or malformed. */
+static size_t FrameDeltaGetRle(const uint8_t *data, size_t size, uint8_t *pixels,
+			       size_t stride, uint32_t w, uint32_t h)
+{
+	size_t count = (size_t)w * h;
+	size_t i = 0, at = 0;
+
+	while (i < count) {
+		if (at >= size)
+			return 0;
+		uint8_t n = data[at++];
+		size_t run = (size_t)(n & 0x7F) + 1;
+		int repeat = (n & 0x80) != 0;
+		if (i + run > count || at + (repeat ? 4 : run * 4) > size)
+			return 0;
+		for (size_t k = 0; k < run; k++, i++) {
+			uint8_t *pixel = pixels + (i / w) * stride + (i % w) * 4;
+			memcpy(pixel, data + at + (repeat ? 0 : k * 4), 4);
+		}
+		at += repeat ? 4 : run * 4;
+	}
+	return at;
+}
+
+/* Previous frame moved left by shift, with black coming in on the right */
+static void FrameDeltaPredict(const uint8_t *previous, uint8_t *predicted,
+			      uint32_t width, uint32_t height, uint32_t shift)
+{
+	size_t rowBytes = (size_t)width * 4;
+	for (uint32_t y = 0; y < height; y++) {
+		const uint8_t *src = previous + y * rowBytes;
+		uint8_t *dst = predicted + y * rowBytes;
+		memcpy(dst, src + (size_t)shift * 4, rowBytes - (size_t)shift * 4);
+		memset(dst + rowBytes - (size_t)shift * 4, 0, (size_t)shift * 4);
+	}
+}
+
+/* Group the rows of frame that differ from predicted into bands of adjacent
+ * rows, each covered by one rectangle as wide as their differing columns.
+ * Returns the pixels the rectangles cover; with rects, also stores them
+ * (x, y, w, h each) and their count. */
+static size_t FrameDeltaDirtyRects(const uint8_t *frame, size_t stride,
+				   const uint8_t *predicted, uint32_t width,
+				   uint32_t height, uint16_t *rects, uint32_t *rectCount)
+{
+	size_t area = 0;
+	uint32_t count = 0;
+	uint32_t bandTop = 0, bandLeft = 0, bandRight = 0;
+	int inBand = 0;
+
+	for (uint32_t y = 0; y <= height; y++) {
+		uint32_t left = width, right = 0;
+		if (y < height) {
+			const uint8_t *row = frame + y * stride;
+			const uint8_t *guess = predicted + (size_t)y * width * 4;
+			uint32_t x = 0;
+			while (x < width && memcmp(row + x * 4, guess + x * 4, 4) == 0)
+				x++;
+			if (x < width) {
+				left = x;
+				right = width;
+				while (memcmp(row + (right - 1) * 4, guess + (right - 1) * 4, 4) == 0)
+					right--;
+			}
+		}
+
+		if (left < right) {
+			if (!inBand) {
+				inBand = 1;
+				bandTop = y;
+				bandLeft = left;
+				bandRight = right;
+			} else {
+				if (left < bandLeft)
+					bandLeft = left;
+				if (right > bandRight)
+					bandRight = right;
+			}
+			continue;
+		}
+		if (inBand) {
+			area += (size_t)(bandRight - bandLeft) * (y - bandTop);
+			if (rects) {
+				rects[count * 4 + 0] = (uint16_t)bandLeft;
+				rects[count * 4 + 1] = (uint16_t)bandTop;
+				rects[count * 4 + 2] = (uint16_t)(bandRight - bandLeft);
+				rects[count * 4 + 3] = (uint16_t)(y - bandTop);
+			}
+			count++;
+			inBand = 0;
+		}
+	}
+
+	if (rectCount)
+		*rectCount = count;
+	return area;
+}
+
+static void FrameDeltaEncoderFree(FrameDeltaEncoder *encoder)
+{
+	free(encoder->previous);
+	free(encoder->predicted);
+	free(encoder->record);
+	memset(encoder, 0, sizeof(*encoder));
+}
+
+/*
+ * Encode frame (width x height BGRX8888, rows stride bytes apart) into
+ * encoder->record / recordSize. shiftHint is how far the producer says the
+ * picture moved left since the previous frame, 0 if unknown; it is checked,
+ * never trusted. Returns 0 if out of memory.
+ */
+static int FrameDeltaEncode(FrameDeltaEncoder *encoder, const uint8_t *frame,
+			    size_t stride, uint32_t width, uint32_t height,
+			    uint32_t shiftHint)
+{
+	size_t rowBytes = (size_t)width * 4;
+	size_t frameBytes = rowBytes * height;
+	FrameDeltaRecord record = { 0, 0, (uint16_t)width, (uint16_t)height, 0, 0 };
+
+	encoder->recordSize = 0;
+	if (width == 0 || height == 0 || width > 0xFFFF || height > 0xFFFF
+	    || !FrameDeltaReserve(encoder, FRAMEDELTA_HEADER_SIZE))
+		return 0;
+	encoder->recordSize = FRAMEDELTA_HEADER_SIZE;
+
+	int key = !encoder->previous || width != encoder->width || height != encoder->height
+	    || encoder->sinceKey + 1 >= encoder->keyInterval;
+	if (key && (width != encoder->width || height != encoder->height || !encoder->previous)) {
+		free(encoder->previous);
+		free(encoder->predicted);
+		encoder->previous = malloc(frameBytes);
+		encoder->predicted = malloc(frameBytes);
+		encoder->width = width;
+		encoder->height = height;
+		if (!encoder->previous || !encoder->predicted) {
+			FrameDeltaEncoderFree(encoder);
+			return 0;
+		}
+	}
+
+	if (!key) {
+		/* Pick the cheapest of no shift, the hint and the last shift */
+		uint32_t candidates[3] = { 0, shiftHint, encoder->lastShift };
+		uint32_t best = 0;
+		size_t bestArea = (size_t)-1;
+		for (int c = 0; c < 3; c++) {
+			uint32_t shift = candidates[c];
+			if (shift >= width || (c > 0 && shift == 0)
+			    || (c == 2 && shift == shiftHint))
+				continue;
+			FrameDeltaPredict(encoder->previous, encoder->predicted, width, height, shift);
+			size_t area = FrameDeltaDirtyRects(frame, stride, encoder->predicted,
+							   width, height, NULL, NULL);
+			if (area < bestArea) {
+				bestArea = area;
+				best = shift;
+			}
+		}
+
+		/* A delta touching most of the frame is no cheaper than a key */
+		key = bestArea > (size_t)width * height / 2;
+		if (!key) {
+			uint32_t rectCount = 0;
+			uint16_t *rects = malloc(((size_t)height / 2 + 1) * 4 * sizeof(uint16_t));
+			if (!rects)
+				return 0;
+			FrameDeltaPredict(encoder->previous, encoder->predicted, width, height, best);
+			FrameDeltaDirtyRects(frame, stride, encoder->predicted, width, height,
+					     rects, &rectCount);
+
+			if (!FrameDeltaReserve(encoder, 2)) {
+				free(rects);
+				return 0;
+			}
+			FrameDeltaPut16(encoder->record + encoder->recordSize, rectCount);
+			encoder->recordSize += 2;
+			for (uint32_t r = 0; r < rectCount; r++) {
+				uint16_t *rect = &rects[r * 4];
+				if (!FrameDeltaReserve(encoder, 8)) {
+					free(rects);
+					return 0;
+				}
+				for (int k = 0; k < 4; k++)
+					FrameDeltaPut16(encoder->record + encoder->recordSize + k * 2, rect[k]);
+				encoder->recordSize += 8;
+				if (!FrameDeltaPutRle(encoder, frame + rect[1] * stride + (size_t)rect[0] * 4,
+						      stride, rect[2], rect[3])) {
+					free(rects);
+					return 0;
+				}
+			}
+			free(rects);
+
+			record.type = FRAMEDELTA_DELTA;
+			record.shift = (uint16_t)best;
+			encoder->lastShift = best;
+			encoder->sinceKey++;
+		}
+	}
+
+	if (key) {
+		encoder->recordSize = FRAMEDELTA_HEADER_SIZE;
+		if (!FrameDeltaPutRle(encoder, frame, stride, width, height))
+			return 0;
+		record.type = FRAMEDELTA_KEY;
+		encoder->sinceKey = 0;
+	}
+
+	for (uint32_t y = 0; y < height; y++)
+		memcpy(encoder->previous + y * rowBytes, frame + y * stride, rowBytes);
+	record.size = (uint32_t)(encoder->recordSize - FRAMEDELTA_HEADER_SIZE);
+	record.checksum = FrameDeltaChecksum(encoder->previous, frameBytes);
+	FrameDeltaWriteHeader(encoder->record, &record);
+	return 1;
+}
+
+static void FrameDeltaDecoderFree(FrameDeltaDecoder *decoder)
+{
+	free(decoder->frame);
+	memset(decoder, 0, sizeof(*decoder));
+}
+
+/*
+ * Apply one record to decoder->frame. Returns 1 when the result matches the
+ * record's checksum, 0 when it does not, and -1 when the record is malformed
+ * or a delta comes without a keyframe before it.
+ */
+static int FrameDeltaDecode(FrameDeltaDecoder *decoder, const FrameDeltaRecord *record,
+			    const uint8_t *payload)
+{
+	uint32_t width = record->width, height = record->height;
+	size_t rowBytes = (size_t)width * 4;
+
+	if (record->type == FRAMEDELTA_KEY) {
+		if (!decoder->frame || width != decoder->width || height != decoder->height) {
+			free(decoder->frame);
+			decoder->frame = malloc(rowBytes * height);
+			decoder->width = width;
+			decoder->height = height;
+			if (!decoder->frame)
+				return -1;
+		}
+		if (FrameDeltaGetRle(payload, record->size, decoder->frame, rowBytes,
+				     width, height) != record->size)
+			return -1;
+	} else if (record->type == FRAMEDELTA_DELTA) {
+		if (!decoder->frame || width != decoder->width || height != decoder->height
+		    || record->shift >= width || record->size < 2)
+			return -1;
+
+		/* Predict in place: rows move left, black comes in */
+		size_t shiftBytes = (size_t)record->shift * 4;
+		for (uint32_t y = 0; y < height && shiftBytes > 0; y++) {
+			uint8_t *row = decoder->frame + y * rowBytes;
+			memmove(row, row + shiftBytes, rowBytes - shiftBytes);
+			memset(row + rowBytes - shiftBytes, 0, shiftBytes);
+		}
+
+		uint32_t rectCount = FrameDeltaGet16(payload);
+		size_t at = 2;
+		for (uint32_t r = 0; r < rectCount; r++) {
+			if (at + 8 > record->size)
+				return -1;
+			uint32_t x = FrameDeltaGet16(payload + at);
+			uint32_t y = FrameDeltaGet16(payload + at + 2);
+			uint32_t w = FrameDeltaGet16(payload + at + 4);
+			uint32_t h = FrameDeltaGet16(payload + at + 6);
+			at += 8;
+			if (w == 0 || h == 0 || x + w > width || y + h > height)
+				return -1;
+			size_t used = FrameDeltaGetRle(payload + at, record->size - at,
+						       decoder->frame + y * rowBytes + (size_t)x * 4,
+						       rowBytes, w, h);
+			if (used == 0)
+				return -1;
+			at += used;
+		}
+		if (at != record->size)
+			return -1;
+	} else {
+		return -1;
+	}
+
+	return FrameDeltaChecksum(decoder->frame, rowBytes * height) == record->checksum;
+}
+
+#endif
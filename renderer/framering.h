@@ -0,0 +1,337 @@
+/* framering.h - Shared-memory frame ring between the renderer and display drivers
+ *
+ * The mapping holds one FrameRingHeader followed by slotCount slots. Each slot
+ * is a FrameSlot header followed by height rows of stride bytes (BGRX8888,
+ * top-down). The protocol is single-producer/single-consumer:
+ *
+ *   - the producer owns writeSeq and the slots in [writeSeq, readSeq + slotCount)
+ *   - the consumer owns readSeq and the slots in [readSeq, writeSeq)
+ *
+ * Frame n always lives in slot n % slotCount. Neither side ever blocks or
+ * issues a system call per frame: when the consumer falls behind, the producer
+ * drops the frame and bumps the dropped counter instead of overwriting.
+ */
+#ifndef FRAMERING_H
+#define FRAMERING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define FRAMERING_MAGIC 0x5246514DU	/* "MQFR" */
+#define FRAMERING_VERSION 1
+#define FRAMERING_FORMAT_BGRX8888 1
+#define FRAMERING_DEFAULT_NAME "marquee-frames"
+#define FRAMERING_DEFAULT_SLOTS 4
+#define FRAMERING_MAX_SLOTS 64
+#define FRAMERING_MAX_NAME 128
+#define FRAMERING_ALIGN 64
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t format;	/* FRAMERING_FORMAT_* */
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;	/* Bytes per pixel row */
+	uint32_t slotCount;
+	uint32_t slotSize;	/* Bytes per slot, FrameSlot header included */
+	uint32_t headerSize;	/* Offset of slot 0 from the start of the mapping */
+	_Atomic uint32_t producerAlive;	/* Cleared when the producer detaches */
+	uint8_t pad0[FRAMERING_ALIGN - 10 * sizeof(uint32_t)];
+
+	/* Producer-owned, on its own cache line */
+	_Atomic uint64_t writeSeq;	/* Number of frames published */
+	_Atomic uint64_t dropped;	/* Frames dropped because the ring was full */
+	uint8_t pad1[FRAMERING_ALIGN - 2 * sizeof(uint64_t)];
+
+	/* Consumer-owned, on its own cache line */
+	_Atomic uint64_t readSeq;	/* Number of frames released by the consumer */
+	uint8_t pad2[FRAMERING_ALIGN - sizeof(uint64_t)];
+} FrameRingHeader;
+
+typedef struct {
+	uint64_t sequence;	/* Frame number stored in this slot */
+	uint64_t timestampMs;	/* Producer monotonic clock when the frame was finished */
+	uint32_t segment;	/* Segment shown in this frame */
+	uint32_t shift;		/* Pixels the picture scrolled left since the previous frame, else 0 */
+	uint64_t dueMs;		/* Same clock: when the producer shows the frame itself; frames
+				 * are published up to a few frames ahead of it */
+} FrameSlot;
+
+typedef struct {
+	FrameRingHeader *header;
+	size_t mappingSize;
+	int isProducer;
+#ifdef _WIN32
+	HANDLE mapping;
+#else
+	char shmName[FRAMERING_MAX_NAME + 2];
+#endif
+} FrameRing;
+
+static size_t FrameRingAlign(size_t value)
+{
+	return (value + FRAMERING_ALIGN - 1) & ~(size_t)(FRAMERING_ALIGN - 1);
+}
+
+static uint64_t FrameRingClockMs(void)
+{
+#ifdef _WIN32
+	return (uint64_t)GetTickCount64();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+#endif
+}
+
+static void *FrameRingMap(FrameRing *ring, const char *name, size_t size, int create)
+{
+#ifdef _WIN32
+	char mappingName[FRAMERING_MAX_NAME + 8];
+	snprintf(mappingName, sizeof(mappingName), "Local\\%s", name);
+
+	if (create) {
+		ring->mapping =
+		    CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+				       (DWORD) ((uint64_t)size >> 32), (DWORD) size, mappingName);
+		/* A mapping kept alive by a consumer is reused; MapViewOfFile fails if it is too small */
+	} else {
+		ring->mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, mappingName);
+	}
+	if (!ring->mapping)
+		return NULL;
+
+	void *view = MapViewOfFile(ring->mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+	if (!view) {
+		CloseHandle(ring->mapping);
+		ring->mapping = NULL;
+	}
+	return view;
+#else
+	snprintf(ring->shmName, sizeof(ring->shmName), "/%s", name);
+
+	int fd;
+	if (create) {
+		shm_unlink(ring->shmName);
+		fd = shm_open(ring->shmName, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd >= 0 && ftruncate(fd, (off_t)size) != 0) {
+			close(fd);
+			shm_unlink(ring->shmName);
+			return NULL;
+		}
+	} else {
+		fd = shm_open(ring->shmName, O_RDWR, 0);
+		if (fd >= 0 && size == 0) {
+			struct stat st;
+			if (fstat(fd, &st) == 0)
+				size = (size_t)st.st_size;
+		}
+	}
+	if (fd < 0 || size == 0) {
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+
+	void *view = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (view == MAP_FAILED)
+		return NULL;
+	ring->mappingSize = size;
+	return view;
+#endif
+}
+
+static void FrameRingClose(FrameRing *ring)
+{
+	if (!ring->header)
+		return;
+
+	if (ring->isProducer)
+		atomic_store_explicit(&ring->header->producerAlive, 0, memory_order_release);
+
+#ifdef _WIN32
+	UnmapViewOfFile(ring->header);
+	if (ring->mapping)
+		CloseHandle(ring->mapping);
+	ring->mapping = NULL;
+#else
+	munmap(ring->header, ring->mappingSize);
+	if (ring->isProducer)
+		shm_unlink(ring->shmName);
+#endif
+	ring->header = NULL;
+	ring->mappingSize = 0;
+}
+
+/* Producer side: create the mapping and initialize the header */
+static int FrameRingCreate(FrameRing *ring, const char *name, uint32_t width, uint32_t height, uint32_t slotCount)
+{
+	memset(ring, 0, sizeof(*ring));
+	if (width == 0 || height == 0 || slotCount == 0 || slotCount > FRAMERING_MAX_SLOTS
+	    || strlen(name) > FRAMERING_MAX_NAME)
+		return 0;
+
+	uint32_t stride = width * 4;
+	size_t headerSize = FrameRingAlign(sizeof(FrameRingHeader));
+	size_t slotSize = FrameRingAlign(sizeof(FrameSlot) + (size_t)stride * height);
+	size_t size = headerSize + slotSize * slotCount;
+
+	FrameRingHeader *header = FrameRingMap(ring, name, size, 1);
+	if (!header)
+		return 0;
+
+	memset(header, 0, headerSize);
+	header->version = FRAMERING_VERSION;
+	header->format = FRAMERING_FORMAT_BGRX8888;
+	header->width = width;
+	header->height = height;
+	header->stride = stride;
+	header->slotCount = slotCount;
+	header->slotSize = (uint32_t)slotSize;
+	header->headerSize = (uint32_t)headerSize;
+	atomic_store_explicit(&header->writeSeq, 0, memory_order_relaxed);
+	atomic_store_explicit(&header->readSeq, 0, memory_order_relaxed);
+	atomic_store_explicit(&header->dropped, 0, memory_order_relaxed);
+	atomic_store_explicit(&header->producerAlive, 1, memory_order_relaxed);
+
+	/* Publishing the magic last lets consumers detect a half-initialized ring */
+	atomic_thread_fence(memory_order_release);
+	header->magic = FRAMERING_MAGIC;
+
+	ring->header = header;
+	ring->mappingSize = size;
+	ring->isProducer = 1;
+	return 1;
+}
+
+/* Consumer side: attach to an existing mapping and validate its header */
+static int FrameRingOpen(FrameRing *ring, const char *name)
+{
+	memset(ring, 0, sizeof(*ring));
+	if (strlen(name) > FRAMERING_MAX_NAME)
+		return 0;
+
+#ifdef _WIN32
+	/* Map the fixed header first to learn the full size */
+	FrameRingHeader *probe = FrameRingMap(ring, name, sizeof(FrameRingHeader), 0);
+	if (!probe)
+		return 0;
+	size_t size = 0;
+	if (probe->magic == FRAMERING_MAGIC)
+		size = (size_t)probe->headerSize + (size_t)probe->slotSize * probe->slotCount;
+	UnmapViewOfFile(probe);
+	CloseHandle(ring->mapping);
+	ring->mapping = NULL;
+	if (size == 0)
+		return 0;
+	FrameRingHeader *header = FrameRingMap(ring, name, size, 0);
+#else
+	FrameRingHeader *header = FrameRingMap(ring, name, 0, 0);
+	size_t size = ring->mappingSize;
+#endif
+	if (!header)
+		return 0;
+
+	ring->header = header;
+	ring->mappingSize = size;
+
+	atomic_thread_fence(memory_order_acquire);
+	if (header->magic != FRAMERING_MAGIC || header->version != FRAMERING_VERSION
+	    || header->format != FRAMERING_FORMAT_BGRX8888
+	    || size < (size_t)header->headerSize + (size_t)header->slotSize * header->slotCount) {
+		FrameRingClose(ring);
+		return 0;
+	}
+
+	/* Start with whatever the producer publishes next */
+	atomic_store_explicit(&header->readSeq,
+			      atomic_load_explicit(&header->writeSeq, memory_order_acquire), memory_order_release);
+	return 1;
+}
+
+static FrameSlot *FrameRingSlot(FrameRing *ring, uint64_t sequence)
+{
+	FrameRingHeader *header = ring->header;
+	return (FrameSlot *) ((uint8_t *) header + header->headerSize
+			      + (size_t)(sequence % header->slotCount) * header->slotSize);
+}
+
+static uint8_t *FrameRingPixels(FrameSlot *slot)
+{
+	return (uint8_t *) slot + sizeof(FrameSlot);
+}
+
+/* Producer: claim the next slot, or NULL (and count a drop) when the ring is full */
+static FrameSlot *FrameRingBeginWrite(FrameRing *ring)
+{
+	FrameRingHeader *header = ring->header;
+	uint64_t writeSeq = atomic_load_explicit(&header->writeSeq, memory_order_relaxed);
+	uint64_t readSeq = atomic_load_explicit(&header->readSeq, memory_order_acquire);
+
+	if (writeSeq - readSeq >= header->slotCount) {
+		atomic_fetch_add_explicit(&header->dropped, 1, memory_order_relaxed);
+		return NULL;
+	}
+
+	FrameSlot *slot = FrameRingSlot(ring, writeSeq);
+	slot->sequence = writeSeq;
+	return slot;
+}
+
+/* Producer: hand the slot claimed by FrameRingBeginWrite to the consumer */
+static void FrameRingPublish(FrameRing *ring)
+{
+	FrameRingHeader *header = ring->header;
+	uint64_t writeSeq = atomic_load_explicit(&header->writeSeq, memory_order_relaxed);
+	atomic_store_explicit(&header->writeSeq, writeSeq + 1, memory_order_release);
+}
+
+/* Consumer: oldest unreleased frame, or NULL when none is pending */
+static FrameSlot *FrameRingPeek(FrameRing *ring)
+{
+	FrameRingHeader *header = ring->header;
+	uint64_t readSeq = atomic_load_explicit(&header->readSeq, memory_order_relaxed);
+	uint64_t writeSeq = atomic_load_explicit(&header->writeSeq, memory_order_acquire);
+
+	if (readSeq == writeSeq)
+		return NULL;
+	return FrameRingSlot(ring, readSeq);
+}
+
+/* Consumer: skip all pending frames but the newest, returning how many were skipped */
+static uint64_t FrameRingSkipToLatest(FrameRing *ring)
+{
+	FrameRingHeader *header = ring->header;
+	uint64_t readSeq = atomic_load_explicit(&header->readSeq, memory_order_relaxed);
+	uint64_t writeSeq = atomic_load_explicit(&header->writeSeq, memory_order_acquire);
+
+	if (writeSeq - readSeq <= 1)
+		return 0;
+	atomic_store_explicit(&header->readSeq, writeSeq - 1, memory_order_release);
+	return writeSeq - 1 - readSeq;
+}
+
+/* Consumer: give the frame returned by FrameRingPeek back to the producer */
+static void FrameRingRelease(FrameRing *ring)
+{
+	FrameRingHeader *header = ring->header;
+	uint64_t readSeq = atomic_load_explicit(&header->readSeq, memory_order_relaxed);
+	atomic_store_explicit(&header->readSeq, readSeq + 1, memory_order_release);
+}
+
+#endif
@@ -1,19 +1,58 @@
-/* renderer.c - Marquee Layout Renderer for Windows with TPF and PM support */
+/* renderer.c - Marquee Layout Renderer for Windows with TPF and PM support
+ *
+ * Frames are produced on a render thread a few frames ahead of their deadline
+ * and handed to the UI thread through a bounded lock-free queue; the UI thread
+ * only presents frames and handles input.
+ *
+ * Usage: renderer.exe [--headless] [--ring] [--ring-name NAME] [--ring-slots N]
+ *                     [--sync EPOCH] [--values FILE] [--software]
+ *                     [--playlist LIST | --ticker SOURCE [file.mly] | file.mly]
+ *   --headless     Do not show a window; requires a layout file
+ *   --ring         Publish every frame to the shared-memory frame ring (see framering.h)
+ *   --sync EPOCH   Play as if the loop had been running since EPOCH (seconds since
+ *                  1970, UTC) by the system clock, so every instance given the same
+ *                  EPOCH and layout shows the same frame at the same time
+ *   --playlist LIST  Play the layouts listed in LIST in turn (see LoadPlaylist)
+ *   --ticker SOURCE  Show segments as they arrive on SOURCE: - for standard input,
+ *                  \\.\pipe\NAME for a named pipe, or a file. file.mly, if given,
+ *                  supplies the header.
+ *   --ticker-policy block|drop-oldest  What to do when input outruns the display
+ *   --values FILE  KEY=VALUE lines for {{kv:KEY}} placeholders (see FormatField)
+ *   --software     Draw text by compositing glyph coverage masks (blend.h) instead
+ *                  of with TextOut
+ */
 #include <windows.h>
 #include <commdlg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <wchar.h>
+#include <wctype.h>
+#include <time.h>
+#include <shellapi.h>
 
 #define RENDERER
 #include "../rc/resource.h"
+#include "framering.h"
+#include "blend.h"
+#include "cellwidth.h"
 
 #define MAX_SEGMENTS 10
 #define MAX_LINES_PER_SEGMENT 50
-#define MAX_COLORED_TEXTS_PER_LINE 20
-#define MAX_TEXT_LENGTH 1000
+#define MAX_VALUE_LENGTH 1000	/* Longest placeholder value */
 #define MAX_NESTING_DEPTH 255
+#define MAX_FIELD_LENGTH 64	/* Placeholder spec between {{ and }} */
+#define TILE_WIDTH 256		/* Width of one pre-rasterized tile, px */
+#define TILES_AHEAD 2		/* Tiles kept per line beyond the visible ones */
+#define FRAME_QUEUE_SIZE 4	/* Frames the render thread may run ahead, plus the one on screen */
+#define FONT_CACHE_SIZE 8
+#define FONT_WIDTH_PAGES 256	/* Pages of 256 characters covering the BMP */
+#define MARQUEE_FONT L"MingLiU"
+#define MARQUEE_FALLBACK_FONT L"Courier New"
+#define WM_APP_SWAPLAYOUT (WM_APP + 1)	/* Next playlist layout needs a new frame size or TPF */
+#define TICKER_QUEUE_SIZE 16	/* Parsed ticker segments waiting to be shown */
+#define TICKER_READ_SIZE 4096
+#define SYNC_MAX_SKEW 1000	/* ms off the system clock before --sync jumps instead of slewing */
 
 typedef struct {
 	int linesPerScreen;
@@ -29,77 +68,761 @@ typedef struct {
 } MarqueeConfig;
 
 typedef struct {
-	wchar_t text[MAX_TEXT_LENGTH];
+	wchar_t *text;		/* Grows as the line is parsed; NULL while empty */
+	int length;		/* Characters in text, excluding the terminator */
+	int capacity;
 	COLORREF color;
+	wchar_t field[MAX_FIELD_LENGTH];	/* Placeholder whose value text holds; empty for plain text */
+	int cellWidth;		/* Every character is this wide, px; 0 if they differ */
+	int *charX;		/* Start x of each character from the run's start, length + 1
+				 * entries, for clipping to a tile; unused while cellWidth is set */
 } ColoredText;
 
 typedef struct {
-	ColoredText texts[MAX_COLORED_TEXTS_PER_LINE];
+	ColoredText *texts;	/* Grows as the line is parsed; NULL while empty */
 	int textCount;
+	int textCapacity;
+	int fieldCount;		/* Runs that are placeholders */
+	int *runX;		/* Start x of each run, textCapacity + 1 entries; runX[textCount] is the width */
+	int width;
 } TextLine;
 
 typedef struct {
 	TextLine lines[MAX_LINES_PER_SEGMENT];
 	int lineCount;
+	int width;		/* Widest line, px */
 } TextSegment;
 
+/* A TILE_WIDTH x lineHeight slice of one line, rasterized into the tile atlas */
+typedef struct {
+	int segment;		/* -1 when the slot is free */
+	int line;
+	int tile;		/* Covers line x in [tile * TILE_WIDTH, (tile + 1) * TILE_WIDTH) */
+	unsigned lastUsed;
+} TileSlot;
+
+/* Coverage mask of one character, for --software */
+typedef struct {
+	uint8_t *mask;		/* width x height, 0-255; NULL for blank characters */
+	short width;
+	short height;
+	short left;		/* Offset of the mask from the pen position, px */
+	short top;		/* Offset of the mask from the top of the line, px */
+	BOOL loaded;
+} CachedGlyph;
+
+/* A realized font and its advance widths, shared by every layout of the same face and size */
+typedef struct {
+	wchar_t face[LF_FACESIZE];	/* Face asked for; empty when the slot is free */
+	int height;		/* Character height, px */
+	HFONT font;
+	wchar_t realFace[LF_FACESIZE];	/* Face GDI picked, after the fallback */
+	TEXTMETRICW metrics;
+	int advance;		/* Width of one cell, px */
+	BOOL monospace;		/* Widths are cells * advance; checked when created */
+	short *widths[FONT_WIDTH_PAGES];	/* Filled a page at a time on first use */
+	CachedGlyph *glyphs[FONT_WIDTH_PAGES];	/* --software; allocated a page at a time */
+	int refs;
+	unsigned lastUsed;
+} CachedFont;
+
+typedef struct {
+	CachedFont entries[FONT_CACHE_SIZE];
+	HDC dc;			/* Screen-compatible DC for resolving and measuring */
+	unsigned clock;
+	CRITICAL_SECTION lock;	/* The playlist loader measures on its own thread */
+} FontCache;
+
+/* One pre-rendered frame waiting for (or on) the screen */
+typedef struct {
+	HDC dc;
+	HBITMAP bitmap;
+	HBITMAP oldBitmap;
+	BYTE *pixels;		/* 32bpp top-down DIB bits */
+	ULONGLONG due;		/* GetTickCount64() time at which to present */
+	int segment;
+	LONGLONG arrived;	/* First frame of a ticker segment: when it was read (QPC), else 0 */
+	BOOL scrolling;		/* Lines drawn at scroll, not centered */
+	int scroll;
+} QueuedFrame;
+
+/* One loaded layout file with its font and tiles. A playlist keeps the one on
+ * screen and the next one; only the render thread swaps them while playing. */
 typedef struct {
-	HWND hwnd;
 	MarqueeConfig config;
 	TextSegment segments[MAX_SEGMENTS];
 	int segmentCount;
+	HFONT font;		/* cachedFont->font */
+	CachedFont *cachedFont;
+
+	/* Tile cache, owned by whichever thread renders. Slot i is the band
+	 * [i * tileHeight, (i + 1) * tileHeight) of the atlas. */
+	HDC tileDC;
+	HBITMAP tileBitmap;
+	HBITMAP tileOldBitmap;
+	uint8_t *tileBits;	/* 32bpp top-down, TILE_WIDTH wide */
+	TileSlot *tiles;
+	int tileCount;
+	int tileHeight;
+	unsigned tileClock;
+
+	/* Loop timeline: segment i comes in at loop frame loopStart[i], and
+	 * loopStart[segmentCount] is the loop length */
+	ULONGLONG loopStart[MAX_SEGMENTS + 1];
+	int entry;		/* Playlist entry it was loaded from, -1 if none */
+} MarqueeLayout;
+
+typedef struct {
+	HWND hwnd;
+	MarqueeLayout *layout;
 	int currentScreen;
 	BOOL isRunning;
 	int scrollPosition;
-	DWORD lastUpdate;
-	HFONT font;
 	BOOL isCurrentScreenCentered;	/* Track if current screen should be centered */
-	DWORD centerStartTime;	/* When centered display started */
+	int holdFrames;		/* Frames left to hold the current picture (CD or SD) */
+
+	/* Bounded SPSC queue of frames, screenWidth x screenHeight each. The render
+	 * thread owns frameWrite, the UI thread owns frameRead. While hasPresented,
+	 * frames[frameRead % FRAME_QUEUE_SIZE] is the one on screen. */
+	QueuedFrame frames[FRAME_QUEUE_SIZE];
+	int frameWidth;
+	int frameHeight;
+
+	_Atomic unsigned long frameWrite;
+	_Atomic unsigned long frameRead;
+	BOOL hasPresented;
+
+	/* Render thread, producing frames on a fixed TPF cadence from showStart */
+	HANDLE renderThread;
+	HANDLE frameFreed;	/* Auto-reset, set when the presenter retires a frame */
+	_Atomic int stopRequested;
+	ULONGLONG showStart;
+	ULONGLONG frameNumber;	/* Next frame the render thread will produce */
+	LONGLONG syncFrame;	/* --sync: frameNumber 0 is this frame since the epoch */
+	time_t fieldTime;	/* Second and segment key the placeholders on screen */
+	int fieldKey;		/* were last brought up to date for */
+
+	/* Optional shared-memory output for external display drivers */
+	BOOL ringEnabled;
+	char ringName[FRAMERING_MAX_NAME + 1];
+	FrameRing ring;
+	BOOL ringScrolling;	/* Scroll state of the last published frame, */
+	int ringScroll;		/* for the shift hint delta encoders use */
+	int ringSegment;
 } MarqueeRenderer;
 
+/* One line of a --playlist file */
+typedef struct {
+	wchar_t *path;
+	int loops;		/* Loops to play, when duration is 0 */
+	ULONGLONG duration;	/* ms to play, rounded up to a whole loop */
+} PlaylistEntry;
+
+/* The render thread takes next at a loop boundary and leaves the layout it
+ * replaced in retired; the loader thread frees that and loads the entry after
+ * next, so no more than two layouts are ever loaded. */
+typedef struct {
+	PlaylistEntry *entries;
+	int count;
+	int loaded;		/* Loader: last entry it loaded */
+	MarqueeLayout *_Atomic next;
+	MarqueeLayout *_Atomic retired;
+	HANDLE loader;
+	HANDLE wake;		/* Auto-reset, set when retired is filled or on stop */
+	_Atomic int stop;
+
+	/* Render thread */
+	int loopsPlayed;	/* Loops of the playing entry so far */
+	ULONGLONG entryFrame;	/* frameNumber at which the playing entry came on */
+	_Atomic int swapPosted;	/* WM_APP_SWAPLAYOUT is on its way */
+} Playlist;
+
+/* A segment read by the ticker, with when its END line was read */
+typedef struct {
+	TextSegment segment;
+	LONGLONG arrived;	/* QueryPerformanceCounter */
+} TickerSegment;
+
+/* Ticker mode: the reader thread parses segments from the input into a
+ * bounded lock-free queue and the render thread shows them in order. read is
+ * advanced by compare-and-swap, so with drop-oldest the reader can discard the
+ * oldest segment itself. */
+typedef struct {
+	BOOL active;
+	BOOL dropOldest;
+	TickerSegment *_Atomic slots[TICKER_QUEUE_SIZE];
+	_Atomic unsigned long write;
+	_Atomic unsigned long read;
+	_Atomic unsigned long dropped;
+	HANDLE reader;
+	HANDLE arrived;		/* Auto-reset, set after a push */
+	HANDLE spaceFreed;	/* Auto-reset, set after a pop */
+	_Atomic int stop;
+	const wchar_t *source;
+	CachedFont *font;	/* Of the layout playing, for measuring */
+
+	/* Render thread */
+	TickerSegment *current;	/* On screen, NULL while waiting for input */
+	unsigned shown;		/* Segments taken so far; the tile key of current */
+	BOOL stamped;		/* A frame of current carries its arrival time */
+	BOOL blankShown;	/* Idle and the screen is already blank */
+
+	/* UI thread: read to first presented frame, ms */
+	LONGLONG frequency;
+	double lastLatency;
+	double maxLatency;
+	double totalLatency;
+	unsigned long measured;
+} Ticker;
+
+/* The --values file, reread when it changes */
+typedef struct {
+	CRITICAL_SECTION lock;	/* Loads and the ticker reader fill fields on their own threads */
+	wchar_t *text;		/* Whole file, NULL if unreadable */
+	FILETIME written;
+	ULONGLONG checked;	/* GetTickCount64() of the last look at the file */
+} FieldValues;
+
 MarqueeRenderer *g_renderer = NULL;
+FontCache g_fontCache;
+FieldValues g_values;
+Playlist g_playlist;
+Ticker g_ticker;
+
+/* Command line options, applied once the renderer exists */
+BOOL g_optHeadless = FALSE;
+BOOL g_optSoftware = FALSE;
+BlendRowFunction g_blendRow = BlendCoverageScalar;
+BOOL g_optRing = FALSE;
+wchar_t g_optRingName[FRAMERING_MAX_NAME + 1] = L"" FRAMERING_DEFAULT_NAME;
+int g_optRingSlots = FRAMERING_DEFAULT_SLOTS;
+BOOL g_optSync = FALSE;
+ULONGLONG g_optSyncEpoch = 0;	/* ms since 1970 */
+wchar_t *g_optPlaylist = NULL;
+wchar_t *g_optTicker = NULL;
+wchar_t *g_optValues = NULL;
+BOOL g_optTickerDropOldest = FALSE;
+
+void FreeCachedFont(CachedFont *entry)
+{
+	if (entry->font)
+		DeleteObject(entry->font);
+	for (int p = 0; p < FONT_WIDTH_PAGES; p++) {
+		free(entry->widths[p]);
+		for (int g = 0; entry->glyphs[p] && g < 256; g++)
+			free(entry->glyphs[p][g].mask);
+		free(entry->glyphs[p]);
+	}
+	memset(entry, 0, sizeof(*entry));
+}
 
-void InitRenderer(MarqueeRenderer *renderer, HWND hwnd)
+/*
+ * Return the font for face at height px, creating it on first use. GDI
+ * quietly substitutes a missing face instead of failing, so the face it
+ * picked is checked once here and fallback used when it is not face.
+ * Called by AcquireFont with the cache locked; release with ReleaseFont.
+ */
+CachedFont *LookupFont(const wchar_t *face, const wchar_t *fallback, int height)
 {
-	renderer->hwnd = hwnd;
-	renderer->config.linesPerScreen = 2;
-	renderer->config.screenWidth = 600;
-	renderer->config.screenHeight = 80;
-	renderer->config.screenCount = 2;
-	renderer->config.screenDelay = 500;
-	renderer->config.centerDelay = 1500;
+	FontCache *cache = &g_fontCache;
+	CachedFont *slot = NULL;
+
+	cache->clock++;
+	for (int i = 0; i < FONT_CACHE_SIZE; i++) {
+		CachedFont *entry = &cache->entries[i];
+		if (entry->font && entry->height == height && wcscmp(entry->face, face) == 0) {
+			entry->refs++;
+			entry->lastUsed = cache->clock;
+			return entry;
+		}
+		/* Free slots first, then the least recently used unreferenced font */
+		if (entry->refs == 0 && (!slot || !entry->font ||
+					 (slot->font && entry->lastUsed < slot->lastUsed)))
+			slot = entry;
+	}
+	if (!slot)
+		return NULL;
+
+	if (!cache->dc)
+		cache->dc = CreateCompatibleDC(NULL);
+	if (!cache->dc)
+		return NULL;
+
+	HFONT font = CreateFontW(-height, 0, 0, 0, FW_NORMAL, FALSE, FALSE, FALSE,
+				 DEFAULT_CHARSET, OUT_DEFAULT_PRECIS,
+				 CLIP_DEFAULT_PRECIS, DEFAULT_QUALITY,
+				 FIXED_PITCH | FF_MODERN, face);
+	wchar_t realFace[LF_FACESIZE] = L"";
+	if (font) {
+		HGDIOBJ old = SelectObject(cache->dc, font);
+		GetTextFaceW(cache->dc, LF_FACESIZE, realFace);
+		SelectObject(cache->dc, old);
+	}
+	if ((!font || _wcsicmp(realFace, face) != 0) && fallback) {
+		HFONT other = CreateFontW(-height, 0, 0, 0, FW_NORMAL, FALSE, FALSE, FALSE,
+					  DEFAULT_CHARSET, OUT_DEFAULT_PRECIS,
+					  CLIP_DEFAULT_PRECIS, DEFAULT_QUALITY,
+					  FIXED_PITCH | FF_MODERN, fallback);
+		if (other) {
+			if (font)
+				DeleteObject(font);
+			font = other;
+		}
+	}
+	if (!font)
+		return NULL;
+
+	FreeCachedFont(slot);
+	wcsncpy(slot->face, face, LF_FACESIZE - 1);
+	slot->height = height;
+	slot->font = font;
+	HGDIOBJ old = SelectObject(cache->dc, font);
+	GetTextFaceW(cache->dc, LF_FACESIZE, slot->realFace);
+	GetTextMetricsW(cache->dc, &slot->metrics);
+
+	/* The monospace shortcut holds if a narrow and a wide glyph are one and two
+	 * cells; TMPF_FIXED_PITCH set means variable pitch */
+	INT narrow = 0, wide = 0;
+	GetCharWidth32W(cache->dc, L'M', L'M', &narrow);
+	GetCharWidth32W(cache->dc, 0x4E2D, 0x4E2D, &wide);
+	slot->advance = narrow;
+	slot->monospace = !(slot->metrics.tmPitchAndFamily & TMPF_FIXED_PITCH)
+	    && narrow > 0 && wide == 2 * narrow;
+	SelectObject(cache->dc, old);
+	slot->refs = 1;
+	slot->lastUsed = cache->clock;
+	return slot;
+}
+
+CachedFont *AcquireFont(const wchar_t *face, const wchar_t *fallback, int height)
+{
+	EnterCriticalSection(&g_fontCache.lock);
+	CachedFont *entry = LookupFont(face, fallback, height);
+	LeaveCriticalSection(&g_fontCache.lock);
+	return entry;
+}
+
+void ReleaseFont(CachedFont *entry)
+{
+	EnterCriticalSection(&g_fontCache.lock);
+	if (entry && entry->refs > 0)
+		entry->refs--;
+	LeaveCriticalSection(&g_fontCache.lock);
+}
+
+void InitFontCache()
+{
+	InitializeCriticalSection(&g_fontCache.lock);
+}
+
+void DestroyFontCache()
+{
+	for (int i = 0; i < FONT_CACHE_SIZE; i++)
+		FreeCachedFont(&g_fontCache.entries[i]);
+	if (g_fontCache.dc)
+		DeleteDC(g_fontCache.dc);
+	g_fontCache.dc = NULL;
+	DeleteCriticalSection(&g_fontCache.lock);
+}
+
+/* Width of text in px from the cached advance widths. Call with the font cache
+ * locked. */
+int CachedTextWidth(CachedFont *entry, const wchar_t *text, int length)
+{
+	HDC dc = g_fontCache.dc;
+	int width = 0;
+
+	for (int i = 0; i < length; i++) {
+		wchar_t c = text[i];
+		if (c >= 0xD800 && c <= 0xDFFF) {
+			/* Surrogate pairs have no per-unit width; measure the run */
+			SIZE size = { 0, 0 };
+			HGDIOBJ old = SelectObject(dc, entry->font);
+			GetTextExtentPoint32W(dc, text, length, &size);
+			SelectObject(dc, old);
+			return size.cx;
+		}
+
+		short *page = entry->widths[c >> 8];
+		if (!page) {
+			INT widths[256];
+			page = malloc(256 * sizeof(short));
+			if (!page)
+				return width;
+			HGDIOBJ old = SelectObject(dc, entry->font);
+			if (!GetCharWidth32W(dc, c & 0xFF00, (c & 0xFF00) + 255, widths))
+				memset(widths, 0, sizeof(widths));
+			SelectObject(dc, old);
+			for (int w = 0; w < 256; w++)
+				page[w] = (short)widths[w];
+			entry->widths[c >> 8] = page;
+		}
+		width += page[c & 0xFF];
+	}
+	return width;
+}
+
+/* Coverage mask of c, rasterized with GGO_GRAY8_BITMAP on first use. Call with
+ * the font cache locked. */
+CachedGlyph *GetCachedGlyph(CachedFont *entry, wchar_t c)
+{
+	CachedGlyph *page = entry->glyphs[c >> 8];
+	if (!page) {
+		page = calloc(256, sizeof(CachedGlyph));
+		if (!page)
+			return NULL;
+		entry->glyphs[c >> 8] = page;
+	}
+
+	CachedGlyph *glyph = &page[c & 0xFF];
+	if (glyph->loaded)
+		return glyph;
+	glyph->loaded = TRUE;
+
+	static const MAT2 identity = { {0, 1}, {0, 0}, {0, 0}, {0, 1} };
+	GLYPHMETRICS gm;
+	HDC dc = g_fontCache.dc;
+	HGDIOBJ old = SelectObject(dc, entry->font);
+	DWORD size = GetGlyphOutlineW(dc, c, GGO_GRAY8_BITMAP, &gm, 0, NULL, &identity);
+	BYTE *bits = size != GDI_ERROR && size > 0 ? malloc(size) : NULL;
+	if (bits && GetGlyphOutlineW(dc, c, GGO_GRAY8_BITMAP, &gm, size, bits,
+				     &identity) == GDI_ERROR) {
+		free(bits);
+		bits = NULL;
+	}
+	SelectObject(dc, old);
+	if (!bits)
+		return glyph;	/* Blank, like a space */
+
+	/* Rows are DWORD aligned, levels 0-64 */
+	int width = (int)gm.gmBlackBoxX;
+	int height = (int)gm.gmBlackBoxY;
+	int pitch = (width + 3) & ~3;
+	glyph->mask = malloc((size_t)width * height);
+	if (glyph->mask) {
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
+				unsigned level = bits[y * pitch + x];
+				glyph->mask[y * width + x] =
+				    (uint8_t)((level > 64 ? 64 : level) * 255 / 64);
+			}
+		}
+		glyph->width = (short)width;
+		glyph->height = (short)height;
+		glyph->left = (short)gm.gmptGlyphOrigin.x;
+		glyph->top = (short)(entry->metrics.tmAscent - gm.gmptGlyphOrigin.y);
+	}
+	free(bits);
+	return glyph;
+}
+
+/* An empty layout with the renderer's defaults, for a file to fill in */
+MarqueeLayout *CreateLayout()
+{
+	MarqueeLayout *layout = calloc(1, sizeof(MarqueeLayout));
+	if (!layout)
+		return NULL;
+
+	layout->config.linesPerScreen = 2;
+	layout->config.screenWidth = 600;
+	layout->config.screenHeight = 80;
+	layout->config.screenCount = 2;
+	layout->config.screenDelay = 500;
+	layout->config.centerDelay = 1500;
 
 	/* Set default values for optional flags */
-	renderer->config.timePerFrame = 50;	/* Default TPF: 50ms per frame */
-	renderer->config.pixelsPerFrame = 3;	/* Default PM: 3 pixels per frame */
+	layout->config.timePerFrame = 50;	/* Default TPF: 50ms per frame */
+	layout->config.pixelsPerFrame = 3;	/* Default PM: 3 pixels per frame */
+
+	layout->cachedFont = AcquireFont(MARQUEE_FONT, MARQUEE_FALLBACK_FONT, 16);
+	layout->font = layout->cachedFont ? layout->cachedFont->font : NULL;
+	layout->entry = -1;
+	return layout;
+}
 
-	renderer->segmentCount = 0;
+void InitRenderer(MarqueeRenderer *renderer, HWND hwnd)
+{
+	renderer->hwnd = hwnd;
+	renderer->layout = CreateLayout();
 	renderer->currentScreen = 0;
 	renderer->isRunning = FALSE;
 	renderer->scrollPosition = 0;
-	renderer->lastUpdate = 0;
 	renderer->isCurrentScreenCentered = FALSE;
-	renderer->centerStartTime = 0;
+	renderer->holdFrames = 0;
+
+	memset(renderer->frames, 0, sizeof(renderer->frames));
+	renderer->frameWidth = 0;
+	renderer->frameHeight = 0;
+
+	atomic_init(&renderer->frameWrite, 0);
+	atomic_init(&renderer->frameRead, 0);
+	renderer->hasPresented = FALSE;
+
+	renderer->renderThread = NULL;
+	renderer->frameFreed = CreateEventW(NULL, FALSE, FALSE, NULL);
+	atomic_init(&renderer->stopRequested, 0);
+	renderer->showStart = 0;
+	renderer->fieldTime = 0;
+	renderer->fieldKey = -1;
+	renderer->frameNumber = 0;
+
+	renderer->ringEnabled = FALSE;
+	renderer->ringName[0] = 0;
+	memset(&renderer->ring, 0, sizeof(renderer->ring));
+	renderer->ringScrolling = FALSE;
+}
+
+void DestroyFrameQueue(MarqueeRenderer *renderer)
+{
+	for (int i = 0; i < FRAME_QUEUE_SIZE; i++) {
+		QueuedFrame *frame = &renderer->frames[i];
+		if (frame->dc) {
+			SelectObject(frame->dc, frame->oldBitmap);
+			DeleteDC(frame->dc);
+		}
+		if (frame->bitmap) {
+			DeleteObject(frame->bitmap);
+		}
+		memset(frame, 0, sizeof(*frame));
+	}
+	renderer->frameWidth = 0;
+	renderer->frameHeight = 0;
+	atomic_store(&renderer->frameWrite, 0);
+	atomic_store(&renderer->frameRead, 0);
+	renderer->hasPresented = FALSE;
+}
+
+/* (Re)create the frame queue to match the configured screen size.
+ * Only call while the render thread is stopped. */
+BOOL CreateFrameQueue(MarqueeRenderer *renderer)
+{
+	int width = renderer->layout->config.screenWidth;
+	int height = renderer->layout->config.screenHeight;
+
+	if (renderer->frames[0].dc && renderer->frameWidth == width
+	    && renderer->frameHeight == height) {
+		return TRUE;
+	}
+	DestroyFrameQueue(renderer);
+	if (width <= 0 || height <= 0)
+		return FALSE;
+
+	BITMAPINFO bmi;
+	memset(&bmi, 0, sizeof(bmi));
+	bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+	bmi.bmiHeader.biWidth = width;
+	bmi.bmiHeader.biHeight = -height;	/* Top-down, like the frame ring */
+	bmi.bmiHeader.biPlanes = 1;
+	bmi.bmiHeader.biBitCount = 32;
+	bmi.bmiHeader.biCompression = BI_RGB;
+
+	HDC hdc = GetDC(renderer->hwnd);
+	for (int i = 0; i < FRAME_QUEUE_SIZE; i++) {
+		QueuedFrame *frame = &renderer->frames[i];
+		void *bits = NULL;
+
+		frame->dc = CreateCompatibleDC(hdc);
+		if (frame->dc) {
+			frame->bitmap =
+			    CreateDIBSection(frame->dc, &bmi, DIB_RGB_COLORS,
+					     &bits, NULL, 0);
+		}
+		if (!frame->bitmap) {
+			ReleaseDC(renderer->hwnd, hdc);
+			DestroyFrameQueue(renderer);
+			return FALSE;
+		}
+		frame->oldBitmap = SelectObject(frame->dc, frame->bitmap);
+		frame->pixels = bits;
+	}
+	ReleaseDC(renderer->hwnd, hdc);
+
+	renderer->frameWidth = width;
+	renderer->frameHeight = height;
+	return TRUE;
+}
+
+void DestroyTileCache(MarqueeLayout *layout)
+{
+	if (layout->tileDC) {
+		SelectObject(layout->tileDC, layout->tileOldBitmap);
+		DeleteDC(layout->tileDC);
+	}
+	if (layout->tileBitmap) {
+		DeleteObject(layout->tileBitmap);
+	}
+	free(layout->tiles);
+	layout->tileDC = NULL;
+	layout->tileBitmap = NULL;
+	layout->tileOldBitmap = NULL;
+	layout->tileBits = NULL;
+	layout->tiles = NULL;
+	layout->tileCount = 0;
+	layout->tileHeight = 0;
+}
+
+/* Size the atlas for the visible tiles of every line plus TILES_AHEAD each,
+ * so memory depends on the screen size only, never on segment length */
+BOOL CreateTileCache(MarqueeLayout *layout)
+{
+	DestroyTileCache(layout);
+
+	int lineHeight =
+	    layout->config.screenHeight / layout->config.linesPerScreen;
+	int count = layout->config.linesPerScreen *
+	    ((layout->config.screenWidth + TILE_WIDTH - 1) / TILE_WIDTH + 1 +
+	     TILES_AHEAD);
+	if (lineHeight <= 0 || count <= 0)
+		return FALSE;
+
+	layout->tiles = calloc(count, sizeof(TileSlot));
+	if (!layout->tiles)
+		return FALSE;
+
+	BITMAPINFO bmi;
+	memset(&bmi, 0, sizeof(bmi));
+	bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+	bmi.bmiHeader.biWidth = TILE_WIDTH;
+	bmi.bmiHeader.biHeight = -(lineHeight * count);
+	bmi.bmiHeader.biPlanes = 1;
+	bmi.bmiHeader.biBitCount = 32;
+	bmi.bmiHeader.biCompression = BI_RGB;
+
+	void *bits = NULL;
+	layout->tileDC = CreateCompatibleDC(NULL);
+	if (layout->tileDC) {
+		layout->tileBitmap =
+		    CreateDIBSection(layout->tileDC, &bmi, DIB_RGB_COLORS,
+				     &bits, NULL, 0);
+	}
+	if (!layout->tileBitmap) {
+		DestroyTileCache(layout);
+		return FALSE;
+	}
+	layout->tileBits = bits;
+	layout->tileOldBitmap =
+	    SelectObject(layout->tileDC, layout->tileBitmap);
+	SelectObject(layout->tileDC, layout->font);
+	SetBkMode(layout->tileDC, TRANSPARENT);
+
+	for (int i = 0; i < count; i++) {
+		layout->tiles[i].segment = -1;
+	}
+	layout->tileCount = count;
+	layout->tileHeight = lineHeight;
+	layout->tileClock = 0;
+	return TRUE;
+}
+
+/* Free the runs of a segment; the segment itself is not freed */
+void FreeSegmentText(TextSegment *segment)
+{
+	for (int l = 0; l < segment->lineCount; l++) {
+		TextLine *line = &segment->lines[l];
+		for (int t = 0; t < line->textCapacity; t++) {
+			free(line->texts[t].text);
+			free(line->texts[t].charX);
+		}
+		free(line->texts);
+		free(line->runX);
+		line->texts = NULL;
+		line->runX = NULL;
+		line->textCount = line->textCapacity = 0;
+	}
+}
+
+void DestroyLayout(MarqueeLayout *layout)
+{
+	if (!layout)
+		return;
+	for (int s = 0; s < layout->segmentCount; s++)
+		FreeSegmentText(&layout->segments[s]);
+	DestroyTileCache(layout);
+	ReleaseFont(layout->cachedFont);
+	free(layout);
+}
+
+void FreeTickerSegment(TickerSegment *segment)
+{
+	if (!segment)
+		return;
+	FreeSegmentText(&segment->segment);
+	free(segment);
+}
+
+/* Start publishing frames to a shared-memory ring. The ring keeps the size of
+ * the first layout; later layouts of another size are clipped or padded. */
+BOOL EnableFrameRing(MarqueeRenderer *renderer, const wchar_t *name, int slots)
+{
+	if (renderer->ringEnabled)
+		return TRUE;
+
+	WideCharToMultiByte(CP_ACP, 0, name, -1, renderer->ringName,
+			    sizeof(renderer->ringName), NULL, NULL);
+	renderer->ringName[sizeof(renderer->ringName) - 1] = 0;
+
+	if (!FrameRingCreate(&renderer->ring, renderer->ringName,
+			     (uint32_t) renderer->layout->config.screenWidth,
+			     (uint32_t) renderer->layout->config.screenHeight,
+			     (uint32_t) slots)) {
+		return FALSE;
+	}
+	renderer->ringEnabled = TRUE;
+	return TRUE;
+}
 
-	renderer->font =
-	    CreateFontW(-16, 0, 0, 0, FW_NORMAL, FALSE, FALSE, FALSE,
-			DEFAULT_CHARSET, OUT_DEFAULT_PRECIS,
-			CLIP_DEFAULT_PRECIS, DEFAULT_QUALITY,
-			FIXED_PITCH | FF_MODERN, L"MingLiU");
-	if (!renderer->font) {
-		renderer->font =
-		    CreateFontW(-16, 0, 0, 0, FW_NORMAL, FALSE, FALSE, FALSE,
-				DEFAULT_CHARSET, OUT_DEFAULT_PRECIS,
-				CLIP_DEFAULT_PRECIS, DEFAULT_QUALITY,
-				FIXED_PITCH | FF_MODERN, L"Courier New");
+void PublishFrame(MarqueeRenderer *renderer, QueuedFrame *frame)
+{
+	FrameSlot *slot = FrameRingBeginWrite(&renderer->ring);
+	if (!slot)
+		return;		/* Consumer is behind, frame dropped */
+
+	FrameRingHeader *header = renderer->ring.header;
+	BYTE *dst = FrameRingPixels(slot);
+	int rows = renderer->frameHeight < (int)header->height ?
+	    renderer->frameHeight : (int)header->height;
+	int rowBytes = renderer->frameWidth * 4 < (int)header->stride ?
+	    renderer->frameWidth * 4 : (int)header->stride;
+
+	for (int y = 0; y < rows; y++) {
+		BYTE *row = dst + (size_t)y * header->stride;
+		memcpy(row, frame->pixels +
+		       (size_t)y * renderer->frameWidth * 4, rowBytes);
+		if (rowBytes < (int)header->stride)
+			memset(row + rowBytes, 0, header->stride - rowBytes);
 	}
+	for (int y = rows; y < (int)header->height; y++) {
+		memset(dst + (size_t)y * header->stride, 0, header->stride);
+	}
+
+	/* Same segment scrolled further left: the picture moved by the difference */
+	slot->timestampMs = GetTickCount64();
+	slot->dueMs = frame->due;
+	slot->segment = (uint32_t) frame->segment;
+	slot->shift = 0;
+	if (frame->scrolling && renderer->ringScrolling
+	    && frame->segment == renderer->ringSegment
+	    && frame->scroll < renderer->ringScroll)
+		slot->shift = (uint32_t)(renderer->ringScroll - frame->scroll);
+	FrameRingPublish(&renderer->ring);
+
+	renderer->ringScrolling = frame->scrolling;
+	renderer->ringScroll = frame->scroll;
+	renderer->ringSegment = frame->segment;
 }
 
 void CleanupRenderer(MarqueeRenderer *renderer)
 {
-	if (renderer->font) {
-		DeleteObject(renderer->font);
+	if (renderer->ringEnabled) {
+		FrameRingClose(&renderer->ring);
+		renderer->ringEnabled = FALSE;
 	}
+	DestroyFrameQueue(renderer);
+	if (renderer->frameFreed) {
+		CloseHandle(renderer->frameFreed);
+	}
+	DestroyLayout(renderer->layout);
+	renderer->layout = NULL;
 }
 
 COLORREF ParseHexColor(const wchar_t *colorStr)
@@ -161,12 +884,125 @@ BOOL IsStackEmpty(BacktickStack *stack)
 	return stack->depth == 0;
 }
 
+/* Make room for length characters and the terminator in run->text. Doubling
+ * keeps parsing linear in the line length. FALSE if out of memory. */
+BOOL GrowRun(ColoredText *run, int length)
+{
+	if (length < run->capacity)
+		return TRUE;
+
+	int capacity = run->capacity ? run->capacity : 16;
+	while (capacity <= length)
+		capacity *= 2;
+	wchar_t *text = realloc(run->text, capacity * sizeof(wchar_t));
+	if (!text)
+		return FALSE;
+	run->text = text;
+	run->capacity = capacity;
+	return TRUE;
+}
+
+/* Replace the text of a run */
+void SetRunText(ColoredText *run, const wchar_t *text)
+{
+	int length = (int)wcslen(text);
+	if (!GrowRun(run, length))
+		return;
+	wmemcpy(run->text, text, length + 1);
+	run->length = length;
+}
+
+/* Make room for one more run on textLine. Doubling keeps parsing linear in
+ * the number of color changes. FALSE if out of memory. */
+BOOL GrowLineRuns(TextLine *textLine)
+{
+	if (textLine->textCount < textLine->textCapacity)
+		return TRUE;
+
+	int capacity = textLine->textCapacity ? textLine->textCapacity * 2 : 4;
+	ColoredText *texts = realloc(textLine->texts, capacity * sizeof(ColoredText));
+	if (!texts)
+		return FALSE;
+	memset(texts + textLine->textCapacity, 0,
+	       (capacity - textLine->textCapacity) * sizeof(ColoredText));
+	textLine->texts = texts;
+
+	int *runX = realloc(textLine->runX, (capacity + 1) * sizeof(int));
+	if (!runX)
+		return FALSE;
+	textLine->runX = runX;
+	textLine->textCapacity = capacity;
+	return TRUE;
+}
+
+/* Append one character in the given color. Adjacent characters of the same
+ * color share a run and empty runs are never created, so the run count
+ * reflects real color changes rather than markup structure. */
+void AppendColoredChar(TextLine *textLine, wchar_t c, COLORREF color)
+{
+	ColoredText *run = NULL;
+	if (textLine->textCount > 0)
+		run = &textLine->texts[textLine->textCount - 1];
+
+	if (!run || run->color != color || run->field[0]) {
+		if (GrowLineRuns(textLine)) {
+			run = &textLine->texts[textLine->textCount++];
+			run->length = 0;
+			run->color = color;
+			run->field[0] = 0;
+		} else if (!run || run->field[0]) {
+			return;
+		}
+		/* Out of memory: the character keeps the last run's color */
+	}
+
+	if (GrowRun(run, run->length + 1)) {
+		run->text[run->length++] = c;
+		run->text[run->length] = 0;
+	}
+}
+
+/* Length of the placeholder spec starting after {{, or 0 if it is not one */
+int FieldLength(const wchar_t *spec)
+{
+	/* Bounded, so a long line of {{ without }} stays linear */
+	for (int i = 0; i < MAX_FIELD_LENGTH && spec[i]; i++) {
+		if (spec[i] == L'}' && spec[i + 1] == L'}')
+			return i;
+	}
+	return 0;
+}
+
+/* Append a {{placeholder}} as a run of its own, so that a new value only
+ * touches that run. Its text is filled in by FillFields. */
+void AppendField(TextLine *textLine, const wchar_t *spec, int length,
+		 COLORREF color)
+{
+	/* Out of memory, the placeholder is shown as written */
+	if (!GrowLineRuns(textLine)) {
+		AppendColoredChar(textLine, L'{', color);
+		AppendColoredChar(textLine, L'{', color);
+		for (int i = 0; i < length; i++)
+			AppendColoredChar(textLine, spec[i], color);
+		AppendColoredChar(textLine, L'}', color);
+		AppendColoredChar(textLine, L'}', color);
+		return;
+	}
+
+	ColoredText *run = &textLine->texts[textLine->textCount++];
+	run->length = 0;
+	run->color = color;
+	SetRunText(run, L"");
+	wmemcpy(run->field, spec, length);
+	run->field[length] = 0;
+	textLine->fieldCount++;
+}
+
 /* Enhanced parser for the renderer that handles nested colors */
 void ParseColoredLine(const wchar_t *line, TextLine *textLine)
 {
 	textLine->textCount = 0;
-	wchar_t current[MAX_TEXT_LENGTH] = { 0 };
-	int currentPos = 0;
+	textLine->fieldCount = 0;
 
 	/* Color stack to handle nested colors */
 	COLORREF colorStack[MAX_NESTING_DEPTH];
@@ -178,20 +1014,14 @@ void ParseColoredLine(const wchar_t *line, TextLine *textLine)
 	for (int i = 0; i < len; i++) {
 		if (line[i] == L'\\' && i + 1 < len) {
 			/* Escaped character */
-			current[currentPos++] = line[++i];
+			AppendColoredChar(textLine, line[++i], currentColor);
+		} else if (line[i] == L'{' && i + 1 < len && line[i + 1] == L'{'
+			   && FieldLength(&line[i + 2]) > 0) {
+			/* Placeholder, substituted when shown */
+			int length = FieldLength(&line[i + 2]);
+			AppendField(textLine, &line[i + 2], length, currentColor);
+			i += length + 3;
 		} else if (line[i] == L'`') {
-			/* Save current text if any */
-			if (currentPos > 0) {
-				current[currentPos] = 0;
-				wcscpy(textLine->
-				       texts[textLine->textCount].text,
-				       current);
-				textLine->texts[textLine->textCount].color =
-				    currentColor;
-				textLine->textCount++;
-				currentPos = 0;
-			}
-
 			/* Find the colon that separates parameters from text */
 			int colonPos = -1;
 			for (int j = i + 1; j < len; j++) {
@@ -244,22 +1074,10 @@ void ParseColoredLine(const wchar_t *line, TextLine *textLine)
 				i = colonPos;
 			} else {
 				/* No colon found - treat as regular text */
-				current[currentPos++] = line[i];
+				AppendColoredChar(textLine, line[i], currentColor);
 			}
 		} else if (line[i] == L'\'') {
-			/* End of colored text - save current text and pop color */
-			if (currentPos > 0) {
-				current[currentPos] = 0;
-				wcscpy(textLine->
-				       texts[textLine->textCount].text,
-				       current);
-				textLine->texts[textLine->textCount].color =
-				    currentColor;
-				textLine->textCount++;
-				currentPos = 0;
-			}
-
-			/* Pop color from stack */
+			/* End of colored text - pop color */
 			if (colorDepth > 0) {
 				colorDepth--;
 				currentColor = colorStack[colorDepth];
@@ -267,37 +1085,282 @@ void ParseColoredLine(const wchar_t *line, TextLine *textLine)
 				currentColor = RGB(255, 255, 255);	/* Reset to default white */
 			}
 		} else {
-			current[currentPos++] = line[i];
+			AppendColoredChar(textLine, line[i], currentColor);
+		}
+	}
+}
+
+/* Width of one run, px, and where each of its characters starts, so that
+ * drawing a tile only touches the characters inside it. Call with the font
+ * cache locked. */
+int RunWidth(CachedFont *font, ColoredText *run)
+{
+	run->cellWidth = 0;
+	if (!font)
+		return 0;
+	if (font->monospace) {
+		int cells = TextCells(run->text, run->length);
+		if (cells == run->length) {
+			run->cellWidth = font->advance;
+			return cells * font->advance;
 		}
 	}
 
-	/* Add remaining text */
-	if (currentPos > 0) {
-		current[currentPos] = 0;
-		wcscpy(textLine->texts[textLine->textCount].text, current);
-		textLine->texts[textLine->textCount].color = currentColor;
-		textLine->textCount++;
+	int *charX = realloc(run->charX, (run->length + 1) * sizeof(int));
+	if (!charX) {
+		/* Without the index the whole run is drawn for every tile */
+		free(run->charX);
+		run->charX = NULL;
+		return font->monospace ? TextCells(run->text, run->length) * font->advance
+		    : CachedTextWidth(font, run->text, run->length);
+	}
+	run->charX = charX;
+
+	int x = 0;
+	for (int i = 0; i < run->length; i++) {
+		/* A surrogate pair's width goes to its first unit */
+		wchar_t c = run->text[i];
+		int units = c >= 0xD800 && c <= 0xDBFF && i + 1 < run->length ? 2 : 1;
+		charX[i] = x;
+		x += font->monospace ? TextCells(&run->text[i], units) * font->advance
+		    : CachedTextWidth(font, &run->text[i], units);
+		if (units == 2)
+			charX[++i] = x;
 	}
+	charX[run->length] = x;
+	return x;
 }
 
-BOOL LoadLayoutFile(MarqueeRenderer *renderer, const wchar_t *filename)
+/* Measure the runs of a segment and build the per-line run index by x. Call
+ * with the font cache locked. */
+void MeasureSegment(CachedFont *font, TextSegment *segment)
+{
+	segment->width = 0;
+
+	for (int l = 0; l < segment->lineCount; l++) {
+		TextLine *line = &segment->lines[l];
+		int x = 0;
+
+		for (int t = 0; t < line->textCount; t++) {
+			line->runX[t] = x;
+			x += RunWidth(font, &line->texts[t]);
+		}
+		if (line->runX)		/* NULL for an empty line */
+			line->runX[line->textCount] = x;
+		line->width = x;
+
+		if (x > segment->width)
+			segment->width = x;
+	}
+}
+
+/* Measure every run once per load */
+void MeasureLayout(MarqueeLayout *layout)
+{
+	EnterCriticalSection(&g_fontCache.lock);
+	for (int s = 0; s < layout->segmentCount; s++)
+		MeasureSegment(layout->cachedFont, &layout->segments[s]);
+	LeaveCriticalSection(&g_fontCache.lock);
+}
+
+void InitFieldValues()
+{
+	InitializeCriticalSection(&g_values.lock);
+}
+
+void DestroyFieldValues()
+{
+	free(g_values.text);
+	g_values.text = NULL;
+	DeleteCriticalSection(&g_values.lock);
+}
+
+/* Reread the --values file if it changed; at most once a second. Call with
+ * g_values.lock held. */
+void RefreshFieldValues(void)
+{
+	ULONGLONG now = GetTickCount64();
+	if (g_values.checked && now - g_values.checked < 1000)
+		return;
+	g_values.checked = now;
+
+	WIN32_FILE_ATTRIBUTE_DATA info;
+	if (!GetFileAttributesExW(g_optValues, GetFileExInfoStandard, &info)) {
+		free(g_values.text);
+		g_values.text = NULL;
+		return;
+	}
+	if (g_values.text && CompareFileTime(&info.ftLastWriteTime,
+					     &g_values.written) == 0)
+		return;
+
+	FILE *file = _wfopen(g_optValues, L"r, ccs=UTF-8");
+	if (!file)
+		return;
+
+	size_t length = 0, capacity = 0;
+	wchar_t *text = NULL;
+	wchar_t chunk[1024];
+	while (fgetws(chunk, 1024, file)) {
+		size_t n = wcslen(chunk);
+		if (length + n + 1 > capacity) {
+			size_t newCapacity = capacity ? capacity * 2 : 4096;
+			while (newCapacity < length + n + 1)
+				newCapacity *= 2;
+			wchar_t *grown = realloc(text, newCapacity * sizeof(wchar_t));
+			if (!grown)
+				break;
+			text = grown;
+			capacity = newCapacity;
+		}
+		wmemcpy(text + length, chunk, n + 1);
+		length += n;
+	}
+	fclose(file);
+
+	free(g_values.text);
+	g_values.text = text;
+	g_values.written = info.ftLastWriteTime;
+}
+
+/* Value of key in the --values file: the rest of the first line that starts
+ * with KEY=, or empty */
+void LookupFieldValue(const wchar_t *key, wchar_t *out, int size)
+{
+	out[0] = 0;
+	if (!g_optValues)
+		return;
+
+	size_t keyLength = wcslen(key);
+	EnterCriticalSection(&g_values.lock);
+	RefreshFieldValues();
+	for (const wchar_t *line = g_values.text; line && *line;) {
+		const wchar_t *end = wcschr(line, L'\n');
+		size_t n = end ? (size_t)(end - line) : wcslen(line);
+		if (n > keyLength && wcsncmp(line, key, keyLength) == 0
+		    && line[keyLength] == L'=') {
+			const wchar_t *value = line + keyLength + 1;
+			n -= keyLength + 1;
+			if (n > 0 && value[n - 1] == L'\r')
+				n--;
+			if (n > (size_t)size - 1)
+				n = size - 1;
+			wmemcpy(out, value, n);
+			out[n] = 0;
+			break;
+		}
+		line = end ? end + 1 : NULL;
+	}
+	LeaveCriticalSection(&g_values.lock);
+}
+
+/* Text of a {{placeholder}} at now:
+ *   {{clock}} or {{clock:FORMAT}}  Local time, FORMAT as for wcsftime (%H:%M:%S)
+ *   {{countdown:YYYY-MM-DD HH:MM[:SS]}}  Time left until then, local time:
+ *                                  [Nd ]HH:MM:SS, 00:00:00 once it has passed
+ *   {{kv:KEY}}                     KEY from the --values file
+ * Anything else is shown as written. */
+void FormatField(const wchar_t *field, time_t now, wchar_t *out, int size)
+{
+	const wchar_t *colon = wcschr(field, L':');
+	const wchar_t *arg = colon ? colon + 1 : L"";
+	size_t kind = colon ? (size_t)(colon - field) : wcslen(field);
+
+	out[0] = 0;
+	if (kind == 5 && wcsncmp(field, L"clock", 5) == 0) {
+		struct tm *local = localtime(&now);
+		if (local && !wcsftime(out, size, *arg ? arg : L"%H:%M:%S", local))
+			out[0] = 0;
+	} else if (kind == 9 && wcsncmp(field, L"countdown", 9) == 0) {
+		struct tm target;
+		memset(&target, 0, sizeof(target));
+		int got = swscanf(arg, L"%d-%d-%d%*[ T]%d:%d:%d", &target.tm_year,
+				  &target.tm_mon, &target.tm_mday, &target.tm_hour,
+				  &target.tm_min, &target.tm_sec);
+		if (got < 5) {
+			swprintf(out, size, L"{{%ls}}", field);
+			return;
+		}
+		target.tm_year -= 1900;
+		target.tm_mon -= 1;
+		target.tm_isdst = -1;
+		time_t end = mktime(&target);
+		long long left = end != (time_t)-1 && end > now ? (long long)(end - now) : 0;
+		int days = (int)(left / 86400);
+		int rest = (int)(left % 86400);
+		if (days > 0)
+			swprintf(out, size, L"%dd %02d:%02d:%02d", days, rest / 3600,
+				 rest / 60 % 60, rest % 60);
+		else
+			swprintf(out, size, L"%02d:%02d:%02d", rest / 3600,
+				 rest / 60 % 60, rest % 60);
+	} else if (kind == 2 && wcsncmp(field, L"kv", 2) == 0) {
+		LookupFieldValue(arg, out, size);
+	} else {
+		swprintf(out, size, L"{{%ls}}", field);
+	}
+}
+
+/* Give every placeholder in segment its value at now, before measuring */
+void FillFields(TextSegment *segment, time_t now)
+{
+	for (int l = 0; l < segment->lineCount; l++) {
+		TextLine *line = &segment->lines[l];
+		for (int t = 0; line->fieldCount > 0 && t < line->textCount; t++) {
+			ColoredText *run = &line->texts[t];
+			if (!run->field[0])
+				continue;
+			wchar_t value[MAX_VALUE_LENGTH];
+			FormatField(run->field, now, value, MAX_VALUE_LENGTH);
+			SetRunText(run, value);
+		}
+	}
+}
+
+/* Read one line of any length into *line, which grows as needed, without its
+ * newline. Returns the length, or -1 at the end of the file. */
+int ReadLine(FILE *file, wchar_t **line, size_t *capacity)
+{
+	size_t length = 0;
+
+	for (;;) {
+		if (*capacity - length < 2) {
+			size_t newCapacity = *capacity ? *capacity * 2 : 256;
+			wchar_t *grown = realloc(*line, newCapacity * sizeof(wchar_t));
+			if (!grown)
+				break;
+			*line = grown;
+			*capacity = newCapacity;
+		}
+		if (!fgetws(*line + length, (int)(*capacity - length), file))
+			break;
+		length += wcslen(*line + length);
+		if (length > 0 && (*line)[length - 1] == L'\n') {
+			(*line)[--length] = 0;
+			return (int)length;
+		}
+	}
+
+	if (length == 0)
+		return -1;
+	(*line)[length] = 0;
+	return (int)length;
+}
+
+BOOL ParseLayoutFile(MarqueeLayout *layout, const wchar_t *filename)
 {
 	FILE *file = _wfopen(filename, L"r, ccs=UTF-8");
 	if (!file)
 		return FALSE;
 
-	renderer->segmentCount = 0;
-	wchar_t line[MAX_TEXT_LENGTH];
+	layout->segmentCount = 0;
+	wchar_t *line = NULL;
+	size_t capacity = 0;
+	int len;
 	BOOL inSegment = FALSE;
 	TextSegment *currentSegment = NULL;
 
-	while (fgetws(line, MAX_TEXT_LENGTH, file)) {
-		/* Remove newline */
-		int len = (int)wcslen(line);
-		if (len > 0 && line[len - 1] == L'\n') {
-			line[len - 1] = 0;
-			len--;
-		}
+	while ((len = ReadLine(file, &line, &capacity)) >= 0) {
 		if (len > 0 && line[len - 1] == L'\r') {
 			line[len - 1] = 0;
 			len--;
@@ -305,7 +1368,8 @@ BOOL LoadLayoutFile(MarqueeRenderer *renderer, const wchar_t *filename)
 
 		/* Skip comments and empty lines outside segments */
 		if (len == 0 || line[0] == L'/') {
-			if (inSegment && currentSegment && line[0] != L'/') {
+			if (inSegment && currentSegment && line[0] != L'/'
+			    && currentSegment->lineCount < MAX_LINES_PER_SEGMENT) {
 				/* Empty lines in segments are preserved, but comments are skipped */
 				currentSegment->
 				    lines[currentSegment->lineCount].textCount =
@@ -317,40 +1381,46 @@ BOOL LoadLayoutFile(MarqueeRenderer *renderer, const wchar_t *filename)
 
 		/* Parse configuration */
 		if (wcsncmp(line, L"LPS", 3) == 0) {
-			renderer->config.linesPerScreen = _wtoi(&line[4]);
+			layout->config.linesPerScreen = _wtoi(&line[4]);
 		} else if (wcsncmp(line, L"SW", 2) == 0) {
-			renderer->config.screenWidth = _wtoi(&line[3]);
+			layout->config.screenWidth = _wtoi(&line[3]);
 		} else if (wcsncmp(line, L"SH", 2) == 0) {
-			renderer->config.screenHeight = _wtoi(&line[3]);
+			layout->config.screenHeight = _wtoi(&line[3]);
 		} else if (wcsncmp(line, L"SC", 2) == 0) {
-			renderer->config.screenCount = _wtoi(&line[3]);
+			layout->config.screenCount = _wtoi(&line[3]);
 		} else if (wcsncmp(line, L"SD", 2) == 0) {
-			renderer->config.screenDelay = _wtoi(&line[3]);
+			layout->config.screenDelay = _wtoi(&line[3]);
 		} else if (wcsncmp(line, L"CD", 2) == 0) {
-			renderer->config.centerDelay = _wtoi(&line[3]);
+			layout->config.centerDelay = _wtoi(&line[3]);
 
 			/* Parse optional flags */
 		} else if (wcsncmp(line, L"TPF", 3) == 0) {
 			int value = _wtoi(&line[4]);
 			if (value > 0) {
-				renderer->config.timePerFrame = value;
+				layout->config.timePerFrame = value;
 			}
 		} else if (wcsncmp(line, L"PM", 2) == 0) {
 			int value = _wtoi(&line[3]);
 			if (value > 0) {
-				renderer->config.pixelsPerFrame = value;
+				layout->config.pixelsPerFrame = value;
 			}
 
 		} else if (wcscmp(line, L"START") == 0) {
+			/* Segments past MAX_SEGMENTS are read and skipped */
 			inSegment = TRUE;
-			currentSegment =
-			    &renderer->segments[renderer->segmentCount];
-			currentSegment->lineCount = 0;
+			currentSegment = NULL;
+			if (layout->segmentCount < MAX_SEGMENTS) {
+				currentSegment =
+				    &layout->segments[layout->segmentCount];
+				currentSegment->lineCount = 0;
+			}
 		} else if (wcscmp(line, L"END") == 0) {
 			inSegment = FALSE;
-			renderer->segmentCount++;
+			if (currentSegment)
+				layout->segmentCount++;
 			currentSegment = NULL;
-		} else if (inSegment && currentSegment) {
+		} else if (inSegment && currentSegment
+			   && currentSegment->lineCount < MAX_LINES_PER_SEGMENT) {
 			ParseColoredLine(line,
 					 &currentSegment->
 					 lines[currentSegment->lineCount]);
@@ -358,227 +1428,1440 @@ BOOL LoadLayoutFile(MarqueeRenderer *renderer, const wchar_t *filename)
 		}
 	}
 
+	/* A segment missing its END is not shown */
+	if (currentSegment)
+		FreeSegmentText(currentSegment);
+	free(line);
 	fclose(file);
-
+	return TRUE;
+}
+
+/* Size the font to the header, measure and build the tile cache */
+void PrepareLayout(MarqueeLayout *layout)
+{
 	/* Calculate font size based on screen height and lines per screen */
 	int fontSize =
-	    -(renderer->config.screenHeight / renderer->config.linesPerScreen);
-	if (fontSize > -8)
-		fontSize = -8;	/* Minimum readable size */
-
-	/* Delete old font and create new one with calculated size */
-	if (renderer->font)
-		DeleteObject(renderer->font);
-
-	renderer->font =
-	    CreateFontW(fontSize, 0, 0, 0, FW_NORMAL, FALSE, FALSE, FALSE,
-			DEFAULT_CHARSET, OUT_DEFAULT_PRECIS,
-			CLIP_DEFAULT_PRECIS, DEFAULT_QUALITY,
-			FIXED_PITCH | FF_MODERN, L"MingLiU");
-	if (!renderer->font) {
-		renderer->font =
-		    CreateFontW(fontSize, 0, 0, 0, FW_NORMAL, FALSE, FALSE,
-				FALSE, DEFAULT_CHARSET, OUT_DEFAULT_PRECIS,
-				CLIP_DEFAULT_PRECIS, DEFAULT_QUALITY,
-				FIXED_PITCH | FF_MODERN, L"Courier New");
+	    layout->config.screenHeight / layout->config.linesPerScreen;
+	if (fontSize < 8)
+		fontSize = 8;	/* Minimum readable size */
+
+	/* Reloads and layouts of the same SH/LPS reuse the font and its widths */
+	CachedFont *font = AcquireFont(MARQUEE_FONT, MARQUEE_FALLBACK_FONT, fontSize);
+	if (font) {
+		ReleaseFont(layout->cachedFont);
+		layout->cachedFont = font;
+		layout->font = font->font;
+	}
+
+	time_t now = time(NULL);
+	for (int s = 0; s < layout->segmentCount; s++)
+		FillFields(&layout->segments[s], now);
+
+	MeasureLayout(layout);
+	CreateTileCache(layout);
+}
+
+/* Load a layout ready to play: parsed, measured and with its tile cache. Safe
+ * to call from any thread. */
+MarqueeLayout *LoadLayout(const wchar_t *filename)
+{
+	MarqueeLayout *layout = CreateLayout();
+	if (!layout)
+		return NULL;
+	if (!ParseLayoutFile(layout, filename)) {
+		DestroyLayout(layout);
+		return NULL;
+	}
+
+	PrepareLayout(layout);
+	return layout;
+}
+
+/* Put layout on screen in place of the current one, which is freed. Only call
+ * while the render thread is stopped. */
+BOOL ShowLayout(MarqueeRenderer *renderer, MarqueeLayout *layout)
+{
+	DestroyLayout(renderer->layout);
+	renderer->layout = layout;
+	renderer->currentScreen = 0;
+	renderer->scrollPosition = layout->config.screenWidth;
+	renderer->isCurrentScreenCentered = FALSE;
+	renderer->holdFrames = 0;
+
+	CreateFrameQueue(renderer);
+	if (g_optRing && !renderer->ringEnabled
+	    && !EnableFrameRing(renderer, g_optRingName, g_optRingSlots)) {
+		return FALSE;
 	}
 
 	/* Resize window to match screen width and height from file */
 	SetWindowPos(renderer->hwnd, NULL, 0, 0,
-		     renderer->config.screenWidth + 20,
-		     renderer->config.screenHeight + 80,
+		     layout->config.screenWidth + 20,
+		     layout->config.screenHeight + 80,
 		     SWP_NOMOVE | SWP_NOZORDER);
 
 	return TRUE;
 }
 
-void StartMarquee(MarqueeRenderer *renderer)
+BOOL LoadLayoutFile(MarqueeRenderer *renderer, const wchar_t *filename)
 {
-	renderer->isRunning = TRUE;
-	renderer->scrollPosition = renderer->config.screenWidth;
-	renderer->lastUpdate = GetTickCount();
-	renderer->isCurrentScreenCentered = FALSE;
-	renderer->centerStartTime = 0;
+	MarqueeLayout *layout = LoadLayout(filename);
+	if (!layout)
+		return FALSE;
+	return ShowLayout(renderer, layout);
+}
 
-	/* Use TPF (timePerFrame) for timer interval instead of hardcoded 50ms */
-	SetTimer(renderer->hwnd, 1, renderer->config.timePerFrame, NULL);
+/* Reader thread. When the queue is full, drop-oldest discards the oldest
+ * segment; otherwise the reader waits, which stops it reading and so blocks
+ * the writer. FALSE if the ticker stopped while waiting. */
+BOOL PushTickerSegment(Ticker *ticker, TickerSegment *segment)
+{
+	unsigned long write =
+	    atomic_load_explicit(&ticker->write, memory_order_relaxed);
+
+	for (;;) {
+		unsigned long read =
+		    atomic_load_explicit(&ticker->read, memory_order_acquire);
+		if (write - read < TICKER_QUEUE_SIZE)
+			break;
+		if (atomic_load(&ticker->stop))
+			return FALSE;
+		if (ticker->dropOldest) {
+			TickerSegment *oldest =
+			    atomic_load(&ticker->slots[read % TICKER_QUEUE_SIZE]);
+			if (atomic_compare_exchange_strong(&ticker->read, &read, read + 1)) {
+				FreeTickerSegment(oldest);
+				atomic_fetch_add(&ticker->dropped, 1);
+			}
+		} else {
+			WaitForSingleObject(ticker->spaceFreed, 100);
+		}
+	}
+
+	atomic_store(&ticker->slots[write % TICKER_QUEUE_SIZE], segment);
+	atomic_store_explicit(&ticker->write, write + 1, memory_order_release);
+	SetEvent(ticker->arrived);
+	return TRUE;
 }
 
-void StopMarquee(MarqueeRenderer *renderer)
+/* Render thread: oldest queued segment, or NULL */
+TickerSegment *PopTickerSegment(Ticker *ticker)
 {
-	renderer->isRunning = FALSE;
-	KillTimer(renderer->hwnd, 1);
+	unsigned long read = atomic_load(&ticker->read);
+
+	for (;;) {
+		unsigned long write =
+		    atomic_load_explicit(&ticker->write, memory_order_acquire);
+		if (read == write)
+			return NULL;
+
+		/* If the reader dropped this one meanwhile, the swap fails */
+		TickerSegment *segment =
+		    atomic_load(&ticker->slots[read % TICKER_QUEUE_SIZE]);
+		if (atomic_compare_exchange_weak(&ticker->read, &read, read + 1)) {
+			SetEvent(ticker->spaceFreed);
+			return segment;
+		}
+	}
 }
 
-void ResetMarquee(MarqueeRenderer *renderer)
+/* Render thread: retire the ticker segment on screen and take the next one */
+BOOL NextTickerSegment(Ticker *ticker)
 {
-	StopMarquee(renderer);
-	renderer->currentScreen = 0;
-	renderer->scrollPosition = renderer->config.screenWidth;
-	renderer->isCurrentScreenCentered = FALSE;
-	renderer->centerStartTime = 0;
+	FreeTickerSegment(ticker->current);
+	ticker->current = PopTickerSegment(ticker);
+	if (!ticker->current)
+		return FALSE;
+
+	ticker->shown++;
+	ticker->stamped = FALSE;
+	ticker->blankShown = FALSE;
+	return TRUE;
+}
+
+/* The segment on screen, NULL if there is none */
+TextSegment *ShownSegment(MarqueeRenderer *renderer)
+{
+	if (g_ticker.active)
+		return g_ticker.current ? &g_ticker.current->segment : NULL;
+	if (renderer->currentScreen >= renderer->layout->segmentCount)
+		return NULL;
+	return &renderer->layout->segments[renderer->currentScreen];
+}
+
+/* Identifies the segment on screen to the tile cache and the frame ring */
+int ShownSegmentKey(MarqueeRenderer *renderer)
+{
+	if (g_ticker.active)
+		return (int)(g_ticker.shown & 0x7FFFFFFF);
+	return renderer->currentScreen;
 }
 
 int GetTextWidth(MarqueeRenderer *renderer)
 {
-	if (renderer->segmentCount == 0
-	    || renderer->currentScreen >= renderer->segmentCount) {
-		return 0;
-	}
+	TextSegment *segment = ShownSegment(renderer);
+	return segment ? segment->width : 0;
+}
 
-	HDC hdc = GetDC(renderer->hwnd);
-	SelectObject(hdc, renderer->font);
+BOOL DoesTextFitInWindow(MarqueeRenderer *renderer)
+{
+	if (!ShownSegment(renderer))
+		return TRUE;
+
+	int textWidth = GetTextWidth(renderer);
+	return textWidth <= renderer->layout->config.screenWidth;
+}
 
-	int maxWidth = 0;
-	TextSegment *segment = &renderer->segments[renderer->currentScreen];
+/* Number of whole frames covering a delay in milliseconds, at least one */
+int FramesForDelay(MarqueeRenderer *renderer, int delay)
+{
+	int tpf = renderer->layout->config.timePerFrame;
+	int frames = (delay + tpf - 1) / tpf;
+	return frames > 0 ? frames : 1;
+}
 
-	for (int lineIndex = 0; lineIndex < segment->lineCount; lineIndex++) {
-		int lineWidth = 0;
-		TextLine *line = &segment->lines[lineIndex];
+/* Render thread, at the end of a loop: once the playing entry has had its time,
+ * switch to the next layout if it is loaded. A different frame size or TPF
+ * needs the frame queue rebuilt, so that switch is left to the UI thread. */
+void PlaylistLoopEnded(MarqueeRenderer *renderer)
+{
+	Playlist *playlist = &g_playlist;
+	MarqueeConfig *config = &renderer->layout->config;
+	int entry = renderer->layout->entry;
+
+	playlist->loopsPlayed++;
+	if (entry >= 0) {
+		ULONGLONG played = (renderer->frameNumber + 1 - playlist->entryFrame) *
+		    (ULONGLONG) config->timePerFrame;
+		if (playlist->entries[entry].duration ?
+		    played < playlist->entries[entry].duration :
+		    playlist->loopsPlayed < playlist->entries[entry].loops)
+			return;
+	}
 
-		for (int textIndex = 0; textIndex < line->textCount;
-		     textIndex++) {
-			SIZE textSize;
-			GetTextExtentPoint32W(hdc, line->texts[textIndex].text,
-					      (int)
-					      wcslen(line->texts
-						     [textIndex].text),
-					      &textSize);
-			lineWidth += textSize.cx;
-		}
-		if (lineWidth > maxWidth) {
-			maxWidth = lineWidth;
-		}
+	MarqueeLayout *next =
+	    atomic_load_explicit(&playlist->next, memory_order_acquire);
+	if (!next)
+		return;		/* Still loading, play the loop again */
+
+	if (next->config.screenWidth != renderer->frameWidth
+	    || next->config.screenHeight != renderer->frameHeight
+	    || next->config.timePerFrame != config->timePerFrame) {
+		if (!atomic_exchange(&playlist->swapPosted, 1))
+			PostMessageW(renderer->hwnd, WM_APP_SWAPLAYOUT, 0, 0);
+		return;
 	}
 
-	ReleaseDC(renderer->hwnd, hdc);
-	return maxWidth;
+	atomic_store(&playlist->next, NULL);
+	atomic_store(&playlist->retired, renderer->layout);
+	renderer->layout = next;
+	playlist->loopsPlayed = 0;
+	playlist->entryFrame = renderer->frameNumber + 1;
+	SetEvent(playlist->wake);
 }
 
-BOOL DoesTextFitInWindow(MarqueeRenderer *renderer)
+void NextScreen(MarqueeRenderer *renderer)
 {
-	if (renderer->segmentCount == 0
-	    || renderer->currentScreen >= renderer->segmentCount) {
-		return TRUE;
+	if (g_ticker.active) {
+		NextTickerSegment(&g_ticker);
+	} else {
+		renderer->currentScreen =
+		    (renderer->currentScreen + 1) % renderer->layout->segmentCount;
+		if (renderer->currentScreen == 0 && g_playlist.count > 0)
+			PlaylistLoopEnded(renderer);
 	}
-
-	int textWidth = GetTextWidth(renderer);
-	return textWidth <= renderer->config.screenWidth;
+	renderer->scrollPosition = renderer->layout->config.screenWidth;
+	renderer->isCurrentScreenCentered = FALSE;
 }
 
-void UpdateMarquee(MarqueeRenderer *renderer)
+/* Advance the show by exactly one frame (TPF milliseconds). Delays are counted
+ * in frames so the timeline does not depend on when frames get rendered. */
+void AdvanceMarquee(MarqueeRenderer *renderer)
 {
-	if (!renderer->isRunning || renderer->segmentCount == 0)
+	/* An idle ticker starts a segment that arrived on this very frame */
+	if (g_ticker.active) {
+		if (!g_ticker.current && !NextTickerSegment(&g_ticker))
+			return;
+	} else if (renderer->layout->segmentCount == 0) {
 		return;
+	}
 
-	DWORD now = GetTickCount();
+	if (renderer->holdFrames > 0) {
+		renderer->holdFrames--;
+		return;
+	}
 
 	/* Check if current screen should be centered */
 	if (!renderer->isCurrentScreenCentered && DoesTextFitInWindow(renderer)) {
 		renderer->isCurrentScreenCentered = TRUE;
-		renderer->centerStartTime = now;
-		InvalidateRect(renderer->hwnd, NULL, TRUE);
+		renderer->holdFrames =
+		    FramesForDelay(renderer, renderer->layout->config.centerDelay) - 1;
 		return;
 	}
 
-	/* Handle centered text timing */
+	/* Centered text has been held for CD, move to next screen */
 	if (renderer->isCurrentScreenCentered) {
-		if (now - renderer->centerStartTime >=
-		    renderer->config.centerDelay) {
-			/* Time to move to next screen */
-			renderer->currentScreen =
-			    (renderer->currentScreen +
-			     1) % renderer->segmentCount;
-			renderer->scrollPosition = renderer->config.screenWidth;
-			renderer->isCurrentScreenCentered = FALSE;
-			renderer->centerStartTime = 0;
-			InvalidateRect(renderer->hwnd, NULL, TRUE);
-		}
+		NextScreen(renderer);
 		return;
 	}
 
 	/* Handle scrolling text using PM (pixelsPerFrame) instead of hardcoded 3 */
-	if (now - renderer->lastUpdate >= renderer->config.timePerFrame) {
-		renderer->scrollPosition -= renderer->config.pixelsPerFrame;
+	renderer->scrollPosition -= renderer->layout->config.pixelsPerFrame;
+
+	if (renderer->scrollPosition < -GetTextWidth(renderer)) {
+		NextScreen(renderer);
+		renderer->holdFrames =
+		    FramesForDelay(renderer, renderer->layout->config.screenDelay);
+	}
+}
 
-		if (renderer->scrollPosition < -GetTextWidth(renderer)) {
-			renderer->currentScreen =
-			    (renderer->currentScreen +
-			     1) % renderer->segmentCount;
-			renderer->scrollPosition = renderer->config.screenWidth;
-			Sleep(renderer->config.screenDelay);
+/* Frames segment i plays for, counted as AdvanceMarquee does: the frame that
+ * brings it in, then either CD held centered, or the scroll until it is off the
+ * left edge followed by the blank SD hold */
+ULONGLONG SegmentFrames(MarqueeRenderer *renderer, int i)
+{
+	int sw = renderer->layout->config.screenWidth;
+	int width = renderer->layout->segments[i].width;
+	if (width <= sw)
+		return 1 + FramesForDelay(renderer, renderer->layout->config.centerDelay);
+	return (sw + width) / renderer->layout->config.pixelsPerFrame + 1
+	    + FramesForDelay(renderer, renderer->layout->config.screenDelay);
+}
+
+void BuildLoopTimeline(MarqueeRenderer *renderer)
+{
+	renderer->layout->loopStart[0] = 0;
+	for (int i = 0; i < renderer->layout->segmentCount; i++) {
+		renderer->layout->loopStart[i + 1] =
+		    renderer->layout->loopStart[i] + SegmentFrames(renderer, i);
+	}
+}
+
+/* Put the show in the state AdvanceMarquee reaches after frame frames from the
+ * start, binary searching the loop timeline. Frames before 0 count back. */
+void SeekMarquee(MarqueeRenderer *renderer, LONGLONG frame)
+{
+	int count = renderer->layout->segmentCount;
+	LONGLONG length = (LONGLONG) renderer->layout->loopStart[count];
+	if (count == 0 || length == 0)
+		return;
+
+	ULONGLONG f = (ULONGLONG) (((frame % length) + length) % length);
+	int lo = 0, hi = count - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (renderer->layout->loopStart[mid] <= f)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	int sw = renderer->layout->config.screenWidth;
+	int offset = (int)(f - renderer->layout->loopStart[lo]);
+	renderer->currentScreen = lo;
+	renderer->scrollPosition = sw;
+	renderer->isCurrentScreenCentered = FALSE;
+	renderer->holdFrames = 0;
+	if (offset == 0)
+		return;
+
+	int width = renderer->layout->segments[lo].width;
+	if (width <= sw) {
+		renderer->isCurrentScreenCentered = TRUE;
+		renderer->holdFrames =
+		    FramesForDelay(renderer, renderer->layout->config.centerDelay) - offset;
+		return;
+	}
+
+	int scrollFrames = (sw + width) / renderer->layout->config.pixelsPerFrame + 1;
+	if (offset < scrollFrames) {
+		renderer->scrollPosition = sw - offset * renderer->layout->config.pixelsPerFrame;
+		return;
+	}
+
+	/* The SD hold already has the next segment in, still off screen */
+	renderer->currentScreen = (lo + 1) % count;
+	renderer->holdFrames =
+	    FramesForDelay(renderer, renderer->layout->config.screenDelay) - (offset - scrollFrames);
+}
+
+/* System clock in ms since 1970 */
+ULONGLONG WallClockMillis(void)
+{
+	FILETIME ft;
+	GetSystemTimePreciseAsFileTime(&ft);
+	ULARGE_INTEGER t;
+	t.LowPart = ft.dwLowDateTime;
+	t.HighPart = ft.dwHighDateTime;
+	return (t.QuadPart - 116444736000000000ULL) / 10000;
+}
+
+/* --sync: set showStart so frame syncFrame + frameNumber is due at the epoch
+ * plus that many TPF by the system clock. GetTickCount64 drifts against it, so
+ * this is repeated while playing; small errors are slewed, and a stepped clock
+ * or a fresh start jumps to the frame the clock says is next. */
+void ResyncMarquee(MarqueeRenderer *renderer)
+{
+	LONGLONG tpf = renderer->layout->config.timePerFrame;
+	LONGLONG since = (LONGLONG) (WallClockMillis() - g_optSyncEpoch);
+	LONGLONG tick = (LONGLONG) GetTickCount64();
+	LONGLONG played = (LONGLONG) renderer->frameNumber;
+	LONGLONG frame = renderer->syncFrame + played;
+	LONGLONG ahead = frame * tpf - since;	/* ms until frame is due */
+
+	if (played == 0 || ahead < -SYNC_MAX_SKEW || ahead > SYNC_MAX_SKEW) {
+		frame = since >= 0 ? (since + tpf - 1) / tpf : -(-since / tpf);
+		renderer->syncFrame = frame - played;
+		ahead = frame * tpf - since;
+	}
+	renderer->showStart = (ULONGLONG) (tick + ahead - played * tpf);
+}
+
+/* Index of the first run of line that ends right of x (binary search on runX) */
+int FindRunAt(TextLine *line, int x)
+{
+	int lo = 0, hi = line->textCount;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (line->runX[mid + 1] <= x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Characters [*first, *end) of run t of line that intersect [left, right) in
+ * line coordinates, never splitting a surrogate pair. Returns the x of *first
+ * from the run's start. A long run costs the same per tile as a short one. */
+int ClipRun(TextLine *line, int t, int left, int right, int *first, int *end)
+{
+	ColoredText *run = &line->texts[t];
+	int from = 0, to = run->length;
+	left -= line->runX[t];
+	right -= line->runX[t];
+
+	if (run->cellWidth) {
+		from = left > 0 ? left / run->cellWidth : 0;
+		to = right > 0 ? (right + run->cellWidth - 1) / run->cellWidth : 0;
+		if (from > run->length)
+			from = run->length;
+		if (to > run->length)
+			to = run->length;
+	} else if (run->charX) {
+		/* First character ending right of left, then first starting at
+		 * or past right */
+		int hi = run->length;
+		while (from < hi) {
+			int mid = (from + hi) / 2;
+			if (run->charX[mid + 1] <= left)
+				from = mid + 1;
+			else
+				hi = mid;
+		}
+		to = from;
+		hi = run->length;
+		while (to < hi) {
+			int mid = (to + hi) / 2;
+			if (run->charX[mid] < right)
+				to = mid + 1;
+			else
+				hi = mid;
 		}
+	}
+
+	if (from > 0 && from < run->length && run->text[from] >= 0xDC00
+	    && run->text[from] <= 0xDFFF)
+		from--;
+	if (to > 0 && to < run->length && run->text[to] >= 0xDC00
+	    && run->text[to] <= 0xDFFF)
+		to++;
+	*first = from;
+	*end = to;
+	if (run->cellWidth)
+		return from * run->cellWidth;
+	return run->charX ? run->charX[from] : 0;
+}
 
-		renderer->lastUpdate = now;
-		InvalidateRect(renderer->hwnd, NULL, TRUE);
+/* Draw the parts of the runs of line intersecting [left, right) in line
+ * coordinates, with the line's origin at (originX, y). A margin of half the
+ * line height keeps glyphs that overhang their advance. */
+void DrawLineRange(HDC hdc, TextLine *line, int originX, int y, int left,
+		   int right, int margin)
+{
+	for (int t = FindRunAt(line, left - margin);
+	     t < line->textCount && line->runX[t] < right + margin; t++) {
+		ColoredText *coloredText = &line->texts[t];
+		int first, end;
+		int x = ClipRun(line, t, left - margin, right + margin, &first, &end);
+		if (first >= end)
+			continue;
+		SetTextColor(hdc, coloredText->color);
+		TextOutW(hdc, originX + line->runX[t] + x, y,
+			 coloredText->text + first, end - first);
 	}
 }
 
-void RenderMarquee(MarqueeRenderer *renderer, HDC hdc)
+/* DrawLineRange for --software: composite the glyphs of the runs in
+ * [left, right) into the tile at rows [top, top + tileHeight) of the atlas */
+void DrawLineRangeSoftware(MarqueeLayout *layout, TextLine *line, int originX,
+			   int top, int left, int right, int margin)
+{
+	CachedFont *font = layout->cachedFont;
+	if (!font)
+		return;
+
+	EnterCriticalSection(&g_fontCache.lock);
+	for (int t = FindRunAt(line, left - margin);
+	     t < line->textCount && line->runX[t] < right + margin; t++) {
+		ColoredText *run = &line->texts[t];
+		int first, end;
+		int x = originX + line->runX[t]
+		    + ClipRun(line, t, left - margin, right + margin, &first, &end);
+
+		for (int i = first; i < end && x < TILE_WIDTH; i++) {
+			wchar_t c = run->text[i];
+			if (c >= 0xD800 && c <= 0xDBFF && i + 1 < run->length) {
+				/* No glyph outlines beyond the BMP; leave the cell blank */
+				x += font->monospace ? TextCells(&run->text[i], 2) * font->advance
+				    : CachedTextWidth(font, &run->text[i], 2);
+				i++;
+				continue;
+			}
+
+			CachedGlyph *glyph = GetCachedGlyph(font, c);
+			if (glyph && glyph->mask) {
+				int x0 = x + glyph->left;
+				int skip = x0 < 0 ? -x0 : 0;
+				int count = glyph->width - skip;
+				if (x0 + skip + count > TILE_WIDTH)
+					count = TILE_WIDTH - x0 - skip;
+				for (int y = 0; y < glyph->height && count > 0; y++) {
+					int row = glyph->top + y;
+					if (row < 0 || row >= layout->tileHeight)
+						continue;
+					g_blendRow(layout->tileBits +
+						   ((size_t)(top + row) * TILE_WIDTH + x0 + skip) * 4,
+						   glyph->mask + y * glyph->width + skip,
+						   count, run->color);
+				}
+			}
+			x += font->monospace ? CharCells(c) * font->advance
+			    : CachedTextWidth(font, &c, 1);
+		}
+	}
+	LeaveCriticalSection(&g_fontCache.lock);
+}
+
+int TileEvictionRank(TileSlot *slot, int segmentIndex)
+{
+	if (slot->segment == -1)
+		return 0;
+	return slot->segment != segmentIndex ? 1 : 2;
+}
+
+/* Atlas slot holding the given tile of a line of a segment,
+ * rasterizing it into the least recently used slot on a miss */
+int GetTile(MarqueeLayout *layout, TextSegment *segment, int segmentIndex,
+	    int lineIndex, int tile)
+{
+	if (!layout->tileDC)
+		return -1;
+
+	int victim = 0;
+	layout->tileClock++;
+
+	for (int i = 0; i < layout->tileCount; i++) {
+		TileSlot *slot = &layout->tiles[i];
+		if (slot->segment == segmentIndex && slot->line == lineIndex
+		    && slot->tile == tile) {
+			slot->lastUsed = layout->tileClock;
+			return i;
+		}
+		/* Free slots go first, then tiles of other segments, then the
+		 * least recently used, which is the one scrolled out the longest */
+		TileSlot *best = &layout->tiles[victim];
+		int rank = TileEvictionRank(slot, segmentIndex);
+		int bestRank = TileEvictionRank(best, segmentIndex);
+		if (rank < bestRank
+		    || (rank == bestRank && slot->lastUsed < best->lastUsed)) {
+			victim = i;
+		}
+	}
+
+	TileSlot *slot = &layout->tiles[victim];
+	TextLine *line = &segment->lines[lineIndex];
+	int height = layout->tileHeight;
+	int top = victim * height;
+	RECT rect = { 0, top, TILE_WIDTH, top + height };
+
+	if (g_optSoftware && layout->tileBits) {
+		/* The atlas is only touched directly; flush any GDI work first */
+		GdiFlush();
+		memset(layout->tileBits + (size_t)top * TILE_WIDTH * 4, 0,
+		       (size_t)height * TILE_WIDTH * 4);
+		DrawLineRangeSoftware(layout, line, -tile * TILE_WIDTH, top,
+				      tile * TILE_WIDTH, (tile + 1) * TILE_WIDTH,
+				      height / 2);
+	} else {
+		SaveDC(layout->tileDC);
+		IntersectClipRect(layout->tileDC, rect.left, rect.top, rect.right,
+				  rect.bottom);
+		FillRect(layout->tileDC, &rect,
+			 (HBRUSH) GetStockObject(BLACK_BRUSH));
+		DrawLineRange(layout->tileDC, line, -tile * TILE_WIDTH, top,
+			      tile * TILE_WIDTH, (tile + 1) * TILE_WIDTH, height / 2);
+		RestoreDC(layout->tileDC, -1);
+	}
+
+	slot->segment = segmentIndex;
+	slot->line = lineIndex;
+	slot->tile = tile;
+	slot->lastUsed = layout->tileClock;
+	return victim;
+}
+
+/* Drop the cached tiles first..last of a line, so they are drawn again */
+void InvalidateTiles(MarqueeLayout *layout, int segmentIndex, int lineIndex,
+		     int first, int last)
+{
+	for (int i = 0; i < layout->tileCount; i++) {
+		TileSlot *slot = &layout->tiles[i];
+		if (slot->segment == segmentIndex && slot->line == lineIndex
+		    && slot->tile >= first && slot->tile <= last)
+			slot->segment = -1;
+	}
+}
+
+/* Rasterize the tiles the first frame of a layout needs, so switching to it
+ * does not draw a screenful of text on the render thread */
+void PrewarmTiles(MarqueeLayout *layout)
 {
-	if (renderer->segmentCount == 0
-	    || renderer->currentScreen >= renderer->segmentCount) {
+	if (layout->segmentCount == 0)
 		return;
+
+	TextSegment *segment = &layout->segments[0];
+	BOOL centered = segment->width <= layout->config.screenWidth;
+	int lines = segment->lineCount < layout->config.linesPerScreen ?
+	    segment->lineCount : layout->config.linesPerScreen;
+
+	for (int l = 0; l < lines; l++) {
+		int width = segment->lines[l].width;
+		/* Scrolling text comes in from the right, one tile first */
+		int tiles = centered ? (width + TILE_WIDTH - 1) / TILE_WIDTH : 1;
+		for (int t = 0; t < tiles && t * TILE_WIDTH < width; t++)
+			GetTile(layout, segment, 0, l, t);
+	}
+}
+
+DWORD WINAPI PlaylistLoaderProc(LPVOID param)
+{
+	Playlist *playlist = param;
+	int failures = 0;
+
+	while (!atomic_load(&playlist->stop)) {
+		MarqueeLayout *retired = atomic_exchange(&playlist->retired, NULL);
+		DestroyLayout(retired);
+
+		/* Sleep while next is waiting to be played, or nothing loads */
+		if (atomic_load(&playlist->next) || failures >= playlist->count) {
+			WaitForSingleObject(playlist->wake, INFINITE);
+			continue;
+		}
+
+		int entry = (playlist->loaded + 1) % playlist->count;
+		MarqueeLayout *layout = LoadLayout(playlist->entries[entry].path);
+		playlist->loaded = entry;
+		if (!layout || layout->segmentCount == 0) {
+			DestroyLayout(layout);
+			failures++;
+			continue;
+		}
+		failures = 0;
+		layout->entry = entry;
+		PrewarmTiles(layout);
+		atomic_store_explicit(&playlist->next, layout, memory_order_release);
 	}
 
-	RECT rect;
-	GetClientRect(renderer->hwnd, &rect);
+	return 0;
+}
+
+/* Draw the current frame into hdc, with the screen's top-left corner at (0,0).
+ * Only tiles intersecting the screen are drawn, so the cost per frame does not
+ * depend on how long the segment is. */
+void RenderMarquee(MarqueeRenderer *renderer, HDC hdc)
+{
+	RECT rect = { 0, 0, renderer->layout->config.screenWidth,
+		renderer->layout->config.screenHeight
+	};
 	FillRect(hdc, &rect, (HBRUSH) GetStockObject(BLACK_BRUSH));
 
-	SelectObject(hdc, renderer->font);
+	TextSegment *segment = ShownSegment(renderer);
+	if (!segment)
+		return;
+	int key = ShownSegmentKey(renderer);
+
+	SelectObject(hdc, renderer->layout->font);
 	SetBkMode(hdc, TRANSPARENT);
 
-	TextSegment *segment = &renderer->segments[renderer->currentScreen];
 	int lineHeight =
-	    renderer->config.screenHeight / renderer->config.linesPerScreen;
+	    renderer->layout->config.screenHeight / renderer->layout->config.linesPerScreen;
 
-	int maxLines = renderer->config.linesPerScreen;
+	int maxLines = renderer->layout->config.linesPerScreen;
 	if (segment->lineCount < maxLines) {
 		maxLines = segment->lineCount;
 	}
 
 	for (int lineIndex = 0; lineIndex < maxLines; lineIndex++) {
 		TextLine *line = &segment->lines[lineIndex];
-		int y = lineIndex * lineHeight + 30;
+		int y = lineIndex * lineHeight;
 		int x;
 
 		if (renderer->isCurrentScreenCentered) {
-			/* Calculate total width of this line for centering */
-			int totalWidth = 0;
-			for (int textIndex = 0; textIndex < line->textCount;
-			     textIndex++) {
-				SIZE textSize;
-				int textLen =
-				    (int)wcslen(line->texts[textIndex].text);
-				GetTextExtentPoint32W(hdc,
-						      line->
-						      texts[textIndex].text,
-						      textLen, &textSize);
-				totalWidth += textSize.cx;
-			}
 			/* Center the line */
-			x = (renderer->config.screenWidth - totalWidth) / 2;
+			x = (renderer->layout->config.screenWidth - line->width) / 2;
 		} else {
 			/* Use scrolling position */
 			x = renderer->scrollPosition;
 		}
 
-		for (int textIndex = 0; textIndex < line->textCount;
-		     textIndex++) {
-			ColoredText *coloredText = &line->texts[textIndex];
-			SetTextColor(hdc, coloredText->color);
+		/* Visible part of the line, in line coordinates */
+		int left = -x > 0 ? -x : 0;
+		int right = renderer->layout->config.screenWidth - x;
+		if (right > line->width)
+			right = line->width;
+
+		if (left < right) {
+			int lastTile = (right - 1) / TILE_WIDTH;
+			for (int tile = left / TILE_WIDTH; tile <= lastTile;
+			     tile++) {
+				int slot = GetTile(renderer->layout, segment,
+						   key, lineIndex, tile);
+				if (slot >= 0) {
+					BitBlt(hdc, x + tile * TILE_WIDTH, y,
+					       TILE_WIDTH, lineHeight,
+					       renderer->layout->tileDC, 0,
+					       slot * renderer->layout->tileHeight,
+					       SRCCOPY);
+				} else {
+					DrawLineRange(hdc, line, x, y,
+						      tile * TILE_WIDTH,
+						      (tile + 1) * TILE_WIDTH,
+						      lineHeight / 2);
+				}
+			}
+		}
+
+		/* Rasterize the tile about to scroll in from the right edge */
+		int aheadTile = -1;
+		if (left < right)
+			aheadTile = (right - 1) / TILE_WIDTH + 1;
+		else if (x > 0)
+			aheadTile = 0;	/* Line has not entered the screen yet */
+		if (!renderer->isCurrentScreenCentered && aheadTile >= 0
+		    && aheadTile * TILE_WIDTH < line->width) {
+			GetTile(renderer->layout, segment, key,
+				lineIndex, aheadTile);
+		}
+	}
+}
+
+/* Bring the placeholders of the segment on screen up to date, once a second.
+ * Only runs whose value changed are measured again, and only tiles from the
+ * first of them on are redrawn; tiles right of the last one are kept too when
+ * the line did not change width. */
+void UpdateFields(MarqueeRenderer *renderer)
+{
+	TextSegment *segment = ShownSegment(renderer);
+	int key = ShownSegmentKey(renderer);
+	time_t now = time(NULL);
+
+	if (!segment || (now == renderer->fieldTime && key == renderer->fieldKey))
+		return;
+	renderer->fieldTime = now;
+	renderer->fieldKey = key;
+
+	MarqueeLayout *layout = renderer->layout;
+	BOOL resized = FALSE;
+	wchar_t value[MAX_VALUE_LENGTH];
+
+	for (int l = 0; l < segment->lineCount; l++) {
+		TextLine *line = &segment->lines[l];
+		int first = -1, last = -1;
+		int start = 0, oldEnd = 0;
+
+		/* runX moves along as the runs before each one change width */
+		for (int t = 0; line->fieldCount > 0 && t < line->textCount; t++) {
+			ColoredText *run = &line->texts[t];
+			int end = line->runX[t + 1];
+			int width = end - start;
+			start = end;
+
+			if (run->field[0]) {
+				FormatField(run->field, now, value, MAX_VALUE_LENGTH);
+				if (!run->text || wcscmp(value, run->text) != 0) {
+					SetRunText(run, value);
+
+					EnterCriticalSection(&g_fontCache.lock);
+					width = RunWidth(layout->cachedFont, run);
+					LeaveCriticalSection(&g_fontCache.lock);
+					if (first < 0)
+						first = t;
+					last = t;
+					oldEnd = end;
+				}
+			}
+			line->runX[t + 1] = line->runX[t] + width;
+		}
+		if (first < 0)
+			continue;
+
+		int from = line->runX[first];
+		int oldWidth = line->width;
+		line->width = line->runX[line->textCount];
 
-			SIZE textSize;
-			int textLen = (int)wcslen(coloredText->text);
-			GetTextExtentPoint32W(hdc, coloredText->text, textLen,
-					      &textSize);
+		int to = line->runX[last + 1];
+		if (to != oldEnd) {
+			/* Everything after the changed runs moved */
+			to = line->width > oldWidth ? line->width : oldWidth;
+			resized = TRUE;
+		}
+		if (to <= from)
+			to = from + 1;
+		InvalidateTiles(layout, key, l, from / TILE_WIDTH, (to - 1) / TILE_WIDTH);
+	}
 
-			TextOutW(hdc, x, y, coloredText->text, textLen);
-			x += textSize.cx;
+	if (resized) {
+		segment->width = 0;
+		for (int l = 0; l < segment->lineCount; l++) {
+			if (segment->lines[l].width > segment->width)
+				segment->width = segment->lines[l].width;
 		}
 	}
 }
 
+DWORD WINAPI RenderThreadProc(LPVOID param)
+{
+	MarqueeRenderer *renderer = param;
+	ULONGLONG tpf = (ULONGLONG) renderer->layout->config.timePerFrame;
+	ULONGLONG syncEvery = 1000 / tpf > 0 ? 1000 / tpf : 1;	/* About once a second */
+
+	while (!atomic_load(&renderer->stopRequested)) {
+		unsigned long write =
+		    atomic_load_explicit(&renderer->frameWrite,
+					 memory_order_relaxed);
+		unsigned long read =
+		    atomic_load_explicit(&renderer->frameRead,
+					 memory_order_acquire);
+
+		if (write - read >= FRAME_QUEUE_SIZE) {
+			/* Far enough ahead; wait for the presenter */
+			WaitForSingleObject(renderer->frameFreed, (DWORD) tpf);
+			continue;
+		}
+
+		/* An idle ticker queues no blank frames ahead. Input starts on the
+		 * frame in progress, so it is on screen within the next present. */
+		if (g_ticker.active && !g_ticker.current && g_ticker.blankShown) {
+			if (!NextTickerSegment(&g_ticker)) {
+				WaitForSingleObject(g_ticker.arrived, (DWORD) tpf);
+				continue;
+			}
+			ULONGLONG now = GetTickCount64();
+			if (now > renderer->showStart)
+				renderer->frameNumber = (now - renderer->showStart) / tpf;
+			renderer->isCurrentScreenCentered = FALSE;
+			renderer->scrollPosition = renderer->layout->config.screenWidth;
+			renderer->holdFrames = 0;
+			AdvanceMarquee(renderer);
+		}
+
+		/* Frames whose deadline has already passed are never shown, so only
+		 * advance the timeline for them instead of drawing */
+		if (g_optSync && renderer->frameNumber % syncEvery == 0)
+			ResyncMarquee(renderer);
+		ULONGLONG due = renderer->showStart + renderer->frameNumber * tpf;
+		ULONGLONG now = GetTickCount64();
+		if (g_optSync) {
+			/* Synced playback seeks, so skipping is a jump */
+			if (due + tpf <= now) {
+				ULONGLONG skip = (now - due) / tpf;
+				renderer->frameNumber += skip;
+				due += skip * tpf;
+			}
+			SeekMarquee(renderer, renderer->syncFrame
+				    + (LONGLONG) renderer->frameNumber);
+		}
+		while (due + tpf <= now) {
+			AdvanceMarquee(renderer);
+			renderer->frameNumber++;
+			due += tpf;
+		}
+
+		QueuedFrame *frame = &renderer->frames[write % FRAME_QUEUE_SIZE];
+		UpdateFields(renderer);
+		RenderMarquee(renderer, frame->dc);
+		GdiFlush();
+		frame->due = due;
+		frame->segment = ShownSegmentKey(renderer);
+		frame->scrolling = ShownSegment(renderer) && !renderer->isCurrentScreenCentered;
+		frame->scroll = renderer->scrollPosition;
+		frame->arrived = 0;
+		if (g_ticker.current && !g_ticker.stamped) {
+			frame->arrived = g_ticker.current->arrived;
+			g_ticker.stamped = TRUE;
+		}
+		if (g_ticker.active && !g_ticker.current)
+			g_ticker.blankShown = TRUE;
+
+		if (renderer->ringEnabled)
+			PublishFrame(renderer, frame);
+
+		atomic_store_explicit(&renderer->frameWrite, write + 1,
+				      memory_order_release);
+
+		if (!g_optSync)
+			AdvanceMarquee(renderer);
+		renderer->frameNumber++;
+	}
+
+	return 0;
+}
+
+/* A ticker segment read at arrived (QPC) has just been presented */
+void ReportTickerLatency(MarqueeRenderer *renderer, LONGLONG arrived)
+{
+	Ticker *ticker = &g_ticker;
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+
+	double latency = (double)(now.QuadPart - arrived) * 1000.0 / ticker->frequency;
+	ticker->lastLatency = latency;
+	if (latency > ticker->maxLatency)
+		ticker->maxLatency = latency;
+	ticker->totalLatency += latency;
+	ticker->measured++;
+
+	wchar_t text[160];
+	swprintf(text, 160,
+		 L"Marquee Renderer - ticker: %lu shown, latency %.1f ms (avg %.1f, max %.1f), %lu dropped",
+		 ticker->measured, latency,
+		 ticker->totalLatency / ticker->measured, ticker->maxLatency,
+		 (unsigned long)atomic_load(&ticker->dropped));
+	if (!g_optHeadless)
+		SetWindowTextW(renderer->hwnd, text);
+	wcscat(text, L"\n");
+	OutputDebugStringW(text);
+}
+
+/* UI thread: retire frames up to the newest one that is due and show it */
+void PresentDueFrame(MarqueeRenderer *renderer)
+{
+	ULONGLONG now = GetTickCount64();
+	unsigned long read =
+	    atomic_load_explicit(&renderer->frameRead, memory_order_relaxed);
+	unsigned long write =
+	    atomic_load_explicit(&renderer->frameWrite, memory_order_acquire);
+	unsigned long next = renderer->hasPresented ? read + 1 : read;
+	BOOL changed = FALSE;
+
+	LONGLONG arrived = 0;
+
+	while (next != write
+	       && renderer->frames[next % FRAME_QUEUE_SIZE].due <= now) {
+		if (renderer->frames[next % FRAME_QUEUE_SIZE].arrived)
+			arrived = renderer->frames[next % FRAME_QUEUE_SIZE].arrived;
+		read = next++;
+		renderer->hasPresented = TRUE;
+		changed = TRUE;
+	}
+
+	if (arrived)
+		ReportTickerLatency(renderer, arrived);
+
+	if (changed) {
+		atomic_store_explicit(&renderer->frameRead, read,
+				      memory_order_release);
+		SetEvent(renderer->frameFreed);
+		if (!g_optHeadless)
+			InvalidateRect(renderer->hwnd, NULL, FALSE);
+	}
+}
+
+void StopRenderThread(MarqueeRenderer *renderer)
+{
+	if (!renderer->renderThread)
+		return;
+
+	atomic_store(&renderer->stopRequested, 1);
+	SetEvent(renderer->frameFreed);
+	WaitForSingleObject(renderer->renderThread, INFINITE);
+	CloseHandle(renderer->renderThread);
+	renderer->renderThread = NULL;
+}
+
+/* Show the current state as a single frame while the render thread is stopped */
+void RenderStill(MarqueeRenderer *renderer)
+{
+	if (!renderer->frames[0].dc && !CreateFrameQueue(renderer))
+		return;
+
+	unsigned long write = atomic_load(&renderer->frameWrite);
+	QueuedFrame *frame = &renderer->frames[write % FRAME_QUEUE_SIZE];
+	RenderMarquee(renderer, frame->dc);
+	GdiFlush();
+	frame->due = GetTickCount64();
+	frame->segment = ShownSegmentKey(renderer);
+	frame->scrolling = FALSE;
+	frame->scroll = 0;
+	frame->arrived = 0;
+	if (renderer->ringEnabled)
+		PublishFrame(renderer, frame);
+
+	atomic_store(&renderer->frameWrite, write + 1);
+	atomic_store(&renderer->frameRead, write);
+	renderer->hasPresented = TRUE;
+	if (!g_optHeadless)
+		InvalidateRect(renderer->hwnd, NULL, FALSE);
+}
+
+void StartMarquee(MarqueeRenderer *renderer)
+{
+	StopRenderThread(renderer);
+	if (!renderer->frames[0].dc && !CreateFrameQueue(renderer))
+		return;
+
+	renderer->isRunning = TRUE;
+	renderer->scrollPosition = renderer->layout->config.screenWidth;
+	renderer->isCurrentScreenCentered = FALSE;
+	renderer->holdFrames = 0;
+
+	/* Keep the picture on screen until the first new frame is due */
+	unsigned long read = atomic_load(&renderer->frameRead);
+	atomic_store(&renderer->frameWrite, renderer->hasPresented ? read + 1 : read);
+
+	renderer->showStart = GetTickCount64();
+	renderer->frameNumber = 0;
+	renderer->fieldKey = -1;
+	g_playlist.loopsPlayed = 0;
+	g_playlist.entryFrame = 0;
+	if (g_optSync) {
+		BuildLoopTimeline(renderer);
+		ResyncMarquee(renderer);
+	}
+	atomic_store(&renderer->stopRequested, 0);
+	renderer->renderThread =
+	    CreateThread(NULL, 0, RenderThreadProc, renderer, 0, NULL);
+	if (!renderer->renderThread) {
+		renderer->isRunning = FALSE;
+		return;
+	}
+	SetThreadPriority(renderer->renderThread, THREAD_PRIORITY_ABOVE_NORMAL);
+
+	/* The presenter polls at half a frame so deadlines are met within TPF/2 */
+	int interval = renderer->layout->config.timePerFrame / 2;
+	SetTimer(renderer->hwnd, 1, interval > 10 ? interval : 10, NULL);
+}
+
+void StopMarquee(MarqueeRenderer *renderer)
+{
+	renderer->isRunning = FALSE;
+	KillTimer(renderer->hwnd, 1);
+	StopRenderThread(renderer);
+}
+
+void ResetMarquee(MarqueeRenderer *renderer)
+{
+	StopMarquee(renderer);
+	renderer->currentScreen = 0;
+	renderer->scrollPosition = renderer->layout->config.screenWidth;
+	renderer->isCurrentScreenCentered = FALSE;
+	renderer->holdFrames = 0;
+	RenderStill(renderer);
+}
+
+/*
+ * Read a playlist: one layout per line, optionally followed by " xN" to play
+ * it for N loops or " Ns" for at least N seconds (default one loop). Lines
+ * starting with '/' are comments, and relative paths are taken from the
+ * playlist's directory.
+ */
+BOOL LoadPlaylist(Playlist *playlist, const wchar_t *filename)
+{
+	FILE *file = _wfopen(filename, L"r, ccs=UTF-8");
+	if (!file)
+		return FALSE;
+
+	size_t dirLength = 0;
+	for (const wchar_t *p = filename; *p; p++) {
+		if (*p == L'\\' || *p == L'/')
+			dirLength = p - filename + 1;
+	}
+
+	wchar_t line[MAX_PATH + 32];
+	int capacity = 0;
+	BOOL ok = TRUE;
+	while (ok && fgetws(line, MAX_PATH + 32, file)) {
+		int len = (int)wcslen(line);
+		while (len > 0 && iswspace(line[len - 1]))
+			line[--len] = 0;
+		if (len == 0 || line[0] == L'/')
+			continue;
+
+		PlaylistEntry entry = { NULL, 1, 0 };
+		wchar_t *last = wcsrchr(line, L' ');
+		if (last) {
+			wchar_t *end = NULL;
+			if (last[1] == L'x' && iswdigit(last[2])) {
+				long loops = wcstol(&last[2], &end, 10);
+				if (*end == 0 && loops > 0) {
+					entry.loops = (int)loops;
+					*last = 0;
+				}
+			} else if (iswdigit(last[1])) {
+				double seconds = wcstod(&last[1], &end);
+				if (end[0] == L's' && end[1] == 0 && seconds > 0) {
+					entry.duration = (ULONGLONG) (seconds * 1000);
+					*last = 0;
+				}
+			}
+			len = (int)wcslen(line);
+			while (len > 0 && iswspace(line[len - 1]))
+				line[--len] = 0;
+		}
+
+		BOOL absolute = line[0] == L'\\' || (line[0] && line[1] == L':');
+		size_t prefix = absolute ? 0 : dirLength;
+		entry.path = malloc((prefix + len + 1) * sizeof(wchar_t));
+		if (playlist->count == capacity) {
+			int newCapacity = capacity ? capacity * 2 : 16;
+			PlaylistEntry *entries = realloc(playlist->entries,
+							 newCapacity * sizeof(PlaylistEntry));
+			if (entries) {
+				playlist->entries = entries;
+				capacity = newCapacity;
+			}
+		}
+		if (!entry.path || playlist->count == capacity) {
+			free(entry.path);
+			ok = FALSE;
+			break;
+		}
+		wmemcpy(entry.path, filename, prefix);
+		wmemcpy(entry.path + prefix, line, len + 1);
+		playlist->entries[playlist->count++] = entry;
+	}
+
+	fclose(file);
+	return ok && playlist->count > 0;
+}
+
+/* Show the first entry that loads and start loading the one after it */
+BOOL StartPlaylist(MarqueeRenderer *renderer)
+{
+	Playlist *playlist = &g_playlist;
+
+	for (int i = 0; i < playlist->count; i++) {
+		MarqueeLayout *layout = LoadLayout(playlist->entries[i].path);
+		if (!layout || layout->segmentCount == 0) {
+			DestroyLayout(layout);
+			continue;
+		}
+		layout->entry = i;
+		if (!ShowLayout(renderer, layout))
+			return FALSE;
+
+		playlist->loaded = i;
+		atomic_store(&playlist->next, NULL);
+		atomic_store(&playlist->retired, NULL);
+		atomic_store(&playlist->stop, 0);
+		atomic_store(&playlist->swapPosted, 0);
+		playlist->wake = CreateEventW(NULL, FALSE, FALSE, NULL);
+		if (playlist->wake) {
+			playlist->loader =
+			    CreateThread(NULL, 0, PlaylistLoaderProc, playlist, 0, NULL);
+		}
+		if (playlist->loader)
+			SetThreadPriority(playlist->loader, THREAD_PRIORITY_BELOW_NORMAL);
+
+		StartMarquee(renderer);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/* Stop the loader and forget the playlist. Only call while the render thread
+ * is stopped. */
+void StopPlaylist(void)
+{
+	Playlist *playlist = &g_playlist;
+
+	if (playlist->loader) {
+		atomic_store(&playlist->stop, 1);
+		SetEvent(playlist->wake);
+		WaitForSingleObject(playlist->loader, INFINITE);
+		CloseHandle(playlist->loader);
+		playlist->loader = NULL;
+	}
+	if (playlist->wake) {
+		CloseHandle(playlist->wake);
+		playlist->wake = NULL;
+	}
+	DestroyLayout(atomic_exchange(&playlist->next, NULL));
+	DestroyLayout(atomic_exchange(&playlist->retired, NULL));
+
+	for (int i = 0; i < playlist->count; i++)
+		free(playlist->entries[i].path);
+	free(playlist->entries);
+	playlist->entries = NULL;
+	playlist->count = 0;
+}
+
+/* A segment being read; the reader thread owns it until it is pushed */
+typedef struct {
+	char *bytes;		/* Line so far, UTF-8; grows with it */
+	int byteCount;
+	int byteCapacity;
+	wchar_t *line;		/* bytes converted */
+	int lineCapacity;
+	BOOL started;		/* Past a possible BOM */
+	TickerSegment *segment;
+} TickerParser;
+
+/* Append count bytes to the line being read. FALSE if out of memory. */
+BOOL AppendTickerBytes(TickerParser *parser, const char *bytes, int count)
+{
+	if (parser->byteCount + count > parser->byteCapacity) {
+		int capacity = parser->byteCapacity ? parser->byteCapacity : 256;
+		while (capacity < parser->byteCount + count)
+			capacity *= 2;
+		char *grown = realloc(parser->bytes, capacity);
+		if (!grown)
+			return FALSE;
+		parser->bytes = grown;
+		parser->byteCapacity = capacity;
+	}
+	memcpy(parser->bytes + parser->byteCount, bytes, count);
+	parser->byteCount += count;
+	return TRUE;
+}
+
+/* One complete input line, UTF-8 without its newline. FALSE once the ticker is
+ * stopping. */
+BOOL TickerLine(Ticker *ticker, TickerParser *parser)
+{
+	char *bytes = parser->bytes;
+	int count = parser->byteCount;
+
+	if (!parser->started) {
+		parser->started = TRUE;
+		if (count >= 3 && memcmp(bytes, "\xEF\xBB\xBF", 3) == 0) {
+			bytes += 3;
+			count -= 3;
+		}
+	}
+	if (count > 0 && bytes[count - 1] == '\r')
+		count--;
+
+	int len = count > 0 ? MultiByteToWideChar(CP_UTF8, 0, bytes, count, NULL, 0) : 0;
+	if (len + 1 > parser->lineCapacity) {
+		wchar_t *grown = realloc(parser->line, (len + 1) * sizeof(wchar_t));
+		if (!grown)
+			return TRUE;	/* Skip the line */
+		parser->line = grown;
+		parser->lineCapacity = len + 1;
+	}
+	wchar_t *line = parser->line;
+	if (len > 0)
+		MultiByteToWideChar(CP_UTF8, 0, bytes, count, line, len);
+	line[len] = 0;
+
+	if (len > 0 && line[0] == L'/')
+		return TRUE;
+
+	if (wcscmp(line, L"START") == 0) {
+		FreeTickerSegment(parser->segment);
+		parser->segment = calloc(1, sizeof(TickerSegment));
+	} else if (wcscmp(line, L"END") == 0) {
+		TickerSegment *segment = parser->segment;
+		parser->segment = NULL;
+		if (!segment)
+			return TRUE;
+
+		FillFields(&segment->segment, time(NULL));
+		EnterCriticalSection(&g_fontCache.lock);
+		MeasureSegment(ticker->font, &segment->segment);
+		LeaveCriticalSection(&g_fontCache.lock);
+
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+		segment->arrived = now.QuadPart;
+		if (!PushTickerSegment(ticker, segment)) {
+			FreeTickerSegment(segment);
+			return FALSE;
+		}
+	} else if (parser->segment
+		   && parser->segment->segment.lineCount < MAX_LINES_PER_SEGMENT) {
+		/* Empty lines in segments are kept, as in layout files */
+		TextSegment *segment = &parser->segment->segment;
+		ParseColoredLine(line, &segment->lines[segment->lineCount++]);
+	}
+	return TRUE;
+}
+
+/* Read handle until end of input. FALSE once the ticker is stopping. */
+BOOL ReadTickerStream(Ticker *ticker, HANDLE handle)
+{
+	TickerParser parser;
+	char buffer[TICKER_READ_SIZE];
+	DWORD got = 0;
+	BOOL running = TRUE;
+
+	memset(&parser, 0, sizeof(parser));
+	while (running && !atomic_load(&ticker->stop)
+	       && ReadFile(handle, buffer, sizeof(buffer), &got, NULL) && got > 0) {
+		const char *start = buffer;
+		const char *end = buffer + got;
+
+		while (running && start < end) {
+			const char *newline = memchr(start, '\n', end - start);
+			const char *stop = newline ? newline : end;
+
+			/* Lines may span any number of reads */
+			if (!AppendTickerBytes(&parser, start, (int)(stop - start)))
+				parser.byteCount = 0;	/* Out of memory: lose the line */
+			if (newline) {
+				running = TickerLine(ticker, &parser);
+				parser.byteCount = 0;
+			}
+			start = stop + 1;
+		}
+	}
+
+	/* The last line need not end in a newline */
+	if (running && !atomic_load(&ticker->stop) && parser.byteCount > 0)
+		running = TickerLine(ticker, &parser);
+
+	/* A segment cut off by the end of input is not shown */
+	FreeTickerSegment(parser.segment);
+	free(parser.bytes);
+	free(parser.line);
+	return running && !atomic_load(&ticker->stop);
+}
+
+DWORD WINAPI TickerReaderProc(LPVOID param)
+{
+	Ticker *ticker = (Ticker *) param;
+	const wchar_t *source = ticker->source;
+
+	if (wcscmp(source, L"-") == 0) {
+		ReadTickerStream(ticker, GetStdHandle(STD_INPUT_HANDLE));
+	} else if (wcsncmp(source, L"\\\\.\\pipe\\", 9) == 0) {
+		/* Serve one writer at a time, for as long as the ticker runs */
+		HANDLE pipe = CreateNamedPipeW(source, PIPE_ACCESS_INBOUND,
+					       PIPE_TYPE_BYTE | PIPE_READMODE_BYTE |
+					       PIPE_WAIT, 1, 0, TICKER_READ_SIZE,
+					       0, NULL);
+		if (pipe == INVALID_HANDLE_VALUE)
+			return 1;
+		while (!atomic_load(&ticker->stop)) {
+			if (!ConnectNamedPipe(pipe, NULL)
+			    && GetLastError() != ERROR_PIPE_CONNECTED) {
+				if (atomic_load(&ticker->stop))
+					break;
+				Sleep(100);
+				continue;
+			}
+			BOOL running = ReadTickerStream(ticker, pipe);
+			DisconnectNamedPipe(pipe);
+			if (!running)
+				break;
+		}
+		CloseHandle(pipe);
+	} else {
+		HANDLE file = CreateFileW(source, GENERIC_READ,
+					  FILE_SHARE_READ | FILE_SHARE_WRITE,
+					  NULL, OPEN_EXISTING, 0, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+			return 1;
+		ReadTickerStream(ticker, file);
+		CloseHandle(file);
+	}
+	return 0;
+}
+
+/* Show segments from source as they arrive. The layout on screen supplies the
+ * header; its own segments are not shown. */
+BOOL StartTicker(MarqueeRenderer *renderer, const wchar_t *source, BOOL dropOldest)
+{
+	Ticker *ticker = &g_ticker;
+	LARGE_INTEGER frequency;
+
+	QueryPerformanceFrequency(&frequency);
+	ticker->frequency = frequency.QuadPart;
+	ticker->source = source;
+	ticker->dropOldest = dropOldest;
+	ticker->font = renderer->layout->cachedFont;
+	ticker->current = NULL;
+	ticker->shown = 0;
+	ticker->stamped = FALSE;
+	ticker->blankShown = FALSE;
+	ticker->lastLatency = ticker->maxLatency = ticker->totalLatency = 0;
+	ticker->measured = 0;
+	atomic_store(&ticker->write, 0);
+	atomic_store(&ticker->read, 0);
+	atomic_store(&ticker->dropped, 0);
+	atomic_store(&ticker->stop, 0);
+
+	ticker->arrived = CreateEventW(NULL, FALSE, FALSE, NULL);
+	ticker->spaceFreed = CreateEventW(NULL, FALSE, FALSE, NULL);
+	if (ticker->arrived && ticker->spaceFreed)
+		ticker->reader = CreateThread(NULL, 0, TickerReaderProc, ticker, 0, NULL);
+	if (!ticker->reader) {
+		if (ticker->arrived)
+			CloseHandle(ticker->arrived);
+		if (ticker->spaceFreed)
+			CloseHandle(ticker->spaceFreed);
+		ticker->arrived = ticker->spaceFreed = NULL;
+		return FALSE;
+	}
+
+	ticker->active = TRUE;
+	StartMarquee(renderer);
+	return TRUE;
+}
+
+/* Stop reading and drop whatever was not shown. Only call while the render
+ * thread is stopped. */
+void StopTicker(void)
+{
+	Ticker *ticker = &g_ticker;
+
+	if (!ticker->active)
+		return;
+
+	if (ticker->reader) {
+		/* The reader may be blocked in ReadFile or ConnectNamedPipe */
+		atomic_store(&ticker->stop, 1);
+		do {
+			SetEvent(ticker->spaceFreed);
+			CancelSynchronousIo(ticker->reader);
+		} while (WaitForSingleObject(ticker->reader, 50) == WAIT_TIMEOUT);
+		CloseHandle(ticker->reader);
+		ticker->reader = NULL;
+	}
+	CloseHandle(ticker->arrived);
+	CloseHandle(ticker->spaceFreed);
+	ticker->arrived = ticker->spaceFreed = NULL;
+
+	FreeTickerSegment(ticker->current);
+	ticker->current = NULL;
+	TickerSegment *segment;
+	while ((segment = PopTickerSegment(ticker)) != NULL)
+		FreeTickerSegment(segment);
+	ticker->active = FALSE;
+}
+
 LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 {
 	switch (uMsg) {
@@ -586,13 +2869,20 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 		g_renderer =
 		    (MarqueeRenderer *) malloc(sizeof(MarqueeRenderer));
 		InitRenderer(g_renderer, hwnd);
+		if (!g_renderer->layout)
+			return -1;
 		break;
 
 	case WM_DESTROY:
 		if (g_renderer) {
+			StopMarquee(g_renderer);
+			StopPlaylist();
+			StopTicker();
 			CleanupRenderer(g_renderer);
 			free(g_renderer);
 		}
+		DestroyFontCache();
+		DestroyFieldValues();
 		PostQuitMessage(0);
 		break;
 
@@ -600,17 +2890,44 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 		{
 			PAINTSTRUCT ps;
 			HDC hdc = BeginPaint(hwnd, &ps);
-			if (g_renderer) {
-				RenderMarquee(g_renderer, hdc);
+			RECT rect;
+			GetClientRect(hwnd, &rect);
+			FillRect(hdc, &rect, (HBRUSH) GetStockObject(BLACK_BRUSH));
+			if (g_renderer && g_renderer->hasPresented) {
+				unsigned long read =
+				    atomic_load(&g_renderer->frameRead);
+				BitBlt(hdc, 0, 30, g_renderer->frameWidth,
+				       g_renderer->frameHeight,
+				       g_renderer->frames[read %
+							  FRAME_QUEUE_SIZE].dc,
+				       0, 0, SRCCOPY);
 			}
 			EndPaint(hwnd, &ps);
-			break;
+			return 0;
 		}
 
+	case WM_ERASEBKGND:
+		return 1;	/* WM_PAINT covers the whole client area */
+
 	case WM_TIMER:
 		if (g_renderer) {
-			UpdateMarquee(g_renderer);
+			PresentDueFrame(g_renderer);
+		}
+		break;
+
+	case WM_APP_SWAPLAYOUT:
+		/* The render thread has played a little into the next loop by now;
+		 * a new frame size or TPF needs the frame queue rebuilt anyway */
+		if (g_renderer && g_renderer->isRunning) {
+			StopMarquee(g_renderer);
+			MarqueeLayout *next = atomic_exchange(&g_playlist.next, NULL);
+			if (next) {
+				ShowLayout(g_renderer, next);
+				SetEvent(g_playlist.wake);
+			}
+			StartMarquee(g_renderer);
 		}
+		atomic_store(&g_playlist.swapPosted, 0);
 		break;
 
 	case WM_KEYDOWN:
@@ -642,6 +2959,10 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 					    OFN_PATHMUSTEXIST;
 
 					if (GetOpenFileNameW(&ofn)) {
+						/* The render thread kept playing while the dialog was open */
+						StopMarquee(g_renderer);
+						StopPlaylist();
+						StopTicker();
 						if (LoadLayoutFile
 						    (g_renderer, filename)) {
 							StartMarquee
@@ -666,6 +2987,66 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 	return DefWindowProcW(hwnd, uMsg, wParam, lParam);
 }
 
+/* Parse --options into the g_opt* globals. Everything else is the layout path;
+ * unquoted paths with spaces are joined back together as before. */
+wchar_t *ParseCommandLine(void)
+{
+	int argc = 0;
+	LPWSTR *argv = CommandLineToArgvW(GetCommandLineW(), &argc);
+	if (!argv)
+		return NULL;
+
+	size_t total = 1;
+	for (int i = 1; i < argc; i++) {
+		total += wcslen(argv[i]) + 1;
+	}
+	wchar_t *path = malloc(total * sizeof(wchar_t));
+	if (!path) {
+		LocalFree(argv);
+		return NULL;
+	}
+	path[0] = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (wcscmp(argv[i], L"--headless") == 0) {
+			g_optHeadless = TRUE;
+		} else if (wcscmp(argv[i], L"--ring") == 0) {
+			g_optRing = TRUE;
+		} else if (wcscmp(argv[i], L"--ring-name") == 0 && i + 1 < argc) {
+			g_optRing = TRUE;
+			wcsncpy(g_optRingName, argv[++i], FRAMERING_MAX_NAME);
+			g_optRingName[FRAMERING_MAX_NAME] = 0;
+		} else if (wcscmp(argv[i], L"--ring-slots") == 0 && i + 1 < argc) {
+			int slots = _wtoi(argv[++i]);
+			if (slots > 0 && slots <= FRAMERING_MAX_SLOTS)
+				g_optRingSlots = slots;
+		} else if (wcscmp(argv[i], L"--playlist") == 0 && i + 1 < argc) {
+			free(g_optPlaylist);
+			g_optPlaylist = _wcsdup(argv[++i]);
+		} else if (wcscmp(argv[i], L"--ticker") == 0 && i + 1 < argc) {
+			free(g_optTicker);
+			g_optTicker = _wcsdup(argv[++i]);
+		} else if (wcscmp(argv[i], L"--ticker-policy") == 0 && i + 1 < argc) {
+			g_optTickerDropOldest = wcscmp(argv[++i], L"drop-oldest") == 0;
+		} else if (wcscmp(argv[i], L"--software") == 0) {
+			g_optSoftware = TRUE;
+		} else if (wcscmp(argv[i], L"--values") == 0 && i + 1 < argc) {
+			free(g_optValues);
+			g_optValues = _wcsdup(argv[++i]);
+		} else if (wcscmp(argv[i], L"--sync") == 0 && i + 1 < argc) {
+			g_optSync = TRUE;
+			g_optSyncEpoch = _wcstoui64(argv[++i], NULL, 10) * 1000;
+		} else {
+			if (path[0] != 0)
+				wcscat(path, L" ");
+			wcscat(path, argv[i]);
+		}
+	}
+
+	LocalFree(argv);
+	return path;
+}
+
 int WINAPI
 wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLine,
 	 int nCmdShow)
@@ -673,6 +3054,10 @@ wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLine,
 	(void)hPrevInstance;	/* Suppress unused parameter warning */
 	//(void)lpCmdLine;     /* Suppress unused parameter warning */
 
+	InitFontCache();
+	InitFieldValues();
+	g_blendRow = BlendSelectKernel();
+
 	WNDCLASSW wc;
 	memset(&wc, 0, sizeof(wc));
 	wc.lpfnWndProc = WindowProc;
@@ -698,33 +3083,67 @@ wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLine,
 	if (!hwnd)
 		return 0;
 
-	ShowWindow(hwnd, nCmdShow);
-	UpdateWindow(hwnd);
-
-	if (*lpCmdLine != 0) {
-		size_t lpCmdLineLen = wcslen(lpCmdLine);
-		LPWSTR trimmed = malloc((lpCmdLineLen + 1) * sizeof(wchar_t));
+	wchar_t *layoutPath = ParseCommandLine();
 
-		int offset = 0;
+	if (!g_optHeadless) {
+		ShowWindow(hwnd, nCmdShow);
+		UpdateWindow(hwnd);
+	}
 
-		for (size_t i = 0; i < lpCmdLineLen; i++) {
-			if (lpCmdLine[i] == '"')
-				continue;
-			if (lpCmdLine[i] == 0)
-				break;
-			trimmed[offset] = lpCmdLine[i];
-			offset++;
+	if (g_optTicker) {
+		/* Segments come and go with the input; there is no loop to follow */
+		g_optSync = FALSE;
+		BOOL loaded = FALSE;
+		if (layoutPath && *layoutPath != 0) {
+			loaded = LoadLayoutFile(g_renderer, layoutPath);
+		} else {
+			/* No header: the defaults, sized as a layout file would be */
+			MarqueeLayout *layout = CreateLayout();
+			if (layout) {
+				PrepareLayout(layout);
+				loaded = ShowLayout(g_renderer, layout);
+			}
 		}
-		trimmed[offset] = 0;	// add null byte terminator
-
-		if (LoadLayoutFile(g_renderer, trimmed))
+		if (!loaded || !StartTicker(g_renderer, g_optTicker,
+					    g_optTickerDropOldest)) {
+			if (g_optHeadless) {
+				free(layoutPath);
+				return 1;
+			}
+			MessageBoxW(hwnd, g_optTicker,
+				    L"Could not start the ticker!",
+				    MB_OK | MB_ICONERROR);
+		}
+	} else if (g_optPlaylist) {
+		/* --sync follows a single layout's timeline */
+		g_optSync = FALSE;
+		if (!LoadPlaylist(&g_playlist, g_optPlaylist)
+		    || !StartPlaylist(g_renderer)) {
+			StopPlaylist();
+			if (g_optHeadless) {
+				free(layoutPath);
+				return 1;
+			}
+			MessageBoxW(hwnd, g_optPlaylist,
+				    L"Could not play the playlist!",
+				    MB_OK | MB_ICONERROR);
+		}
+	} else if (layoutPath && *layoutPath != 0) {
+		if (LoadLayoutFile(g_renderer, layoutPath)) {
 			StartMarquee(g_renderer);
-		else
+		} else if (g_optHeadless) {
+			free(layoutPath);
+			return 1;
+		} else {
 			MessageBoxW(hwnd, lpCmdLine,
 				    L"Could not open Marquee Layout!",
 				    MB_OK | MB_ICONERROR);
-		free(trimmed);
+		}
+	} else if (g_optHeadless) {
+		free(layoutPath);
+		return 1;	/* Nothing to show and no window to load from */
 	}
+	free(layoutPath);
 
 	MSG msg;
 	while (GetMessage(&msg, NULL, 0, 0)) {
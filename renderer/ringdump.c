@@ -0,0 +1,420 @@
+/* ringdump.c - Reference consumer (and test producer) for the renderer frame ring */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "framering.h"
+#include "blend.h"
+#include "framedelta.h"
+
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+static void SleepMs(unsigned ms)
+{
+#ifdef _WIN32
+	Sleep(ms);
+#else
+	struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000L };
+	nanosleep(&ts, NULL);
+#endif
+}
+
+static void PrintUsage(const char *program)
+{
+	printf("Usage: %s [options]\n", program);
+	printf("Attaches to the renderer frame ring and consumes frames.\n\n");
+	printf("  --name NAME     Ring name (default %s)\n", FRAMERING_DEFAULT_NAME);
+	printf("  --count N       Stop after N frames (default: run until the producer exits)\n");
+	printf("  --out FILE      Append every frame as raw BGRX8888 to FILE\n");
+	printf("  --delta FILE    Write the frames to FILE as a delta stream (see framedelta.h)\n");
+	printf("  --keyframe N    Frames between keyframes of a delta stream (default %d)\n",
+	       FRAMEDELTA_DEFAULT_KEY_INTERVAL);
+	printf("  --decode FILE   Decode a delta stream and verify every frame; --out gets the frames\n");
+	printf("  --latest        Skip pending frames and always take the newest one\n");
+	printf("  --pattern WxH   Act as producer and publish a moving test pattern instead\n");
+	printf("  --fps N         Test pattern frame rate (default 20)\n");
+	printf("  --blend-check   Check the SIMD text blend kernels against the scalar one\n");
+}
+
+/* FNV-1a over the pixel rows, printed so runs can be compared frame by frame */
+static uint32_t FrameChecksum(const uint8_t *pixels, size_t size)
+{
+	uint32_t hash = 2166136261U;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= pixels[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/* Compare kernel with the scalar blend on random rows of every length up to
+ * 67 pixels and every offset within a vector; returns mismatches */
+static long CheckBlendKernel(const char *name, BlendRowFunction kernel)
+{
+	uint8_t expected[72 * 4], actual[72 * 4], coverage[72];
+	uint32_t seed = 12345;
+	long mismatches = 0;
+
+	for (int round = 0; round < 20000; round++) {
+		int offset = round % 8;
+		int count = round % 68;
+		uint32_t color = 0;
+		for (int i = 0; i < (int)sizeof(expected); i++) {
+			seed = seed * 1103515245U + 12345U;
+			expected[i] = (uint8_t)(seed >> 16);
+		}
+		for (int i = 0; i < (int)sizeof(coverage); i++) {
+			seed = seed * 1103515245U + 12345U;
+			/* Runs of empty and solid coverage, as in real glyphs */
+			unsigned r = (seed >> 16) & 0xFF;
+			coverage[i] = round % 3 == 0 ? (r < 96 ? 0 : r > 160 ? 255 : (uint8_t)r) : (uint8_t)r;
+		}
+		seed = seed * 1103515245U + 12345U;
+		color = seed & 0xFFFFFF;
+
+		memcpy(actual, expected, sizeof(actual));
+		BlendCoverageScalar(expected + offset * 4, coverage + offset, count, color);
+		kernel(actual + offset * 4, coverage + offset, count, color);
+		if (memcmp(expected, actual, sizeof(actual)) != 0)
+			mismatches++;
+	}
+
+	printf("  %-6s %s\n", name, mismatches ? "MISMATCH" : "bit-exact");
+	return mismatches;
+}
+
+static int RunBlendCheck(void)
+{
+	long failures = 0;
+
+	/* The scalar kernel against exact rounding, for every input */
+	for (unsigned a = 0; a < 256; a++) {
+		for (unsigned d = 0; d < 256; d++) {
+			for (unsigned c = 0; c < 256; c++) {
+				uint8_t pixel[4] = { (uint8_t)d, (uint8_t)d, (uint8_t)d, (uint8_t)d };
+				uint8_t coverage = (uint8_t)a;
+				BlendCoverageScalar(pixel, &coverage, 1, c | (c << 8) | (c << 16));
+				unsigned sum = d * (255 - a) + c * a;
+				unsigned rounded = (sum * 2 + 255) / 510;
+				unsigned alpha = (d * (255 - a) + 255 * a) * 2 + 255;
+				if (pixel[0] != rounded || pixel[1] != rounded || pixel[2] != rounded
+				    || pixel[3] != alpha / 510)
+					failures++;
+			}
+		}
+	}
+	printf("Blend kernels:\n  %-6s %s\n", "scalar", failures ? "WRONG" : "exact");
+
+#ifdef BLEND_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		failures += CheckBlendKernel("sse2", BlendCoverageSSE2);
+	else
+		printf("  %-6s not supported here\n", "sse2");
+	if (__builtin_cpu_supports("avx2"))
+		failures += CheckBlendKernel("avx2", BlendCoverageAVX2);
+	else
+		printf("  %-6s not supported here\n", "avx2");
+#endif
+
+	BlendRowFunction selected = BlendSelectKernel();
+	const char *name = "scalar";
+#ifdef BLEND_X86
+	if (selected == BlendCoverageAVX2)
+		name = "avx2";
+	else if (selected == BlendCoverageSSE2)
+		name = "sse2";
+#endif
+	printf("The renderer uses %s here\n", name);
+
+	return failures ? 1 : 0;
+}
+
+static int RunPattern(const char *name, uint32_t width, uint32_t height, unsigned fps, long count)
+{
+	FrameRing ring;
+	if (!FrameRingCreate(&ring, name, width, height, FRAMERING_DEFAULT_SLOTS)) {
+		fprintf(stderr, "Error: Could not create frame ring '%s'\n", name);
+		return 1;
+	}
+
+	printf("Publishing %ux%u test pattern on '%s' at %u fps\n", width, height, name, fps);
+
+	unsigned interval = fps > 0 ? 1000 / fps : 50;
+	long published = -1;
+	for (long frame = 0; count < 0 || frame < count; frame++) {
+		FrameSlot *slot = FrameRingBeginWrite(&ring);
+		if (slot) {
+			uint8_t *pixels = FrameRingPixels(slot);
+			for (uint32_t y = 0; y < height; y++) {
+				uint8_t *row = pixels + (size_t)y * ring.header->stride;
+				for (uint32_t x = 0; x < width; x++) {
+					uint32_t phase = (x + (uint32_t)frame * 3) % 64;
+					row[x * 4 + 0] = (uint8_t)(phase * 4);
+					row[x * 4 + 1] = (uint8_t)(y * 255 / height);
+					row[x * 4 + 2] = (uint8_t)(255 - phase * 4);
+					row[x * 4 + 3] = 0;
+				}
+			}
+			slot->timestampMs = FrameRingClockMs();
+			slot->dueMs = slot->timestampMs;
+			slot->segment = (uint32_t)(frame / 100);
+			/* The pattern scrolls left 3 px a frame */
+			slot->shift = published >= 0 ? (uint32_t)(frame - published) * 3 : 0;
+			FrameRingPublish(&ring);
+			published = frame;
+		}
+		SleepMs(interval);
+	}
+
+	printf("Done, %llu frames dropped\n",
+	       (unsigned long long)atomic_load_explicit(&ring.header->dropped, memory_order_relaxed));
+	FrameRingClose(&ring);
+	return 0;
+}
+
+static int RunConsumer(const char *name, long count, const char *outPath, int latest,
+		       const char *deltaPath, uint32_t keyInterval)
+{
+	FrameRing ring;
+	for (int attempt = 0; !FrameRingOpen(&ring, name); attempt++) {
+		if (attempt == 0)
+			printf("Waiting for frame ring '%s'...\n", name);
+		SleepMs(100);
+	}
+
+	FrameRingHeader *header = ring.header;
+	printf("Attached: %ux%u, stride %u, %u slots\n", header->width, header->height, header->stride, header->slotCount);
+
+	FILE *out = NULL;
+	if (outPath) {
+		out = fopen(outPath, "ab");
+		if (!out) {
+			fprintf(stderr, "Error: Could not open '%s'\n", outPath);
+			FrameRingClose(&ring);
+			return 1;
+		}
+	}
+
+	FILE *delta = NULL;
+	FrameDeltaEncoder encoder;
+	memset(&encoder, 0, sizeof(encoder));
+	encoder.keyInterval = keyInterval;
+	uint64_t deltaBytes = 0;
+	if (deltaPath) {
+		delta = fopen(deltaPath, "wb");
+		if (!delta) {
+			fprintf(stderr, "Error: Could not open '%s'\n", deltaPath);
+			if (out)
+				fclose(out);
+			FrameRingClose(&ring);
+			return 1;
+		}
+		uint8_t streamHeader[8];
+		memcpy(streamHeader, FRAMEDELTA_MAGIC, 4);
+		FrameDeltaPut32(streamHeader + 4, FRAMEDELTA_VERSION);
+		fwrite(streamHeader, 1, sizeof(streamHeader), delta);
+		deltaBytes = sizeof(streamHeader);
+	}
+
+	size_t frameBytes = (size_t)header->stride * header->height;
+	uint64_t expected = atomic_load_explicit(&header->readSeq, memory_order_relaxed);
+	uint64_t skipped = 0, gaps = 0;
+	long received = 0;
+
+	while (count < 0 || received < count) {
+		if (latest)
+			skipped += FrameRingSkipToLatest(&ring);
+
+		FrameSlot *slot = FrameRingPeek(&ring);
+		if (!slot) {
+			if (!atomic_load_explicit(&header->producerAlive, memory_order_acquire))
+				break;
+			SleepMs(1);
+			continue;
+		}
+
+		/* The slot is ours until released: read the pixels in place */
+		const uint8_t *pixels = FrameRingPixels(slot);
+		int contiguous = slot->sequence == expected;
+		if (slot->sequence != expected)
+			gaps += slot->sequence - expected;
+		expected = slot->sequence + 1;
+
+		/* After a gap the shift is relative to a frame we never saw */
+		if (delta && FrameDeltaEncode(&encoder, pixels, header->stride, header->width,
+					      header->height, contiguous && received > 0 ? slot->shift : 0)) {
+			fwrite(encoder.record, 1, encoder.recordSize, delta);
+			fflush(delta);
+			deltaBytes += encoder.recordSize;
+		}
+
+		uint64_t now = FrameRingClockMs();
+		uint64_t latency = now - slot->timestampMs;
+		long long due = (long long)(slot->dueMs - now);
+		printf("frame %llu segment %u latency %llums due %+lldms checksum %08x\n",
+		       (unsigned long long)slot->sequence, slot->segment,
+		       (unsigned long long)latency, due, FrameChecksum(pixels, frameBytes));
+		if (out)
+			fwrite(pixels, 1, frameBytes, out);
+
+		FrameRingRelease(&ring);
+		received++;
+	}
+
+	printf("Received %ld frames, skipped %llu, sequence gaps %llu, producer drops %llu\n",
+	       received, (unsigned long long)skipped, (unsigned long long)gaps,
+	       (unsigned long long)atomic_load_explicit(&header->dropped, memory_order_relaxed));
+	if (delta) {
+		uint64_t rawBytes = (uint64_t)received * header->width * header->height * 4;
+		printf("Delta stream: %llu bytes for %llu raw, %.1fx smaller\n",
+		       (unsigned long long)deltaBytes, (unsigned long long)rawBytes,
+		       deltaBytes ? (double)rawBytes / deltaBytes : 0.0);
+		fclose(delta);
+		FrameDeltaEncoderFree(&encoder);
+	}
+
+	if (out)
+		fclose(out);
+	FrameRingClose(&ring);
+	return 0;
+}
+
+/* Reference decoder: rebuild every frame of a delta stream and check it
+ * against the checksum the encoder recorded */
+static int RunDecode(const char *path, const char *outPath)
+{
+	FILE *in = fopen(path, "rb");
+	if (!in) {
+		fprintf(stderr, "Error: Could not open '%s'\n", path);
+		return 1;
+	}
+
+	uint8_t streamHeader[8];
+	if (fread(streamHeader, 1, sizeof(streamHeader), in) != sizeof(streamHeader)
+	    || memcmp(streamHeader, FRAMEDELTA_MAGIC, 4) != 0
+	    || FrameDeltaGet32(streamHeader + 4) != FRAMEDELTA_VERSION) {
+		fprintf(stderr, "Error: '%s' is not a delta stream\n", path);
+		fclose(in);
+		return 1;
+	}
+
+	FILE *out = NULL;
+	if (outPath) {
+		out = fopen(outPath, "ab");
+		if (!out) {
+			fprintf(stderr, "Error: Could not open '%s'\n", outPath);
+			fclose(in);
+			return 1;
+		}
+	}
+
+	FrameDeltaDecoder decoder;
+	memset(&decoder, 0, sizeof(decoder));
+	uint8_t *payload = NULL;
+	size_t capacity = 0;
+	uint64_t frames = 0, keys = 0, failures = 0;
+	uint64_t streamBytes = sizeof(streamHeader), rawBytes = 0;
+	uint8_t recordHeader[FRAMEDELTA_HEADER_SIZE];
+
+	while (fread(recordHeader, 1, sizeof(recordHeader), in) == sizeof(recordHeader)) {
+		FrameDeltaRecord record;
+		FrameDeltaReadHeader(recordHeader, &record);
+		if (record.size > capacity) {
+			uint8_t *grown = realloc(payload, record.size);
+			if (!grown) {
+				failures++;
+				break;
+			}
+			payload = grown;
+			capacity = record.size;
+		}
+		if (fread(payload, 1, record.size, in) != record.size) {
+			printf("frame %llu truncated\n", (unsigned long long)frames);
+			failures++;
+			break;
+		}
+
+		int result = FrameDeltaDecode(&decoder, &record, payload);
+		printf("frame %llu %s shift %u, %u bytes, checksum %08x %s\n",
+		       (unsigned long long)frames, record.type == FRAMEDELTA_KEY ? "key" : "delta",
+		       record.shift, record.size, record.checksum,
+		       result > 0 ? "ok" : result == 0 ? "MISMATCH" : "MALFORMED");
+		if (result <= 0)
+			failures++;
+		if (result >= 0 && out)
+			fwrite(decoder.frame, 1, (size_t)decoder.width * decoder.height * 4, out);
+
+		frames++;
+		if (record.type == FRAMEDELTA_KEY)
+			keys++;
+		streamBytes += sizeof(recordHeader) + record.size;
+		rawBytes += (uint64_t)record.width * record.height * 4;
+	}
+
+	printf("Decoded %llu frames (%llu keyframes), %llu failed; %llu bytes for %llu raw, %.1fx smaller\n",
+	       (unsigned long long)frames, (unsigned long long)keys, (unsigned long long)failures,
+	       (unsigned long long)streamBytes, (unsigned long long)rawBytes,
+	       streamBytes ? (double)rawBytes / streamBytes : 0.0);
+
+	free(payload);
+	FrameDeltaDecoderFree(&decoder);
+	if (out)
+		fclose(out);
+	fclose(in);
+	return failures ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *name = FRAMERING_DEFAULT_NAME;
+	const char *outPath = NULL;
+	long count = -1;
+	int latest = 0;
+	unsigned patternWidth = 0, patternHeight = 0, fps = 20;
+	int blendCheck = 0;
+	const char *deltaPath = NULL, *decodePath = NULL;
+	uint32_t keyInterval = FRAMEDELTA_DEFAULT_KEY_INTERVAL;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--name") == 0 && i + 1 < argc) {
+			name = argv[++i];
+		} else if (strcmp(argv[i], "--count") == 0 && i + 1 < argc) {
+			count = strtol(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+			outPath = argv[++i];
+		} else if (strcmp(argv[i], "--latest") == 0) {
+			latest = 1;
+		} else if (strcmp(argv[i], "--pattern") == 0 && i + 1 < argc) {
+			if (sscanf(argv[++i], "%ux%u", &patternWidth, &patternHeight) != 2) {
+				PrintUsage(argv[0]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+			fps = (unsigned)strtoul(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "--delta") == 0 && i + 1 < argc) {
+			deltaPath = argv[++i];
+		} else if (strcmp(argv[i], "--keyframe") == 0 && i + 1 < argc) {
+			keyInterval = (uint32_t)strtoul(argv[++i], NULL, 10);
+			if (keyInterval == 0)
+				keyInterval = 1;
+		} else if (strcmp(argv[i], "--decode") == 0 && i + 1 < argc) {
+			decodePath = argv[++i];
+		} else if (strcmp(argv[i], "--blend-check") == 0) {
+			blendCheck = 1;
+		} else {
+			PrintUsage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (blendCheck)
+		return RunBlendCheck();
+	if (decodePath)
+		return RunDecode(decodePath, outPath);
+	if (patternWidth > 0 && patternHeight > 0)
+		return RunPattern(name, patternWidth, patternHeight, fps, count);
+	return RunConsumer(name, count, outPath, latest, deltaPath, keyInterval);
+}
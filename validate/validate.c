@@ -1,40 +1,215 @@
 /* validate.c - Standalone Marquee Layout File Validator */
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <wchar.h>
 #include <locale.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #ifdef _WIN32
+#include <winsock2.h>
+#include <afunix.h>
 #include <windows.h>
 #include <io.h>
 #include <fcntl.h>
+#include <direct.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define closesocket close
 #endif
 
 #define VALIDATE
 #include "../rc/resource.h"
+#include "../renderer/cellwidth.h"
 
 #define MAX_ERROR_MSG 512
-#define MAX_ERRORS 1000
 #define MAX_NESTING_DEPTH 255
+#define LEGACY_LINE_LENGTH 1024	/* Line buffer of renderers before lines could grow */
+#define VALIDATOR_NAME L"validate"
+#define VALIDATOR_VERSION L"2.2.0"
+/* Part of every cache key: bump it in any change that alters the diagnostics
+ * reported for the same bytes, so older cache entries are not reused */
+#define CACHE_RESULTS_VERSION 3
+
+/* Diagnostic codes. Reported as MLY<code + 1>, so only ever append. */
+typedef enum {
+	DIAG_DUPLICATE_LPS,
+	DIAG_LPS_NOT_POSITIVE,
+	DIAG_DUPLICATE_SW,
+	DIAG_SW_NOT_POSITIVE,
+	DIAG_DUPLICATE_SH,
+	DIAG_SH_NOT_POSITIVE,
+	DIAG_DUPLICATE_SC,
+	DIAG_SC_NOT_POSITIVE,
+	DIAG_DUPLICATE_SD,
+	DIAG_SD_NEGATIVE,
+	DIAG_CD_NEGATIVE,
+	DIAG_DUPLICATE_TPF,
+	DIAG_TPF_NOT_POSITIVE,
+	DIAG_TPF_TOO_LOW,
+	DIAG_DUPLICATE_PM,
+	DIAG_PM_NOT_POSITIVE,
+	DIAG_PM_TOO_HIGH,
+	DIAG_START_IN_SEGMENT,
+	DIAG_END_WITHOUT_START,
+	DIAG_TEXT_OUTSIDE_SEGMENT,
+	DIAG_INVALID_HEX_COLOR,
+	DIAG_COLOR_SPEC_LENGTH,
+	DIAG_NESTING_TOO_DEEP,
+	DIAG_UNMATCHED_QUOTE,
+	DIAG_UNCLOSED_BACKTICKS,
+	DIAG_MISSING_LPS,
+	DIAG_MISSING_SW,
+	DIAG_MISSING_SH,
+	DIAG_MISSING_SC,
+	DIAG_MISSING_SD,
+	DIAG_SEGMENT_COUNT,
+	DIAG_UNCLOSED_SEGMENT,
+	DIAG_LONG_LINE,
+	DIAG_COUNT
+} DiagnosticCode;
 
 typedef struct {
-	int lineNumber;
-	wchar_t message[MAX_ERROR_MSG];
 	int severity;		/* 0=info, 1=warning, 2=error */
-} ValidationError;
+	const wchar_t *format;	/* swprintf format, gets the record's args */
+} DiagnosticInfo;
+
+const DiagnosticInfo diagnosticTable[DIAG_COUNT] = {
+	{2, L"Duplicate LPS command"},
+	{2, L"LPS must be positive"},
+	{2, L"Duplicate SW command"},
+	{2, L"SW must be positive"},
+	{2, L"Duplicate SH command"},
+	{2, L"SH must be positive"},
+	{2, L"Duplicate SC command"},
+	{2, L"SC must be positive"},
+	{2, L"Duplicate SD command"},
+	{2, L"SD cannot be negative"},
+	{2, L"CD cannot be negative"},
+	{1, L"Duplicate TPF command"},
+	{2, L"TPF (millis per frame) must be positive"},
+	{1, L"TPF below 16ms may cause performance issues"},
+	{1, L"Duplicate PM command"},
+	{2, L"PM (pixel movement per frame) must be positive"},
+	{1, L"PM above 20 pixels may scroll too fast"},
+	{2, L"START inside another segment"},
+	{2, L"END without START"},
+	{2, L"Text outside segment"},
+	{2, L"Invalid hex color specification"},
+	{2, L"Color specification must be exactly 6 hex characters"},
+	{2, L"Too many nested color specifications (maximum %d)"},
+	{2, L"Closing quote without opening backtick"},
+	{2, L"Unclosed color specification (%d unmatched backticks)"},
+	{2, L"Missing LPS command"},
+	{2, L"Missing SW command"},
+	{2, L"Missing SH command"},
+	{2, L"Missing SC command"},
+	{2, L"Missing SD command"},
+	{2, L"Expected %d segments, found %d"},
+	{2, L"File ends with unclosed segment"},
+	{1, L"Line is %d characters long; older renderers cut lines at %d"},
+};
+
+/* One issue, 20 bytes. Message text is only produced when printing. */
+typedef struct {
+	unsigned short code;	/* DiagnosticCode */
+	unsigned char severity;
+	unsigned char reserved;
+	int lineNumber;		/* 0 for whole-file issues */
+	int column;		/* 1-based, 0 when unknown */
+	int args[2];
+} Diagnostic;
+
+typedef struct {
+	Diagnostic *items;
+	int count;
+	int capacity;
+	int severityCounts[3];
+	int stopped;		/* Hit --max-errors, rest of the file unchecked */
+} DiagnosticStore;
+
+DiagnosticStore diagnostics = { NULL, 0, 0, {0, 0, 0}, 0 };
 
-ValidationError errors[MAX_ERRORS];
-int errorCount = 0;
+enum { FORMAT_TEXT, FORMAT_JSON, FORMAT_SARIF };
+int outputFormat = FORMAT_TEXT;
+
+/* On-disk result cache (--cache DIR), one entry per content hash */
+#define CACHE_MAGIC 0x43594C4DU	/* "MLYC" */
+#define CACHE_MAX_RECORDS 1000000
+
+typedef struct {
+	uint32_t magic;
+	uint32_t count;		/* Diagnostic records that follow */
+	uint64_t key;
+	uint64_t contentSize;
+} CacheEntryHeader;
+
+const char *cacheDir = NULL;
+int cacheHits = 0, cacheMisses = 0;
+
+int maxErrors = 0;		/* --max-errors, --fail-fast is 1; 0 = no limit */
+int headerOnly = 0;
+int timelineEnabled = 0;	/* --timeline */
+
+/* Errors that are not diagnostics of a file. They go to stderr when stdout
+ * carries a JSON or SARIF document, so the document still parses. */
+void PrintError(const wchar_t *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	vfwprintf(outputFormat == FORMAT_TEXT ? stdout : stderr, format, args);
+	va_end(args);
+}
 
-void AddValidationError(int lineNum, const wchar_t *message, int severity)
+void ClearDiagnostics(void)
 {
-	if (errorCount < MAX_ERRORS) {
-		errors[errorCount].lineNumber = lineNum;
-		wcscpy(errors[errorCount].message, message);
-		errors[errorCount].severity = severity;
-		errorCount++;
+	diagnostics.count = 0;
+	diagnostics.stopped = 0;
+	memset(diagnostics.severityCounts, 0, sizeof(diagnostics.severityCounts));
+}
+
+void AddDiagnostic(int code, int lineNum, int column, int arg0, int arg1)
+{
+	if (diagnostics.stopped)
+		return;
+
+	if (diagnostics.count == diagnostics.capacity) {
+		int capacity = diagnostics.capacity ? diagnostics.capacity * 2 : 64;
+		Diagnostic *items = realloc(diagnostics.items, (size_t)capacity * sizeof(Diagnostic));
+		if (!items)
+			return;	/* Out of memory: keep what we have */
+		diagnostics.items = items;
+		diagnostics.capacity = capacity;
 	}
+
+	Diagnostic *d = &diagnostics.items[diagnostics.count++];
+	d->code = (unsigned short)code;
+	d->severity = (unsigned char)diagnosticTable[code].severity;
+	d->reserved = 0;
+	d->lineNumber = lineNum;
+	d->column = column;
+	d->args[0] = arg0;
+	d->args[1] = arg1;
+	diagnostics.severityCounts[d->severity]++;
+
+	if (maxErrors > 0 && diagnostics.severityCounts[2] >= maxErrors)
+		diagnostics.stopped = 1;
+}
+
+void FormatDiagnostic(const Diagnostic *d, wchar_t *buffer, size_t size)
+{
+	swprintf(buffer, size, diagnosticTable[d->code].format, d->args[0], d->args[1]);
 }
 
 int IsValidHexColor(const wchar_t *str, int len)
@@ -142,31 +317,23 @@ void ValidateColorSyntax(const wchar_t *line, int lineNum)
 					if (IsValidHexColor(colorSpec, 6)) {
 						hasColorSpec = 1;
 					} else {
-						AddValidationError(lineNum,
-								   L"Invalid hex color specification",
-								   2);
+						AddDiagnostic(DIAG_INVALID_HEX_COLOR, lineNum, i + 2, 0, 0);
 					}
 				} else if (paramLen > 0) {
-					AddValidationError(lineNum,
-							   L"Color specification must be exactly 6 hex characters",
-							   2);
+					AddDiagnostic(DIAG_COLOR_SPEC_LENGTH, lineNum, i + 2, 0, 0);
 				}
 			}
 
 			/* Push this backtick onto the stack */
 			if (!PushBacktick(&stack, i, hasColorSpec)) {
-				AddValidationError(lineNum,
-						   L"Too many nested color specifications (maximum 255)",
-						   2);
+				AddDiagnostic(DIAG_NESTING_TOO_DEEP, lineNum, i + 1, MAX_NESTING_DEPTH, 0);
 			}
 
 		} else if (line[i] == L'\'') {
 			/* Pop the most recent backtick from stack */
 			BacktickState state;
 			if (!PopBacktick(&stack, &state)) {
-				AddValidationError(lineNum,
-						   L"Closing quote without opening backtick",
-						   2);
+				AddDiagnostic(DIAG_UNMATCHED_QUOTE, lineNum, i + 1, 0, 0);
 			} else {
 				/* Successfully matched a backtick-quote pair */
 				/* Could add additional validation here if needed */
@@ -176,334 +343,878 @@ void ValidateColorSyntax(const wchar_t *line, int lineNum)
 
 	/* Check for unmatched backticks */
 	if (!IsStackEmpty(&stack)) {
-		wchar_t errorMsg[256];
-		swprintf(errorMsg, 256,
-			 L"Unclosed color specification (%d unmatched backticks)",
-			 stack.depth);
-		AddValidationError(lineNum, errorMsg, 2);
+		AddDiagnostic(DIAG_UNCLOSED_BACKTICKS, lineNum, stack.stack[0].position + 1, stack.depth, 0);
 	}
 }
 
-int ValidateFile(const char *filename)
+/* Read the whole file; two zero bytes are appended so it can be used as a string */
+unsigned char *ReadFileBytes(const char *filename, long *sizeOut)
 {
-	errorCount = 0;
-
 	FILE *file = fopen(filename, "rb");
 	if (!file) {
-		wprintf(L"Error: Could not open file '%s'\n", filename);
-		return 0;
+		PrintError(L"Error: Could not open file '%s'\n", filename);
+		return NULL;
 	}
 
-	/* Get file size and read content (existing logic) */
 	fseek(file, 0, SEEK_END);
 	long size = ftell(file);
 	fseek(file, 0, SEEK_SET);
+	if (size < 0)
+		size = 0;
+
+	unsigned char *data = malloc((size_t)size + 2);
+	if (!data) {
+		fclose(file);
+		PrintError(L"Error: Could not allocate memory to read file\n");
+		return NULL;
+	}
+	size = (long)fread(data, 1, (size_t)size, file);
+	data[size] = data[size + 1] = 0;
+	fclose(file);
+
+	*sizeOut = size;
+	return data;
+}
+
+/* FNV-1a 64 over the validator and results versions and the raw file bytes */
+uint64_t CacheKey(const unsigned char *data, long size)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (const wchar_t *v = VALIDATOR_VERSION; *v; v++) {
+		hash ^= (uint64_t)*v;
+		hash *= 1099511628211ULL;
+	}
+	hash ^= CACHE_RESULTS_VERSION;
+	hash *= 1099511628211ULL;
+	for (long i = 0; i < size; i++) {
+		hash ^= data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+void CachePath(char *path, size_t size, uint64_t key, const char *suffix)
+{
+	snprintf(path, size, "%s/%016llx%s", cacheDir, (unsigned long long)key, suffix);
+}
+
+/* Returns 1 and fills the store if an entry for this content exists */
+int LoadCachedDiagnostics(uint64_t key, long size)
+{
+	char path[1024];
+	CachePath(path, sizeof(path), key, ".mlc");
+
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		return 0;
+
+	CacheEntryHeader header;
+	int ok = fread(&header, sizeof(header), 1, file) == 1 &&
+	    header.magic == CACHE_MAGIC && header.key == key &&
+	    header.contentSize == (uint64_t)size && header.count <= CACHE_MAX_RECORDS;
 
-	wchar_t *buffer = NULL;
-
-	/* File reading logic remains the same... */
-	if (size >= 2) {
-		unsigned char bom[2];
-		fread(bom, 1, 2, file);
-
-		if (bom[0] == 0xFF && bom[1] == 0xFE) {
-			long remainingSize = size - 2;
-			if (remainingSize > 0) {
-				buffer =
-				    malloc(remainingSize + sizeof(wchar_t));
-				if (buffer) {
-					size_t bytesRead =
-					    fread(buffer, 1, remainingSize,
-						  file);
-					buffer[bytesRead / sizeof(wchar_t)] =
-					    L'\0';
+	for (uint32_t i = 0; ok && i < header.count; i++) {
+		Diagnostic d;
+		if (fread(&d, sizeof(d), 1, file) != 1 || d.code >= DIAG_COUNT) {
+			ok = 0;
+			break;
+		}
+		AddDiagnostic(d.code, d.lineNumber, d.column, d.args[0], d.args[1]);
+	}
+	fclose(file);
+
+	if (!ok)
+		ClearDiagnostics();	/* Stale or torn entry: validate normally */
+	return ok;
+}
+
+/*
+ * Entries are written to a private temp file and renamed into place, so
+ * concurrent validate processes only ever see complete entries. Two
+ * writers racing on the same key produce identical content.
+ */
+void StoreCachedDiagnostics(uint64_t key, long size)
+{
+	char path[1024], tempPath[1100];
+	CachePath(path, sizeof(path), key, ".mlc");
+	snprintf(tempPath, sizeof(tempPath), "%s.%ld.tmp", path, (long)getpid());
+
+	FILE *file = fopen(tempPath, "wb");
+	if (!file)
+		return;
+
+	CacheEntryHeader header = { CACHE_MAGIC, (uint32_t)diagnostics.count, key, (uint64_t)size };
+	int ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+	    fwrite(diagnostics.items, sizeof(Diagnostic), (size_t)diagnostics.count, file) == (size_t)diagnostics.count;
+	ok = (fclose(file) == 0) && ok;
+
+#ifdef _WIN32
+	if (!ok || !MoveFileExA(tempPath, path, MOVEFILE_REPLACE_EXISTING))
+		remove(tempPath);
+#else
+	if (!ok || rename(tempPath, path) != 0)
+		remove(tempPath);
+#endif
+}
+
+/* Per-file parse state, fed one line at a time */
+typedef struct {
+	int lineNum;
+	int segmentCount;
+	int expectedSegments;
+	int hasLPS, hasSW, hasSH, hasSC, hasSD;
+	int hasTPF, hasPM;	/* Optional flags tracking */
+	int inSegment;
+	int sawStart;		/* Header block is over */
+} LayoutState;
+
+enum { ENCODING_UNKNOWN, ENCODING_UTF16LE, ENCODING_MULTIBYTE };
+
+#define READ_CHUNK_SIZE 65536
+
+/* Incremental decoder: bytes in, complete lines out to ValidateLine */
+typedef struct {
+	LayoutState layout;
+	int encoding;
+	mbstate_t mbState;
+	unsigned char pending;	/* UTF-16 unit split across chunks */
+	int pendingLen;
+	wchar_t highSurrogate;
+	wchar_t *line;		/* Grows to the longest line */
+	int lineCapacity;
+	int linePos;
+	int ended;		/* Saw a NUL, like the old whole-file decode */
+	int delimiterScan;	/* Header-only: raw START/END scan */
+	char rawLine[8];
+	int rawLen;
+} LineReader;
+
+/*
+ * Playback timeline (--timeline). The renderer's schedule depends only on the
+ * header and the width of each segment, so it is worked out here frame for
+ * frame as AdvanceMarquee in renderer.c would play it. Widths are estimates:
+ * the renderer measures the font it gets, here a narrow cell is taken as half
+ * the font height and cellwidth.h says which characters take two cells.
+ */
+#define TIMELINE_MAX_SEGMENTS 10	/* MAX_SEGMENTS in renderer.c */
+#define TIMELINE_MAX_LINES 50	/* MAX_LINES_PER_SEGMENT in renderer.c */
+#define TIMELINE_MAX_FIELD 64	/* MAX_FIELD_LENGTH in renderer.c */
+
+typedef struct {
+	int line;		/* Line of the segment's START */
+	int cells;		/* Widest line, in narrow cells */
+	int lines;
+	int placeholders;	/* Has {{...}}: width depends on the values shown */
+} TimelineSegment;
+
+typedef struct {
+	int lps, sw, sh, sd, cd, tpf, pm;	/* Header values, renderer defaults if absent */
+	TimelineSegment *segments;
+	int count;
+	int capacity;
+	int open;		/* Inside a segment, segments[count] is being measured */
+	int failed;		/* Out of memory: no timeline for this file */
+	int skipping;		/* Inside a segment past TIMELINE_MAX_SEGMENTS */
+	int skippedSegments;	/* Past TIMELINE_MAX_SEGMENTS, not played */
+	int skippedLines;	/* Past TIMELINE_MAX_LINES in their segment */
+} Timeline;
+
+Timeline timeline = { 0 };
+
+/* One segment as played */
+typedef struct {
+	int centered;
+	int width;		/* px */
+	int frames;		/* On screen, including the frame that brings it in */
+	int holdFrames;		/* SD hold after a scroll, blank */
+} SegmentTiming;
+
+/* Length of the placeholder spec between {{ and }}, 0 if spec does not
+ * start one (FieldLength in renderer.c) */
+int PlaceholderLength(const wchar_t *spec)
+{
+	for (int i = 0; i < TIMELINE_MAX_FIELD && spec[i]; i++) {
+		if (spec[i] == L'}' && spec[i + 1] == L'}')
+			return i;
+	}
+	return 0;
+}
+
+/* Cells of a placeholder as FormatField in renderer.c would fill it in now.
+ * {{kv:KEY}} values are not known here and count as the markup. */
+int PlaceholderCells(const wchar_t *spec, int length)
+{
+	wchar_t field[TIMELINE_MAX_FIELD + 1], value[256];
+	wmemcpy(field, spec, length);
+	field[length] = 0;
+	const wchar_t *colon = wcschr(field, L':');
+	const wchar_t *arg = colon ? colon + 1 : L"";
+	size_t kind = colon ? (size_t)(colon - field) : wcslen(field);
+	time_t now = time(NULL);
+	int got = 0;
+	struct tm target;
+
+	swprintf(value, 256, L"{{%ls}}", field);
+	if (kind == 5 && wcsncmp(field, L"clock", 5) == 0) {
+		struct tm *local = localtime(&now);
+		if (!local || !wcsftime(value, 256, *arg ? arg : L"%H:%M:%S", local))
+			value[0] = 0;
+	} else if (kind == 9 && wcsncmp(field, L"countdown", 9) == 0) {
+		memset(&target, 0, sizeof(target));
+		got = swscanf(arg, L"%d-%d-%d%*[ T]%d:%d:%d", &target.tm_year, &target.tm_mon,
+			      &target.tm_mday, &target.tm_hour, &target.tm_min, &target.tm_sec);
+	}
+	if (got >= 5) {
+		target.tm_year -= 1900;
+		target.tm_mon -= 1;
+		target.tm_isdst = -1;
+		time_t end = mktime(&target);
+		long long left = end != (time_t)-1 && end > now ? (long long)(end - now) : 0;
+		if (left >= 86400)
+			swprintf(value, 256, L"%dd 00:00:00", (int)(left / 86400));
+		else
+			wcscpy(value, L"00:00:00");
+	}
+	return TextCells(value, (int)wcslen(value));
+}
+
+/* Visible cells of a segment line, skipping color brackets like ParseColoredLine.
+ * Sets *placeholders if the line has any. */
+int LineCells(const wchar_t *line, int *placeholders)
+{
+	int cells = 0;
+	int len = (int)wcslen(line);
+	for (int i = 0; i < len; i++) {
+		unsigned c = (unsigned)line[i];
+		int field;
+		if (c == L'\\' && i + 1 < len) {
+			c = (unsigned)line[++i];
+		} else if (c == L'{' && i + 1 < len && line[i + 1] == L'{'
+			   && (field = PlaceholderLength(&line[i + 2])) > 0) {
+			cells += PlaceholderCells(&line[i + 2], field);
+			*placeholders = 1;
+			i += field + 3;
+			continue;
+		} else if (c == L'`') {
+			int colonPos = -1;
+			for (int j = i + 1; j < len; j++) {
+				if (line[j] == L'\\' && j + 1 < len) {
+					j++;
+					continue;
 				}
-			} else {
-				buffer = malloc(sizeof(wchar_t));
-				if (buffer)
-					buffer[0] = L'\0';
-			}
-		} else {
-			fseek(file, 0, SEEK_SET);
-			char *mbBuffer = malloc(size + 1);
-			if (mbBuffer) {
-				fread(mbBuffer, 1, size, file);
-				mbBuffer[size] = 0;
-
-				size_t wideSize =
-				    mbstowcs(NULL, mbBuffer, 0) + 1;
-				buffer = malloc(wideSize * sizeof(wchar_t));
-				if (buffer) {
-					mbstowcs(buffer, mbBuffer, wideSize);
+				if (line[j] == L':') {
+					colonPos = j;
+					break;
+				} else if (line[j] == L'\'' || line[j] == L'`') {
+					break;
 				}
-				free(mbBuffer);
 			}
+			if (colonPos != -1) {
+				i = colonPos;
+				continue;
+			}
+		} else if (c == L'\'') {
+			continue;
+		}
+
+		/* UTF-16 wchar_t: a surrogate pair is one character */
+		int units = c >= 0xD800 && c <= 0xDBFF && i + 1 < len
+		    && (unsigned)line[i + 1] >= 0xDC00 && (unsigned)line[i + 1] <= 0xDFFF ? 2 : 1;
+		cells += TextCells(&line[i], units);
+		i += units - 1;
+	}
+	return cells;
+}
+
+void ResetTimeline(void)
+{
+	timeline.lps = 2;
+	timeline.sw = 600;
+	timeline.sh = 80;
+	timeline.sd = 500;
+	timeline.cd = 1500;
+	timeline.tpf = 50;
+	timeline.pm = 3;
+	timeline.count = 0;
+	timeline.open = 0;
+	timeline.failed = 0;
+	timeline.skipping = 0;
+	timeline.skippedSegments = 0;
+	timeline.skippedLines = 0;
+}
+
+void TimelineStart(int lineNum)
+{
+	/* The renderer reads past its last segment without keeping them */
+	if (timeline.count >= TIMELINE_MAX_SEGMENTS) {
+		timeline.open = 0;
+		timeline.skipping = 1;
+		return;
+	}
+	if (timeline.count == timeline.capacity) {
+		int capacity = timeline.capacity ? timeline.capacity * 2 : 16;
+		TimelineSegment *segments =
+		    realloc(timeline.segments, (size_t)capacity * sizeof(TimelineSegment));
+		if (!segments) {
+			timeline.failed = 1;
+			return;
 		}
+		timeline.segments = segments;
+		timeline.capacity = capacity;
+	}
+
+	/* A START inside a segment restarts it, as in the renderer */
+	timeline.segments[timeline.count].line = lineNum;
+	timeline.segments[timeline.count].cells = 0;
+	timeline.segments[timeline.count].lines = 0;
+	timeline.segments[timeline.count].placeholders = 0;
+	timeline.open = 1;
+}
+
+void TimelineEnd(void)
+{
+	if (timeline.open)
+		timeline.count++;
+	else if (timeline.skipping)
+		timeline.skippedSegments++;
+	timeline.open = 0;
+	timeline.skipping = 0;
+}
+
+void TimelineLine(const wchar_t *line)
+{
+	if (!timeline.open)
+		return;
+	TimelineSegment *segment = &timeline.segments[timeline.count];
+	if (segment->lines >= TIMELINE_MAX_LINES) {
+		timeline.skippedLines++;
+		return;
+	}
+	segment->lines++;
+	int cells = LineCells(line, &segment->placeholders);
+	if (cells > segment->cells)
+		segment->cells = cells;
+}
+
+/* Frames covering a delay, at least one (FramesForDelay in renderer.c) */
+int TimelineFrames(int delay)
+{
+	int frames = (delay + timeline.tpf - 1) / timeline.tpf;
+	return frames > 0 ? frames : 1;
+}
+
+/* Estimated width of a narrow cell, px */
+int TimelineCellWidth(void)
+{
+	int fontSize = timeline.sh / timeline.lps;
+	if (fontSize < 8)
+		fontSize = 8;
+	return fontSize / 2;
+}
+
+void TimeSegment(const TimelineSegment *segment, SegmentTiming *timing)
+{
+	timing->width = segment->cells * TimelineCellWidth();
+	timing->centered = timing->width <= timeline.sw;
+	if (timing->centered) {
+		/* Brought in, then held for CD */
+		timing->frames = 1 + TimelineFrames(timeline.cd);
+		timing->holdFrames = 0;
 	} else {
-		buffer = malloc(sizeof(wchar_t));
-		if (buffer)
-			buffer[0] = L'\0';
+		/* Scrolls from x = SW until it is fully off the left edge */
+		timing->frames = (timeline.sw + timing->width) / timeline.pm + 1;
+		timing->holdFrames = TimelineFrames(timeline.sd);
 	}
+}
 
-	fclose(file);
+/* The timeline is only known for files the renderer plays as validated */
+int TimelineAvailable(void)
+{
+	return !timeline.failed && !diagnostics.stopped
+	    && diagnostics.severityCounts[2] == 0 && timeline.lps > 0;
+}
 
-	if (!buffer) {
-		wprintf(L"Error: Could not allocate memory to read file\n");
-		return 0;
+void ValidateDelimiter(LayoutState *st, int isStart)
+{
+	if (isStart) {
+		if (st->inSegment)
+			AddDiagnostic(DIAG_START_IN_SEGMENT, st->lineNum, 1, 0, 0);
+		st->inSegment = 1;
+		st->sawStart = 1;
+		if (timelineEnabled)
+			TimelineStart(st->lineNum);
+	} else {
+		if (!st->inSegment)
+			AddDiagnostic(DIAG_END_WITHOUT_START, st->lineNum, 1, 0, 0);
+		st->inSegment = 0;
+		st->segmentCount++;
+		if (timelineEnabled)
+			TimelineEnd();
 	}
+}
 
-	/* Parse line by line with TPF and PM support */
-	wchar_t line[1024];
-	int linePos = 0;
-	int lineNum = 1;
-	int segmentCount = 0;
-	int hasLPS = 0, hasSW = 0, hasSH = 0, hasSC = 0, hasSD = 0;
-	int inSegment = 0;
-	int expectedSegments = 0;
-	int textLen = (int)wcslen(buffer);
+void ValidateLine(LayoutState *st, const wchar_t *line)
+{
+	int len = (int)wcslen(line);
 
-	/* Optional flags tracking */
-	int hasTPF = 0, hasPM = 0;
+	if (headerOnly && st->sawStart) {
+		if (wcscmp(line, L"START") == 0)
+			ValidateDelimiter(st, 1);
+		else if (wcscmp(line, L"END") == 0)
+			ValidateDelimiter(st, 0);
+		return;
+	}
 
-	for (int i = 0; i <= textLen; i++) {
-		wchar_t c = (i < textLen) ? buffer[i] : L'\0';
+	/* Skip empty lines and comments */
+	if (line[0] != L'/' && len > 0) {
+		/* Check metadata commands */
+		if (wcsncmp(line, L"LPS", 3) == 0) {
+			if (st->hasLPS)
+				AddDiagnostic(DIAG_DUPLICATE_LPS, st->lineNum, 1, 0, 0);
+			st->hasLPS = 1;
+			if (wcslen(line) > 4) {
+				int value =
+				    wcstol(&line[4], NULL, 10);
+				if (value <= 0)
+					AddDiagnostic(DIAG_LPS_NOT_POSITIVE, st->lineNum, 1, 0, 0);
+				timeline.lps = value;
+			}
+		} else if (wcsncmp(line, L"SW", 2) == 0) {
+			if (st->hasSW)
+				AddDiagnostic(DIAG_DUPLICATE_SW, st->lineNum, 1, 0, 0);
+			st->hasSW = 1;
+			if (wcslen(line) > 3) {
+				int value =
+				    wcstol(&line[3], NULL, 10);
+				if (value <= 0)
+					AddDiagnostic(DIAG_SW_NOT_POSITIVE, st->lineNum, 1, 0, 0);
+				timeline.sw = value;
+			}
+		} else if (wcsncmp(line, L"SH", 2) == 0) {
+			if (st->hasSH)
+				AddDiagnostic(DIAG_DUPLICATE_SH, st->lineNum, 1, 0, 0);
+			st->hasSH = 1;
+			if (wcslen(line) > 3) {
+				int value =
+				    wcstol(&line[3], NULL, 10);
+				if (value <= 0)
+					AddDiagnostic(DIAG_SH_NOT_POSITIVE, st->lineNum, 1, 0, 0);
+				timeline.sh = value;
+			}
+		} else if (wcsncmp(line, L"SC", 2) == 0) {
+			if (st->hasSC)
+				AddDiagnostic(DIAG_DUPLICATE_SC, st->lineNum, 1, 0, 0);
+			st->hasSC = 1;
+			if (wcslen(line) > 3) {
+				st->expectedSegments =
+				    wcstol(&line[3], NULL, 10);
+				if (st->expectedSegments <= 0)
+					AddDiagnostic(DIAG_SC_NOT_POSITIVE, st->lineNum, 1, 0, 0);
+			}
+		} else if (wcsncmp(line, L"SD", 2) == 0) {
+			if (st->hasSD)
+				AddDiagnostic(DIAG_DUPLICATE_SD, st->lineNum, 1, 0, 0);
+			st->hasSD = 1;
+			if (wcslen(line) > 3) {
+				int value =
+				    wcstol(&line[3], NULL, 10);
+				if (value < 0)
+					AddDiagnostic(DIAG_SD_NEGATIVE, st->lineNum, 1, 0, 0);
+				timeline.sd = value;
+			}
+		} else if (wcsncmp(line, L"CD", 2) == 0) {
+			if (wcslen(line) > 3) {
+				int value =
+				    wcstol(&line[3], NULL, 10);
+				if (value < 0)
+					AddDiagnostic(DIAG_CD_NEGATIVE, st->lineNum, 1, 0, 0);
+				timeline.cd = value;
+			}
 
-		if (c == L'\r') {
-			continue;
-		} else if (c == L'\n' || c == L'\0') {
-			line[linePos] = L'\0';
-
-			int len = (int)wcslen(line);
-
-			/* Skip empty lines and comments */
-			if (line[0] != L'/' && len > 0) {
-				/* Check metadata commands */
-				if (wcsncmp(line, L"LPS", 3) == 0) {
-					if (hasLPS)
-						AddValidationError(lineNum,
-								   L"Duplicate LPS command",
-								   2);
-					hasLPS = 1;
-					if (wcslen(line) > 4) {
-						int value =
-						    wcstol(&line[4], NULL, 10);
-						if (value <= 0)
-							AddValidationError
-							    (lineNum,
-							     L"LPS must be positive",
-							     2);
-					}
-				} else if (wcsncmp(line, L"SW", 2) == 0) {
-					if (hasSW)
-						AddValidationError(lineNum,
-								   L"Duplicate SW command",
-								   2);
-					hasSW = 1;
-					if (wcslen(line) > 3) {
-						int value =
-						    wcstol(&line[3], NULL, 10);
-						if (value <= 0)
-							AddValidationError
-							    (lineNum,
-							     L"SW must be positive",
-							     2);
-					}
-				} else if (wcsncmp(line, L"SH", 2) == 0) {
-					if (hasSH)
-						AddValidationError(lineNum,
-								   L"Duplicate SH command",
-								   2);
-					hasSH = 1;
-					if (wcslen(line) > 3) {
-						int value =
-						    wcstol(&line[3], NULL, 10);
-						if (value <= 0)
-							AddValidationError
-							    (lineNum,
-							     L"SH must be positive",
-							     2);
-					}
-				} else if (wcsncmp(line, L"SC", 2) == 0) {
-					if (hasSC)
-						AddValidationError(lineNum,
-								   L"Duplicate SC command",
-								   2);
-					hasSC = 1;
-					if (wcslen(line) > 3) {
-						expectedSegments =
-						    wcstol(&line[3], NULL, 10);
-						if (expectedSegments <= 0)
-							AddValidationError
-							    (lineNum,
-							     L"SC must be positive",
-							     2);
-					}
-				} else if (wcsncmp(line, L"SD", 2) == 0) {
-					if (hasSD)
-						AddValidationError(lineNum,
-								   L"Duplicate SD command",
-								   2);
-					hasSD = 1;
-					if (wcslen(line) > 3) {
-						int value =
-						    wcstol(&line[3], NULL, 10);
-						if (value < 0)
-							AddValidationError
-							    (lineNum,
-							     L"SD cannot be negative",
-							     2);
-					}
-				} else if (wcsncmp(line, L"CD", 2) == 0) {
-					if (wcslen(line) > 3) {
-						int value =
-						    wcstol(&line[3], NULL, 10);
-						if (value < 0)
-							AddValidationError
-							    (lineNum,
-							     L"CD cannot be negative",
-							     2);
-					}
+			/* OPTIONAL FLAGS */
+		} else if (wcsncmp(line, L"TPF", 3) == 0) {
+			if (st->hasTPF)
+				AddDiagnostic(DIAG_DUPLICATE_TPF, st->lineNum, 1, 0, 0);
+			st->hasTPF = 1;
+			if (wcslen(line) > 4) {
+				int value =
+				    wcstol(&line[4], NULL, 10);
+				if (value <= 0)
+					AddDiagnostic(DIAG_TPF_NOT_POSITIVE, st->lineNum, 1, 0, 0);
+				if (value < 16)
+					AddDiagnostic(DIAG_TPF_TOO_LOW, st->lineNum, 1, 0, 0);
+				if (value > 0)
+					timeline.tpf = value;
+			}
+		} else if (wcsncmp(line, L"PM", 2) == 0) {
+			if (st->hasPM)
+				AddDiagnostic(DIAG_DUPLICATE_PM, st->lineNum, 1, 0, 0);
+			st->hasPM = 1;
+			if (wcslen(line) > 3) {
+				int value =
+				    wcstol(&line[3], NULL, 10);
+				if (value <= 0)
+					AddDiagnostic(DIAG_PM_NOT_POSITIVE, st->lineNum, 1, 0, 0);
+				if (value > 20)
+					AddDiagnostic(DIAG_PM_TOO_HIGH, st->lineNum, 1, 0, 0);
+				if (value > 0)
+					timeline.pm = value;
+			}
 
-					/* OPTIONAL FLAGS */
-				} else if (wcsncmp(line, L"TPF", 3) == 0) {
-					if (hasTPF)
-						AddValidationError(lineNum,
-								   L"Duplicate TPF command",
-								   1);
-					hasTPF = 1;
-					if (wcslen(line) > 4) {
-						int value =
-						    wcstol(&line[4], NULL, 10);
-						if (value <= 0)
-							AddValidationError
-							    (lineNum,
-							     L"TPF (millis per frame) must be positive",
-							     2);
-						if (value < 16)
-							AddValidationError
-							    (lineNum,
-							     L"TPF below 16ms may cause performance issues",
-							     1);
-					}
-				} else if (wcsncmp(line, L"PM", 2) == 0) {
-					if (hasPM)
-						AddValidationError(lineNum,
-								   L"Duplicate PM command",
-								   1);
-					hasPM = 1;
-					if (wcslen(line) > 3) {
-						int value =
-						    wcstol(&line[3], NULL, 10);
-						if (value <= 0)
-							AddValidationError
-							    (lineNum,
-							     L"PM (pixel movement per frame) must be positive",
-							     2);
-						if (value > 20)
-							AddValidationError
-							    (lineNum,
-							     L"PM above 20 pixels may scroll too fast",
-							     1);
-					}
+		} else if (wcscmp(line, L"START") == 0) {
+			ValidateDelimiter(st, 1);
+		} else if (wcscmp(line, L"END") == 0) {
+			ValidateDelimiter(st, 0);
+		} else if (st->inSegment) {
+			ValidateColorSyntax(line, st->lineNum);
+			if (timelineEnabled)
+				TimelineLine(line);
+		} else {
+			AddDiagnostic(DIAG_TEXT_OUTSIDE_SEGMENT, st->lineNum, 1, 0, 0);
+		}
+	} else if (len == 0 && st->inSegment && timelineEnabled) {
+		/* Empty lines count towards the renderer's line limit */
+		TimelineLine(line);
+	}
 
-				} else if (wcscmp(line, L"START") == 0) {
-					if (inSegment)
-						AddValidationError(lineNum,
-								   L"START inside another segment",
-								   2);
-					inSegment = 1;
-				} else if (wcscmp(line, L"END") == 0) {
-					if (!inSegment)
-						AddValidationError(lineNum,
-								   L"END without START",
-								   2);
-					inSegment = 0;
-					segmentCount++;
-				} else if (inSegment) {
-					ValidateColorSyntax(line, lineNum);
-				} else {
-					AddValidationError(lineNum,
-							   L"Text outside segment",
-							   2);
-				}
+}
+
+/* Double the line buffer; out of memory, the rest of the line is dropped */
+int GrowLine(LineReader *reader)
+{
+	int capacity = reader->lineCapacity ? reader->lineCapacity * 2 : 1024;
+	wchar_t *line = realloc(reader->line, (size_t)capacity * sizeof(wchar_t));
+	if (!line)
+		return 0;
+	reader->line = line;
+	reader->lineCapacity = capacity;
+	return 1;
+}
+
+void EmitChar(LineReader *reader, wchar_t c)
+{
+	if (c == L'\r') {
+		return;
+	} else if (c == L'\n' || c == L'\0') {
+		if (!reader->line && !GrowLine(reader))
+			return;
+		reader->line[reader->linePos] = L'\0';
+		if (reader->linePos > LEGACY_LINE_LENGTH)
+			AddDiagnostic(DIAG_LONG_LINE, reader->layout.lineNum, LEGACY_LINE_LENGTH + 1,
+				      reader->linePos, LEGACY_LINE_LENGTH);
+		ValidateLine(&reader->layout, reader->line);
+		reader->linePos = 0;
+		reader->layout.lineNum++;
+		if (c == L'\0')
+			reader->ended = 1;
+	} else if (reader->linePos + 1 < reader->lineCapacity || GrowLine(reader)) {
+		reader->line[reader->linePos++] = c;
+	}
+}
+
+/*
+ * Header-only mode after the first START: only delimiter lines matter,
+ * so skip decoding and jump from newline to newline. START and END are
+ * ASCII and a line always begins on a character boundary.
+ */
+size_t ScanDelimiters(LineReader *reader, const unsigned char *bytes, size_t size)
+{
+	size_t pos = 0;
+	while (pos < size && !reader->ended) {
+		const unsigned char *newline = memchr(bytes + pos, '\n', size - pos);
+		size_t end = newline ? (size_t)(newline - bytes) : size;
+		for (size_t i = pos; i < end && reader->rawLen < (int)sizeof(reader->rawLine); i++) {
+			if (bytes[i] == 0) {
+				reader->ended = 1;
+				break;
 			}
+			reader->rawLine[reader->rawLen++] = (char)bytes[i];
+		}
+		if (!newline)
+			return size;	/* Line continues in the next chunk */
 
-			linePos = 0;
-			lineNum++;
+		int len = reader->rawLen;
+		if (len > 0 && reader->rawLine[len - 1] == '\r')
+			len--;
+		if (len == 5 && memcmp(reader->rawLine, "START", 5) == 0)
+			ValidateDelimiter(&reader->layout, 1);
+		else if (len == 3 && memcmp(reader->rawLine, "END", 3) == 0)
+			ValidateDelimiter(&reader->layout, 0);
+		reader->rawLen = 0;
+		reader->layout.lineNum++;
+		pos = end + 1;
+	}
+	return size;
+}
 
-			if (c == L'\0')
+/* Returns 0 once the outcome is decided and no more input is needed */
+int DecodeChunk(LineReader *reader, const unsigned char *bytes, size_t size)
+{
+	size_t pos = 0;
+
+	if (reader->encoding == ENCODING_UNKNOWN) {
+		if (size >= 2 && bytes[0] == 0xFF && bytes[1] == 0xFE) {
+			reader->encoding = ENCODING_UTF16LE;
+			pos = 2;
+		} else {
+			reader->encoding = ENCODING_MULTIBYTE;
+		}
+	}
+
+	while (pos < size && !reader->ended && !diagnostics.stopped) {
+		if (reader->encoding == ENCODING_UTF16LE) {
+			if (reader->pendingLen == 0 && pos + 1 == size) {
+				reader->pending = bytes[pos++];
+				reader->pendingLen = 1;
 				break;
+			}
+			unsigned unit;
+			if (reader->pendingLen) {
+				unit = reader->pending | (bytes[pos++] << 8);
+				reader->pendingLen = 0;
+			} else {
+				unit = bytes[pos] | (bytes[pos + 1] << 8);
+				pos += 2;
+			}
+#if WCHAR_MAX > 0xFFFF
+			/* Combine surrogate pairs where wchar_t holds full code points */
+			if (unit >= 0xD800 && unit < 0xDC00) {
+				reader->highSurrogate = (wchar_t)unit;
+				continue;
+			}
+			if (unit >= 0xDC00 && unit < 0xE000 && reader->highSurrogate) {
+				unit = 0x10000 + ((reader->highSurrogate - 0xD800) << 10) + (unit - 0xDC00);
+			}
+			reader->highSurrogate = 0;
+#endif
+			EmitChar(reader, (wchar_t)unit);
 		} else {
-			if (linePos < 1023) {
-				line[linePos++] = c;
+			if (reader->delimiterScan) {
+				pos += ScanDelimiters(reader, bytes + pos, size - pos);
+				break;
 			}
+
+			/* A sequence split across chunks is carried in mbState */
+			wchar_t c;
+			size_t used = mbrtowc(&c, (const char *)bytes + pos, size - pos, &reader->mbState);
+			if (used == (size_t)-2)
+				break;
+			if (used == (size_t)-1) {
+				memset(&reader->mbState, 0, sizeof(reader->mbState));
+				c = 0xFFFD;
+				used = 1;
+			} else if (used == 0) {
+				used = 1;	/* Embedded NUL */
+			}
+			pos += used;
+			EmitChar(reader, c);
+
+			if (headerOnly && reader->layout.sawStart && c == L'\n')
+				reader->delimiterScan = 1;
 		}
 	}
 
+	return !reader->ended && !diagnostics.stopped;
+}
+
+/* Flush the last line and run the whole-file checks */
+void FinishLayout(LineReader *reader)
+{
+	if (!reader->ended && !diagnostics.stopped) {
+		if (reader->delimiterScan) {
+			static const unsigned char newline = '\n';
+			ScanDelimiters(reader, &newline, 1);
+		} else {
+			if (reader->pendingLen || !mbsinit(&reader->mbState))
+				EmitChar(reader, 0xFFFD);
+			EmitChar(reader, L'\0');
+		}
+	}
+
+	/* An early stop leaves the totals unknown */
+	if (diagnostics.stopped)
+		return;
+
+	LayoutState *st = &reader->layout;
+
 	/* Check required metadata */
-	if (!hasLPS)
-		AddValidationError(0, L"Missing LPS command", 2);
-	if (!hasSW)
-		AddValidationError(0, L"Missing SW command", 2);
-	if (!hasSH)
-		AddValidationError(0, L"Missing SH command", 2);
-	if (!hasSC)
-		AddValidationError(0, L"Missing SC command", 2);
-	if (!hasSD)
-		AddValidationError(0, L"Missing SD command", 2);
+	if (!st->hasLPS)
+		AddDiagnostic(DIAG_MISSING_LPS, 0, 0, 0, 0);
+	if (!st->hasSW)
+		AddDiagnostic(DIAG_MISSING_SW, 0, 0, 0, 0);
+	if (!st->hasSH)
+		AddDiagnostic(DIAG_MISSING_SH, 0, 0, 0, 0);
+	if (!st->hasSC)
+		AddDiagnostic(DIAG_MISSING_SC, 0, 0, 0, 0);
+	if (!st->hasSD)
+		AddDiagnostic(DIAG_MISSING_SD, 0, 0, 0, 0);
 
 	/* Check segment count */
-	if (expectedSegments != segmentCount) {
-		wchar_t msg[256];
-		swprintf(msg, 256, L"Expected %d segments, found %d",
-			 expectedSegments, segmentCount);
-		AddValidationError(0, msg, 2);
+	if (st->expectedSegments != st->segmentCount) {
+		AddDiagnostic(DIAG_SEGMENT_COUNT, 0, 0, st->expectedSegments, st->segmentCount);
 	}
 
-	if (inSegment) {
-		AddValidationError(lineNum - 1,
-				   L"File ends with unclosed segment", 2);
+	if (st->inSegment) {
+		AddDiagnostic(DIAG_UNCLOSED_SEGMENT, st->lineNum - 1, 0, 0, 0);
 	}
+}
 
-	free(buffer);
+void InitLineReader(LineReader *reader)
+{
+	memset(reader, 0, sizeof(*reader));
+	reader->layout.lineNum = 1;
+	ResetTimeline();
+}
+
+int ValidateBytes(const unsigned char *data, long size)
+{
+	LineReader reader;
+	InitLineReader(&reader);
+	DecodeChunk(&reader, data, (size_t)size);
+	FinishLayout(&reader);
+	free(reader.line);
 	return 1;
 }
 
+/* Read in chunks so an early decision stops the I/O as well */
+int ValidateStream(const char *filename)
+{
+	FILE *file = fopen(filename, "rb");
+	if (!file) {
+		PrintError(L"Error: Could not open file '%s'\n", filename);
+		return 0;
+	}
+
+	unsigned char *chunk = malloc(READ_CHUNK_SIZE);
+	if (!chunk) {
+		fclose(file);
+		PrintError(L"Error: Could not allocate memory to read file\n");
+		return 0;
+	}
+
+	LineReader reader;
+	InitLineReader(&reader);
+
+	size_t got;
+	while ((got = fread(chunk, 1, READ_CHUNK_SIZE, file)) > 0) {
+		if (!DecodeChunk(&reader, chunk, got))
+			break;
+	}
+	FinishLayout(&reader);
+
+	free(reader.line);
+	free(chunk);
+	fclose(file);
+	return 1;
+}
+
+/* Server mode keeps recent results in memory, direct-mapped by key */
+#define MEMORY_CACHE_SLOTS 4096
+
+typedef struct {
+	uint64_t key;
+	uint64_t contentSize;
+	Diagnostic *items;	/* NULL when the slot is empty */
+	int count;
+} MemoryCacheEntry;
+
+MemoryCacheEntry *memoryCache = NULL;
+
+int LoadMemoryCache(uint64_t key, long size)
+{
+	MemoryCacheEntry *entry = &memoryCache[key % MEMORY_CACHE_SLOTS];
+	if (!entry->items || entry->key != key || entry->contentSize != (uint64_t)size)
+		return 0;
+	for (int i = 0; i < entry->count; i++) {
+		const Diagnostic *d = &entry->items[i];
+		AddDiagnostic(d->code, d->lineNumber, d->column, d->args[0], d->args[1]);
+	}
+	return 1;
+}
+
+void StoreMemoryCache(uint64_t key, long size)
+{
+	MemoryCacheEntry *entry = &memoryCache[key % MEMORY_CACHE_SLOTS];
+	Diagnostic *items = malloc(((size_t)diagnostics.count + 1) * sizeof(Diagnostic));
+	if (!items)
+		return;
+	memcpy(items, diagnostics.items, (size_t)diagnostics.count * sizeof(Diagnostic));
+	free(entry->items);
+	entry->key = key;
+	entry->contentSize = (uint64_t)size;
+	entry->items = items;
+	entry->count = diagnostics.count;
+}
+
+/* Validate file content already in memory, going through the caches */
+int ValidateData(const unsigned char *data, long size)
+{
+	if (maxErrors > 0 || headerOnly || timelineEnabled)
+		return ValidateBytes(data, size);
+
+	uint64_t key = CacheKey(data, size);
+	if (memoryCache && LoadMemoryCache(key, size)) {
+		cacheHits++;
+		return 1;
+	}
+	if (cacheDir && LoadCachedDiagnostics(key, size)) {
+		cacheHits++;
+		if (memoryCache)
+			StoreMemoryCache(key, size);
+		return 1;
+	}
+
+	int result = ValidateBytes(data, size);
+	if (result) {
+		cacheMisses++;
+		if (cacheDir)
+			StoreCachedDiagnostics(key, size);
+		if (memoryCache)
+			StoreMemoryCache(key, size);
+	}
+	return result;
+}
+
+int ValidateFile(const char *filename)
+{
+	ClearDiagnostics();
+
+	/* Partial results are never cached, and hashing would read the whole file */
+	if ((!cacheDir && !memoryCache) || maxErrors > 0 || headerOnly || timelineEnabled)
+		return ValidateStream(filename);
+
+	long size = 0;
+	unsigned char *data = ReadFileBytes(filename, &size);
+	if (!data)
+		return 0;
+
+	int result = ValidateData(data, size);
+	free(data);
+	return result;
+}
+
 void PrintResults(void)
 {
+	int errorCount = diagnostics.count;
 	if (errorCount == 0) {
 		wprintf(L"[i] Validation passed - No errors found\n");
 		return;
 	}
 
-	/* Count errors by severity */
-	int errors_count = 0, warnings_count = 0, info_count = 0;
-	for (int i = 0; i < errorCount; i++) {
-		switch (errors[i].severity) {
-		case 0:
-			info_count++;
-			break;
-		case 1:
-			warnings_count++;
-			break;
-		case 2:
-			errors_count++;
-			break;
-		}
-	}
-
 	wprintf(L"[x] Validation failed - %d issues found:\n", errorCount);
 	wprintf(L"  Errors: %d, Warnings: %d, Info: %d\n\n",
-		errors_count, warnings_count, info_count);
+		diagnostics.severityCounts[2], diagnostics.severityCounts[1], diagnostics.severityCounts[0]);
 	wprintf(L" +-----+------+------+---\n");
 	wprintf(L" | Severity   | Line | Message\n");
 	wprintf(L" +-----+------+------+---------\n");
 
 	/* Print all errors */
 	for (int i = 0; i < errorCount; i++) {
+		const Diagnostic *d = &diagnostics.items[i];
 		const wchar_t *severityStr;
 		const wchar_t *icon;
-		switch (errors[i].severity) {
+		wchar_t message[MAX_ERROR_MSG];
+		switch (d->severity) {
 		case 0:
 			severityStr = L"INFO";
 			icon = L"[i]";
@@ -522,17 +1233,580 @@ void PrintResults(void)
 			break;
 		}
 
-		if (errors[i].lineNumber > 0) {
+		FormatDiagnostic(d, message, MAX_ERROR_MSG);
+		if (d->lineNumber > 0) {
 			wprintf(L" | %3ls | %4ls | %4d | %ls\n",
-				icon, severityStr, errors[i].lineNumber,
-				errors[i].message);
+				icon, severityStr, d->lineNumber, message);
 		} else {
 			wprintf(L" | %3ls | %4ls |      | %ls\n",
-				icon, severityStr, errors[i].message);
+				icon, severityStr, message);
 		}
 	}
 
 	wprintf(L" +-----+------+------+---------\n");
+
+	if (diagnostics.stopped)
+		wprintf(L"  Stopped after %d errors, the rest of the file was not checked\n",
+			diagnostics.severityCounts[2]);
+}
+
+void PrintTimeline(void)
+{
+	if (!TimelineAvailable()) {
+		wprintf(L"\n  Timeline: not available for a file with errors\n");
+		return;
+	}
+
+	wprintf(L"\n  Timeline, estimated (TPF %d ms, PM %d px, SW %d px, %d px per narrow character):\n",
+		timeline.tpf, timeline.pm, timeline.sw, TimelineCellWidth());
+	wprintf(L"  Segment  Line  Mode     Width       Time\n");
+
+	long long totalFrames = 0;
+	int placeholders = 0;
+	for (int i = 0; i < timeline.count; i++) {
+		SegmentTiming timing;
+		TimeSegment(&timeline.segments[i], &timing);
+		totalFrames += timing.frames + timing.holdFrames;
+		placeholders |= timeline.segments[i].placeholders;
+		wprintf(L"  %7d  %4d  %-6ls  %5d%lc %7.3f s",
+			i + 1, timeline.segments[i].line, timing.centered ? L"center" : L"scroll",
+			timing.width, timeline.segments[i].placeholders ? L'*' : L' ',
+			timing.frames * (double)timeline.tpf / 1000);
+		if (timing.holdFrames)
+			wprintf(L" + %.3f s hold", timing.holdFrames * (double)timeline.tpf / 1000);
+		putwchar(L'\n');
+	}
+	wprintf(L"  Loop: %.3f s, %lld frames\n", totalFrames * (double)timeline.tpf / 1000, totalFrames);
+	if (timeline.skippedSegments)
+		wprintf(L"  Not played: %d segments after the first %d\n",
+			timeline.skippedSegments, TIMELINE_MAX_SEGMENTS);
+	if (timeline.skippedLines)
+		wprintf(L"  Not played: %d lines past %d in their segment\n",
+			timeline.skippedLines, TIMELINE_MAX_LINES);
+	if (placeholders)
+		wprintf(L"  * Has {{...}} placeholders, measured by their text now ({{kv:...}} as written);\n"
+			L"    the width changes with the values shown\n");
+	wprintf(L"  Widths assume the renderer's monospace face; the real font can differ slightly\n");
+}
+
+/* Write a JSON string literal; narrow strings are in the locale's encoding */
+void PrintJsonString(const wchar_t *str)
+{
+	putwchar(L'"');
+	for (; *str; str++) {
+		wchar_t c = *str;
+		if (c == L'"' || c == L'\\') {
+			wprintf(L"\\%lc", (wint_t)c);
+		} else if (c < 0x20) {
+			wprintf(L"\\u%04x", (unsigned)c);
+		} else {
+			putwchar(c);
+		}
+	}
+	putwchar(L'"');
+}
+
+void PrintJsonPath(const char *path)
+{
+	wchar_t wide[1024];
+	size_t len = mbstowcs(wide, path, 1023);
+	if (len == (size_t)-1) {
+		/* Not valid in this locale: keep the ASCII bytes only */
+		len = 0;
+		for (const char *p = path; *p && len < 1023; p++) {
+			if ((unsigned char)*p < 0x80)
+				wide[len++] = (wchar_t)*p;
+		}
+	}
+	wide[len] = 0;
+	PrintJsonString(wide);
+}
+
+const wchar_t *SeverityName(int severity)
+{
+	switch (severity) {
+	case 0:
+		return L"info";
+	case 1:
+		return L"warning";
+	default:
+		return L"error";
+	}
+}
+
+/* ,"timeline":{...}, times in milliseconds */
+void PrintTimelineJson(void)
+{
+	if (!TimelineAvailable()) {
+		wprintf(L",\"timeline\":null");
+		return;
+	}
+
+	wprintf(L",\"timeline\":{\"estimated\":true,\"cellWidth\":%d,\"frameMs\":%d,\"pixelsPerFrame\":%d,"
+		L"\"screenWidth\":%d,\"skippedSegments\":%d,\"skippedLines\":%d,\"segments\":[",
+		TimelineCellWidth(), timeline.tpf, timeline.pm, timeline.sw,
+		timeline.skippedSegments, timeline.skippedLines);
+	long long totalFrames = 0;
+	for (int i = 0; i < timeline.count; i++) {
+		SegmentTiming timing;
+		TimeSegment(&timeline.segments[i], &timing);
+		totalFrames += timing.frames + timing.holdFrames;
+		wprintf(L"%ls{\"line\":%d,\"mode\":\"%ls\",\"width\":%d,\"placeholders\":%ls,"
+			L"\"frames\":%d,\"holdFrames\":%d,\"ms\":%lld}",
+			i ? L"," : L"", timeline.segments[i].line, timing.centered ? L"center" : L"scroll",
+			timing.width, timeline.segments[i].placeholders ? L"true" : L"false",
+			timing.frames, timing.holdFrames,
+			(long long)(timing.frames + timing.holdFrames) * timeline.tpf);
+	}
+	wprintf(L"],\"totalFrames\":%lld,\"totalMs\":%lld}", totalFrames, totalFrames * timeline.tpf);
+}
+
+/* Stream the diagnostics of one file as a JSON object */
+void PrintResultsJson(const char *filename)
+{
+	wchar_t message[MAX_ERROR_MSG];
+
+	wprintf(L"{\"file\":");
+	PrintJsonPath(filename);
+	wprintf(L",\"complete\":%ls,\"errors\":%d,\"warnings\":%d,\"info\":%d,\"diagnostics\":[",
+		diagnostics.stopped ? L"false" : L"true",
+		diagnostics.severityCounts[2], diagnostics.severityCounts[1], diagnostics.severityCounts[0]);
+
+	for (int i = 0; i < diagnostics.count; i++) {
+		const Diagnostic *d = &diagnostics.items[i];
+		FormatDiagnostic(d, message, MAX_ERROR_MSG);
+		wprintf(L"%ls\n{\"code\":\"MLY%03d\",\"severity\":\"%ls\",\"line\":%d,\"column\":%d,\"message\":",
+			i ? L"," : L"", d->code + 1, SeverityName(d->severity), d->lineNumber, d->column);
+		PrintJsonString(message);
+		putwchar(L'}');
+	}
+	putwchar(L']');
+	if (timelineEnabled)
+		PrintTimelineJson();
+	wprintf(L"}\n");
+}
+
+/* SARIF 2.1.0: one run, rules from the message table, results streamed */
+void PrintSarifHeader(void)
+{
+	wprintf(L"{\"version\":\"2.1.0\",\"$schema\":\"https://json.schemastore.org/sarif-2.1.0.json\",\"runs\":[{\"tool\":{\"driver\":{\"name\":\"%ls\",\"version\":\"%ls\",\"rules\":[",
+		VALIDATOR_NAME, VALIDATOR_VERSION);
+	for (int code = 0; code < DIAG_COUNT; code++) {
+		wprintf(L"%ls\n{\"id\":\"MLY%03d\",\"shortDescription\":{\"text\":", code ? L"," : L"", code + 1);
+		PrintJsonString(diagnosticTable[code].format);
+		wprintf(L"}}");
+	}
+	wprintf(L"]}},\"results\":[");
+}
+
+void PrintResultsSarif(const char *filename, int first)
+{
+	wchar_t message[MAX_ERROR_MSG];
+
+	for (int i = 0; i < diagnostics.count; i++) {
+		const Diagnostic *d = &diagnostics.items[i];
+		FormatDiagnostic(d, message, MAX_ERROR_MSG);
+		wprintf(L"%ls\n{\"ruleId\":\"MLY%03d\",\"level\":\"%ls\",\"message\":{\"text\":",
+			(first && i == 0) ? L"" : L",", d->code + 1, d->severity == 0 ? L"note" : SeverityName(d->severity));
+		PrintJsonString(message);
+		wprintf(L"},\"locations\":[{\"physicalLocation\":{\"artifactLocation\":{\"uri\":");
+		PrintJsonPath(filename);
+		putwchar(L'}');
+		if (d->lineNumber > 0) {
+			wprintf(L",\"region\":{\"startLine\":%d", d->lineNumber);
+			if (d->column > 0)
+				wprintf(L",\"startColumn\":%d", d->column);
+			putwchar(L'}');
+		}
+		wprintf(L"}}]}");
+	}
+}
+
+void PrintSarifFooter(void)
+{
+	wprintf(L"]}]}\n");
+}
+
+/*
+ * Server mode (--serve SOCKET) answers requests over a local socket so
+ * callers do not pay process startup per check. Line protocol:
+ *
+ *   server -> "MLYVALIDATE <version>"            on connect
+ *   client -> "OPTIONS <max errors> <header only>"  for this connection's
+ *             later requests, no reply; without it the server's own flags apply
+ *   client -> "PATH <absolute path>"             validate a file
+ *   client -> "BUF <bytes>" + <bytes>            validate inline content
+ *   server -> "OK <count> <complete>" then <count> lines of
+ *             "<code> <line> <column> <arg0> <arg1>", or "ERR <reason>"
+ *   client -> "QUIT" (close) or "SHUTDOWN" (stop the server)
+ *
+ * Records carry the arguments, not text, so both ends format from the
+ * same message table; a version mismatch is refused by the client. A
+ * connection that sends nothing for SERVER_IDLE_TIMEOUT ms is closed, so an
+ * idle client does not hold up the ones waiting behind it.
+ */
+#define SERVER_BANNER "MLYVALIDATE"
+#define SERVER_IDLE_TIMEOUT 10000
+#define MAX_PROTOCOL_LINE 1100
+#define MAX_INLINE_SIZE (64L * 1024 * 1024)
+
+typedef struct {
+	SOCKET socket;
+	char buffer[4096];
+	int length;
+	int position;
+} Connection;
+
+int ConnectionFill(Connection *conn)
+{
+	if (conn->position < conn->length)
+		return 1;
+	int got = recv(conn->socket, conn->buffer, sizeof(conn->buffer), 0);
+	if (got <= 0)
+		return 0;
+	conn->length = got;
+	conn->position = 0;
+	return 1;
+}
+
+/* Reads one '\n'-terminated line without the terminator */
+int ConnectionReadLine(Connection *conn, char *line, int size)
+{
+	int len = 0;
+	for (;;) {
+		if (!ConnectionFill(conn))
+			return 0;
+		char c = conn->buffer[conn->position++];
+		if (c == '\n')
+			break;
+		if (c != '\r' && len < size - 1)
+			line[len++] = c;
+	}
+	line[len] = 0;
+	return 1;
+}
+
+int ConnectionRead(Connection *conn, unsigned char *data, long size)
+{
+	while (size > 0) {
+		if (!ConnectionFill(conn))
+			return 0;
+		int take = conn->length - conn->position;
+		if (take > size)
+			take = (int)size;
+		memcpy(data, conn->buffer + conn->position, take);
+		conn->position += take;
+		data += take;
+		size -= take;
+	}
+	return 1;
+}
+
+int ConnectionWrite(Connection *conn, const char *data, size_t size)
+{
+	while (size > 0) {
+		int sent = send(conn->socket, data, (int)size, 0);
+		if (sent <= 0)
+			return 0;
+		data += sent;
+		size -= sent;
+	}
+	return 1;
+}
+
+int InitSockets(void)
+{
+#ifdef _WIN32
+	WSADATA wsaData;
+	return WSAStartup(MAKEWORD(2, 2), &wsaData) == 0;
+#else
+	signal(SIGPIPE, SIG_IGN);	/* A client hanging up is not fatal */
+	return 1;
+#endif
+}
+
+/* Make blocking reads and writes on socket give up after ms */
+void SetSocketTimeout(SOCKET socket, int ms)
+{
+#ifdef _WIN32
+	DWORD timeout = (DWORD)ms;
+#else
+	struct timeval timeout = { ms / 1000, (ms % 1000) * 1000 };
+#endif
+	setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+	setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, (const char *)&timeout, sizeof(timeout));
+}
+
+int MakeSocketAddress(struct sockaddr_un *address, const char *path)
+{
+	memset(address, 0, sizeof(*address));
+	address->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address->sun_path)) {
+		PrintError(L"Error: Socket path too long '%s'\n", path);
+		return 0;
+	}
+	strcpy(address->sun_path, path);
+	return 1;
+}
+
+int SendDiagnostics(Connection *conn)
+{
+	char line[128];
+	int len = snprintf(line, sizeof(line), "OK %d %d\n", diagnostics.count, !diagnostics.stopped);
+	if (!ConnectionWrite(conn, line, len))
+		return 0;
+	for (int i = 0; i < diagnostics.count; i++) {
+		const Diagnostic *d = &diagnostics.items[i];
+		len = snprintf(line, sizeof(line), "%d %d %d %d %d\n",
+			       d->code, d->lineNumber, d->column, d->args[0], d->args[1]);
+		if (!ConnectionWrite(conn, line, len))
+			return 0;
+	}
+	return 1;
+}
+
+/* Returns 0 when the connection is done, -1 when the server should stop */
+int HandleRequest(Connection *conn, const char *request)
+{
+	static const char cannotRead[] = "ERR cannot read file\n";
+
+	ClearDiagnostics();
+
+	if (strncmp(request, "PATH ", 5) == 0) {
+		if (!ValidateFile(request + 5))
+			return ConnectionWrite(conn, cannotRead, sizeof(cannotRead) - 1);
+		return SendDiagnostics(conn);
+	} else if (strncmp(request, "BUF ", 4) == 0) {
+		long size = atol(request + 4);
+		if (size < 0 || size > MAX_INLINE_SIZE)
+			return 0;
+		unsigned char *data = malloc((size_t)size + 2);
+		if (!data || !ConnectionRead(conn, data, size)) {
+			free(data);
+			return 0;
+		}
+		data[size] = data[size + 1] = 0;
+		ValidateData(data, size);
+		free(data);
+		return SendDiagnostics(conn);
+	} else if (strncmp(request, "OPTIONS ", 8) == 0) {
+		int errors, header;
+		if (sscanf(request + 8, "%d %d", &errors, &header) != 2 || errors < 0)
+			return 0;
+		maxErrors = errors;
+		headerOnly = header != 0;
+		return 1;
+	} else if (strcmp(request, "SHUTDOWN") == 0) {
+		return -1;
+	}
+	return 0;		/* QUIT or anything unknown */
+}
+
+int Serve(const char *path)
+{
+	struct sockaddr_un address;
+	if (!InitSockets() || !MakeSocketAddress(&address, path))
+		return 1;
+
+	SOCKET listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener == INVALID_SOCKET) {
+		PrintError(L"Error: Could not create socket\n");
+		return 1;
+	}
+
+	remove(path);		/* Stale socket from an earlier server */
+	if (bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+	    listen(listener, 16) != 0) {
+		PrintError(L"Error: Could not listen on '%s'\n", path);
+		closesocket(listener);
+		return 1;
+	}
+
+	memoryCache = calloc(MEMORY_CACHE_SLOTS, sizeof(MemoryCacheEntry));
+	wprintf(L"Listening on %s\n", path);
+	fflush(stdout);
+
+	char banner[64];
+	int bannerLen = snprintf(banner, sizeof(banner), SERVER_BANNER " %ls\n", VALIDATOR_VERSION);
+
+	/* Connections are served one at a time; each may send many requests */
+	int serverMaxErrors = maxErrors, serverHeaderOnly = headerOnly;
+	int running = 1;
+	while (running) {
+		Connection conn = { accept(listener, NULL, NULL), {0}, 0, 0 };
+		if (conn.socket == INVALID_SOCKET)
+			continue;
+		SetSocketTimeout(conn.socket, SERVER_IDLE_TIMEOUT);
+		maxErrors = serverMaxErrors;
+		headerOnly = serverHeaderOnly;
+
+		char request[MAX_PROTOCOL_LINE];
+		int status = ConnectionWrite(&conn, banner, bannerLen);
+		while (status > 0 && ConnectionReadLine(&conn, request, sizeof(request)))
+			status = HandleRequest(&conn, request);
+		if (status < 0)
+			running = 0;
+		closesocket(conn.socket);
+	}
+
+	closesocket(listener);
+	remove(path);
+	wprintf(L"Server stopped (%d cache hits, %d misses)\n", cacheHits, cacheMisses);
+	return 0;
+}
+
+int ConnectToServer(Connection *conn, const char *path)
+{
+	struct sockaddr_un address;
+	if (!InitSockets() || !MakeSocketAddress(&address, path))
+		return 0;
+
+	memset(conn, 0, sizeof(*conn));
+	conn->socket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (conn->socket == INVALID_SOCKET ||
+	    connect(conn->socket, (struct sockaddr *)&address, sizeof(address)) != 0) {
+		PrintError(L"Error: Could not connect to validate server at '%s'\n", path);
+		return 0;
+	}
+
+	char banner[MAX_PROTOCOL_LINE], expected[64];
+	snprintf(expected, sizeof(expected), SERVER_BANNER " %ls", VALIDATOR_VERSION);
+	if (!ConnectionReadLine(conn, banner, sizeof(banner)) || strcmp(banner, expected) != 0) {
+		PrintError(L"Error: Server at '%s' is not validate %ls\n", path, VALIDATOR_VERSION);
+		closesocket(conn->socket);
+		return 0;
+	}
+
+	/* The server checks with this client's limits, not its own */
+	char options[64];
+	int len = snprintf(options, sizeof(options), "OPTIONS %d %d\n", maxErrors, headerOnly);
+	if (!ConnectionWrite(conn, options, len)) {
+		PrintError(L"Error: Lost connection to validate server\n");
+		closesocket(conn->socket);
+		return 0;
+	}
+	return 1;
+}
+
+/* Ask the server about one file ("-" sends standard input inline) */
+int RemoteValidate(Connection *conn, const char *filename)
+{
+	char request[MAX_PROTOCOL_LINE];
+	int ok;
+
+	ClearDiagnostics();
+
+	if (strcmp(filename, "-") == 0) {
+		size_t size = 0, capacity = 65536;
+		char *data = malloc(capacity);
+		size_t got;
+		while (data && (got = fread(data + size, 1, capacity - size, stdin)) > 0) {
+			size += got;
+			if (size == capacity) {
+				char *grown = realloc(data, capacity * 2);
+				if (!grown) {
+					free(data);
+					data = NULL;
+					break;
+				}
+				data = grown;
+				capacity *= 2;
+			}
+		}
+		if (!data) {
+			PrintError(L"Error: Could not allocate memory to read file\n");
+			return 0;
+		}
+		int len = snprintf(request, sizeof(request), "BUF %lu\n", (unsigned long)size);
+		ok = ConnectionWrite(conn, request, len) && ConnectionWrite(conn, data, size);
+		free(data);
+	} else {
+		/* The server has its own working directory */
+		char fullPath[MAX_PROTOCOL_LINE - 8];
+#ifdef _WIN32
+		if (!_fullpath(fullPath, filename, sizeof(fullPath)))
+#else
+		if (!realpath(filename, fullPath))
+#endif
+		{
+			PrintError(L"Error: Could not open file '%s'\n", filename);
+			return 0;
+		}
+		int len = snprintf(request, sizeof(request), "PATH %s\n", fullPath);
+		ok = ConnectionWrite(conn, request, len);
+	}
+
+	char reply[MAX_PROTOCOL_LINE];
+	if (!ok || !ConnectionReadLine(conn, reply, sizeof(reply))) {
+		PrintError(L"Error: Lost connection to validate server\n");
+		return 0;
+	}
+
+	int count, complete;
+	if (sscanf(reply, "OK %d %d", &count, &complete) != 2) {
+		PrintError(L"Error: Could not open file '%s'\n", filename);
+		return 0;
+	}
+
+	for (int i = 0; i < count; i++) {
+		int code, lineNum, column, arg0, arg1;
+		if (!ConnectionReadLine(conn, reply, sizeof(reply)) ||
+		    sscanf(reply, "%d %d %d %d %d", &code, &lineNum, &column, &arg0, &arg1) != 5 ||
+		    code < 0 || code >= DIAG_COUNT) {
+			PrintError(L"Error: Lost connection to validate server\n");
+			return 0;
+		}
+		AddDiagnostic(code, lineNum, column, arg0, arg1);
+	}
+	diagnostics.stopped = !complete;
+	return 1;
+}
+
+int AddFileName(const char ***files, int *count, int *capacity, const char *name)
+{
+	if (*count == *capacity) {
+		int newCapacity = *capacity ? *capacity * 2 : 16;
+		const char **grown = realloc(*files, (size_t)newCapacity * sizeof(char *));
+		if (!grown) {
+			PrintError(L"Error: Out of memory\n");
+			return 0;
+		}
+		*files = grown;
+		*capacity = newCapacity;
+	}
+	(*files)[(*count)++] = name;
+	return 1;
+}
+
+/* Large repositories exceed the command line limit, so paths can come from a list */
+int ReadFileList(const char *listPath, const char ***files, int *count, int *capacity)
+{
+	FILE *list = strcmp(listPath, "-") == 0 ? stdin : fopen(listPath, "r");
+	if (!list) {
+		PrintError(L"Error: Could not open file list '%s'\n", listPath);
+		return 0;
+	}
+
+	char path[1024];
+	int ok = 1;
+	while (ok && fgets(path, sizeof(path), list)) {
+		size_t len = strcspn(path, "\r\n");
+		path[len] = 0;
+		if (len == 0)
+			continue;
+		char *copy = malloc(len + 1);
+		if (!copy) {
+			PrintError(L"Error: Out of memory\n");
+			ok = 0;
+			break;
+		}
+		memcpy(copy, path, len + 1);
+		ok = AddFileName(files, count, capacity, copy);
+	}
+
+	if (list != stdin)
+		fclose(list);
+	return ok;
 }
 
 int main(int argc, char *argv[])
@@ -546,29 +1820,136 @@ int main(int argc, char *argv[])
 	_setmode(_fileno(stderr), _O_U16TEXT);
 #endif
 
-	if (argc != 2) {
-		wprintf(L"Usage: %s <filename.mly>\n", argv[0]);
-		wprintf
-		    (L"Validates a Marquee Layout file and reports any syntax errors.\n");
+	const char **files = NULL;
+	int fileCount = 0, fileCapacity = 0;
+	const char *listPath = NULL;
+	const char *servePath = NULL, *clientPath = NULL;
+	int badArgs = 0;
+	for (int i = 1; i < argc && !badArgs; i++) {
+		if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "text") == 0)
+				outputFormat = FORMAT_TEXT;
+			else if (strcmp(argv[i], "json") == 0)
+				outputFormat = FORMAT_JSON;
+			else if (strcmp(argv[i], "sarif") == 0)
+				outputFormat = FORMAT_SARIF;
+			else
+				badArgs = 1;
+		} else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+			cacheDir = argv[++i];
+		} else if (strcmp(argv[i], "--files-from") == 0 && i + 1 < argc) {
+			listPath = argv[++i];
+		} else if (strcmp(argv[i], "--fail-fast") == 0) {
+			maxErrors = 1;
+		} else if (strcmp(argv[i], "--max-errors") == 0 && i + 1 < argc) {
+			maxErrors = atoi(argv[++i]);
+			if (maxErrors <= 0)
+				badArgs = 1;
+		} else if (strcmp(argv[i], "--header-only") == 0) {
+			headerOnly = 1;
+		} else if (strcmp(argv[i], "--timeline") == 0) {
+			timelineEnabled = 1;
+		} else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+			servePath = argv[++i];
+		} else if (strcmp(argv[i], "--client") == 0 && i + 1 < argc) {
+			clientPath = argv[++i];
+		} else if (strcmp(argv[i], "-") == 0) {
+			if (!AddFileName(&files, &fileCount, &fileCapacity, argv[i]))
+				return 1;
+		} else if (argv[i][0] != '-') {
+			if (!AddFileName(&files, &fileCount, &fileCapacity, argv[i]))
+				return 1;
+		} else {
+			badArgs = 1;
+		}
+	}
+
+	/* The timeline needs every segment line, and servers only send diagnostics */
+	if (timelineEnabled && (headerOnly || clientPath || servePath || outputFormat == FORMAT_SARIF))
+		badArgs = 1;
+
+	if (!badArgs && listPath && !ReadFileList(listPath, &files, &fileCount, &fileCapacity))
 		return 1;
+
+	if (!badArgs && cacheDir) {
+#ifdef _WIN32
+		_mkdir(cacheDir);
+#else
+		mkdir(cacheDir, 0777);
+#endif
 	}
 
-	wprintf(L"Validating file: %s\n\n", argv[1]);
+	if (!badArgs && servePath)
+		return Serve(servePath);
 
-	if (!ValidateFile(argv[1])) {
+	if (badArgs || fileCount == 0) {
+		wprintf(L"Usage: %s [options] <filename.mly>...\n", argv[0]);
+		wprintf
+		    (L"Validates Marquee Layout files and reports any syntax errors.\n");
+		wprintf(L"  --format FORMAT    Output as text (default), json or sarif\n");
+		wprintf(L"  --cache DIR        Reuse results for files whose content has not changed\n");
+		wprintf(L"  --files-from LIST  Also validate the paths listed in LIST, one per line (- for stdin)\n");
+		wprintf(L"  --fail-fast        Stop reading a file at its first error\n");
+		wprintf(L"  --max-errors N     Stop reading a file after N errors\n");
+		wprintf(L"  --header-only      Check only the header commands and the START/END structure\n");
+		wprintf(L"  --timeline         Report how long each segment and the whole loop play (text or json)\n");
+		wprintf(L"  --serve SOCKET     Run as a validation server on a local socket\n");
+		wprintf(L"  --client SOCKET    Ask a running server instead (- validates standard input)\n");
 		return 1;
 	}
 
-	PrintResults();
+	Connection server;
+	if (clientPath && !ConnectToServer(&server, clientPath))
+		return 1;
 
-	/* Return exit code based on validation results */
 	int exit_code = 0;
-	for (int i = 0; i < errorCount; i++) {
-		if (errors[i].severity == 2) {	/* Error */
+	int sarifResults = 0, jsonPrinted = 0;
+
+	if (outputFormat == FORMAT_SARIF)
+		PrintSarifHeader();
+	else if (outputFormat == FORMAT_JSON && fileCount > 1)
+		wprintf(L"[");
+
+	for (int f = 0; f < fileCount; f++) {
+		const char *filename = files[f];
+
+		if (outputFormat == FORMAT_TEXT)
+			wprintf(L"%lsValidating file: %s\n\n", f ? L"\n" : L"", filename);
+
+		if (!(clientPath ? RemoteValidate(&server, filename) : ValidateFile(filename))) {
 			exit_code = 1;
+			continue;
+		}
+
+		switch (outputFormat) {
+		case FORMAT_JSON:
+			if (jsonPrinted++ > 0)
+				wprintf(L",");
+			PrintResultsJson(filename);
+			break;
+		case FORMAT_SARIF:
+			PrintResultsSarif(filename, sarifResults == 0);
+			sarifResults += diagnostics.count;
+			break;
+		default:
+			PrintResults();
+			if (timelineEnabled)
+				PrintTimeline();
 			break;
 		}
+
+		/* Return exit code based on validation results */
+		if (diagnostics.severityCounts[2] > 0)
+			exit_code = 1;
 	}
 
+	if (outputFormat == FORMAT_SARIF)
+		PrintSarifFooter();
+	else if (outputFormat == FORMAT_JSON && fileCount > 1)
+		wprintf(L"]\n");
+	else if (outputFormat == FORMAT_TEXT && cacheDir && fileCount > 1)
+		wprintf(L"\nCache: %d hits, %d misses\n", cacheHits, cacheMisses);
+
 	return exit_code;
 }